@@ -0,0 +1,190 @@
+/*
+ * Copyright (c) 2013 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+ * OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ * ---------------------------------------------------------------------
+ */
+
+
+/*
+ * kvs_chunk_bench stores values from 64 KiB to 64 MiB whole, with
+ * max_vallen raised to fit them, and in 64 KiB chunks, and for each
+ * reports how far the process grew past the bytes stored, how long a
+ * full rewrite with one small slice changed takes, and how long it
+ * takes to write a value out to /dev/null: with write(2) from
+ * kvstore_get, or writev(2) from kvstore_getv. Each layout runs in its
+ * own child so that neither reuses memory the other freed.
+ *
+ * usage: kvs_chunk_bench [MiB stored per size]
+ */
+
+
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "kv.h"
+
+
+#define CHUNK   (64 * 1024)
+#define MAXIOV  1024
+
+
+static double
+now(void)
+{
+        struct timeval   tv;
+
+        gettimeofday(&tv, NULL);
+        return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+
+static double
+rss_mb(void)
+{
+        FILE            *f;
+        unsigned long    size, rss = 0;
+
+        if (NULL == (f = fopen("/proc/self/statm", "r")))
+                return 0;
+        if (2 != fscanf(f, "%lu %lu", &size, &rss))
+                rss = 0;
+        fclose(f);
+        return rss * (double)sysconf(_SC_PAGESIZE) / (1 << 20);
+}
+
+
+static void
+store(kvstore kvs, int chunked, char *key, char *val, size_t size)
+{
+        struct iovec     iov;
+
+        iov.iov_base = val;
+        iov.iov_len = size;
+        if (chunked ? kvstore_setv(kvs, key, &iov, 1) :
+            kvstore_set(kvs, key, val))
+                abort();
+}
+
+
+static void
+run(const char *name, int chunked, size_t size, size_t copies, char *val,
+    int null)
+{
+        kvstore          kvs;
+        struct iovec     iov[MAXIOV];
+        size_t           i, chunk = CHUNK, max = size;
+        char             key[32], *v;
+        double           rss, t_upd, t_read;
+        ssize_t          n;
+        pid_t            pid;
+
+        if (0 != (pid = fork())) {
+                if (-1 != pid)
+                        waitpid(pid, NULL, 0);
+                return;
+        }
+        if (NULL == (kvs = kvstore_new()))
+                abort();
+        if (chunked) {
+                kvstore_config(kvs, KVSTORE_CHUNK_SIZE, &chunk);
+                kvstore_config(kvs, KVSTORE_MAX_CHUNKED_VALLEN, &max);
+        } else {
+                kvstore_config(kvs, KVSTORE_MAX_VALLEN, &max);
+        }
+
+        rss = rss_mb();
+        for (i = 0; i < copies; i++) {
+                snprintf(key, sizeof(key), "value:%zu", i);
+                store(kvs, chunked, key, val, size);
+        }
+        rss = rss_mb() - rss;
+
+        t_upd = now();
+        for (i = 0; i < copies * 4; i++) {
+                snprintf(key, sizeof(key), "value:%zu", i % copies);
+                memset(val + size / 2, 'a' + (int)(i % 26), 64);
+                store(kvs, chunked, key, val, size);
+        }
+        t_upd = now() - t_upd;
+
+        t_read = now();
+        for (i = 0; i < copies * 4; i++) {
+                snprintf(key, sizeof(key), "value:%zu", i % copies);
+                if (chunked) {
+                        n = kvstore_getv(kvs, key, iov, MAXIOV);
+                        if ((n < 1) || (n > MAXIOV) ||
+                            (writev(null, iov, (int)n) != (ssize_t)size))
+                                abort();
+                } else {
+                        v = kvstore_get(kvs, key);
+                        if ((NULL == v) ||
+                            (write(null, v, size) != (ssize_t)size))
+                                abort();
+                }
+        }
+        t_read = now() - t_read;
+
+        printf("%8zuK %-7s %10.1f %8.1f%% %12.1f %12.1f\n", size >> 10,
+            name, rss, 100.0 * (rss - (double)(size * copies) / (1 << 20)) /
+            ((double)(size * copies) / (1 << 20)),
+            t_upd * 1e6 / (copies * 4), t_read * 1e6 / (copies * 4));
+        fflush(stdout);
+        kvstore_discard(kvs);
+        _exit(0);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+        size_t   total = 128, size, copies;
+        char    *val;
+        int      null;
+
+        if (argc > 1)
+                total = strtoul(argv[1], NULL, 10);
+        if (0 == total)
+                return 1;
+        total <<= 20;
+        if (-1 == (null = open("/dev/null", O_WRONLY)))
+                return 1;
+
+        printf("%zu MiB stored per size, %d KiB chunks\n", total >> 20,
+            CHUNK >> 10);
+        printf("%9s %-7s %10s %9s %12s %12s\n", "size", "layout", "RSS MB",
+            "overhead", "rewrite us", "write us");
+        fflush(stdout);
+        for (size = 64 * 1024; size <= 64 * 1024 * 1024; size *= 4) {
+                if (NULL == (val = (char *)malloc(size + 1)))
+                        return 1;
+                memset(val, 'v', size);
+                val[size] = 0;
+                copies = total / size ? total / size : 1;
+                run("whole", 0, size, copies, val, null);
+                run("chunked", 1, size, copies, val, null);
+                free(val);
+        }
+
+        close(null);
+        return 0;
+}
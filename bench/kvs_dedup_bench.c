@@ -0,0 +1,187 @@
+/*
+ * Copyright (c) 2013 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+ * OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ * ---------------------------------------------------------------------
+ */
+
+
+/*
+ * kvs_dedup_bench sets keys to values drawn from a small set with a
+ * Zipf-like skew, as tags, states and templated payloads tend to be,
+ * and compares a plain store with one that shares values through the
+ * dedup pool: how fast the sets go and how much each grew the process.
+ * It then does the same with every value distinct, which is the worst
+ * case for dedup, as it pays for the pool and shares nothing. Each run
+ * is done in its own child so that none reuses memory another freed.
+ *
+ * usage: kvs_dedup_bench [keys [distinct values [value size]]]
+ */
+
+
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "kv.h"
+
+
+static double
+now(void)
+{
+        struct timeval   tv;
+
+        gettimeofday(&tv, NULL);
+        return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+
+static double
+rss_mb(void)
+{
+        FILE            *f;
+        unsigned long    size, rss = 0;
+
+        if (NULL == (f = fopen("/proc/self/statm", "r")))
+                return 0;
+        if (2 != fscanf(f, "%lu %lu", &size, &rss))
+                rss = 0;
+        fclose(f);
+        return rss * (double)sysconf(_SC_PAGESIZE) / (1 << 20);
+}
+
+
+static uint64_t
+next_rand(uint64_t *state)
+{
+        uint64_t        z = (*state += 0x9e3779b97f4a7c15ULL);
+
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+}
+
+
+/*
+ * zipf fills pick with n draws from distinct values, the k'th most
+ * common drawn in proportion to 1 / k.
+ */
+static void
+zipf(size_t *pick, size_t n, size_t distinct)
+{
+        double          *cdf, u;
+        uint64_t         rng = 1;
+        size_t           i, lo, hi;
+
+        if (NULL == (cdf = malloc(distinct * sizeof(double))))
+                abort();
+        for (i = 0, u = 0; i < distinct; i++)
+                cdf[i] = u += 1.0 / (i + 1);
+        for (i = 0; i < n; i++) {
+                u = (next_rand(&rng) >> 11) * 0x1p-53 * cdf[distinct - 1];
+                for (lo = 0, hi = distinct - 1; lo < hi; ) {
+                        if (cdf[(lo + hi) / 2] < u)
+                                lo = (lo + hi) / 2 + 1;
+                        else
+                                hi = (lo + hi) / 2;
+                }
+                pick[i] = lo;
+        }
+        free(cdf);
+}
+
+
+static void
+run(const char *name, size_t min, const size_t *pick, size_t n,
+    size_t vsize)
+{
+        struct kvstore_dedup_stats       st;
+        kvstore                          kvs;
+        pid_t                            pid;
+        size_t                           i;
+        char                             key[32], *val;
+        double                           rss, t;
+
+        if (0 != (pid = fork())) {
+                if (-1 != pid)
+                        waitpid(pid, NULL, 0);
+                return;
+        }
+        if (NULL == (val = malloc(vsize + 1)))
+                abort();
+        rss = rss_mb();
+        if (NULL == (kvs = kvstore_new()))
+                abort();
+        if ((0 != min) && kvstore_config(kvs, KVSTORE_DEDUP, &min))
+                abort();
+
+        t = now();
+        for (i = 0; i < n; i++) {
+                snprintf(key, sizeof(key), "key:%zu", i);
+                snprintf(val, vsize + 1, "%0*zu", (int)vsize, pick[i]);
+                if (kvstore_set(kvs, key, val))
+                        abort();
+        }
+        t = now() - t;
+        rss = rss_mb() - rss;
+
+        printf("%-14s %10.2f %10.1f", name, n / t / 1e6, rss);
+        if ((0 == min) || kvstore_dedup_stats(kvs, &st))
+                printf("\n");
+        else
+                printf(" %10llu %10.1f\n", (unsigned long long)st.values,
+                    st.saved / (double)(1 << 20));
+        fflush(stdout);
+        kvstore_discard(kvs);
+        free(val);
+        _exit(0);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+        size_t   n = 1000000, distinct = 1000, vsize = 100;
+        size_t  *pick, i;
+
+        if (argc > 1)
+                n = strtoul(argv[1], NULL, 10);
+        if (argc > 2)
+                distinct = strtoul(argv[2], NULL, 10);
+        if (argc > 3)
+                vsize = strtoul(argv[3], NULL, 10);
+        if ((0 == n) || (0 == distinct) || (20 > vsize) || (4096 < vsize))
+                return 1;
+        if (NULL == (pick = calloc(n, sizeof(size_t))))
+                return 1;
+
+        printf("%zu keys, %zu byte values\n", n, vsize);
+        printf("%-14s %10s %10s %10s %10s\n", "store", "Msets/s", "RSS MB",
+            "values", "saved MB");
+        fflush(stdout);
+        zipf(pick, n, distinct);
+        run("plain zipf", 0, pick, n, vsize);
+        run("dedup zipf", 16, pick, n, vsize);
+        for (i = 0; i < n; i++)
+                pick[i] = i;
+        run("plain unique", 0, pick, n, vsize);
+        run("dedup unique", 16, pick, n, vsize);
+        free(pick);
+        return 0;
+}
@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) 2013 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+ * OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ * ---------------------------------------------------------------------
+ */
+
+
+/*
+ * kvs_defrag_bench fills a store with values of random sizes, churns
+ * them with updates of other random sizes, deletes most keys, and then
+ * compares the resident set against the live data: as left by the
+ * churn, after malloc_trim alone, and after each of a few defragmenter
+ * passes. The longest step includes the sort and the trim, which run
+ * with the store unlocked.
+ *
+ * usage: kvs_defrag_bench [keys]
+ */
+
+
+#include <sys/time.h>
+#include <sys/types.h>
+#include <malloc.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "kv.h"
+
+
+static double
+now(void)
+{
+        struct timeval   tv;
+
+        gettimeofday(&tv, NULL);
+        return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+
+static double
+rss_mb(void)
+{
+        FILE            *f;
+        unsigned long    size, rss = 0;
+
+        if (NULL == (f = fopen("/proc/self/statm", "r")))
+                return 0;
+        if (2 != fscanf(f, "%lu %lu", &size, &rss))
+                rss = 0;
+        fclose(f);
+        return rss * (double)sysconf(_SC_PAGESIZE) / (1 << 20);
+}
+
+
+static uint64_t
+next_rand(uint64_t *state)
+{
+        uint64_t        z = (*state += 0x9e3779b97f4a7c15ULL);
+
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+        kvstore                          kvs;
+        struct kvstore_defrag_stats      stats;
+        uint64_t                         state = 1;
+        size_t                           n = 200000, i, len, live = 0;
+        size_t                           maxval = 2048;
+        char                             key[32], *val;
+        double                           t, step, worst = 0;
+        int                              pass;
+
+        if (argc > 1)
+                n = strtoul(argv[1], NULL, 10);
+        if (NULL == (val = malloc(maxval + 1)))
+                abort();
+        memset(val, 'v', maxval);
+        if (NULL == (kvs = kvstore_new()))
+                abort();
+        kvstore_config(kvs, KVSTORE_MAX_VALLEN, &maxval);
+
+        for (i = 0; i < 4 * n; i++) {
+                snprintf(key, sizeof(key), "key:%zu", i % n);
+                len = 16 + next_rand(&state) % (maxval - 16);
+                val[len] = 0;
+                kvstore_set(kvs, key, val);
+                val[len] = 'v';
+        }
+        for (i = 0; i < n; i++) {
+                snprintf(key, sizeof(key), "key:%zu", i);
+                if (0 != i % 4)
+                        kvstore_del(kvs, key);
+                else
+                        live += strlen(key) + strlen(kvstore_get(kvs, key));
+        }
+
+        printf("%lu keys, %lu live, %.1f MB live data\n", (unsigned long)n,
+            (unsigned long)kvstore_len(kvs), live / (double)(1 << 20));
+        printf("%-16s %10.1f MB\n", "after churn", rss_mb());
+        malloc_trim(0);
+        printf("%-16s %10.1f MB\n", "malloc_trim", rss_mb());
+
+        t = now();
+        for (pass = 1; pass <= 4; pass++) {
+                do {
+                        step = now();
+                        kvstore_defrag_step(kvs, 256);
+                        step = now() - step;
+                        worst = step > worst ? step : worst;
+                        kvstore_defrag_stats(kvs, &stats);
+                } while (stats.cycles < pass);
+                printf("defrag pass %-4d %10.1f MB\n", pass, rss_mb());
+        }
+        t = now() - t;
+        printf("moved %lu entries (%.1f MB) in %.3f s, longest step %.0f us, "
+            "reclaimed %.1f MB\n", (unsigned long)stats.moved,
+            stats.moved_bytes / (double)(1 << 20), t, worst * 1e6,
+            stats.reclaimed_bytes / (double)(1 << 20));
+
+        kvstore_discard(kvs);
+        free(val);
+        return 0;
+}
@@ -0,0 +1,208 @@
+/*
+ * Copyright (c) 2013 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+ * OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ * ---------------------------------------------------------------------
+ */
+
+
+/*
+ * kvs_frozen_bench fills an in-memory store, times looking keys up in
+ * it, present and absent, in random order, and freezes it to a file;
+ * then it opens the file as a frozen store and times the same lookups.
+ * It reports how much each grew the process and, for the frozen store,
+ * the file's size and what its index costs per key. Each store is used
+ * in its own child so that neither reuses memory the other freed.
+ *
+ * usage: kvs_frozen_bench [keys] [value size] [file]
+ */
+
+
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "kv.h"
+
+
+static double
+now(void)
+{
+        struct timeval   tv;
+
+        gettimeofday(&tv, NULL);
+        return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+
+static double
+rss_mb(void)
+{
+        FILE            *f;
+        unsigned long    size, rss = 0;
+
+        if (NULL == (f = fopen("/proc/self/statm", "r")))
+                return 0;
+        if (2 != fscanf(f, "%lu %lu", &size, &rss))
+                rss = 0;
+        fclose(f);
+        return rss * (double)sysconf(_SC_PAGESIZE) / (1 << 20);
+}
+
+
+static uint64_t
+next_rand(uint64_t *state)
+{
+        uint64_t        z = (*state += 0x9e3779b97f4a7c15ULL);
+
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+}
+
+
+static void
+lookups(kvstore kvs, size_t n, double *hit, double *miss)
+{
+        uint64_t         state = 7;
+        size_t           i, hits = 0;
+        char             key[32];
+        double           t;
+
+        t = now();
+        for (i = 0; i < n; i++) {
+                snprintf(key, sizeof(key), "key:%zu",
+                    (size_t)(next_rand(&state) % n));
+                hits += NULL != kvstore_get(kvs, key);
+        }
+        *hit = n / (now() - t) / 1e3;
+
+        t = now();
+        for (i = 0; i < n; i++) {
+                snprintf(key, sizeof(key), "nokey:%zu",
+                    (size_t)(next_rand(&state) % n));
+                hits += NULL != kvstore_get(kvs, key);
+        }
+        *miss = n / (now() - t) / 1e3;
+        if (hits != n)
+                abort();
+}
+
+
+static void
+run_mutable(size_t n, char *val, const char *path)
+{
+        kvstore          kvs;
+        size_t           i;
+        char             key[32];
+        double           rss, hit, miss, t_freeze;
+        pid_t            pid;
+
+        if (0 != (pid = fork())) {
+                if (-1 != pid)
+                        waitpid(pid, NULL, 0);
+                return;
+        }
+        rss = rss_mb();
+        if (NULL == (kvs = kvstore_new()))
+                abort();
+        for (i = 0; i < n; i++) {
+                snprintf(key, sizeof(key), "key:%zu", i);
+                if (kvstore_set(kvs, key, val))
+                        abort();
+        }
+        rss = rss_mb() - rss;
+        lookups(kvs, n, &hit, &miss);
+
+        t_freeze = now();
+        if (kvstore_freeze(kvs, path))
+                abort();
+        t_freeze = now() - t_freeze;
+        printf("%-8s %10.0f %10.0f %10.1f\n", "mutable", hit, miss, rss);
+        printf("freeze took %.2f s\n", t_freeze);
+        fflush(stdout);
+        kvstore_discard(kvs);
+        _exit(0);
+}
+
+
+static void
+run_frozen(size_t n, size_t vsize, const char *path)
+{
+        kvstore          kvs;
+        struct stat      st;
+        size_t           i, data = 0;
+        char             key[32];
+        double           rss, hit, miss;
+        pid_t            pid;
+
+        if (0 != (pid = fork())) {
+                if (-1 != pid)
+                        waitpid(pid, NULL, 0);
+                return;
+        }
+        rss = rss_mb();
+        if ((NULL == (kvs = kvstore_open_frozen(path))) || stat(path, &st))
+                abort();
+        lookups(kvs, n, &hit, &miss);
+        rss = rss_mb() - rss;
+        for (i = 0; i < n; i++)
+                data += snprintf(key, sizeof(key), "key:%zu", i) + vsize + 10;
+
+        printf("%-8s %10.0f %10.0f %10.1f\n", "frozen", hit, miss, rss);
+        printf("file %.1f MB, index %.2f bits/key, offsets %d bits/key\n",
+            st.st_size / (double)(1 << 20),
+            ((double)st.st_size - data - 8.0 * n) * 8 / n, 64);
+        fflush(stdout);
+        kvstore_discard(kvs);
+        _exit(0);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+        size_t           n = 1000000, vsize = 32;
+        const char      *path = "kvs_frozen_bench.frz";
+        char            *val;
+
+        if (argc > 1)
+                n = strtoul(argv[1], NULL, 10);
+        if (argc > 2)
+                vsize = strtoul(argv[2], NULL, 10);
+        if (argc > 3)
+                path = argv[3];
+        if ((0 == n) || (0 == vsize) || (NULL == (val = malloc(vsize + 1))))
+                return 1;
+        memset(val, 'v', vsize);
+        val[vsize] = 0;
+
+        printf("%lu keys, %lu byte values\n", (unsigned long)n,
+            (unsigned long)vsize);
+        printf("%-8s %10s %10s %10s\n", "store", "hit k/s", "miss k/s",
+            "RSS MB");
+        fflush(stdout);
+        run_mutable(n, val, path);
+        run_frozen(n, vsize, path);
+
+        unlink(path);
+        free(val);
+        return 0;
+}
@@ -0,0 +1,205 @@
+/*
+ * Copyright (c) 2013 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+ * OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ * ---------------------------------------------------------------------
+ */
+
+
+
+/*
+ * kvs_hot_bench reads keys drawn from a Zipf distribution with exponent
+ * 1.2 from several threads, with one operation in a hundred a write, and
+ * compares a plain store with one tracking hot keys and one that also
+ * serves them from per-CPU copies. It then lists the hottest keys the
+ * tracker found, which should be key0, key1 and so on.
+ *
+ * usage: kvs_hot_bench [threads [keys [ops]]]
+ */
+
+
+#include <sys/time.h>
+#include <sys/types.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kv.h"
+
+
+struct worker {
+        kvstore          kvs;
+        const double    *cdf;
+        size_t           keys;
+        size_t           ops;
+        uint64_t         rng;
+        size_t           misses;
+        pthread_t        thread;
+};
+
+
+static double
+now(void)
+{
+        struct timeval   tv;
+
+        gettimeofday(&tv, NULL);
+        return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+
+static uint64_t
+next(uint64_t *s)
+{
+        *s ^= *s << 13;
+        *s ^= *s >> 7;
+        *s ^= *s << 17;
+        return *s;
+}
+
+
+/*
+ * zipf picks a key index by binary search of the cumulative
+ * distribution.
+ */
+static size_t
+zipf(const double *cdf, size_t n, uint64_t *rng)
+{
+        double   u = (next(rng) >> 11) * (1.0 / 9007199254740992.0);
+        size_t   lo = 0, hi = n - 1, mid;
+
+        while (lo < hi) {
+                mid = (lo + hi) / 2;
+                if (cdf[mid] < u)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+        return lo;
+}
+
+
+static void *
+run(void *arg)
+{
+        struct worker   *w = (struct worker *)arg;
+        char             key[32];
+        size_t           i, k;
+
+        for (i = 0; i < w->ops; i++) {
+                k = zipf(w->cdf, w->keys, &w->rng);
+                snprintf(key, sizeof(key), "key%zu", k);
+                if (0 == next(&w->rng) % 100)
+                        kvstore_set(w->kvs, key, "value");
+                else if (NULL == kvstore_get(w->kvs, key))
+                        w->misses++;
+        }
+        return NULL;
+}
+
+
+static void
+bench(const char *name, size_t track, int replicate, const double *cdf,
+    size_t nthreads, size_t keys, size_t ops)
+{
+        struct kvstore_hot_key   hot[5];
+        struct worker           *w;
+        kvstore                  kvs;
+        char                     key[32];
+        size_t                   i, misses = 0;
+        ssize_t                  n;
+        double                   t;
+
+        if (NULL == (kvs = kvstore_new()))
+                abort();
+        if (track && kvstore_config(kvs, KVSTORE_HOT_KEYS, &track))
+                abort();
+        if (replicate &&
+            kvstore_config(kvs, KVSTORE_HOT_REPLICATE, &replicate))
+                abort();
+        for (i = 0; i < keys; i++) {
+                snprintf(key, sizeof(key), "key%zu", i);
+                kvstore_set(kvs, key, "value");
+        }
+        if (NULL == (w = calloc(nthreads, sizeof(struct worker))))
+                abort();
+
+        t = now();
+        for (i = 0; i < nthreads; i++) {
+                w[i].kvs = kvs;
+                w[i].cdf = cdf;
+                w[i].keys = keys;
+                w[i].ops = ops;
+                w[i].rng = 0x9e3779b97f4a7c15ULL * (i + 1);
+                if (pthread_create(&w[i].thread, NULL, run, &w[i]))
+                        abort();
+        }
+        for (i = 0; i < nthreads; i++) {
+                pthread_join(w[i].thread, NULL);
+                misses += w[i].misses;
+        }
+        t = now() - t;
+
+        printf("%-12s %12.0f", name, nthreads * ops / t);
+        if (track) {
+                n = kvstore_hot_keys(kvs, hot, 5);
+                for (i = 0; (ssize_t)i < n; i++) {
+                        printf(" %s%s", hot[i].key,
+                            hot[i].replicated ? "*" : "");
+                        free(hot[i].key);
+                }
+        }
+        printf("%s\n", 0 == misses ? "" : "  (misses!)");
+        kvstore_discard(kvs);
+        free(w);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+        size_t   nthreads = 4, keys = 100000, ops = 1000000, i;
+        double  *cdf, sum = 0;
+
+        if (argc > 1)
+                nthreads = strtoul(argv[1], NULL, 10);
+        if (argc > 2)
+                keys = strtoul(argv[2], NULL, 10);
+        if (argc > 3)
+                ops = strtoul(argv[3], NULL, 10);
+        if ((0 == nthreads) || (0 == keys))
+                abort();
+
+        if (NULL == (cdf = calloc(keys, sizeof(double))))
+                abort();
+        for (i = 0; i < keys; i++) {
+                sum += 1.0 / pow((double)(i + 1), 1.2);
+                cdf[i] = sum;
+        }
+        for (i = 0; i < keys; i++)
+                cdf[i] /= sum;
+
+        printf("%lu threads, %lu keys, %lu ops each, zipf 1.2, 1%% writes\n",
+            (unsigned long)nthreads, (unsigned long)keys,
+            (unsigned long)ops);
+        printf("%-12s %12s %s\n", "", "ops/s", "hottest (* = replicated)");
+        bench("plain", 0, 0, cdf, nthreads, keys, ops);
+        bench("tracked", 16, 0, cdf, nthreads, keys, ops);
+        bench("replicated", 16, 1, cdf, nthreads, keys, ops);
+        free(cdf);
+        return 0;
+}
@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2013 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+ * OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ * ---------------------------------------------------------------------
+ */
+
+
+/*
+ * kvs_load_bench writes a TSV file of generated records and loads it
+ * with a kvstore_set loop and then with kvstore_bulk_load at 1, 2, 4,
+ * ... threads up to the number of online CPUs.
+ *
+ * usage: kvs_load_bench [records]
+ */
+
+
+#include <sys/time.h>
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "kv.h"
+
+
+static double
+now(void)
+{
+        struct timeval   tv;
+
+        gettimeofday(&tv, NULL);
+        return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+        kvstore          kvs;
+        FILE            *f;
+        char             path[] = "/tmp/kvs_load_bench.XXXXXX";
+        char             line[128], *key, *val;
+        size_t           n = 1000000, i, threads, ncpu;
+        double           t;
+        int              fd;
+
+        if (argc > 1)
+                n = strtoul(argv[1], NULL, 10);
+        ncpu = (size_t)sysconf(_SC_NPROCESSORS_ONLN);
+        if (0 == ncpu || (size_t)-1 == ncpu)
+                ncpu = 1;
+        if (-1 == (fd = mkstemp(path)) || NULL == (f = fdopen(fd, "w")))
+                abort();
+        for (i = 0; i < n; i++)
+                fprintf(f, "user:%08zx\tvalue-%zu-%zx\n", i * 2654435761UL,
+                    i, i * 31);
+        fclose(f);
+
+        printf("%lu records\n", (unsigned long)n);
+        printf("%10s %14s %12s\n", "loader", "records/s", "seconds");
+
+        if (NULL == (kvs = kvstore_new()) || NULL == (f = fopen(path, "r")))
+                abort();
+        t = now();
+        while (NULL != fgets(line, sizeof(line), f)) {
+                key = line;
+                if (NULL == (val = strchr(line, '\t')))
+                        continue;
+                *val++ = 0;
+                val[strcspn(val, "\n")] = 0;
+                kvstore_set(kvs, key, val);
+        }
+        t = now() - t;
+        fclose(f);
+        printf("%10s %14.0f %12.3f\n", "set loop", n / t, t);
+        kvstore_discard(kvs);
+
+        for (threads = 1; threads <= ncpu; threads *= 2) {
+                if (NULL == (kvs = kvstore_new()))
+                        abort();
+                kvstore_config(kvs, KVSTORE_LOAD_THREADS, &threads);
+                t = now();
+                if ((ssize_t)n != kvstore_bulk_load(kvs, path,
+                    KVSTORE_LOAD_TSV))
+                        abort();
+                t = now() - t;
+                snprintf(line, sizeof(line), "bulk x%lu",
+                    (unsigned long)threads);
+                printf("%10s %14.0f %12.3f\n", line, n / t, t);
+                kvstore_discard(kvs);
+        }
+
+        unlink(path);
+        return 0;
+}
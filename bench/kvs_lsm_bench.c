@@ -0,0 +1,148 @@
+/*
+ * Copyright (c) 2013 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+ * OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ * ---------------------------------------------------------------------
+ */
+
+
+/*
+ * kvs_lsm_bench loads a key space into an LSM store, overwrites it at
+ * random several times over and then reads it back, reporting write,
+ * read and space amplification and the throughput of each phase.
+ *
+ * usage: kvs_lsm_bench [directory] [keys] [overwrite passes]
+ */
+
+
+#include <sys/time.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "kv.h"
+
+
+static double
+now(void)
+{
+        struct timeval   tv;
+
+        gettimeofday(&tv, NULL);
+        return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+
+static void
+cleanup(const char *path)
+{
+        struct dirent   *de;
+        DIR             *dir;
+        char             file[512];
+
+        if (NULL == (dir = opendir(path)))
+                return;
+        while (NULL != (de = readdir(dir))) {
+                if ('.' == de->d_name[0])
+                        continue;
+                snprintf(file, sizeof(file), "%s/%s", path, de->d_name);
+                unlink(file);
+        }
+        closedir(dir);
+        rmdir(path);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+        struct kvstore_lsm_stats stats;
+        kvstore                  kvs;
+        char                     tmp[] = "/tmp/kvs_lsm_bench.XXXXXX";
+        char                    *path = tmp;
+        char                     key[32];
+        char                     val[128];
+        size_t                   keys = 200000;
+        size_t                   passes = 4;
+        size_t                   i, found = 0;
+        uint64_t                 live, gets, reads;
+        unsigned int             seed = 1;
+        double                   start, elapsed;
+        int                      lvl;
+
+        if (argc > 1)
+                path = argv[1];
+        else if (NULL == mkdtemp(tmp))
+                abort();
+        if (argc > 2)
+                keys = strtoul(argv[2], NULL, 10);
+        if (argc > 3)
+                passes = strtoul(argv[3], NULL, 10);
+        if (NULL == (kvs = kvstore_open_lsm(path)))
+                abort();
+
+        memset(val, 'v', sizeof(val) - 1);
+        val[sizeof(val) - 1] = 0;
+        live = keys * (16 + sizeof(val) - 1);
+
+        start = now();
+        for (i = 0; i < keys * (passes + 1); i++) {
+                snprintf(key, sizeof(key), "key%013u",
+                    (unsigned int)(i < keys ? i : rand_r(&seed) % keys));
+                if (kvstore_set(kvs, key, val))
+                        abort();
+        }
+        if (kvstore_lsm_compact(kvs))
+                abort();
+        elapsed = now() - start;
+        printf("write: %lu sets in %.2fs, %.0f sets/s\n",
+            (unsigned long)(keys * (passes + 1)), elapsed,
+            keys * (passes + 1) / elapsed);
+
+        kvstore_lsm_stats(kvs, &stats);
+        gets = stats.gets;
+        reads = stats.block_reads;
+        start = now();
+        for (i = 0; i < keys; i++) {
+                snprintf(key, sizeof(key), "key%013u",
+                    (unsigned int)(rand_r(&seed) % (keys * 2)));
+                if (NULL != kvstore_get(kvs, key))
+                        found++;
+        }
+        elapsed = now() - start;
+        printf("read:  %lu gets (%lu hits) in %.2fs, %.0f gets/s\n",
+            (unsigned long)keys, (unsigned long)found, elapsed,
+            keys / elapsed);
+
+        kvstore_lsm_stats(kvs, &stats);
+        printf("write amplification: %.2f\n",
+            (double)stats.disk_writes / stats.user_bytes);
+        printf("read amplification:  %.2f blocks/get, %lu bloom skips\n",
+            (double)(stats.block_reads - reads) / (stats.gets - gets),
+            (unsigned long)stats.bloom_skips);
+        printf("space amplification: %.2f\n",
+            (double)stats.disk_bytes / live);
+        printf("tables per level:   ");
+        for (lvl = 0; lvl < KVSTORE_LSM_LEVELS; lvl++)
+                printf(" %lu", (unsigned long)stats.tables[lvl]);
+        printf("\n");
+
+        kvstore_discard(kvs);
+        if (path == tmp)
+                cleanup(path);
+        return 0;
+}
@@ -0,0 +1,175 @@
+/*
+ * Copyright (c) 2013 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+ * OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ * ---------------------------------------------------------------------
+ */
+
+
+/*
+ * kvs_rcache_bench has each of several threads read its own small
+ * working set of keys over and over out of a larger store, while one
+ * read in a thousand becomes a write to a random key, and compares a
+ * plain store with one that has per-thread read caches. For the latter
+ * it also reports how the reads split between hits, misses and stale
+ * entries.
+ *
+ * usage: kvs_rcache_bench [threads [working set [ops]]]
+ */
+
+
+#include <sys/time.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kv.h"
+
+
+#define KEYS    100000
+
+
+struct worker {
+        kvstore          kvs;
+        size_t           set;
+        size_t           ops;
+        uint64_t         rng;
+        size_t           misses;
+        pthread_t        thread;
+};
+
+
+static double
+now(void)
+{
+        struct timeval   tv;
+
+        gettimeofday(&tv, NULL);
+        return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+
+static uint64_t
+next_rand(uint64_t *state)
+{
+        uint64_t        z = (*state += 0x9e3779b97f4a7c15ULL);
+
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+}
+
+
+static void *
+work(void *arg)
+{
+        struct worker   *w = (struct worker *)arg;
+        size_t           i, *keys;
+        char             key[32];
+
+        if (NULL == (keys = (size_t *)malloc(w->set * sizeof(size_t))))
+                abort();
+        for (i = 0; i < w->set; i++)
+                keys[i] = (size_t)(next_rand(&w->rng) % KEYS);
+        for (i = 0; i < w->ops; i++) {
+                if (0 == next_rand(&w->rng) % 1000) {
+                        snprintf(key, sizeof(key), "key:%zu",
+                            (size_t)(next_rand(&w->rng) % KEYS));
+                        kvstore_set(w->kvs, key, "written");
+                        continue;
+                }
+                snprintf(key, sizeof(key), "key:%zu", keys[i % w->set]);
+                w->misses += NULL == kvstore_get(w->kvs, key);
+        }
+        free(keys);
+        return NULL;
+}
+
+
+static void
+run(const char *name, size_t slots, size_t nthreads, size_t set, size_t ops)
+{
+        struct kvstore_read_cache_stats  st;
+        struct worker                   *w;
+        kvstore                          kvs;
+        size_t                           i, misses = 0;
+        char                             key[32];
+        double                           t;
+
+        if ((NULL == (kvs = kvstore_new())) ||
+            (NULL == (w = calloc(nthreads, sizeof(struct worker)))))
+                abort();
+        if ((0 != slots) && kvstore_config(kvs, KVSTORE_READ_CACHE, &slots))
+                abort();
+        for (i = 0; i < KEYS; i++) {
+                snprintf(key, sizeof(key), "key:%zu", i);
+                kvstore_set(kvs, key, "value");
+        }
+
+        t = now();
+        for (i = 0; i < nthreads; i++) {
+                w[i].kvs = kvs;
+                w[i].set = set;
+                w[i].ops = ops;
+                w[i].rng = i + 1;
+                if (pthread_create(&w[i].thread, NULL, work, &w[i]))
+                        abort();
+        }
+        for (i = 0; i < nthreads; i++) {
+                pthread_join(w[i].thread, NULL);
+                misses += w[i].misses;
+        }
+        t = now() - t;
+        if (0 != misses)
+                abort();
+
+        printf("%-8s %10.2f", name, nthreads * ops / t / 1e6);
+        if ((0 == slots) || kvstore_read_cache_stats(kvs, &st)) {
+                printf("\n");
+        } else {
+                t = (double)(st.hits + st.misses + st.stale) / 100;
+                printf(" %9.1f%% %9.1f%% %9.1f%%\n", st.hits / t,
+                    st.misses / t, st.stale / t);
+        }
+        fflush(stdout);
+        kvstore_discard(kvs);
+        free(w);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+        size_t   nthreads = 4, set = 64, ops = 2000000;
+
+        if (argc > 1)
+                nthreads = strtoul(argv[1], NULL, 10);
+        if (argc > 2)
+                set = strtoul(argv[2], NULL, 10);
+        if (argc > 3)
+                ops = strtoul(argv[3], NULL, 10);
+        if ((0 == nthreads) || (0 == set) || (0 == ops))
+                return 1;
+
+        printf("%zu threads, %zu keys each, %zu ops each\n", nthreads, set,
+            ops);
+        printf("%-8s %10s %10s %10s %10s\n", "store", "Mops/s", "hits",
+            "misses", "stale");
+        run("plain", 0, nthreads, set, ops);
+        run("cached", set * 16, nthreads, set, ops);
+        return 0;
+}
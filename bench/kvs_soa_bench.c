@@ -0,0 +1,177 @@
+/*
+ * Copyright (c) 2013 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+ * OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ * ---------------------------------------------------------------------
+ */
+
+
+
+/*
+ * kvs_soa_bench fills a node store and a compact store with the same
+ * keys, then times each one loading, scanning in full and looking keys
+ * up, present and absent, in random order, and reports how much the
+ * process grew while it was loaded. Each layout runs in its own child
+ * so that neither reuses memory the other freed.
+ *
+ * usage: kvs_soa_bench [keys] [value size]
+ */
+
+
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "kv.h"
+
+
+static double
+now(void)
+{
+        struct timeval   tv;
+
+        gettimeofday(&tv, NULL);
+        return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+
+static double
+rss_mb(void)
+{
+        FILE            *f;
+        unsigned long    size, rss = 0;
+
+        if (NULL == (f = fopen("/proc/self/statm", "r")))
+                return 0;
+        if (2 != fscanf(f, "%lu %lu", &size, &rss))
+                rss = 0;
+        fclose(f);
+        return rss * (double)sysconf(_SC_PAGESIZE) / (1 << 20);
+}
+
+
+static uint64_t
+next_rand(uint64_t *state)
+{
+        uint64_t        z = (*state += 0x9e3779b97f4a7c15ULL);
+
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+}
+
+
+static void
+scan_sum(char *key, char *val, void *arg)
+{
+        size_t  *sum = (size_t *)arg;
+
+        *sum += (unsigned char)key[0] + (unsigned char)val[0];
+}
+
+
+static void
+run(const char *name, int compact, size_t n, char *val, size_t vsize)
+{
+        kvstore          kvs;
+        uint64_t         state = 7;
+        size_t           i, cursor, sum = 0, hits = 0;
+        char             key[32];
+        double           rss, t_set, t_scan, t_hit, t_miss;
+        pid_t            pid;
+
+        if (0 != (pid = fork())) {
+                if (-1 != pid)
+                        waitpid(pid, NULL, 0);
+                return;
+        }
+        if (NULL == (kvs = compact ? kvstore_new_compact() : kvstore_new()))
+                abort();
+        kvstore_config(kvs, KVSTORE_MAX_VALLEN, &vsize);
+        rss = rss_mb();
+        t_set = now();
+        for (i = 0; i < n; i++) {
+                snprintf(key, sizeof(key), "key:%zu", i);
+                if (kvstore_set(kvs, key, val))
+                        abort();
+        }
+        t_set = now() - t_set;
+        rss = rss_mb() - rss;
+
+        t_scan = now();
+        cursor = 0;
+        do {
+                kvstore_scan(kvs, &cursor, 1024, scan_sum, &sum);
+        } while (0 != cursor);
+        t_scan = now() - t_scan;
+
+        t_hit = now();
+        for (i = 0; i < n; i++) {
+                snprintf(key, sizeof(key), "key:%zu",
+                    (size_t)(next_rand(&state) % n));
+                hits += NULL != kvstore_get(kvs, key);
+        }
+        t_hit = now() - t_hit;
+
+        t_miss = now();
+        for (i = 0; i < n; i++) {
+                snprintf(key, sizeof(key), "nokey:%zu",
+                    (size_t)(next_rand(&state) % n));
+                hits += NULL != kvstore_get(kvs, key);
+        }
+        t_miss = now() - t_miss;
+
+        if ((hits != n) || (0 == sum))
+                abort();
+        printf("%-8s %10.0f %10.1f %10.0f %10.0f %10.1f\n", name,
+            n / t_set / 1e3, n / t_scan / 1e6, n / t_hit / 1e3,
+            n / t_miss / 1e3, rss);
+        fflush(stdout);
+        kvstore_discard(kvs);
+        _exit(0);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+        size_t   n = 1000000, vsize = 32;
+        char    *val;
+
+        if (argc > 1)
+                n = strtoul(argv[1], NULL, 10);
+        if (argc > 2)
+                vsize = strtoul(argv[2], NULL, 10);
+        if ((0 == n) || (0 == vsize) || (NULL == (val = malloc(vsize + 1))))
+                return 1;
+        memset(val, 'v', vsize);
+        val[vsize] = 0;
+
+        printf("%lu keys, %lu byte values\n", (unsigned long)n,
+            (unsigned long)vsize);
+        printf("%-8s %10s %10s %10s %10s %10s\n", "layout", "set k/s",
+            "scan M/s", "hit k/s", "miss k/s", "RSS MB");
+
+        fflush(stdout);
+        run("node", 0, n, val, vsize);
+        run("compact", 1, n, val, vsize);
+
+        free(val);
+        return 0;
+}
@@ -0,0 +1,222 @@
+/*
+ * Copyright (c) 2013 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+ * OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ * ---------------------------------------------------------------------
+ */
+
+
+/*
+ * kvs_txn_bench moves money between a few hot accounts from several
+ * threads. Each transfer reads two balances, does some work to decide
+ * on the new ones, and writes both. It compares one application mutex
+ * held around the whole transfer with optimistic transactions, and
+ * checks that no money was created or lost.
+ *
+ * usage: kvs_txn_bench [threads [accounts [work]]]
+ */
+
+
+#include <sys/time.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kv.h"
+
+
+static const size_t      TRANSFERS = 50000;
+
+struct worker {
+        kvstore          kvs;
+        pthread_mutex_t *lock;
+        size_t           accounts;
+        size_t           work;
+        unsigned int     seed;
+        size_t           from;
+        size_t           to;
+        size_t           tries;
+        pthread_t        thread;
+};
+
+
+static double
+now(void)
+{
+        struct timeval   tv;
+
+        gettimeofday(&tv, NULL);
+        return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+
+/*
+ * think stands in for whatever the application computes between reading
+ * and writing; it is what the single mutex serialises.
+ */
+static long
+think(long a, size_t work)
+{
+        volatile uint64_t        h = (uint64_t)a;
+        size_t                   i;
+
+        for (i = 0; i < work; i++)
+                h = h * 0x100000001b3ULL + i;
+        return a + (long)(h & 0);
+}
+
+
+static void
+pick(struct worker *w)
+{
+        w->from = rand_r(&w->seed) % w->accounts;
+        w->to = (w->from + 1 + rand_r(&w->seed) % (w->accounts - 1)) %
+            w->accounts;
+}
+
+
+static int
+transfer(kvstore_txn txn, void *arg)
+{
+        struct worker   *w = (struct worker *)arg;
+        char             from[32], to[32], val[24];
+        long             a, b;
+
+        w->tries++;
+        snprintf(from, sizeof(from), "acct%zu", w->from);
+        snprintf(to, sizeof(to), "acct%zu", w->to);
+        a = think(atol(kvstore_txn_get(txn, from)), w->work) - 1;
+        b = atol(kvstore_txn_get(txn, to)) + 1;
+        snprintf(val, sizeof(val), "%ld", a);
+        kvstore_txn_set(txn, from, val);
+        snprintf(val, sizeof(val), "%ld", b);
+        kvstore_txn_set(txn, to, val);
+        return 0;
+}
+
+
+static void *
+run_mutex(void *arg)
+{
+        struct worker   *w = (struct worker *)arg;
+        char             from[32], to[32], val[24];
+        size_t           i;
+        long             a, b;
+
+        for (i = 0; i < TRANSFERS; i++) {
+                pick(w);
+                snprintf(from, sizeof(from), "acct%zu", w->from);
+                snprintf(to, sizeof(to), "acct%zu", w->to);
+                pthread_mutex_lock(w->lock);
+                a = think(atol(kvstore_get(w->kvs, from)), w->work) - 1;
+                b = atol(kvstore_get(w->kvs, to)) + 1;
+                snprintf(val, sizeof(val), "%ld", a);
+                kvstore_set(w->kvs, from, val);
+                snprintf(val, sizeof(val), "%ld", b);
+                kvstore_set(w->kvs, to, val);
+                pthread_mutex_unlock(w->lock);
+        }
+        return NULL;
+}
+
+
+static void *
+run_txn(void *arg)
+{
+        struct worker   *w = (struct worker *)arg;
+        size_t           i;
+
+        for (i = 0; i < TRANSFERS; i++) {
+                pick(w);
+                if (0 != kvstore_txn_run(w->kvs, transfer, w))
+                        abort();
+        }
+        return NULL;
+}
+
+
+static void
+bench(const char *name, void *(*fn)(void *), size_t nthreads,
+    size_t accounts, size_t work)
+{
+        pthread_mutex_t  lock = PTHREAD_MUTEX_INITIALIZER;
+        struct worker   *w;
+        kvstore          kvs;
+        char             key[32];
+        size_t           i, tries = 0;
+        long             total = 0;
+        double           t;
+
+        if (NULL == (kvs = kvstore_new()))
+                abort();
+        for (i = 0; i < accounts; i++) {
+                snprintf(key, sizeof(key), "acct%zu", i);
+                kvstore_set(kvs, key, "1000000");
+        }
+        if (NULL == (w = calloc(nthreads, sizeof(struct worker))))
+                abort();
+
+        t = now();
+        for (i = 0; i < nthreads; i++) {
+                w[i].kvs = kvs;
+                w[i].lock = &lock;
+                w[i].accounts = accounts;
+                w[i].work = work;
+                w[i].seed = (unsigned int)i + 1;
+                if (pthread_create(&w[i].thread, NULL, fn, &w[i]))
+                        abort();
+        }
+        for (i = 0; i < nthreads; i++) {
+                pthread_join(w[i].thread, NULL);
+                tries += w[i].tries;
+        }
+        t = now() - t;
+
+        for (i = 0; i < accounts; i++) {
+                snprintf(key, sizeof(key), "acct%zu", i);
+                total += atol(kvstore_get(kvs, key));
+        }
+        printf("%-12s %12.0f %10.2f%s\n", name, nthreads * TRANSFERS / t,
+            0 == tries ? 0.0 : tries / (double)(nthreads * TRANSFERS),
+            total == (long)accounts * 1000000 ? "" : "  (total wrong!)");
+        kvstore_discard(kvs);
+        free(w);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+        size_t  nthreads = 4, accounts = 64, work = 2000;
+
+        if (argc > 1)
+                nthreads = strtoul(argv[1], NULL, 10);
+        if (argc > 2)
+                accounts = strtoul(argv[2], NULL, 10);
+        if (argc > 3)
+                work = strtoul(argv[3], NULL, 10);
+        if ((0 == nthreads) || (2 > accounts))
+                abort();
+
+        printf("%lu threads, %lu accounts, work %lu\n",
+            (unsigned long)nthreads, (unsigned long)accounts,
+            (unsigned long)work);
+        printf("%-12s %12s %10s\n", "", "transfers/s", "tries/txn");
+        bench("mutex", run_mutex, nthreads, accounts, work);
+        bench("txn", run_txn, nthreads, accounts, work);
+        return 0;
+}
@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2013 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+ * OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ * ---------------------------------------------------------------------
+ */
+
+
+/*
+ * kvs_u64_bench stores the same set of 64-bit IDs through the string API
+ * (formatted as decimal) and through the integer-key API, and compares
+ * the cost of set, get and del.
+ *
+ * usage: kvs_u64_bench [keys]
+ */
+
+
+#include <sys/time.h>
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kv.h"
+
+
+static double
+now(void)
+{
+        struct timeval   tv;
+
+        gettimeofday(&tv, NULL);
+        return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+
+static uint64_t
+next_id(uint64_t *state)
+{
+        uint64_t        z = (*state += 0x9e3779b97f4a7c15ULL);
+
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+        kvstore          kvs;
+        uint64_t        *ids;
+        uint64_t         state = 1;
+        size_t           n = 1000000, i, misses = 0;
+        char             key[24];
+        double           t, str[3], u64[3];
+
+        if (argc > 1)
+                n = strtoul(argv[1], NULL, 10);
+        if (NULL == (ids = malloc(n * sizeof(uint64_t))))
+                abort();
+        for (i = 0; i < n; i++)
+                ids[i] = next_id(&state);
+
+        if (NULL == (kvs = kvstore_new()))
+                abort();
+        t = now();
+        for (i = 0; i < n; i++) {
+                snprintf(key, sizeof(key), "%llu", (unsigned long long)ids[i]);
+                kvstore_set(kvs, key, "x");
+        }
+        str[0] = now() - t;
+        t = now();
+        for (i = 0; i < n; i++) {
+                snprintf(key, sizeof(key), "%llu", (unsigned long long)ids[i]);
+                misses += NULL == kvstore_get(kvs, key);
+        }
+        str[1] = now() - t;
+        t = now();
+        for (i = 0; i < n; i++) {
+                snprintf(key, sizeof(key), "%llu", (unsigned long long)ids[i]);
+                kvstore_del(kvs, key);
+        }
+        str[2] = now() - t;
+        kvstore_discard(kvs);
+
+        if (NULL == (kvs = kvstore_new()))
+                abort();
+        t = now();
+        for (i = 0; i < n; i++)
+                kvstore_u64_set(kvs, ids[i], "x");
+        u64[0] = now() - t;
+        t = now();
+        for (i = 0; i < n; i++)
+                misses += NULL == kvstore_u64_get(kvs, ids[i]);
+        u64[1] = now() - t;
+        t = now();
+        for (i = 0; i < n; i++)
+                kvstore_u64_del(kvs, ids[i]);
+        u64[2] = now() - t;
+        kvstore_discard(kvs);
+
+        printf("%lu keys%s\n", (unsigned long)n, misses ? " (misses!)" : "");
+        printf("%6s %14s %14s %8s\n", "op", "string ns/op", "u64 ns/op",
+            "speedup");
+        printf("%6s %14.1f %14.1f %7.2fx\n", "set", str[0] * 1e9 / n,
+            u64[0] * 1e9 / n, str[0] / u64[0]);
+        printf("%6s %14.1f %14.1f %7.2fx\n", "get", str[1] * 1e9 / n,
+            u64[1] * 1e9 / n, str[1] / u64[1]);
+        printf("%6s %14.1f %14.1f %7.2fx\n", "del", str[2] * 1e9 / n,
+            u64[2] * 1e9 / n, str[2] / u64[2]);
+        free(ids);
+        return 0;
+}
@@ -0,0 +1,137 @@
+/*
+ * Copyright (c) 2013 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+ * OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ * ---------------------------------------------------------------------
+ */
+
+
+/*
+ * kvs_wc_bench compares kvstore_set through the store lock against the
+ * write-combining applier, with 8, 32 and 64 writers hammering a small
+ * set of hot keys.
+ *
+ * usage: kvs_wc_bench [writes per thread] [hot keys]
+ */
+
+
+#include <sys/time.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kv.h"
+
+
+struct writer {
+        kvstore          kvs;
+        size_t           writes;
+        size_t           keys;
+        unsigned int     seed;
+};
+
+
+static double
+now(void)
+{
+        struct timeval   tv;
+
+        gettimeofday(&tv, NULL);
+        return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+
+static void *
+writer(void *arg)
+{
+        struct writer   *w = (struct writer *)arg;
+        char             key[32];
+        char             val[32];
+        size_t           i;
+
+        for (i = 0; i < w->writes; i++) {
+                snprintf(key, sizeof(key), "hot%u",
+                    (unsigned int)(rand_r(&w->seed) % w->keys));
+                snprintf(val, sizeof(val), "%lu", (unsigned long)i);
+                kvstore_set(w->kvs, key, val);
+        }
+        kvstore_wc_sync(w->kvs);
+        return NULL;
+}
+
+
+static double
+run(int combine, int nthreads, size_t writes, size_t keys)
+{
+        kvstore          kvs;
+        pthread_t       *threads;
+        struct writer   *args;
+        double           start, elapsed;
+        int              i;
+
+        if (NULL == (kvs = kvstore_new()))
+                abort();
+        if (combine && kvstore_config(kvs, KVSTORE_WRITE_COMBINE, &combine))
+                abort();
+        threads = calloc(nthreads, sizeof(pthread_t));
+        args = calloc(nthreads, sizeof(struct writer));
+        if ((NULL == threads) || (NULL == args))
+                abort();
+
+        start = now();
+        for (i = 0; i < nthreads; i++) {
+                args[i].kvs = kvs;
+                args[i].writes = writes;
+                args[i].keys = keys;
+                args[i].seed = (unsigned int)i + 1;
+                if (pthread_create(&threads[i], NULL, writer, &args[i]))
+                        abort();
+        }
+        for (i = 0; i < nthreads; i++)
+                pthread_join(threads[i], NULL);
+        elapsed = now() - start;
+
+        kvstore_discard(kvs);
+        free(threads);
+        free(args);
+        return (double)writes * nthreads / elapsed;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+        int              nthreads[] = { 8, 32, 64 };
+        size_t           writes = 20000;
+        size_t           keys = 64;
+        double           locked, combined;
+        size_t           i;
+
+        if (argc > 1)
+                writes = strtoul(argv[1], NULL, 10);
+        if (argc > 2)
+                keys = strtoul(argv[2], NULL, 10);
+
+        printf("%8s %16s %16s %8s\n", "threads", "locked ops/s",
+            "combined ops/s", "speedup");
+        for (i = 0; i < sizeof(nthreads) / sizeof(nthreads[0]); i++) {
+                locked = run(0, nthreads[i], writes, keys);
+                combined = run(1, nthreads[i], writes, keys);
+                printf("%8d %16.0f %16.0f %7.2fx\n", nthreads[i], locked,
+                    combined, combined / locked);
+        }
+        return 0;
+}
@@ -0,0 +1,677 @@
+/*
+ * Copyright (c) 2013 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+ * OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ * ---------------------------------------------------------------------
+ */
+
+
+/*
+ * kvstored serves a kvstore over the memcached text protocol. Each
+ * worker thread runs its own edge-triggered epoll loop on its own
+ * listening socket; SO_REUSEPORT has the kernel spread connections
+ * across them. Requests are pipelined: everything readable is parsed
+ * and answered in one pass, and the replies are sent with writev.
+ *
+ * Supported commands are get, gets, set, delete, incr, version and quit.
+ * Flags and expiry times are accepted but not stored, and the cas value
+ * reported by gets is a hash of the value rather than a version.
+ *
+ * usage: kvstored [-l address] [-p port] [-t threads] [-d directory]
+ */
+
+
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "kv.h"
+
+
+#define KVSTORED_MAX_TOKENS     1024
+#define KVSTORED_MAX_IOV        64
+#define KVSTORED_MAX_LINE       (64 * 1024)
+
+static const size_t      KVSTORED_BLOCK = 64 * 1024;
+static const size_t      KVSTORED_MAX_KEYLEN = 250;
+static const size_t      KVSTORED_MAX_VALLEN = 1024 * 1024;
+static const size_t      KVSTORED_HIGH_WATER = 4 * 1024 * 1024;
+static const int         KVSTORED_EVENTS = 256;
+
+
+/*
+ * Replies are built in a chain of blocks, so a large reply never has to
+ * be moved to make room, and the chain is handed to writev as is.
+ */
+struct block {
+        struct block    *next;
+        size_t           len;
+        size_t           cap;
+        size_t           sent;
+        char             data[];
+};
+
+struct conn {
+        int              fd;
+        int              closing;
+        char            *in;
+        size_t           in_len;
+        size_t           in_cap;
+        struct block    *out;
+        struct block    *out_tail;
+        size_t           out_len;
+};
+
+struct worker {
+        kvstore          kvs;
+        int              lfd;
+        int              epfd;
+        pthread_t        thread;
+        char            *tokens[KVSTORED_MAX_TOKENS];
+        char             line[KVSTORED_MAX_LINE + 1];
+};
+
+struct get_reply {
+        struct conn     *c;
+        int              cas;
+        int              failed;
+};
+
+
+static int       stop = 0;
+
+
+static void
+on_signal(int sig)
+{
+        (void)sig;
+        __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+}
+
+
+static int
+set_nonblock(int fd)
+{
+        int     flags;
+
+        if (-1 == (flags = fcntl(fd, F_GETFL)))
+                return -1;
+        return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+
+static char *
+reserve(struct conn *c, size_t n)
+{
+        struct block    *b = c->out_tail;
+        size_t           cap;
+
+        if ((NULL != b) && (b->cap - b->len >= n))
+                return b->data + b->len;
+        cap = n > KVSTORED_BLOCK ? n : KVSTORED_BLOCK;
+        if (NULL == (b = malloc(sizeof(struct block) + cap)))
+                return NULL;
+        b->next = NULL;
+        b->len = 0;
+        b->cap = cap;
+        b->sent = 0;
+        if (NULL == c->out_tail)
+                c->out = b;
+        else
+                c->out_tail->next = b;
+        c->out_tail = b;
+        return b->data;
+}
+
+
+static void
+commit(struct conn *c, size_t n)
+{
+        c->out_tail->len += n;
+        c->out_len += n;
+}
+
+
+static int
+reply(struct conn *c, const char *msg)
+{
+        size_t   len = strlen(msg);
+        char    *p;
+
+        if (NULL == (p = reserve(c, len)))
+                return -1;
+        memcpy(p, msg, len);
+        commit(c, len);
+        return 0;
+}
+
+
+static uint64_t
+cas_of(const char *val, size_t len)
+{
+        uint64_t        h = 0xcbf29ce484222325ULL;
+        size_t          i;
+
+        for (i = 0; i < len; i++) {
+                h ^= (unsigned char)val[i];
+                h *= 0x100000001b3ULL;
+        }
+        return h;
+}
+
+
+/*
+ * get_value runs under the store lock for each key of a get: the value
+ * is copied once, straight into the reply chain next to its header.
+ */
+static void
+get_value(char *key, char *val, void *arg)
+{
+        struct get_reply        *r = (struct get_reply *)arg;
+        size_t                   klen, vlen, n;
+        char                    *p;
+        int                      hlen;
+
+        if ((NULL == val) || r->failed)
+                return;
+        klen = strlen(key);
+        vlen = strlen(val);
+        n = klen + vlen + 64;
+        if (NULL == (p = reserve(r->c, n))) {
+                r->failed = 1;
+                return;
+        }
+        if (r->cas)
+                hlen = snprintf(p, n, "VALUE %s 0 %lu %llu\r\n", key,
+                    (unsigned long)vlen,
+                    (unsigned long long)cas_of(val, vlen));
+        else
+                hlen = snprintf(p, n, "VALUE %s 0 %lu\r\n", key,
+                    (unsigned long)vlen);
+        memcpy(p + hlen, val, vlen);
+        memcpy(p + hlen + vlen, "\r\n", 2);
+        commit(r->c, (size_t)hlen + vlen + 2);
+}
+
+
+static int
+tokenize(char *line, char **tokens)
+{
+        int     n = 0;
+
+        while (*line) {
+                while (' ' == *line)
+                        *line++ = 0;
+                if (0 == *line)
+                        break;
+                if (KVSTORED_MAX_TOKENS == n)
+                        return -1;
+                tokens[n++] = line;
+                while (*line && (' ' != *line))
+                        line++;
+        }
+        return n;
+}
+
+
+/*
+ * process answers every complete request in the input buffer. Request
+ * lines are tokenized in a copy, so that a set whose data has not all
+ * arrived yet can be left in place. Returns 1 if it stopped because too
+ * much output is waiting to be sent, 0 once only an incomplete request
+ * (or nothing) is left, and -1 if the connection should be dropped.
+ */
+static int
+process(struct worker *w, struct conn *c)
+{
+        struct get_reply         r;
+        char                   **tokens = w->tokens;
+        char                    *line, *eol, *data, *end;
+        const char              *msg;
+        unsigned long            bytes;
+        uint64_t                 n;
+        size_t                   off = 0, llen;
+        int                      ntok, noreply, retval = 0;
+        char                     buf[32];
+
+        while ((off < c->in_len) && !c->closing) {
+                if (c->out_len >= KVSTORED_HIGH_WATER) {
+                        retval = 1;
+                        break;
+                }
+                eol = memchr(c->in + off, '\n', c->in_len - off);
+                if (NULL == eol) {
+                        if (c->in_len - off > KVSTORED_MAX_LINE)
+                                return -1;
+                        break;
+                }
+                llen = (size_t)(eol - (c->in + off)) + 1;
+                if (llen > KVSTORED_MAX_LINE)
+                        return -1;
+                line = w->line;
+                memcpy(line, c->in + off, llen - 1);
+                line[llen - 1] = 0;
+                if ((llen > 1) && ('\r' == line[llen - 2]))
+                        line[llen - 2] = 0;
+
+                if (0 >= (ntok = tokenize(line, tokens))) {
+                        if (-1 == ntok && reply(c, "CLIENT_ERROR line "
+                            "has too many tokens\r\n"))
+                                return -1;
+                        off += llen;
+                        continue;
+                }
+                noreply = !strcmp(tokens[ntok - 1], "noreply");
+
+                if (!strcmp(tokens[0], "set")) {
+                        if ((ntok < 5) || (ntok > 6)) {
+                                off += llen;
+                                if (reply(c, "ERROR\r\n"))
+                                        return -1;
+                                continue;
+                        }
+                        bytes = strtoul(tokens[4], &end, 10);
+                        if ((0 != *end) || (bytes > KVSTORED_MAX_VALLEN))
+                                return -1;
+                        if (c->in_len - off < llen + bytes + 2)
+                                break;
+                        data = c->in + off + llen;
+                        off += llen + bytes + 2;
+                        if (('\r' != data[bytes]) ||
+                            ('\n' != data[bytes + 1])) {
+                                if (reply(c, "CLIENT_ERROR bad data "
+                                    "chunk\r\n"))
+                                        return -1;
+                                continue;
+                        }
+                        data[bytes] = 0;
+                        if ((strlen(data) != bytes) ||
+                            kvstore_set(w->kvs, tokens[1], data)) {
+                                if (!noreply && reply(c,
+                                    "NOT_STORED\r\n"))
+                                        return -1;
+                                continue;
+                        }
+                        if (!noreply && reply(c, "STORED\r\n"))
+                                return -1;
+                        continue;
+                }
+
+                off += llen;
+                if (!strcmp(tokens[0], "get") || !strcmp(tokens[0], "gets")) {
+                        if (ntok < 2) {
+                                if (reply(c, "ERROR\r\n"))
+                                        return -1;
+                                continue;
+                        }
+                        r.c = c;
+                        r.cas = ('s' == tokens[0][3]);
+                        r.failed = 0;
+                        kvstore_mget(w->kvs, tokens + 1, (size_t)ntok - 1,
+                            get_value, &r);
+                        if (r.failed || reply(c, "END\r\n"))
+                                return -1;
+                } else if (!strcmp(tokens[0], "delete")) {
+                        if (ntok < 2) {
+                                if (reply(c, "ERROR\r\n"))
+                                        return -1;
+                                continue;
+                        }
+                        if (kvstore_del(w->kvs, tokens[1]))
+                                msg = "NOT_FOUND\r\n";
+                        else
+                                msg = "DELETED\r\n";
+                        if (!noreply && reply(c, msg))
+                                return -1;
+                } else if (!strcmp(tokens[0], "incr")) {
+                        if (ntok < 3) {
+                                if (reply(c, "ERROR\r\n"))
+                                        return -1;
+                                continue;
+                        }
+                        n = strtoull(tokens[2], &end, 10);
+                        if ((0 != *end) || ('-' == tokens[2][0])) {
+                                msg = "CLIENT_ERROR invalid numeric "
+                                    "delta argument\r\n";
+                        } else if (kvstore_incr(w->kvs, tokens[1], n, &n)) {
+                                if (ENOENT == errno)
+                                        msg = "NOT_FOUND\r\n";
+                                else
+                                        msg = "CLIENT_ERROR cannot "
+                                            "increment or decrement "
+                                            "non-numeric value\r\n";
+                        } else {
+                                snprintf(buf, sizeof(buf), "%llu\r\n",
+                                    (unsigned long long)n);
+                                msg = buf;
+                        }
+                        if (!noreply && reply(c, msg))
+                                return -1;
+                } else if (!strcmp(tokens[0], "version")) {
+                        if (reply(c, "VERSION " PACKAGE_VERSION "\r\n"))
+                                return -1;
+                } else if (!strcmp(tokens[0], "quit")) {
+                        c->closing = 1;
+                } else {
+                        if (reply(c, "ERROR\r\n"))
+                                return -1;
+                }
+        }
+
+        memmove(c->in, c->in + off, c->in_len - off);
+        c->in_len -= off;
+        return retval;
+}
+
+
+/*
+ * flush writes as much of the reply chain as the socket will take.
+ */
+static int
+flush(struct conn *c)
+{
+        struct iovec     iov[KVSTORED_MAX_IOV];
+        struct block    *b;
+        ssize_t          n;
+        size_t           done;
+        int              niov;
+
+        while (NULL != c->out) {
+                niov = 0;
+                for (b = c->out; (NULL != b) && (niov < KVSTORED_MAX_IOV);
+                    b = b->next) {
+                        iov[niov].iov_base = b->data + b->sent;
+                        iov[niov].iov_len = b->len - b->sent;
+                        niov++;
+                }
+                n = writev(c->fd, iov, niov);
+                if (-1 == n) {
+                        if (EINTR == errno)
+                                continue;
+                        if ((EAGAIN == errno) || (EWOULDBLOCK == errno))
+                                return 0;
+                        return -1;
+                }
+                c->out_len -= (size_t)n;
+                done = (size_t)n;
+                while ((NULL != (b = c->out)) &&
+                    (done >= b->len - b->sent)) {
+                        done -= b->len - b->sent;
+                        c->out = b->next;
+                        free(b);
+                }
+                if (NULL == c->out)
+                        c->out_tail = NULL;
+                else
+                        c->out->sent += done;
+        }
+        return 0;
+}
+
+
+static void
+conn_close(struct worker *w, struct conn *c)
+{
+        struct block    *b;
+
+        epoll_ctl(w->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+        close(c->fd);
+        while (NULL != (b = c->out)) {
+                c->out = b->next;
+                free(b);
+        }
+        free(c->in);
+        free(c);
+}
+
+
+/*
+ * serve handles a readiness event on a connection. With edge-triggered
+ * notification the socket has to be drained: read until EAGAIN, then
+ * answer and write until EAGAIN.
+ */
+static int
+serve(struct worker *w, struct conn *c)
+{
+        ssize_t  n;
+        size_t   cap;
+        char    *in;
+        int      eof = 0, rc;
+
+        for (;;) {
+                if (c->in_cap - c->in_len < 4096) {
+                        cap = c->in_cap ? c->in_cap * 2 : 16384;
+                        if (NULL == (in = realloc(c->in, cap)))
+                                return -1;
+                        c->in = in;
+                        c->in_cap = cap;
+                }
+                n = read(c->fd, c->in + c->in_len, c->in_cap - c->in_len);
+                if (0 == n) {
+                        eof = 1;
+                        break;
+                }
+                if (-1 == n) {
+                        if (EINTR == errno)
+                                continue;
+                        if ((EAGAIN == errno) || (EWOULDBLOCK == errno))
+                                break;
+                        return -1;
+                }
+                c->in_len += (size_t)n;
+        }
+
+        /*
+         * If the replies drain completely there will be no EPOLLOUT edge
+         * to pick up where process left off, so keep going here.
+         */
+        while (1 == (rc = process(w, c))) {
+                if (flush(c))
+                        return -1;
+                if (c->out_len > 0)
+                        return 0;
+        }
+        if ((-1 == rc) || flush(c))
+                return -1;
+
+        if ((eof || c->closing) && (0 == c->out_len))
+                return -1;
+        return 0;
+}
+
+
+static void
+accept_all(struct worker *w)
+{
+        struct epoll_event       ev;
+        struct conn             *c;
+        int                      fd, one = 1;
+
+        for (;;) {
+                fd = accept(w->lfd, NULL, NULL);
+                if (-1 == fd) {
+                        if (EINTR == errno)
+                                continue;
+                        return;
+                }
+                if (set_nonblock(fd) ||
+                    (NULL == (c = calloc(1, sizeof(struct conn))))) {
+                        close(fd);
+                        continue;
+                }
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                c->fd = fd;
+                ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+                ev.data.ptr = c;
+                if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, fd, &ev)) {
+                        close(fd);
+                        free(c);
+                }
+        }
+}
+
+
+static void *
+run(void *arg)
+{
+        struct worker           *w = (struct worker *)arg;
+        struct epoll_event       events[KVSTORED_EVENTS];
+        int                      i, n;
+
+        while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+                n = epoll_wait(w->epfd, events, KVSTORED_EVENTS, 500);
+                for (i = 0; i < n; i++) {
+                        if (NULL == events[i].data.ptr) {
+                                accept_all(w);
+                                continue;
+                        }
+                        if (serve(w, (struct conn *)events[i].data.ptr))
+                                conn_close(w, events[i].data.ptr);
+                }
+        }
+        return NULL;
+}
+
+
+static int
+listen_on(struct in_addr *addr, int port)
+{
+        struct sockaddr_in       sin;
+        int                      fd, one = 1;
+
+        if (-1 == (fd = socket(AF_INET, SOCK_STREAM, 0)))
+                return -1;
+        memset(&sin, 0x0, sizeof(sin));
+        sin.sin_family = AF_INET;
+        sin.sin_port = htons((uint16_t)port);
+        sin.sin_addr = *addr;
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) ||
+            setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) ||
+            bind(fd, (struct sockaddr *)&sin, sizeof(sin)) ||
+            listen(fd, SOMAXCONN) || set_nonblock(fd)) {
+                close(fd);
+                return -1;
+        }
+        return fd;
+}
+
+
+static void
+usage(void)
+{
+        fprintf(stderr, "usage: kvstored [-l address] [-p port] "
+            "[-t threads] [-d directory]\n");
+        exit(1);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+        struct epoll_event       ev;
+        struct worker           *workers;
+        struct in_addr           addr;
+        struct sigaction         sa;
+        kvstore                  kvs;
+        char                    *dir = NULL;
+        size_t                   keylen = KVSTORED_MAX_KEYLEN;
+        size_t                   vallen = KVSTORED_MAX_VALLEN;
+        long                     nthreads;
+        int                      ch, i, port = 11211;
+
+        addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (0 >= (nthreads = sysconf(_SC_NPROCESSORS_ONLN)))
+                nthreads = 1;
+        while (-1 != (ch = getopt(argc, argv, "d:l:p:t:"))) {
+                switch (ch) {
+                case 'd':
+                        dir = optarg;
+                        break;
+                case 'l':
+                        if (1 != inet_pton(AF_INET, optarg, &addr))
+                                usage();
+                        break;
+                case 'p':
+                        port = atoi(optarg);
+                        break;
+                case 't':
+                        nthreads = atol(optarg);
+                        break;
+                default:
+                        usage();
+                }
+        }
+        if ((port <= 0) || (port > 65535) || (nthreads <= 0))
+                usage();
+
+        memset(&sa, 0x0, sizeof(sa));
+        sa.sa_handler = on_signal;
+        sigaction(SIGINT, &sa, NULL);
+        sigaction(SIGTERM, &sa, NULL);
+        sa.sa_handler = SIG_IGN;
+        sigaction(SIGPIPE, &sa, NULL);
+
+        kvs = NULL == dir ? kvstore_new() : kvstore_open(dir);
+        if (NULL == kvs) {
+                fprintf(stderr, "kvstored: failed to open the store\n");
+                return 1;
+        }
+        kvstore_config(kvs, KVSTORE_MAX_KEYLEN, &keylen);
+        kvstore_config(kvs, KVSTORE_MAX_VALLEN, &vallen);
+
+        if (NULL == (workers = calloc(nthreads, sizeof(struct worker))))
+                return 1;
+        for (i = 0; i < nthreads; i++) {
+                workers[i].kvs = kvs;
+                workers[i].lfd = listen_on(&addr, port);
+                workers[i].epfd = epoll_create1(EPOLL_CLOEXEC);
+                if ((-1 == workers[i].lfd) || (-1 == workers[i].epfd)) {
+                        perror("kvstored");
+                        return 1;
+                }
+                ev.events = EPOLLIN | EPOLLET;
+                ev.data.ptr = NULL;
+                if (epoll_ctl(workers[i].epfd, EPOLL_CTL_ADD,
+                    workers[i].lfd, &ev) ||
+                    pthread_create(&workers[i].thread, NULL, run,
+                    &workers[i])) {
+                        perror("kvstored");
+                        return 1;
+                }
+        }
+
+        for (i = 0; i < nthreads; i++)
+                pthread_join(workers[i].thread, NULL);
+        for (i = 0; i < nthreads; i++) {
+                close(workers[i].lfd);
+                close(workers[i].epfd);
+        }
+        free(workers);
+        kvstore_discard(kvs);
+        return 0;
+}
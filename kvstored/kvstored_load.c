@@ -0,0 +1,408 @@
+/*
+ * Copyright (c) 2013 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+ * OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ * ---------------------------------------------------------------------
+ */
+
+
+/*
+ * kvstored_load drives kvstored (or any memcached) over the text
+ * protocol: it preloads a key space, then runs a mix of pipelined gets
+ * and sets from several connections, one thread each, and reports the
+ * request rate.
+ *
+ * usage: kvstored_load [-h address] [-p port] [-c connections]
+ *                      [-n requests] [-P depth] [-k keys] [-g get %]
+ *                      [-m keys per get] [-s value size]
+ */
+
+
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+struct config {
+        struct in_addr   addr;
+        int              port;
+        int              conns;
+        size_t           requests;
+        size_t           depth;
+        size_t           keys;
+        unsigned int     gets;
+        size_t           mget;
+        size_t           vsize;
+};
+
+struct client {
+        struct config   *cfg;
+        pthread_t        thread;
+        unsigned int     seed;
+        size_t           done;
+        size_t           hits;
+        int              failed;
+        char            *in;
+        size_t           in_len;
+        size_t           in_cap;
+        size_t           in_off;
+};
+
+
+static struct config     cfg;
+static char             *value;
+
+
+static double
+now(void)
+{
+        struct timeval   tv;
+
+        gettimeofday(&tv, NULL);
+        return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+
+static int
+connect_to(struct config *c)
+{
+        struct sockaddr_in       sin;
+        int                      fd, one = 1;
+
+        if (-1 == (fd = socket(AF_INET, SOCK_STREAM, 0)))
+                return -1;
+        memset(&sin, 0x0, sizeof(sin));
+        sin.sin_family = AF_INET;
+        sin.sin_port = htons((uint16_t)c->port);
+        sin.sin_addr = c->addr;
+        if (connect(fd, (struct sockaddr *)&sin, sizeof(sin))) {
+                close(fd);
+                return -1;
+        }
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        return fd;
+}
+
+
+static int
+send_all(int fd, const char *buf, size_t len)
+{
+        ssize_t n;
+
+        while (len > 0) {
+                n = write(fd, buf, len);
+                if (-1 == n) {
+                        if (EINTR == errno)
+                                continue;
+                        return -1;
+                }
+                buf += n;
+                len -= (size_t)n;
+        }
+        return 0;
+}
+
+
+/*
+ * next_line returns the next complete reply line, reading more from the
+ * socket as needed, or NULL if the connection failed.
+ */
+static char *
+next_line(struct client *cl, int fd, size_t need)
+{
+        char    *eol, *nbuf;
+        ssize_t  n;
+
+        for (;;) {
+                if (need) {
+                        if (cl->in_len - cl->in_off >= need) {
+                                cl->in_off += need;
+                                return cl->in;
+                        }
+                } else if (NULL != (eol = memchr(cl->in + cl->in_off, '\n',
+                    cl->in_len - cl->in_off))) {
+                        *eol = 0;
+                        eol = cl->in + cl->in_off;
+                        cl->in_off += strlen(eol) + 1;
+                        return eol;
+                }
+
+                if (cl->in_off > 0) {
+                        memmove(cl->in, cl->in + cl->in_off,
+                            cl->in_len - cl->in_off);
+                        cl->in_len -= cl->in_off;
+                        cl->in_off = 0;
+                }
+                if (cl->in_cap - cl->in_len < 4096) {
+                        nbuf = realloc(cl->in, cl->in_cap * 2 + 65536);
+                        if (NULL == nbuf)
+                                return NULL;
+                        cl->in = nbuf;
+                        cl->in_cap = cl->in_cap * 2 + 65536;
+                }
+                n = read(fd, cl->in + cl->in_len, cl->in_cap - cl->in_len - 1);
+                if (-1 == n && EINTR == errno)
+                        continue;
+                if (n <= 0)
+                        return NULL;
+                cl->in_len += (size_t)n;
+        }
+}
+
+
+static int
+read_get(struct client *cl, int fd)
+{
+        unsigned long    bytes;
+        char            *line, *p;
+
+        for (;;) {
+                if (NULL == (line = next_line(cl, fd, 0)))
+                        return -1;
+                if (0 == strncmp(line, "END", 3))
+                        return 0;
+                if (0 != strncmp(line, "VALUE ", 6))
+                        return -1;
+                if (NULL == (p = strrchr(line, ' ')))
+                        return -1;
+                bytes = strtoul(p + 1, NULL, 10);
+                if (NULL == next_line(cl, fd, bytes + 2))
+                        return -1;
+                cl->hits++;
+        }
+}
+
+
+static void *
+client(void *arg)
+{
+        struct client   *cl = (struct client *)arg;
+        struct config   *c = cl->cfg;
+        char            *req, *line;
+        char            *isget;
+        size_t           cap, len, i, j, batch;
+        int              fd;
+
+        cap = c->depth * (c->mget * 32 + c->vsize + 64) + 1;
+        req = malloc(cap);
+        isget = malloc(c->depth);
+        if ((NULL == req) || (NULL == isget) || (-1 == (fd = connect_to(c)))) {
+                cl->failed = 1;
+                free(req);
+                free(isget);
+                return NULL;
+        }
+
+        while (cl->done < c->requests) {
+                batch = c->requests - cl->done;
+                if (batch > c->depth)
+                        batch = c->depth;
+                len = 0;
+                for (i = 0; i < batch; i++) {
+                        isget[i] = (rand_r(&cl->seed) % 100) < c->gets;
+                        if (isget[i]) {
+                                len += snprintf(req + len, cap - len, "get");
+                                for (j = 0; j < c->mget; j++)
+                                        len += snprintf(req + len, cap - len,
+                                            " key%lu", (unsigned long)
+                                            (rand_r(&cl->seed) % c->keys));
+                                len += snprintf(req + len, cap - len, "\r\n");
+                        } else {
+                                len += snprintf(req + len, cap - len,
+                                    "set key%lu 0 0 %lu\r\n%s\r\n",
+                                    (unsigned long)(rand_r(&cl->seed) %
+                                    c->keys), (unsigned long)c->vsize,
+                                    value);
+                        }
+                }
+                if (send_all(fd, req, len))
+                        break;
+                for (i = 0; i < batch; i++) {
+                        if (isget[i]) {
+                                if (read_get(cl, fd))
+                                        break;
+                        } else {
+                                line = next_line(cl, fd, 0);
+                                if ((NULL == line) ||
+                                    strncmp(line, "STORED", 6))
+                                        break;
+                        }
+                }
+                if (i < batch) {
+                        cl->failed = 1;
+                        break;
+                }
+                cl->done += batch;
+        }
+
+        close(fd);
+        free(req);
+        free(isget);
+        free(cl->in);
+        return NULL;
+}
+
+
+static int
+preload(struct config *c)
+{
+        struct client    cl;
+        char            *req, *line;
+        size_t           i, n, len, cap;
+        int              fd, retval = -1;
+
+        memset(&cl, 0x0, sizeof(cl));
+        cap = 1024 * (c->vsize + 64);
+        if (NULL == (req = malloc(cap)))
+                return -1;
+        if (-1 == (fd = connect_to(c))) {
+                free(req);
+                return -1;
+        }
+        for (i = 0; i < c->keys; i += n) {
+                len = 0;
+                for (n = 0; (n < 1024) && (i + n < c->keys); n++)
+                        len += snprintf(req + len, cap - len,
+                            "set key%lu 0 0 %lu\r\n%s\r\n",
+                            (unsigned long)(i + n), (unsigned long)c->vsize,
+                            value);
+                if (send_all(fd, req, len))
+                        goto preload_done;
+                for (len = 0; len < n; len++) {
+                        line = next_line(&cl, fd, 0);
+                        if ((NULL == line) || strncmp(line, "STORED", 6))
+                                goto preload_done;
+                }
+        }
+        retval = 0;
+
+preload_done:
+        close(fd);
+        free(req);
+        free(cl.in);
+        return retval;
+}
+
+
+static void
+usage(void)
+{
+        fprintf(stderr, "usage: kvstored_load [-h address] [-p port] "
+            "[-c connections] [-n requests]\n"
+            "                     [-P depth] [-k keys] [-g get %%] "
+            "[-m keys per get] [-s value size]\n");
+        exit(1);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+        struct client   *clients;
+        size_t           total = 0, hits = 0, keys;
+        double           start, elapsed;
+        int              ch, i, failed = 0;
+
+        cfg.addr.s_addr = htonl(INADDR_LOOPBACK);
+        cfg.port = 11211;
+        cfg.conns = 4;
+        cfg.requests = 100000;
+        cfg.depth = 16;
+        cfg.keys = 10000;
+        cfg.gets = 90;
+        cfg.mget = 1;
+        cfg.vsize = 32;
+        while (-1 != (ch = getopt(argc, argv, "c:g:h:k:m:n:p:P:s:"))) {
+                switch (ch) {
+                case 'c':
+                        cfg.conns = atoi(optarg);
+                        break;
+                case 'g':
+                        cfg.gets = (unsigned int)atoi(optarg);
+                        break;
+                case 'h':
+                        if (1 != inet_pton(AF_INET, optarg, &cfg.addr))
+                                usage();
+                        break;
+                case 'k':
+                        cfg.keys = strtoul(optarg, NULL, 10);
+                        break;
+                case 'm':
+                        cfg.mget = strtoul(optarg, NULL, 10);
+                        break;
+                case 'n':
+                        cfg.requests = strtoul(optarg, NULL, 10);
+                        break;
+                case 'p':
+                        cfg.port = atoi(optarg);
+                        break;
+                case 'P':
+                        cfg.depth = strtoul(optarg, NULL, 10);
+                        break;
+                case 's':
+                        cfg.vsize = strtoul(optarg, NULL, 10);
+                        break;
+                default:
+                        usage();
+                }
+        }
+        if ((cfg.conns <= 0) || (0 == cfg.depth) || (0 == cfg.keys) ||
+            (0 == cfg.mget) || (0 == cfg.vsize))
+                usage();
+
+        if (NULL == (value = malloc(cfg.vsize + 1)))
+                return 1;
+        memset(value, 'v', cfg.vsize);
+        value[cfg.vsize] = 0;
+        if (preload(&cfg)) {
+                fprintf(stderr, "kvstored_load: preload failed\n");
+                return 1;
+        }
+
+        if (NULL == (clients = calloc(cfg.conns, sizeof(struct client))))
+                return 1;
+        start = now();
+        for (i = 0; i < cfg.conns; i++) {
+                clients[i].cfg = &cfg;
+                clients[i].seed = (unsigned int)i + 1;
+                if (pthread_create(&clients[i].thread, NULL, client,
+                    &clients[i]))
+                        return 1;
+        }
+        for (i = 0; i < cfg.conns; i++) {
+                pthread_join(clients[i].thread, NULL);
+                total += clients[i].done;
+                hits += clients[i].hits;
+                failed += clients[i].failed;
+        }
+        elapsed = now() - start;
+
+        keys = (size_t)(total * (cfg.gets / 100.0) * cfg.mget);
+        printf("%lu requests over %d connections, depth %lu: "
+            "%.0f requests/s, ~%.0f keys/s read, %lu hits\n",
+            (unsigned long)total, cfg.conns, (unsigned long)cfg.depth,
+            total / elapsed, keys / elapsed, (unsigned long)hits);
+        free(clients);
+        free(value);
+        return failed ? 1 : 0;
+}
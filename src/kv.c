@@ -21,41 +21,33 @@
 #include <sys/time.h>
 #include <errno.h>
 #include <semaphore.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "kv.h"
+#include "kv_int.h"
 
 
 const size_t      KVSTORE_DEFAULT_MAX_KEYLEN = 4096;
 const size_t      KVSTORE_DEFAULT_MAX_VALLEN = 4096;
-
-
-struct _kvstore_kv {
-        char                    *key;
-        size_t                   key_len;
-        char                    *val;
-        size_t                   val_len;
-        TAILQ_ENTRY(_kvstore_kv) entries;
-};
-TAILQ_HEAD(_tq_kvstore_kv, _kvstore_kv);
-
-struct _kvstore {
-        struct _tq_kvstore_kv   *queue;
-        sem_t                   *sem;
-        size_t                   refs;
-        size_t                   keys;
-        size_t                   max_keylen;
-        size_t                   max_vallen;
-        struct timeval           timeo;
-};
+static const size_t      KVSTORE_TABLE_INITIAL = 16;
+static const size_t      KVSTORE_REHASH_STEP = 1;
 
 
 static int       _lock_kvstore(kvstore);
-static int       _unlock_kvstore(kvstore);
+static int       _kvstore_table_init(struct _kvstore_table *, size_t);
+static int       _kvstore_resize(kvstore, size_t);
+static void      _kvstore_rehash_step(kvstore, size_t);
+static int       _kvstore_hash_config(kvstore, KVSTORE_CONFIG_OPT, void *);
+static int       _kvstore_put(kvstore, char *, char *);
 static int       _kvstore_update(kvstore, struct _kvstore_kv *, char *);
+static int       _kvstore_remove(kvstore, char *);
+static size_t    _kvstore_scan_bucket(struct _kvstore_table *, size_t,
+                    kvstore_scan_cb, void *);
+static size_t    _kvstore_rev(size_t);
 
 
 int
@@ -72,6 +64,10 @@ _lock_kvstore(kvstore kvs)
                 select(0, NULL, NULL, NULL, &ts);
                 retval = sem_trywait(kvs->sem);
         }
+        if ((0 == retval) && (NULL != kvs->shm) && _kvstore_shm_lock(kvs)) {
+                sem_post(kvs->sem);
+                return -1;
+        }
         return retval;
 }
 
@@ -79,10 +75,310 @@ _lock_kvstore(kvstore kvs)
 int
 _unlock_kvstore(kvstore kvs)
 {
+        KVSTORE_PROBE1(lock__release, kvs);
+        if (NULL != kvs->shm)
+                _kvstore_shm_unlock(kvs);
         return sem_post(kvs->sem);
 }
 
 
+/*
+ * _acquire_kvstore keeps retrying _lock_kvstore while the store is merely
+ * busy, and only gives up if the semaphore itself is unusable.
+ */
+int
+_acquire_kvstore(kvstore kvs)
+{
+        KVSTORE_PROBE1(lock__wait, kvs);
+        while (-1 == _lock_kvstore(kvs)) {
+                if ((EAGAIN != errno) && (EINTR != errno))
+                        return -1;
+        }
+        KVSTORE_PROBE1(lock__acquired, kvs);
+        return 0;
+}
+
+
+int
+_kvstore_table_init(struct _kvstore_table *t, size_t size)
+{
+        t->buckets = (struct _kvstore_kv **)calloc(size,
+            sizeof(struct _kvstore_kv *));
+        if (NULL == t->buckets)
+                return -1;
+        t->size = size;
+        t->mask = size - 1;
+        t->used = 0;
+        return 0;
+}
+
+
+/*
+ * _kvstore_resize starts an incremental rehash into a table of size
+ * buckets; the entries are moved a few buckets at a time by
+ * _kvstore_rehash_step.
+ */
+int
+_kvstore_resize(kvstore kvs, size_t size)
+{
+        if (-1 != kvs->rehash)
+                return 0;
+        if (size == kvs->table[0].size)
+                return 0;
+        if (_kvstore_table_init(&kvs->table[1], size))
+                return -1;
+        kvs->rehash = 0;
+        return 0;
+}
+
+
+void
+_kvstore_rehash_step(kvstore kvs, size_t n)
+{
+        struct _kvstore_table   *from = &kvs->table[0];
+        struct _kvstore_table   *to = &kvs->table[1];
+        struct _kvstore_kv      *kv, *next;
+        size_t                   empty = n * 10;
+        size_t                   idx;
+
+        if (-1 == kvs->rehash)
+                return;
+
+        while (n-- && from->used) {
+                while (NULL == from->buckets[kvs->rehash]) {
+                        kvs->rehash++;
+                        if (0 == --empty)
+                                return;
+                }
+                kv = from->buckets[kvs->rehash];
+                while (NULL != kv) {
+                        next = kv->next;
+                        idx = kv->hash & to->mask;
+                        kv->next = to->buckets[idx];
+                        to->buckets[idx] = kv;
+                        from->used--;
+                        to->used++;
+                        kv = next;
+                }
+                from->buckets[kvs->rehash] = NULL;
+                kvs->rehash++;
+        }
+
+        if (0 == from->used) {
+                free(from->buckets);
+                *from = *to;
+                memset(to, 0x0, sizeof(struct _kvstore_table));
+                kvs->rehash = -1;
+        }
+}
+
+
+/*
+ * _kvstore_presize finishes any rehash in progress and then grows the
+ * index in one go to hold n entries, for callers about to add many.
+ */
+int
+_kvstore_presize(kvstore kvs, size_t n)
+{
+        size_t  size;
+
+        while (-1 != kvs->rehash)
+                _kvstore_rehash_step(kvs, kvs->table[0].size);
+        for (size = kvs->table[0].size; size < n; )
+                size <<= 1;
+        if (size <= kvs->table[0].size)
+                return 0;
+        if (_kvstore_resize(kvs, size))
+                return -1;
+        while (-1 != kvs->rehash)
+                _kvstore_rehash_step(kvs, kvs->table[0].size);
+        return 0;
+}
+
+
+/*
+ * _kvstore_hash_config changes the hash or its seed, then finishes any
+ * rehash and rebuilds the index in place under the new hashes.
+ */
+int
+_kvstore_hash_config(kvstore kvs, KVSTORE_CONFIG_OPT opt, void *val)
+{
+        struct _kvstore_table   *t = &kvs->table[0];
+        struct _kvstore_kv      *kv;
+        KVSTORE_HASH_ALG         alg = kvs->hasher.alg;
+
+        if ((NULL != kvs->shm) || (NULL != kvs->lsm) ||
+            (NULL != kvs->watch) || (NULL != kvs->hot) ||
+            (NULL != kvs->frozen) || (NULL != kvs->rcache) ||
+            (NULL != kvs->dedup))
+                return -1;
+        if (KVSTORE_HASH == opt) {
+                alg = *(KVSTORE_HASH_ALG *)val;
+                if ((KVSTORE_HASH_SIPHASH != alg) &&
+                    (KVSTORE_HASH_FAST != alg))
+                        return -1;
+        }
+        if (NULL != kvs->wc)
+                kvstore_wc_sync(kvs);
+        if (_acquire_kvstore(kvs))
+                return -1;
+
+        kvs->hasher.alg = alg;
+        if (KVSTORE_HASH_SEED == opt)
+                memcpy(kvs->hasher.seed, val, sizeof(kvs->hasher.seed));
+        if (NULL != kvs->soa) {
+                if (_kvstore_soa_rehash(kvs)) {
+                        _unlock_kvstore(kvs);
+                        return -1;
+                }
+                return _unlock_kvstore(kvs);
+        }
+        while (-1 != kvs->rehash)
+                _kvstore_rehash_step(kvs, kvs->table[0].size);
+        memset(t->buckets, 0x0, t->size * sizeof(struct _kvstore_kv *));
+        TAILQ_FOREACH(kv, kvs->queue, entries) {
+                kv->hash = _kvstore_hash(kvs, kv->key, kv->key_len);
+                kv->next = t->buckets[kv->hash & t->mask];
+                t->buckets[kv->hash & t->mask] = kv;
+        }
+        return _unlock_kvstore(kvs);
+}
+
+
+struct _kvstore_kv *
+_kvstore_find(kvstore kvs, char *key, size_t klen, uint64_t hash)
+{
+        struct _kvstore_kv      *kv;
+        int                      i;
+
+        for (i = 0; i < 2; i++) {
+                if (NULL == kvs->table[i].buckets)
+                        break;
+                kv = kvs->table[i].buckets[hash & kvs->table[i].mask];
+                for (; NULL != kv; kv = kv->next) {
+                        if ((kv->hash == hash) && (kv->key_len == klen) &&
+                            (0 == memcmp(kv->key, key, klen)))
+                                return kv;
+                }
+                if (-1 == kvs->rehash)
+                        break;
+        }
+        return NULL;
+}
+
+
+/*
+ * _kvstore_new_kv allocates an entry holding a copy of key; the caller
+ * fills in the value and links it into the index.
+ */
+struct _kvstore_kv *
+_kvstore_new_kv(char *key, size_t klen, uint64_t hash)
+{
+        struct _kvstore_kv      *kv;
+
+        kv = (struct _kvstore_kv *)malloc(sizeof(struct _kvstore_kv));
+        if (NULL == kv)
+                return NULL;
+        memset(kv, 0x0, sizeof(struct _kvstore_kv));
+
+        kv->key = (char *)malloc((klen + 1) * sizeof(char));
+        if (NULL == kv->key) {
+                free(kv);
+                return NULL;
+        }
+        memcpy(kv->key, key, klen);
+        kv->key[klen] = 0;
+        kv->key_len = klen;
+        kv->hash = hash;
+        return kv;
+}
+
+
+void
+_kvstore_link(kvstore kvs, struct _kvstore_kv *kv)
+{
+        struct _kvstore_table   *t;
+
+        t = &kvs->table[-1 == kvs->rehash ? 0 : 1];
+        kv->next = t->buckets[kv->hash & t->mask];
+        t->buckets[kv->hash & t->mask] = kv;
+        t->used++;
+
+        TAILQ_INSERT_HEAD(kvs->queue, kv, entries);
+        kvs->keys++;
+
+        if (kvs->keys >= kvs->table[0].size)
+                _kvstore_resize(kvs, kvs->table[0].size * 2);
+}
+
+
+struct _kvstore_kv *
+_kvstore_unlink(kvstore kvs, char *key, size_t klen, uint64_t hash)
+{
+        struct _kvstore_kv      *kv, **kvp;
+        size_t                   size;
+        int                      i;
+
+        for (i = 0; i < 2; i++) {
+                if (NULL == kvs->table[i].buckets)
+                        break;
+                kvp = &kvs->table[i].buckets[hash & kvs->table[i].mask];
+                for (; NULL != (kv = *kvp); kvp = &kv->next) {
+                        if ((kv->hash != hash) || (kv->key_len != klen) ||
+                            (0 != memcmp(kv->key, key, klen)))
+                                continue;
+                        if (NULL != kvs->rcache)
+                                _kvstore_rcache_bump(kvs, hash);
+                        *kvp = kv->next;
+                        kvs->table[i].used--;
+                        TAILQ_REMOVE(kvs->queue, kv, entries);
+                        kvs->keys--;
+
+                        size = kvs->table[0].size;
+                        if ((size > KVSTORE_TABLE_INITIAL) &&
+                            ((kvs->keys * 8) < size))
+                                _kvstore_resize(kvs, size / 2);
+                        return kv;
+                }
+                if (-1 == kvs->rehash)
+                        break;
+        }
+        return NULL;
+}
+
+
+/*
+ * _kvstore_free_kv frees an unlinked entry: its chunks, its key and,
+ * through _kvstore_free_val, its value.
+ */
+void
+_kvstore_free_kv(kvstore kvs, struct _kvstore_kv *kv)
+{
+        _kvstore_chunks_free(kv->chunks);
+        free(kv->key);
+        _kvstore_free_val(kvs, kv);
+        free(kv);
+}
+
+
+/*
+ * _kvstore_free_val lets go of an entry's value, whether it is its own
+ * or shared through the dedup pool. Values that belong to a storage
+ * engine (kvs->bc) live in its segment files rather than on the heap
+ * and are left alone.
+ */
+void
+_kvstore_free_val(kvstore kvs, struct _kvstore_kv *kv)
+{
+        if (KVSTORE_VAL_POOLED(kvs, kv))
+                _kvstore_dedup_release(kvs, kv->val);
+        else if (NULL == kvs->bc)
+                free(kv->val);
+        kv->val = NULL;
+        kv->val_cap = 0;
+}
+
+
 kvstore
 kvstore_new(void)
 {
@@ -111,11 +407,19 @@ kvstore_new(void)
                 TAILQ_INIT(kvs->queue);
         }
 
+        if (_kvstore_table_init(&kvs->table[0], KVSTORE_TABLE_INITIAL)) {
+                kvstore_discard(kvs);
+                return NULL;
+        }
+        kvs->rehash = -1;
+
         kvs->keys = 0;
         kvs->timeo.tv_sec = 0;
         kvs->timeo.tv_usec = 10000;
         kvs->max_keylen = KVSTORE_DEFAULT_MAX_KEYLEN;
         kvs->max_vallen = KVSTORE_DEFAULT_MAX_VALLEN;
+        kvs->max_chunked = KVSTORE_DEFAULT_MAX_CHUNKED_VALLEN;
+        _kvstore_hash_init(kvs);
         _unlock_kvstore(kvs);
 
         return kvs;
@@ -161,13 +465,38 @@ kvstore_discard(kvstore kvs)
                 return _unlock_kvstore(kvs);
         }
 
-        while (NULL != (kv = TAILQ_FIRST(kvs->queue))) {
-                free(kv->key);
-                free(kv->val);
+        /*
+         * Background workers may need the lock to finish what they are
+         * doing, so they are stopped with the store unlocked.
+         */
+        _unlock_kvstore(kvs);
+        _kvstore_defrag_stop(kvs);
+        _kvstore_aio_shutdown(kvs);
+        _kvstore_wc_shutdown(kvs);
+        _kvstore_bc_close(kvs);
+        _kvstore_lsm_close(kvs);
+        _kvstore_shm_close(kvs);
+        _acquire_kvstore(kvs);
+
+        _kvstore_reap_index(kvs);
+        while (NULL != kvs->queue && NULL != (kv = TAILQ_FIRST(kvs->queue))) {
                 TAILQ_REMOVE(kvs->queue, kv, entries);
-                free(kv);
+                _kvstore_free_kv(kvs, kv);
         }
         free(kvs->queue);
+        free(kvs->table[0].buckets);
+        free(kvs->table[1].buckets);
+        free(kvs->bc);
+        _kvstore_cdc_free(kvs);
+        _kvstore_u64_free(kvs);
+        _kvstore_defrag_free(kvs);
+        _kvstore_watch_free(kvs);
+        _kvstore_hot_free(kvs);
+        _kvstore_trace_free(kvs);
+        _kvstore_soa_free(kvs);
+        _kvstore_frozen_free(kvs);
+        _kvstore_rcache_free(kvs);
+        _kvstore_dedup_free(kvs);
         while (1) {
                 retval = _unlock_kvstore(kvs);
                 switch (retval) {
@@ -220,6 +549,35 @@ kvstore_config(kvstore kvs, KVSTORE_CONFIG_OPT opt, void *val)
         case KVSTORE_MAX_VALLEN:
                 kvs->max_vallen = *(size_t *)val;
                 break;
+        case KVSTORE_WRITE_COMBINE:
+                return _kvstore_wc_config(kvs, *(int *)val);
+        case KVSTORE_SYNC:
+        case KVSTORE_SEGMENT_SIZE:
+                return _kvstore_bc_config(kvs, opt, val);
+        case KVSTORE_MEMTABLE_SIZE:
+                return _kvstore_lsm_config(kvs, opt, val);
+        case KVSTORE_LOAD_THREADS:
+                kvs->load_threads = *(size_t *)val;
+                break;
+        case KVSTORE_DEFRAG:
+                return _kvstore_defrag_config(kvs, *(int *)val);
+        case KVSTORE_HASH:
+        case KVSTORE_HASH_SEED:
+                return _kvstore_hash_config(kvs, opt, val);
+        case KVSTORE_HOT_KEYS:
+        case KVSTORE_HOT_REPLICATE:
+                return _kvstore_hot_config(kvs, opt, val);
+        case KVSTORE_TRACE:
+                return _kvstore_trace_config(kvs, *(size_t *)val);
+        case KVSTORE_REAP:
+                return _kvstore_reap_config(kvs, *(int *)val);
+        case KVSTORE_CHUNK_SIZE:
+        case KVSTORE_MAX_CHUNKED_VALLEN:
+                return _kvstore_chunk_config(kvs, opt, *(size_t *)val);
+        case KVSTORE_READ_CACHE:
+                return _kvstore_rcache_config(kvs, *(size_t *)val);
+        case KVSTORE_DEDUP:
+                return _kvstore_dedup_config(kvs, *(size_t *)val);
         default:
                 break;
         }
@@ -231,128 +589,511 @@ kvstore_config(kvstore kvs, KVSTORE_CONFIG_OPT opt, void *val)
 int
 kvstore_set(kvstore kvs, char *key, char *val)
 {
-        struct _kvstore_kv      *kv;
-        size_t                   klen;
-        size_t                   vlen;
+        struct _kvstore_span     sp;
+        int                      retval = -1;
 
         if (NULL == kvs)
                 return -1;
-
-        TAILQ_FOREACH(kv, kvs->queue, entries) {
-                if (0 == strncmp(kv->key, key, kvs->max_keylen))
-                        return _kvstore_update(kvs, kv, val);
+        _kvstore_trace_begin(kvs, &sp, KVSTORE_OP_SET, key);
+        if (NULL != kvs->wc) {
+                retval = _kvstore_wc_enqueue(kvs, KVSTORE_OP_SET, key, val);
+                goto set_done;
         }
+        if (_acquire_kvstore(kvs))
+                goto set_done;
+        _kvstore_trace_locked(kvs, &sp);
+        retval = _kvstore_set(kvs, key, val);
+        _unlock_kvstore(kvs);
+        if ((0 == retval) && (NULL != kvs->lsm))
+                _kvstore_lsm_throttle(kvs);
 
-        kv = NULL;
-        kv = (struct _kvstore_kv *)malloc(sizeof(struct _kvstore_kv));
-        if (NULL == kv)
-                return -1;
+set_done:
+        _kvstore_trace_end(kvs, &sp, retval);
+        return retval;
+}
+
+
+/*
+ * _kvstore_set and _kvstore_del apply a change with the store locked and,
+ * if the store has a change ring, record it there, then wake anything
+ * watching the key.
+ */
+int
+_kvstore_set(kvstore kvs, char *key, char *val)
+{
+        int     retval;
+
+        retval = _kvstore_put(kvs, key, val);
+        if ((0 == retval) && (NULL != kvs->cdc))
+                _kvstore_cdc_log(kvs, KVSTORE_OP_SET, key, val);
+        if ((0 == retval) && (NULL != kvs->watch))
+                _kvstore_watch_notify(kvs, key, strlen(key));
+        if ((0 == retval) && (NULL != kvs->hot))
+                _kvstore_hot_write(kvs, key, strlen(key));
+        return retval;
+}
+
+
+int
+_kvstore_put(kvstore kvs, char *key, char *val)
+{
+        struct _kvstore_kv      *kv;
+        struct iovec             iov;
+        uint64_t                 hash;
+        size_t                   klen;
+        size_t                   vlen;
+        int                      pool, dead = 0;
 
+        if (NULL != kvs->frozen) {
+                errno = EROFS;
+                return -1;
+        }
         klen = strnlen(key, kvs->max_keylen + 1);
         if (((kvs->max_keylen + 1) == klen) || (0 == klen))
                 return -1;
 
+        _kvstore_rehash_step(kvs, KVSTORE_REHASH_STEP);
+        hash = _kvstore_hash(kvs, key, klen);
+        if (NULL != kvs->bc)
+                return _kvstore_bc_set(kvs, key, klen, hash, val);
+        if (NULL != kvs->shm)
+                return _kvstore_shm_set(kvs, key, klen, hash, val);
+        if (NULL != kvs->soa)
+                return _kvstore_soa_set(kvs, key, klen, hash, val);
+        if (NULL != kvs->rcache)
+                _kvstore_rcache_bump(kvs, hash);
         vlen = strnlen(val, kvs->max_vallen + 1);
-        if (((kvs->max_vallen + 1) == vlen) || (0 == vlen))
-                return -1;
-
-        kv->key = (char *)malloc((klen + 1) * sizeof(char));
-        kv->val = (char *)malloc((vlen + 1) * sizeof(char));
-        if ((NULL == kv->key) || (NULL == kv->val)) {
-                free(kv->key);
-                free(kv->val);
-                free(kv);
-                return -1;
+        if (((kvs->max_vallen + 1) == vlen) && (0 != kvs->chunk_size)) {
+                iov.iov_base = val;
+                iov.iov_len = strnlen(val, kvs->max_chunked + 1);
+                return _kvstore_chunk_set(kvs, key, klen, hash, &iov, 1,
+                    iov.iov_len);
         }
+        if (NULL != (kv = _kvstore_find(kvs, key, klen, hash))) {
+                dead = NULL == kv->val ? -1 : 0;
+                if (_kvstore_update(kvs, kv, val))
+                        return -1;
+        } else {
+                if (((kvs->max_vallen + 1) == vlen) || (0 == vlen))
+                        return -1;
 
-        kv->key_len = klen;
-        kv->val_len = vlen;
-        memset(kv->key, 0x0, klen + 1);
-        memset(kv->val, 0x0, vlen + 1);
-        strncpy(kv->key, key, klen);
-        strncpy(kv->val, val, vlen);
+                if (NULL == (kv = _kvstore_new_kv(key, klen, hash)))
+                        return -1;
+                pool = (0 != kvs->dedup_min) && (vlen >= kvs->dedup_min);
+                if (pool)
+                        kv->val = _kvstore_dedup_intern(kvs, val, vlen);
+                else
+                        kv->val = (char *)malloc((vlen + 1) * sizeof(char));
+                if (NULL == kv->val) {
+                        _kvstore_free_kv(kvs, kv);
+                        return -1;
+                }
+                kv->val_len = vlen;
+                if (!pool) {
+                        kv->val_cap = vlen + 1;
+                        memcpy(kv->val, val, vlen);
+                        kv->val[vlen] = 0;
+                }
 
-        TAILQ_INSERT_HEAD(kvs->queue, kv, entries);
-        kvs->keys++;
+                _kvstore_link(kvs, kv);
+        }
+
+        if (NULL != kvs->lsm)
+                return _kvstore_lsm_wrote(kvs, klen, kv->val_len, dead);
         return 0;
 }
 
 
+/*
+ * _kvstore_update reuses the value's allocation when the new value fits
+ * and would not leave most of it idle. A value long enough to share is
+ * interned before the old one is released, so that setting a key to
+ * the value it already holds never frees it. Likewise a chunked value
+ * keeps its chunks until the new value exists, so that an update that
+ * fails leaves it intact.
+ */
 int
 _kvstore_update(kvstore kvs, struct _kvstore_kv *kv, char *val)
 {
         size_t   vlen;
+        size_t   cap = 0;
         char    *update_val;
 
         vlen = strnlen(val, kvs->max_vallen + 1);
         if (((kvs->max_vallen + 1) == vlen) || (0 == vlen))
                 return -1;
 
-        update_val = (char *)malloc((vlen + 1) * sizeof(char));
-        if (NULL == update_val)
-                return -1;
-        memset(update_val, 0x0, vlen + 1);
-        strncpy(update_val, val, vlen);
+        if ((0 != kvs->dedup_min) && (vlen >= kvs->dedup_min)) {
+                update_val = _kvstore_dedup_intern(kvs, val, vlen);
+                if (NULL == update_val)
+                        return -1;
+        } else if ((NULL != kv->val) && (vlen + 1 <= kv->val_cap) &&
+            ((vlen + 1) * 4 >= kv->val_cap)) {
+                memmove(kv->val, val, vlen);
+                kv->val[vlen] = 0;
+                kv->val_len = vlen;
+                return 0;
+        } else {
+                update_val = (char *)malloc((vlen + 1) * sizeof(char));
+                if (NULL == update_val)
+                        return -1;
+                memcpy(update_val, val, vlen);
+                update_val[vlen] = 0;
+                cap = vlen + 1;
+        }
 
-        free(kv->val);
-        kv->val = NULL;
-        kv->val_len = vlen;
+        _kvstore_chunks_free(kv->chunks);
+        kv->chunks = NULL;
+        _kvstore_free_val(kvs, kv);
         kv->val = update_val;
+        kv->val_len = vlen;
+        kv->val_cap = cap;
         return 0;
 }
 
 
 char *
 kvstore_get(kvstore kvs, char *key)
+{
+        struct _kvstore_span     sp;
+        char                    *val = NULL;
+
+        if (NULL == kvs)
+                return NULL;
+        _kvstore_trace_begin(kvs, &sp, KVSTORE_OP_GET, key);
+        if (NULL != kvs->rcache) {
+                val = _kvstore_rcache_get(kvs, key);
+                goto get_done;
+        }
+        if (NULL != kvs->hot) {
+                val = _kvstore_hot_get(kvs, key);
+                goto get_done;
+        }
+        if (_acquire_kvstore(kvs))
+                goto get_done;
+        _kvstore_trace_locked(kvs, &sp);
+        val = _kvstore_get(kvs, key, NULL);
+        _unlock_kvstore(kvs);
+
+get_done:
+        _kvstore_trace_end(kvs, &sp, NULL == val ? -1 : 0);
+        return val;
+}
+
+
+/*
+ * _kvstore_get looks key up with the store locked, returning the value
+ * and, if len is not NULL, its length. An LSM store keeps looking in its
+ * tables if the key is not in the memtable; a memtable entry without a
+ * value is a delete that hides anything older.
+ */
+char *
+_kvstore_get(kvstore kvs, char *key, size_t *len)
 {
         struct _kvstore_kv      *kv;
-        int                      match = 0;
 
-        TAILQ_FOREACH(kv, kvs->queue, entries) {
-                if (0 == strncmp(kv->key, key, kvs->max_keylen)) {
-                        match = 1;
-                        break;
-                }
+        if (NULL != kvs->shm)
+                return _kvstore_shm_get(kvs, key, len);
+        if (NULL != kvs->soa)
+                return _kvstore_soa_get(kvs, key, len);
+        if (NULL != kvs->frozen)
+                return _kvstore_frozen_get(kvs, key, len);
+        if (NULL != (kv = _kvstore_lookup(kvs, key))) {
+                if ((NULL != len) && (NULL != kv->val))
+                        *len = kv->val_len;
+                if (NULL != kv->chunks)
+                        errno = EFBIG;
+                return kv->val;
+        }
+        if (NULL != kvs->lsm)
+                return _kvstore_lsm_get(kvs, key, len);
+        return NULL;
+}
+
+
+/*
+ * kvstore_mget looks up several keys under one acquisition of the lock,
+ * calling cb with each key and its value, or NULL if it is not present.
+ * cb runs with the store locked: it must not call back into the store,
+ * and it should copy out whatever it needs from the value.
+ */
+int
+kvstore_mget(kvstore kvs, char **keys, size_t nkeys, kvstore_scan_cb cb,
+    void *arg)
+{
+        char    *val, *whole;
+        size_t   i;
+
+        if ((NULL == kvs) || (NULL == keys) || (NULL == cb))
+                return -1;
+        if (_acquire_kvstore(kvs))
+                return -1;
+        for (i = 0; i < nkeys; i++) {
+                whole = NULL;
+                if (NULL == (val = _kvstore_get(kvs, keys[i], NULL)))
+                        val = whole = _kvstore_chunk_dup(kvs, keys[i]);
+                cb(keys[i], val, arg);
+                free(whole);
+        }
+        return _unlock_kvstore(kvs);
+}
+
+
+/*
+ * kvstore_incr adds delta to a value holding an unsigned decimal number,
+ * wrapping at 2^64, and stores the result in *result. It fails with
+ * errno set to ENOENT if the key is not present, EINVAL if its value is
+ * not a number and EFBIG if its value is held in chunks.
+ */
+int
+kvstore_incr(kvstore kvs, char *key, uint64_t delta, uint64_t *result)
+{
+        char            *val, *end;
+        char             buf[24];
+        uint64_t         n;
+        int              retval = -1;
+
+        if ((NULL == kvs) || (NULL == result))
+                return -1;
+        if (_acquire_kvstore(kvs))
+                return -1;
+        errno = 0;
+        if (NULL == (val = _kvstore_get(kvs, key, NULL))) {
+                if (EFBIG != errno)
+                        errno = ENOENT;
+                goto incr_done;
+        }
+        n = strtoull(val, &end, 10);
+        if ((val == end) || (0 != *end) || ('-' == val[0]) ||
+            (ERANGE == errno)) {
+                errno = EINVAL;
+                goto incr_done;
         }
+        n += delta;
+        snprintf(buf, sizeof(buf), "%llu", (unsigned long long)n);
+        if (0 == (retval = _kvstore_set(kvs, key, buf)))
+                *result = n;
+
+incr_done:
+        _unlock_kvstore(kvs);
+        return retval;
+}
+
 
-        if (!match)
+struct _kvstore_kv *
+_kvstore_lookup(kvstore kvs, char *key)
+{
+        size_t  klen;
+
+        klen = strnlen(key, kvs->max_keylen + 1);
+        if (((kvs->max_keylen + 1) == klen) || (0 == klen))
                 return NULL;
-        return kv->val;
+        _kvstore_rehash_step(kvs, KVSTORE_REHASH_STEP);
+        return _kvstore_find(kvs, key, klen, _kvstore_hash(kvs, key, klen));
 }
 
 
 int
 kvstore_del(kvstore kvs, char *key)
+{
+        struct _kvstore_span     sp;
+        int                      retval = -1;
+
+        if (NULL == kvs)
+                return -1;
+        _kvstore_trace_begin(kvs, &sp, KVSTORE_OP_DEL, key);
+        if (NULL != kvs->wc) {
+                retval = _kvstore_wc_enqueue(kvs, KVSTORE_OP_DEL, key, NULL);
+                goto del_done;
+        }
+        if (_acquire_kvstore(kvs))
+                goto del_done;
+        _kvstore_trace_locked(kvs, &sp);
+        retval = _kvstore_del(kvs, key);
+        _unlock_kvstore(kvs);
+        if ((0 == retval) && (NULL != kvs->lsm))
+                _kvstore_lsm_throttle(kvs);
+
+del_done:
+        _kvstore_trace_end(kvs, &sp, retval);
+        return retval;
+}
+
+
+int
+_kvstore_del(kvstore kvs, char *key)
+{
+        int     retval;
+
+        retval = _kvstore_remove(kvs, key);
+        if ((0 == retval) && (NULL != kvs->cdc))
+                _kvstore_cdc_log(kvs, KVSTORE_OP_DEL, key, NULL);
+        if ((0 == retval) && (NULL != kvs->watch))
+                _kvstore_watch_notify(kvs, key, strlen(key));
+        if ((0 == retval) && (NULL != kvs->hot))
+                _kvstore_hot_write(kvs, key, strlen(key));
+        return retval;
+}
+
+
+int
+_kvstore_remove(kvstore kvs, char *key)
 {
         struct _kvstore_kv      *kv;
+        uint64_t                 hash;
+        size_t                   klen;
 
-        TAILQ_FOREACH(kv, kvs->queue, entries) {
-                if (0 == strncmp(kv->key, key, kvs->max_keylen)) {
-                        free(kv->key);
-                        free(kv->val);
-                        TAILQ_REMOVE(kvs->queue, kv, entries);
-                        free(kv);
-                        kvs->keys--;
-                        return 0;
-                }
+        if (NULL != kvs->frozen) {
+                errno = EROFS;
+                return -1;
         }
-        return -1;
+        klen = strnlen(key, kvs->max_keylen + 1);
+        if (((kvs->max_keylen + 1) == klen) || (0 == klen))
+                return -1;
+
+        _kvstore_rehash_step(kvs, KVSTORE_REHASH_STEP);
+        hash = _kvstore_hash(kvs, key, klen);
+        if (NULL != kvs->bc)
+                return _kvstore_bc_del(kvs, key, klen, hash);
+        if (NULL != kvs->shm)
+                return _kvstore_shm_del(kvs, key, klen, hash);
+        if (NULL != kvs->soa)
+                return _kvstore_soa_del(kvs, key, klen, hash);
+        if (NULL != kvs->lsm)
+                return _kvstore_lsm_del(kvs, key, klen, hash);
+        if (NULL == (kv = _kvstore_unlink(kvs, key, klen, hash)))
+                return -1;
+        _kvstore_retire_kv(kvs, kv);
+        return 0;
+}
+
+
+/*
+ * kvstore_scan visits the buckets of the index in reverse-binary order,
+ * the same way Redis' SCAN does. Because the high bits of the cursor are
+ * incremented first, a bucket that has been visited in a table of one
+ * size maps onto buckets that have also been visited in a table of twice
+ * or half the size, so a key that is present for the whole scan is
+ * returned at least once even if the table is resized between calls. A
+ * key may be returned more than once.
+ *
+ * Each call takes the lock, reports at least count keys (unless the scan
+ * finishes first) and releases it again; *cursor should start at 0 and
+ * the scan is complete when it comes back as 0. The callback runs with
+ * the store locked and must not call back into it.
+ */
+int
+kvstore_scan(kvstore kvs, size_t *cursor, size_t count, kvstore_scan_cb cb,
+    void *arg)
+{
+        if ((NULL == kvs) || (NULL == cursor) || (NULL == cb) ||
+            (NULL != kvs->shm))
+                return -1;
+        if (0 == count)
+                count = 1;
+        if (_acquire_kvstore(kvs))
+                return -1;
+        _kvstore_scan_locked(kvs, cursor, count, cb, arg);
+        return _unlock_kvstore(kvs);
 }
 
 
+/*
+ * _kvstore_scan_locked is one call's worth of kvstore_scan, for callers
+ * that already hold the lock.
+ */
 void
-kvstore_show_keys(kvstore kvs)
+_kvstore_scan_locked(kvstore kvs, size_t *cursor, size_t count,
+    kvstore_scan_cb cb, void *arg)
+{
+        struct _kvstore_table   *t0, *t1;
+        size_t                   v, m0, m1;
+        size_t                   found = 0;
+        size_t                   visits;
+
+        if (NULL != kvs->soa) {
+                _kvstore_soa_scan(kvs, cursor, count, cb, arg);
+                return;
+        }
+        if (NULL != kvs->frozen) {
+                _kvstore_frozen_scan(kvs, cursor, count, cb, arg);
+                return;
+        }
+        v = *cursor;
+        visits = count * 10;
+        do {
+                t0 = &kvs->table[0];
+                if (-1 == kvs->rehash) {
+                        m0 = t0->mask;
+                        found += _kvstore_scan_bucket(t0, v & m0, cb, arg);
+                        v |= ~m0;
+                        v = _kvstore_rev(v);
+                        v++;
+                        v = _kvstore_rev(v);
+                } else {
+                        t1 = &kvs->table[1];
+                        if (t0->size > t1->size) {
+                                t0 = &kvs->table[1];
+                                t1 = &kvs->table[0];
+                        }
+                        m0 = t0->mask;
+                        m1 = t1->mask;
+                        found += _kvstore_scan_bucket(t0, v & m0, cb, arg);
+                        do {
+                                found += _kvstore_scan_bucket(t1, v & m1,
+                                    cb, arg);
+                                v |= ~m1;
+                                v = _kvstore_rev(v);
+                                v++;
+                                v = _kvstore_rev(v);
+                        } while (v & (m0 ^ m1));
+                }
+        } while ((0 != v) && (found < count) && (0 != --visits));
+
+        *cursor = v;
+}
+
+
+size_t
+_kvstore_scan_bucket(struct _kvstore_table *t, size_t idx,
+    kvstore_scan_cb cb, void *arg)
 {
         struct _kvstore_kv      *kv;
-        size_t                   i = 0;
+        size_t                   n = 0;
+
+        for (kv = t->buckets[idx]; NULL != kv; kv = kv->next) {
+                if (NULL != kv->chunks)
+                        cb(kv->key, "", arg);
+                else if (NULL != kv->val)
+                        cb(kv->key, kv->val, arg);
+                else
+                        continue;
+                n++;
+        }
+        return n;
+}
+
 
-        TAILQ_FOREACH(kv, kvs->queue, entries)
-            printf("key %8u: '%s'\n", (unsigned int)i++, kv->key);
+size_t
+_kvstore_rev(size_t v)
+{
+        size_t  r = 0;
+        size_t  i;
+
+        for (i = 0; i < sizeof(size_t) * 8; i++) {
+                r = (r << 1) | (v & 1);
+                v >>= 1;
+        }
+        return r;
 }
 
 
 size_t
 kvstore_len(kvstore kvs)
 {
-        return kvs->keys;
+        if (NULL != kvs->shm)
+                return _kvstore_shm_len(kvs);
+        if (NULL != kvs->lsm)
+                return _kvstore_lsm_len(kvs);
+        return kvs->keys + _kvstore_u64_len(kvs);
 }
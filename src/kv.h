@@ -21,18 +21,182 @@
 #define __LIBKVSTORE_KV_H
 #include <sys/types.h>
 #include <sys/queue.h>
+#include <sys/uio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <unistd.h>
 
 extern const size_t      KVSTORE_DEFAULT_MAX_KEYLEN;
 extern const size_t      KVSTORE_DEFAULT_MAX_VALLEN;
+extern const size_t      KVSTORE_DEFAULT_SEGMENT_SIZE;
+extern const size_t      KVSTORE_DEFAULT_MEMTABLE_SIZE;
+extern const size_t      KVSTORE_DEFAULT_SHM_SIZE;
+extern const size_t      KVSTORE_DEFAULT_MAX_CHUNKED_VALLEN;
+
+#define KVSTORE_LSM_LEVELS      7
 
 typedef enum {
         KVSTORE_MAX_KEYLEN,
-        KVSTORE_MAX_VALLEN
+        KVSTORE_MAX_VALLEN,
+        KVSTORE_WRITE_COMBINE,
+        KVSTORE_SYNC,
+        KVSTORE_SEGMENT_SIZE,
+        KVSTORE_MEMTABLE_SIZE,
+        KVSTORE_LOAD_THREADS,
+        KVSTORE_DEFRAG,
+        KVSTORE_HASH,
+        KVSTORE_HASH_SEED,
+        KVSTORE_HOT_KEYS,
+        KVSTORE_HOT_REPLICATE,
+        KVSTORE_TRACE,
+        KVSTORE_REAP,
+        KVSTORE_CHUNK_SIZE,
+        KVSTORE_MAX_CHUNKED_VALLEN,
+        KVSTORE_READ_CACHE,
+        KVSTORE_DEDUP
 } KVSTORE_CONFIG_OPT;
 
+/*
+ * Key hashes for KVSTORE_HASH. Each store is seeded at random; SipHash
+ * keeps clients that cannot learn the seed from choosing keys that
+ * collide, and the fast hash gives that up for speed on trusted keys.
+ * KVSTORE_HASH_SEED takes a pointer to two uint64_t. Changing either
+ * rehashes the whole store; shared, LSM and watched stores keep the
+ * hash they started with.
+ */
+typedef enum {
+        KVSTORE_HASH_SIPHASH,
+        KVSTORE_HASH_FAST
+} KVSTORE_HASH_ALG;
+
+typedef enum {
+        KVSTORE_LOAD_TSV,
+        KVSTORE_LOAD_BINARY
+} KVSTORE_LOAD_FORMAT;
+
+typedef enum {
+        KVSTORE_OP_SET,
+        KVSTORE_OP_GET,
+        KVSTORE_OP_DEL
+} KVSTORE_OP;
+
+/*
+ * An asynchronous request. For KVSTORE_OP_GET, val is the buffer the
+ * value is copied into and len is its size; the completion's res is the
+ * full length of the value, or -1 if the key is not present. For set and
+ * del, res is the return value of kvstore_set or kvstore_del. data is
+ * passed through to the completion untouched.
+ */
+struct kvstore_sqe {
+        KVSTORE_OP       op;
+        char            *key;
+        char            *val;
+        size_t           len;
+        uint64_t         data;
+};
+
+/*
+ * The completion of a request: data is copied from the request, so that
+ * the caller can tell which one completed, and res is its result.
+ */
+struct kvstore_cqe {
+        uint64_t         data;
+        ssize_t          res;
+};
+
+/*
+ * Counters for an LSM store. Write amplification is disk_writes over
+ * user_bytes, space amplification is disk_bytes over the size of the
+ * live data, and read amplification is block_reads over gets.
+ */
+struct kvstore_lsm_stats {
+        uint64_t         user_bytes;
+        uint64_t         disk_writes;
+        uint64_t         disk_bytes;
+        uint64_t         gets;
+        uint64_t         block_reads;
+        uint64_t         bloom_skips;
+        size_t           tables[KVSTORE_LSM_LEVELS];
+};
+
+/*
+ * Counters for the defragmenter. reclaimed_bytes is how far the resident
+ * set shrank when pages freed by moving entries went back to the kernel.
+ */
+struct kvstore_defrag_stats {
+        uint64_t         cycles;
+        uint64_t         moved;
+        uint64_t         moved_bytes;
+        uint64_t         reclaimed_bytes;
+};
+
+/*
+ * Read cache counters, summed over every thread. A stale lookup found
+ * the key cached but changed since; it is not counted as a miss.
+ */
+struct kvstore_read_cache_stats {
+        uint64_t         hits;
+        uint64_t         misses;
+        uint64_t         stale;
+        size_t           threads;
+};
+
+/*
+ * Value deduplication counters. values is the number of distinct values
+ * in the pool and refs the number of entries holding them; bytes is
+ * what the pool takes up, and saved what the entries sharing a value
+ * would have taken up with copies of their own.
+ */
+struct kvstore_dedup_stats {
+        uint64_t         values;
+        uint64_t         refs;
+        uint64_t         bytes;
+        uint64_t         saved;
+};
+
+/*
+ * One of the hottest keys, from kvstore_hot_keys. reads is an estimate
+ * and, like writes, is halved every so often so that it follows the
+ * traffic. replicated is set while CPUs hold their own copies of the
+ * key for kvstore_get. key is a copy for the caller to free.
+ */
+struct kvstore_hot_key {
+        char            *key;
+        uint64_t         reads;
+        uint64_t         writes;
+        int              replicated;
+};
+
+/*
+ * The trace dump format. Each block is a header followed by that many
+ * events from one thread, oldest first; times are in ticks, and
+ * ticks_per_sec converts them. op is a KVSTORE_OP and result is 0 or -1.
+ */
+#define KVSTORE_TRACE_MAGIC     0x314543415254564bULL
+
+struct kvstore_trace_header {
+        uint64_t         magic;
+        uint64_t         ticks_per_sec;
+        uint64_t         thread;
+        uint64_t         events;
+};
+
+struct kvstore_trace_event {
+        uint64_t         tsc;
+        uint64_t         hash;
+        uint64_t         lock_wait;
+        uint64_t         work;
+        uint32_t         thread;
+        uint16_t         op;
+        int16_t          result;
+};
+
 typedef struct _kvstore * kvstore;
+typedef struct _kvstore_txn * kvstore_txn;
+typedef void (*kvstore_scan_cb)(char *, char *, void *);
+typedef int (*kvstore_txn_cb)(kvstore_txn, void *);
+typedef void (*kvstore_reduce_cb)(void *, char *, char *, void *);
+typedef void (*kvstore_merge_cb)(void *, void *, void *);
 
 kvstore          kvstore_new(void);
 int              kvstore_discard(kvstore);
@@ -42,5 +206,234 @@ int              kvstore_set(kvstore, char *, char *);
 char            *kvstore_get(kvstore, char *);
 int              kvstore_del(kvstore, char *);
 size_t           kvstore_len(kvstore);
+int              kvstore_scan(kvstore, size_t *, size_t, kvstore_scan_cb,
+                    void *);
+int              kvstore_mget(kvstore, char **, size_t, kvstore_scan_cb,
+                    void *);
+int              kvstore_incr(kvstore, char *, uint64_t, uint64_t *);
+
+/*
+ * Appends and partial access to values, which in an in-memory store cost
+ * in proportion to the bytes appended, written or read rather than to
+ * the size of the value. kvstore_setrange's offset may be at most the
+ * value's length, so values never have holes.
+ */
+ssize_t          kvstore_append(kvstore, char *, const char *);
+ssize_t          kvstore_setrange(kvstore, char *, size_t, const char *);
+ssize_t          kvstore_getrange(kvstore, char *, size_t, size_t, char *);
+
+/*
+ * KVSTORE_CHUNK_SIZE takes a size_t of at least 64 and lets an in-memory
+ * store hold values longer than max_vallen, up to
+ * KVSTORE_MAX_CHUNKED_VALLEN, as chunks of that size; once set, it can
+ * be changed but not turned off. kvstore_get returns NULL with errno set
+ * to EFBIG for such a value and scans report it as empty: read it with
+ * kvstore_getv or kvstore_getrange. Rewriting one only stores the chunks
+ * that differ. Change data capture and hot keys are not available with
+ * chunking, and parallel passes skip chunked values.
+ */
+int              kvstore_setv(kvstore, char *, const struct iovec *, int);
+ssize_t          kvstore_getv(kvstore, char *, struct iovec *, int);
+
+/*
+ * Range deletes walk the store in batches and let other callers in
+ * between them, so a key added to the range while one runs may survive
+ * it. Not available on LSM or shared stores.
+ */
+ssize_t          kvstore_del_prefix(kvstore, char *);
+ssize_t          kvstore_del_range(kvstore, char *, char *);
+
+/*
+ * KVSTORE_HOT_KEYS takes a size_t and has kvstore_get track that many of
+ * the most read keys (0 stops tracking); KVSTORE_HOT_REPLICATE takes an
+ * int and lets kvstore_get serve hot, rarely written keys from per-CPU
+ * copies without locking. Set both before sharing the store between
+ * threads. Only available on in-memory stores.
+ */
+ssize_t          kvstore_hot_keys(kvstore, struct kvstore_hot_key *, size_t);
+
+/*
+ * KVSTORE_TRACE takes a size_t and has every thread record its last that
+ * many gets, sets and deletes (rounded up to a power of two; 0 stops
+ * tracing). kvstore_trace_dump writes the rings to a file descriptor;
+ * kvstore_trace_signal appends a dump to the file at path whenever the
+ * process receives the signal. Decode dumps with kvs_trace.
+ */
+ssize_t          kvstore_trace_dump(kvstore, int);
+int              kvstore_trace_signal(kvstore, int, const char *);
+
+/*
+ * KVSTORE_REAP takes an int and, when set, has the store leave freeing
+ * what it deletes to a background thread, and kvstore_discard hand the
+ * whole store to that thread rather than walking it. kvstore_reap_wait
+ * waits until everything given to the thread so far has been freed.
+ * A forked child starts a thread of its own when it first needs one.
+ */
+void             kvstore_reap_wait(void);
+
+/*
+ * KVSTORE_READ_CACHE takes a size_t and gives every thread that reads
+ * the store a cache of that many recently read values (rounded up to a
+ * power of two), which kvstore_get answers from without locking the
+ * store while the key is unchanged. It must be set before the store is
+ * shared and cannot be changed afterwards; it is not available on
+ * bitcask, LSM, shared memory or compact stores, or with hot keys.
+ */
+int              kvstore_read_cache_stats(kvstore,
+                    struct kvstore_read_cache_stats *);
+
+/*
+ * KVSTORE_DEDUP takes a size_t and has values at least that long stored
+ * once however many keys hold them; 0 stops sharing new values. It is
+ * not available on bitcask, LSM, shared memory, compact or frozen
+ * stores. kvstore_dedup_stats fails if it has never been set.
+ */
+int              kvstore_dedup_stats(kvstore, struct kvstore_dedup_stats *);
+
+/*
+ * The parallel passes see the same entries kvstore_scan would, as they
+ * were when the call began, with chunked values joined whole. They work
+ * on a copy, so the store is only locked while that is taken.
+ */
+int              kvstore_parallel_foreach(kvstore, size_t, kvstore_scan_cb,
+                    void *);
+int              kvstore_parallel_reduce(kvstore, size_t, kvstore_reduce_cb,
+                    kvstore_merge_cb, void *, size_t, void *);
+
+/*
+ * Transactions buffer their writes and apply them all at once on commit,
+ * which fails with EAGAIN if any key the transaction read has changed.
+ * Integer keys are not covered.
+ */
+kvstore_txn      kvstore_txn_begin(kvstore);
+char            *kvstore_txn_get(kvstore_txn, char *);
+int              kvstore_txn_set(kvstore_txn, char *, char *);
+int              kvstore_txn_del(kvstore_txn, char *);
+int              kvstore_txn_commit(kvstore_txn);
+void             kvstore_txn_abort(kvstore_txn);
+int              kvstore_txn_run(kvstore, kvstore_txn_cb, void *);
+
+/*
+ * Integer keys live in a separate table of their own, counted by
+ * kvstore_len but not seen by kvstore_scan. They are only available on
+ * in-memory stores.
+ */
+int              kvstore_u64_set(kvstore, uint64_t, char *);
+char            *kvstore_u64_get(kvstore, uint64_t);
+int              kvstore_u64_del(kvstore, uint64_t);
+
+/*
+ * kvstore_aio_init starts a worker thread that applies requests queued
+ * with kvstore_aio_submit; at most entries requests may be in flight.
+ * kvstore_aio_fd returns an eventfd that becomes readable when there are
+ * completions to collect with kvstore_aio_reap. Requests still queued
+ * when the store is discarded are applied first.
+ */
+int              kvstore_aio_init(kvstore, size_t);
+int              kvstore_aio_fd(kvstore);
+ssize_t          kvstore_aio_submit(kvstore, struct kvstore_sqe *, size_t);
+ssize_t          kvstore_aio_reap(kvstore, struct kvstore_cqe *, size_t);
+
+/*
+ * With KVSTORE_WRITE_COMBINE on, kvstore_set and kvstore_del only check
+ * their arguments and queue the write for a single applier thread, which
+ * drops writes to a key that a later queued write replaces. They return
+ * before the write is applied, and kvstore_del returns 0 whether or not
+ * the key exists. kvstore_wc_sync waits until everything the calling
+ * thread queued has been applied.
+ */
+int              kvstore_wc_sync(kvstore);
+
+/*
+ * Defragmenting moves values, so a pointer from kvstore_get is only good
+ * until the next step; with KVSTORE_DEFRAG on, copy values out through
+ * kvstore_mget instead. Not available on bitcask, shared, compact or
+ * frozen stores.
+ */
+ssize_t          kvstore_defrag_step(kvstore, size_t);
+int              kvstore_defrag_stats(kvstore, struct kvstore_defrag_stats *);
+
+/*
+ * kvstore_watch blocks until a key is set or deleted, returning its new
+ * version; kvstore_watch_fd hands out an eventfd that becomes readable
+ * instead. Only writes made through this process are seen, so watches
+ * on a shared store miss other processes' writes. Integer keys cannot
+ * be watched.
+ */
+uint64_t         kvstore_watch(kvstore, char *, uint64_t, int);
+int              kvstore_watch_fd(kvstore, char *);
+int              kvstore_unwatch_fd(kvstore, char *, int);
+
+/*
+ * A store opened with kvstore_open keeps its values in log-structured
+ * segment files under the given directory. kvstore_get returns a pointer
+ * into the mapped segment, which stays valid until the next set or
+ * delete of any key: a merge moving the value in the background keeps
+ * the old segment mapped until then.
+ */
+kvstore          kvstore_open(const char *);
+int              kvstore_merge(kvstore);
+
+/*
+ * A store opened with kvstore_open_lsm keeps recent writes in memory and
+ * moves them into sorted tables under the given directory in the
+ * background. Writes still in memory are lost if the process dies before
+ * kvstore_discard. kvstore_len and kvstore_scan only see the in-memory
+ * part of the store, not counting deletes. A value from kvstore_get is
+ * valid until the next set or delete of any key, since the background
+ * work frees what it replaces once the store has moved on.
+ */
+kvstore          kvstore_open_lsm(const char *);
+int              kvstore_lsm_compact(kvstore);
+int              kvstore_lsm_stats(kvstore, struct kvstore_lsm_stats *);
+
+/*
+ * Change data capture: kvstore_cdc_init makes a store record its changes
+ * in a ring, kvstore_cdc_send streams those after a sequence number to a
+ * pipe or socket, and kvstore_cdc_recv applies such a stream to a
+ * follower. A follower resumes from its kvstore_cdc_seq.
+ */
+int              kvstore_cdc_init(kvstore, size_t);
+uint64_t         kvstore_cdc_seq(kvstore);
+ssize_t          kvstore_cdc_send(kvstore, int, uint64_t *);
+ssize_t          kvstore_cdc_recv(kvstore, int);
+
+/*
+ * A store opened with kvstore_shm_open lives in a shared memory segment
+ * that any number of processes can attach to. kvstore_get returns a
+ * pointer into the segment, valid until any process next sets or
+ * deletes the key. kvstore_scan is not supported. Remove a named
+ * segment with shm_unlink once it is no longer needed.
+ */
+kvstore          kvstore_shm_open(const char *, size_t);
+
+/*
+ * A store made with kvstore_new_compact keeps its entries in parallel
+ * arrays and its keys and values packed in one buffer, which scans and
+ * lookups read front to back. The buffer moves as it grows, so a value
+ * from kvstore_get is only valid until the next set of any key. Change
+ * data capture, parallel passes, hot keys and defragmentation are not
+ * supported.
+ */
+kvstore          kvstore_new_compact(void);
+
+/*
+ * kvstore_freeze writes an in-memory store's string keys and values to
+ * a file indexed by a minimal perfect hash, built with
+ * KVSTORE_LOAD_THREADS threads. kvstore_open_frozen maps such a file as
+ * a store that can be read and scanned but not changed; kvstore_get
+ * finds a key with a single probe and returns a pointer into the
+ * mapping, valid until kvstore_discard. Writes fail with errno set to
+ * EROFS.
+ */
+int              kvstore_freeze(kvstore, const char *);
+kvstore          kvstore_open_frozen(const char *);
+
+/*
+ * kvstore_bulk_load reads a file of records into the store in parallel,
+ * with KVSTORE_LOAD_THREADS threads (by default one per online CPU).
+ * The store is locked while the parsed records are linked in.
+ */
+ssize_t          kvstore_bulk_load(kvstore, const char *, KVSTORE_LOAD_FORMAT);
 
 #endif
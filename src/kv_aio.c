@@ -0,0 +1,388 @@
+/*
+ * Copyright (c) 2013 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+ * OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ * ---------------------------------------------------------------------
+ */
+
+
+#include <sys/types.h>
+#include <sys/eventfd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "kv.h"
+#include "kv_int.h"
+
+
+static const size_t      KVSTORE_AIO_BATCH = 256;
+
+
+/*
+ * A bounded multi-producer, multi-consumer ring (Vyukov's queue): every
+ * cell carries a sequence number that tells producers and consumers
+ * whose turn it is, so neither side ever takes a lock. head and tail sit
+ * on their own cache lines since they are written by different threads.
+ */
+struct _kvstore_ring {
+        size_t           head;
+        char             pad0[64 - sizeof(size_t)];
+        size_t           tail;
+        char             pad1[64 - sizeof(size_t)];
+        size_t           mask;
+        size_t           esize;
+        unsigned char   *cells;
+};
+
+struct _kvstore_aio {
+        struct _kvstore_ring     sq;
+        struct _kvstore_ring     cq;
+        size_t                   entries;
+        size_t                   inflight;
+        struct kvstore_sqe      *batch;
+        sem_t                    doorbell;
+        int                      efd;
+        int                      stop;
+        pthread_t                worker;
+};
+
+
+static int       _ring_init(struct _kvstore_ring *, size_t, size_t);
+static int       _ring_push(struct _kvstore_ring *, const void *);
+static int       _ring_pop(struct _kvstore_ring *, void *);
+static void      _kvstore_aio_apply(kvstore, struct kvstore_sqe *,
+                    struct kvstore_cqe *);
+static void     *_kvstore_aio_worker(void *);
+
+
+int
+_ring_init(struct _kvstore_ring *r, size_t entries, size_t esize)
+{
+        size_t  i;
+
+        memset(r, 0x0, sizeof(struct _kvstore_ring));
+        r->esize = sizeof(size_t) + esize;
+        r->cells = (unsigned char *)calloc(entries, r->esize);
+        if (NULL == r->cells)
+                return -1;
+        for (i = 0; i < entries; i++)
+                *(size_t *)(r->cells + i * r->esize) = i;
+        r->mask = entries - 1;
+        return 0;
+}
+
+
+int
+_ring_push(struct _kvstore_ring *r, const void *e)
+{
+        unsigned char   *cell;
+        size_t           pos, seq;
+
+        pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+        for (;;) {
+                cell = r->cells + (pos & r->mask) * r->esize;
+                seq = __atomic_load_n((size_t *)cell, __ATOMIC_ACQUIRE);
+                if (seq == pos) {
+                        if (__atomic_compare_exchange_n(&r->head, &pos,
+                            pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                                break;
+                } else if (seq < pos) {
+                        return -1;
+                } else {
+                        pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+                }
+        }
+        memcpy(cell + sizeof(size_t), e, r->esize - sizeof(size_t));
+        __atomic_store_n((size_t *)cell, pos + 1, __ATOMIC_RELEASE);
+        return 0;
+}
+
+
+int
+_ring_pop(struct _kvstore_ring *r, void *e)
+{
+        unsigned char   *cell;
+        size_t           pos, seq;
+
+        pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+        for (;;) {
+                cell = r->cells + (pos & r->mask) * r->esize;
+                seq = __atomic_load_n((size_t *)cell, __ATOMIC_ACQUIRE);
+                if (seq == pos + 1) {
+                        if (__atomic_compare_exchange_n(&r->tail, &pos,
+                            pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                                break;
+                } else if (seq < pos + 1) {
+                        return -1;
+                } else {
+                        pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+                }
+        }
+        memcpy(e, cell + sizeof(size_t), r->esize - sizeof(size_t));
+        __atomic_store_n((size_t *)cell, pos + r->mask + 1, __ATOMIC_RELEASE);
+        return 0;
+}
+
+
+/*
+ * kvstore_aio_init sets up the submission and completion rings, rounded
+ * up to a power of two entries, and starts the worker that drains them.
+ * Everything the worker needs is allocated here, so that a request
+ * accepted by kvstore_aio_submit always gets its completion.
+ */
+int
+kvstore_aio_init(kvstore kvs, size_t entries)
+{
+        struct _kvstore_aio     *aio;
+        size_t                   n = 1;
+
+        if ((NULL == kvs) || (0 == entries) || (NULL != kvs->aio))
+                return -1;
+        while (n < entries)
+                n <<= 1;
+
+        aio = (struct _kvstore_aio *)malloc(sizeof(struct _kvstore_aio));
+        if (NULL == aio)
+                return -1;
+        memset(aio, 0x0, sizeof(struct _kvstore_aio));
+        aio->entries = n;
+        aio->efd = -1;
+
+        if (_ring_init(&aio->sq, n, sizeof(struct kvstore_sqe)))
+                goto aio_fail;
+        if (_ring_init(&aio->cq, n, sizeof(struct kvstore_cqe)))
+                goto aio_fail;
+        aio->batch = (struct kvstore_sqe *)calloc(KVSTORE_AIO_BATCH,
+            sizeof(struct kvstore_sqe));
+        if (NULL == aio->batch)
+                goto aio_fail;
+        if (-1 == (aio->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)))
+                goto aio_fail;
+        if (sem_init(&aio->doorbell, 0, 0))
+                goto aio_fail;
+        kvs->aio = aio;
+        if (pthread_create(&aio->worker, NULL, _kvstore_aio_worker, kvs)) {
+                sem_destroy(&aio->doorbell);
+                goto aio_fail;
+        }
+        return 0;
+
+aio_fail:
+        if (-1 != aio->efd)
+                close(aio->efd);
+        free(aio->sq.cells);
+        free(aio->cq.cells);
+        free(aio->batch);
+        free(aio);
+        kvs->aio = NULL;
+        return -1;
+}
+
+
+/*
+ * kvstore_aio_fd returns the eventfd that is signalled whenever new
+ * completions are posted; its counter is the number of completions.
+ */
+int
+kvstore_aio_fd(kvstore kvs)
+{
+        if ((NULL == kvs) || (NULL == kvs->aio))
+                return -1;
+        return kvs->aio->efd;
+}
+
+
+/*
+ * kvstore_aio_submit queues up to n requests and wakes the worker once
+ * for the whole batch. The keys, values and get buffers they point to
+ * must stay valid until the matching completion has been reaped. Fewer
+ * than n requests are queued if that would leave more requests in
+ * flight than the rings hold; the number actually queued is returned.
+ */
+ssize_t
+kvstore_aio_submit(kvstore kvs, struct kvstore_sqe *sqes, size_t n)
+{
+        struct _kvstore_aio     *aio;
+        size_t                   cur, room, i;
+
+        if ((NULL == kvs) || (NULL == kvs->aio) || (NULL == sqes))
+                return -1;
+        aio = kvs->aio;
+
+        cur = __atomic_load_n(&aio->inflight, __ATOMIC_RELAXED);
+        do {
+                room = aio->entries - cur;
+                if (n > room)
+                        n = room;
+                if (0 == n) {
+                        errno = EBUSY;
+                        return 0;
+                }
+        } while (!__atomic_compare_exchange_n(&aio->inflight, &cur, cur + n,
+            1, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+        /*
+         * Reserving inflight first guarantees the push cannot fail.
+         */
+        for (i = 0; i < n; i++)
+                _ring_push(&aio->sq, &sqes[i]);
+        sem_post(&aio->doorbell);
+        return (ssize_t)n;
+}
+
+
+/*
+ * kvstore_aio_reap copies up to n completions into cqes without
+ * blocking, returning how many were available. Callers waiting on the
+ * eventfd should read it before reaping, so that completions posted
+ * while they reap signal it again.
+ */
+ssize_t
+kvstore_aio_reap(kvstore kvs, struct kvstore_cqe *cqes, size_t n)
+{
+        struct _kvstore_aio     *aio;
+        size_t                   i;
+
+        if ((NULL == kvs) || (NULL == kvs->aio) || (NULL == cqes))
+                return -1;
+        aio = kvs->aio;
+
+        for (i = 0; i < n; i++) {
+                if (_ring_pop(&aio->cq, &cqes[i]))
+                        break;
+        }
+        if (i > 0)
+                __atomic_sub_fetch(&aio->inflight, i, __ATOMIC_ACQ_REL);
+        return (ssize_t)i;
+}
+
+
+void
+_kvstore_aio_apply(kvstore kvs, struct kvstore_sqe *sqe,
+    struct kvstore_cqe *cqe)
+{
+        char    *val;
+        size_t   len = 0;
+
+        cqe->data = sqe->data;
+        cqe->res = -1;
+        switch (sqe->op) {
+        case KVSTORE_OP_SET:
+                cqe->res = _kvstore_set(kvs, sqe->key, sqe->val);
+                break;
+        case KVSTORE_OP_GET:
+                if (NULL == (val = _kvstore_get(kvs, sqe->key, &len)))
+                        break;
+                if ((NULL != sqe->val) && (0 < sqe->len)) {
+                        if (len < sqe->len) {
+                                memcpy(sqe->val, val, len + 1);
+                        } else {
+                                memcpy(sqe->val, val, sqe->len - 1);
+                                sqe->val[sqe->len - 1] = 0;
+                        }
+                }
+                cqe->res = (ssize_t)len;
+                break;
+        case KVSTORE_OP_DEL:
+                cqe->res = _kvstore_del(kvs, sqe->key);
+                break;
+        default:
+                break;
+        }
+}
+
+
+/*
+ * The worker drains the submission ring in batches, applying each batch
+ * under a single acquisition of the store lock, and signals the eventfd
+ * once per batch.
+ */
+void *
+_kvstore_aio_worker(void *arg)
+{
+        kvstore                  kvs = (kvstore)arg;
+        struct _kvstore_aio     *aio = kvs->aio;
+        struct kvstore_sqe      *batch = aio->batch;
+        struct kvstore_cqe       cqe;
+        uint64_t                 done;
+        size_t                   i, n;
+
+        for (;;) {
+                while (-1 == sem_wait(&aio->doorbell) && EINTR == errno)
+                        ;
+
+                for (;;) {
+                        for (n = 0; n < KVSTORE_AIO_BATCH; n++) {
+                                if (_ring_pop(&aio->sq, &batch[n]))
+                                        break;
+                        }
+                        if (0 == n)
+                                break;
+
+                        if (_acquire_kvstore(kvs)) {
+                                for (i = 0; i < n; i++) {
+                                        cqe.data = batch[i].data;
+                                        cqe.res = -1;
+                                        _ring_push(&aio->cq, &cqe);
+                                }
+                        } else {
+                                for (i = 0; i < n; i++) {
+                                        _kvstore_aio_apply(kvs, &batch[i],
+                                            &cqe);
+                                        _ring_push(&aio->cq, &cqe);
+                                }
+                                _unlock_kvstore(kvs);
+                        }
+
+                        done = n;
+                        while ((-1 == write(aio->efd, &done, sizeof(done))) &&
+                            (EINTR == errno))
+                                ;
+                }
+
+                if (__atomic_load_n(&aio->stop, __ATOMIC_ACQUIRE))
+                        break;
+        }
+        return NULL;
+}
+
+
+/*
+ * _kvstore_aio_shutdown is called by kvstore_discard with the store
+ * unlocked; requests still queued are applied before the worker exits.
+ */
+void
+_kvstore_aio_shutdown(kvstore kvs)
+{
+        struct _kvstore_aio     *aio = kvs->aio;
+
+        if (NULL == aio)
+                return;
+        __atomic_store_n(&aio->stop, 1, __ATOMIC_RELEASE);
+        sem_post(&aio->doorbell);
+        pthread_join(aio->worker, NULL);
+
+        sem_destroy(&aio->doorbell);
+        close(aio->efd);
+        free(aio->sq.cells);
+        free(aio->cq.cells);
+        free(aio->batch);
+        free(aio);
+        kvs->aio = NULL;
+}
@@ -0,0 +1,248 @@
+/*
+ * Copyright (c) 2013 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+ * OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ * ---------------------------------------------------------------------
+ */
+
+
+
+/*
+ * Appends and partial reads and writes of values. In an in-memory store
+ * a value being written into past its end grows in place, to at least
+ * twice its size each time, so appending or overwriting a small piece
+ * costs in proportion to the piece. Other kinds of store fall back to
+ * reading the whole value and setting a new one.
+ */
+
+
+#include <sys/types.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kv.h"
+#include "kv_int.h"
+
+
+#define KVSTORE_APPEND  ((size_t)-1)
+
+
+static ssize_t   _str_splice(kvstore, struct _kvstore_kv *, size_t,
+                    const char *, size_t);
+static ssize_t   _str_copy(kvstore, char *, size_t, const char *, size_t);
+static ssize_t   _str_write(kvstore, char *, size_t, const char *);
+
+
+/*
+ * _str_splice writes data over kv's value at off, growing the value and
+ * its allocation as needed, and records the change. A value that is or
+ * becomes too long for max_vallen is written in chunks, and one shared
+ * through the dedup pool is copied out of it first.
+ */
+ssize_t
+_str_splice(kvstore kvs, struct _kvstore_kv *kv, size_t off,
+    const char *data, size_t dlen)
+{
+        size_t   len, cap;
+        char    *val;
+
+        if (NULL != kvs->rcache)
+                _kvstore_rcache_bump(kvs, kv->hash);
+        len = off + dlen > kv->val_len ? off + dlen : kv->val_len;
+        if ((NULL != kv->chunks) ||
+            ((len > kvs->max_vallen) && (0 != kvs->chunk_size))) {
+                if (_kvstore_chunk_write(kvs, kv, off, data, dlen))
+                        return -1;
+                goto written;
+        }
+        if (len > kvs->max_vallen) {
+                errno = EINVAL;
+                return -1;
+        }
+        if (KVSTORE_VAL_POOLED(kvs, kv)) {
+                if (NULL == (val = (char *)malloc(len + 1)))
+                        return -1;
+                memcpy(val, kv->val, kv->val_len);
+                _kvstore_dedup_release(kvs, kv->val);
+                kv->val = val;
+                kv->val_cap = len + 1;
+        }
+        if (len + 1 > kv->val_cap) {
+                cap = kv->val_cap * 2 > len + 1 ? kv->val_cap * 2 : len + 1;
+                if (cap > kvs->max_vallen + 1)
+                        cap = kvs->max_vallen + 1;
+                if (NULL == (val = (char *)realloc(kv->val, cap)))
+                        return -1;
+                kv->val = val;
+                kv->val_cap = cap;
+        }
+        memcpy(kv->val + off, data, dlen);
+        kv->val_len = len;
+        kv->val[len] = 0;
+
+        if (NULL != kvs->cdc)
+                _kvstore_cdc_log(kvs, KVSTORE_OP_SET, kv->key, kv->val);
+written:
+        if (NULL != kvs->watch)
+                _kvstore_watch_notify(kvs, kv->key, kv->key_len);
+        if (NULL != kvs->hot)
+                _kvstore_hot_write(kvs, kv->key, kv->key_len);
+        return (ssize_t)len;
+}
+
+
+/*
+ * _str_copy is the fallback for stores whose values cannot be grown in
+ * place: it builds the new value in full and sets it.
+ */
+ssize_t
+_str_copy(kvstore kvs, char *key, size_t off, const char *data,
+    size_t dlen)
+{
+        char    *old, *val;
+        size_t   olen = 0, len;
+        ssize_t  retval = -1;
+
+        old = _kvstore_get(kvs, key, &olen);
+        if (NULL == old)
+                olen = 0;
+        if (KVSTORE_APPEND == off)
+                off = olen;
+        if (off > olen) {
+                errno = EINVAL;
+                return -1;
+        }
+        len = off + dlen > olen ? off + dlen : olen;
+        if (NULL == (val = (char *)malloc(len + 1)))
+                return -1;
+        if (0 != olen)
+                memcpy(val, old, olen);
+        memcpy(val + off, data, dlen);
+        val[len] = 0;
+        if (0 == _kvstore_set(kvs, key, val))
+                retval = (ssize_t)len;
+        free(val);
+        return retval;
+}
+
+
+ssize_t
+_str_write(kvstore kvs, char *key, size_t off, const char *data)
+{
+        struct _kvstore_kv      *kv;
+        size_t                   dlen;
+        ssize_t                  retval;
+
+        if ((NULL == kvs) || (NULL == key) || (NULL == data))
+                return -1;
+        if (NULL != kvs->wc)
+                kvstore_wc_sync(kvs);
+        dlen = strnlen(data, (0 != kvs->chunk_size ? kvs->max_chunked :
+            kvs->max_vallen) + 1);
+        if (_acquire_kvstore(kvs))
+                return -1;
+
+        if ((NULL != kvs->bc) || (NULL != kvs->lsm) || (NULL != kvs->shm) ||
+            (NULL != kvs->soa)) {
+                retval = _str_copy(kvs, key, off, data, dlen);
+        } else if (NULL == (kv = _kvstore_lookup(kvs, key))) {
+                retval = -1;
+                if ((0 != off) && (KVSTORE_APPEND != off))
+                        errno = EINVAL;
+                else if (0 == _kvstore_set(kvs, key, (char *)data))
+                        retval = (ssize_t)dlen;
+        } else {
+                if (KVSTORE_APPEND == off)
+                        off = kv->val_len;
+                if (off > kv->val_len) {
+                        errno = EINVAL;
+                        retval = -1;
+                } else if (0 == dlen) {
+                        retval = (ssize_t)kv->val_len;
+                } else {
+                        retval = _str_splice(kvs, kv, off, data, dlen);
+                }
+        }
+
+        _unlock_kvstore(kvs);
+        if ((-1 != retval) && (NULL != kvs->lsm))
+                _kvstore_lsm_throttle(kvs);
+        return retval;
+}
+
+
+/*
+ * kvstore_append adds data to the end of key's value, creating the key
+ * if it is not present, and returns the value's new length.
+ */
+ssize_t
+kvstore_append(kvstore kvs, char *key, const char *data)
+{
+        return _str_write(kvs, key, KVSTORE_APPEND, data);
+}
+
+
+/*
+ * kvstore_setrange writes data over key's value starting at off, which
+ * may be at most the value's length, extending the value if data runs
+ * past its end. It returns the value's new length.
+ */
+ssize_t
+kvstore_setrange(kvstore kvs, char *key, size_t off, const char *data)
+{
+        if (KVSTORE_APPEND == off)
+                return -1;
+        return _str_write(kvs, key, off, data);
+}
+
+
+/*
+ * kvstore_getrange copies up to len bytes of key's value, starting at
+ * off, into buf and returns how many it copied: 0 if off is at or past
+ * the end of the value. buf is not NUL-terminated. It fails with errno
+ * set to ENOENT if the key is not present.
+ */
+ssize_t
+kvstore_getrange(kvstore kvs, char *key, size_t off, size_t len, char *buf)
+{
+        struct _kvstore_kv      *kv;
+        char                    *val;
+        size_t                   vlen = 0;
+
+        if ((NULL == kvs) || (NULL == key) || (NULL == buf))
+                return -1;
+        if (_acquire_kvstore(kvs))
+                return -1;
+        if ((0 != kvs->chunk_size) &&
+            (NULL != (kv = _kvstore_lookup(kvs, key))) &&
+            (NULL != kv->chunks)) {
+                len = _kvstore_chunk_read(kv, off, len, buf);
+                _unlock_kvstore(kvs);
+                return (ssize_t)len;
+        }
+        if (NULL == (val = _kvstore_get(kvs, key, &vlen))) {
+                _unlock_kvstore(kvs);
+                errno = ENOENT;
+                return -1;
+        }
+        if (off >= vlen)
+                len = 0;
+        else if (len > vlen - off)
+                len = vlen - off;
+        memcpy(buf, val + off, len);
+        _unlock_kvstore(kvs);
+        return (ssize_t)len;
+}
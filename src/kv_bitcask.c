@@ -0,0 +1,1091 @@
+/*
+ * Copyright (c) 2013 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+ * OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ * ---------------------------------------------------------------------
+ */
+
+
+/*
+ * A Bitcask-style persistent engine. Every set or del is appended to the
+ * active segment file in the store directory; the in-memory index keeps
+ * only the keys, and each entry's value pointer points straight into a
+ * read-only mapping of the segment holding its latest record, so
+ * kvstore_get never copies or reads from disk explicitly.
+ *
+ * A record is a header followed by the key and value, both NUL
+ * terminated so the mapping can be handed out as a C string:
+ *
+ *      crc32 | key length | value length | key \0 | value \0
+ *
+ * Deletes are records with a value length of KVSTORE_BC_TOMBSTONE and no
+ * value. Alongside each segment, a hint file lists (key, value length,
+ * offset) for every record so that the index can be rebuilt at startup
+ * without reading the values; a hint file is only trusted if it ends in
+ * a trailer recording the size of the finished segment.
+ *
+ * Merging reclaims segments whose records are mostly overwritten: live
+ * records are appended again through the normal write path and the old
+ * segment files are removed. A merged segment stays mapped, on a retired
+ * list, until the store has been written to since, so a value from
+ * kvstore_get is good until the next set or delete of any key even if a
+ * merge moves it in the meantime.
+ */
+
+
+#include <sys/types.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "kv.h"
+#include "kv_int.h"
+
+
+const size_t             KVSTORE_DEFAULT_SEGMENT_SIZE = 64 * 1024 * 1024;
+static const uint32_t    KVSTORE_BC_TOMBSTONE = UINT32_MAX;
+static const size_t      KVSTORE_BC_MERGE_BATCH = 256;
+
+
+struct _kvstore_bc_hdr {
+        uint32_t         crc;
+        uint32_t         key_len;
+        uint32_t         val_len;
+};
+
+struct _kvstore_bc_hint {
+        uint32_t         key_len;
+        uint32_t         val_len;
+        uint64_t         off;
+};
+
+struct _kvstore_seg {
+        uint32_t         id;
+        int              fd;
+        char            *map;
+        size_t           maplen;
+        size_t           size;
+        size_t           dead;
+        struct _kvstore_seg
+                        *next;
+};
+
+struct _kvstore_bc {
+        char                    *path;
+        int                      lockfd;
+        struct _kvstore_seg    **segs;
+        size_t                   nsegs;
+        size_t                   cap;
+        char                    *hints;
+        size_t                   hint_len;
+        size_t                   hint_cap;
+        size_t                   seg_max;
+        uint64_t                 writes;
+        uint64_t                 retired_at;
+        struct _kvstore_seg     *retired;
+        int                      sync;
+        int                      started;
+        int                      stop;
+        sem_t                    kick;
+        pthread_mutex_t          merge_lock;
+        pthread_t                merger;
+};
+
+
+static uint32_t          crc_table[256];
+static pthread_once_t    crc_once = PTHREAD_ONCE_INIT;
+
+static void      _crc_init(void);
+static uint32_t  _crc32(uint32_t, const void *, size_t);
+static size_t    _rec_size(uint32_t, uint32_t);
+static char     *_seg_path(struct _kvstore_bc *, uint32_t, const char *);
+static struct _kvstore_seg
+                *_seg_find(struct _kvstore_bc *, uint32_t);
+static int       _seg_add(struct _kvstore_bc *, struct _kvstore_seg *);
+static struct _kvstore_seg
+                *_seg_open(struct _kvstore_bc *, uint32_t, int);
+static void      _seg_free(struct _kvstore_seg *);
+static int       _seg_rotate(kvstore);
+static int       _seg_finish(struct _kvstore_bc *, struct _kvstore_seg *);
+static int       _bc_append(kvstore, char *, size_t, char *, uint32_t, int,
+                    char **);
+static void      _bc_apply(kvstore, struct _kvstore_seg *, char *, size_t,
+                    uint32_t, size_t);
+static int       _bc_load_hints(kvstore, struct _kvstore_seg *);
+static int       _bc_load_data(kvstore, struct _kvstore_seg *);
+static int       _bc_load(kvstore);
+static void      _bc_unlink_seg(struct _kvstore_bc *, uint32_t);
+static int       _bc_mergeable(struct _kvstore_seg *);
+static int       _bc_merge_seg(kvstore, uint32_t);
+static int       _bc_merge(kvstore, int);
+static void      _bc_release(kvstore, int);
+static void     *_bc_merger(void *);
+
+
+void
+_crc_init(void)
+{
+        uint32_t        c;
+        int             i, j;
+
+        for (i = 0; i < 256; i++) {
+                c = (uint32_t)i;
+                for (j = 0; j < 8; j++)
+                        c = (c & 1) ? 0xedb88320U ^ (c >> 1) : c >> 1;
+                crc_table[i] = c;
+        }
+}
+
+
+uint32_t
+_crc32(uint32_t crc, const void *buf, size_t len)
+{
+        const unsigned char     *p = (const unsigned char *)buf;
+
+        crc = ~crc;
+        while (len--)
+                crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        return ~crc;
+}
+
+
+size_t
+_rec_size(uint32_t klen, uint32_t vlen)
+{
+        size_t  size;
+
+        size = sizeof(struct _kvstore_bc_hdr) + klen + 1;
+        if (KVSTORE_BC_TOMBSTONE != vlen)
+                size += vlen + 1;
+        return size;
+}
+
+
+char *
+_seg_path(struct _kvstore_bc *bc, uint32_t id, const char *ext)
+{
+        char    *path;
+        size_t   len;
+
+        len = strlen(bc->path) + 32;
+        if (NULL == (path = (char *)malloc(len)))
+                return NULL;
+        snprintf(path, len, "%s/%010u.%s", bc->path, (unsigned int)id, ext);
+        return path;
+}
+
+
+struct _kvstore_seg *
+_seg_find(struct _kvstore_bc *bc, uint32_t id)
+{
+        size_t  lo = 0, hi = bc->nsegs, mid;
+
+        while (lo < hi) {
+                mid = lo + (hi - lo) / 2;
+                if (bc->segs[mid]->id == id)
+                        return bc->segs[mid];
+                if (bc->segs[mid]->id < id)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+        return NULL;
+}
+
+
+/*
+ * Segments are always added in increasing id order, so the array stays
+ * sorted and the last segment is the active one.
+ */
+int
+_seg_add(struct _kvstore_bc *bc, struct _kvstore_seg *seg)
+{
+        struct _kvstore_seg     **segs;
+        size_t                    cap;
+
+        if (bc->nsegs == bc->cap) {
+                cap = bc->cap ? bc->cap * 2 : 8;
+                segs = (struct _kvstore_seg **)realloc(bc->segs,
+                    cap * sizeof(struct _kvstore_seg *));
+                if (NULL == segs)
+                        return -1;
+                bc->segs = segs;
+                bc->cap = cap;
+        }
+        bc->segs[bc->nsegs++] = seg;
+        return 0;
+}
+
+
+/*
+ * _seg_open opens (and with create, makes) a segment's data file and maps
+ * it. A segment being written is mapped at the maximum segment size up
+ * front; pages past the end of the file are never touched.
+ */
+struct _kvstore_seg *
+_seg_open(struct _kvstore_bc *bc, uint32_t id, int create)
+{
+        struct _kvstore_seg     *seg;
+        struct stat              st;
+        char                    *path;
+        int                      flags = O_RDWR | O_CLOEXEC;
+
+        if (NULL == (path = _seg_path(bc, id, "data")))
+                return NULL;
+        if (NULL == (seg = (struct _kvstore_seg *)malloc(sizeof(*seg)))) {
+                free(path);
+                return NULL;
+        }
+        memset(seg, 0x0, sizeof(struct _kvstore_seg));
+        seg->id = id;
+        seg->map = MAP_FAILED;
+
+        if (create)
+                flags |= O_CREAT | O_EXCL;
+        seg->fd = open(path, flags, 0644);
+        free(path);
+        if (-1 == seg->fd)
+                goto seg_fail;
+        if (fstat(seg->fd, &st))
+                goto seg_fail;
+        seg->size = (size_t)st.st_size;
+        seg->maplen = create ? bc->seg_max : seg->size;
+        if (0 == seg->maplen)
+                return seg;
+
+        seg->map = (char *)mmap(NULL, seg->maplen, PROT_READ, MAP_SHARED,
+            seg->fd, 0);
+        if (MAP_FAILED == seg->map)
+                goto seg_fail;
+        return seg;
+
+seg_fail:
+        _seg_free(seg);
+        return NULL;
+}
+
+
+void
+_seg_free(struct _kvstore_seg *seg)
+{
+        if (NULL == seg)
+                return;
+        if ((MAP_FAILED != seg->map) && (NULL != seg->map))
+                munmap(seg->map, seg->maplen);
+        if (-1 != seg->fd)
+                close(seg->fd);
+        free(seg);
+}
+
+
+/*
+ * _seg_finish writes out the hint file for the active segment, ending it
+ * with a trailer that records the final size of the data file.
+ */
+int
+_seg_finish(struct _kvstore_bc *bc, struct _kvstore_seg *seg)
+{
+        struct _kvstore_bc_hint  trailer;
+        char                    *path;
+        ssize_t                  n;
+        size_t                   off = 0;
+        int                      fd;
+        int                      retval = -1;
+
+        if (fdatasync(seg->fd))
+                return -1;
+        if (NULL == (path = _seg_path(bc, seg->id, "hint")))
+                return -1;
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        free(path);
+        if (-1 == fd)
+                return -1;
+
+        while (off < bc->hint_len) {
+                n = write(fd, bc->hints + off, bc->hint_len - off);
+                if (-1 == n) {
+                        if (EINTR == errno)
+                                continue;
+                        goto finish_done;
+                }
+                off += (size_t)n;
+        }
+        trailer.key_len = 0;
+        trailer.val_len = 0;
+        trailer.off = seg->size;
+        if ((ssize_t)sizeof(trailer) != write(fd, &trailer, sizeof(trailer)))
+                goto finish_done;
+        if (fdatasync(fd))
+                goto finish_done;
+        bc->hint_len = 0;
+        retval = 0;
+
+finish_done:
+        close(fd);
+        return retval;
+}
+
+
+int
+_seg_rotate(kvstore kvs)
+{
+        struct _kvstore_bc      *bc = kvs->bc;
+        struct _kvstore_seg     *seg = NULL;
+        uint32_t                 id = 0;
+        size_t                   i;
+
+        if (bc->nsegs) {
+                seg = bc->segs[bc->nsegs - 1];
+                id = seg->id + 1;
+                if (_seg_finish(bc, seg))
+                        return -1;
+        }
+        if (NULL == (seg = _seg_open(bc, id, 1)))
+                return -1;
+        if (_seg_add(bc, seg)) {
+                _seg_free(seg);
+                return -1;
+        }
+
+        for (i = 0; i + 1 < bc->nsegs; i++) {
+                if (_bc_mergeable(bc->segs[i])) {
+                        sem_post(&bc->kick);
+                        break;
+                }
+        }
+        return 0;
+}
+
+
+/*
+ * _bc_append writes a record to the active segment, rotating first if it
+ * would not fit, and records a hint for it. On success *valp points at
+ * the value in the segment mapping.
+ */
+int
+_bc_append(kvstore kvs, char *key, size_t klen, char *val, uint32_t vlen,
+    int sync, char **valp)
+{
+        struct _kvstore_bc      *bc = kvs->bc;
+        struct _kvstore_seg     *seg = bc->segs[bc->nsegs - 1];
+        struct _kvstore_bc_hdr   hdr;
+        struct _kvstore_bc_hint  hint;
+        struct iovec             iov[3];
+        char                    *hints;
+        size_t                   size, cap;
+        ssize_t                  n;
+        int                      iovcnt = 2;
+
+        size = _rec_size((uint32_t)klen, vlen);
+        if (size > bc->seg_max) {
+                errno = EFBIG;
+                return -1;
+        }
+        if ((seg->size + size > seg->maplen) ||
+            (seg->size + size > bc->seg_max)) {
+                if (_seg_rotate(kvs))
+                        return -1;
+                seg = bc->segs[bc->nsegs - 1];
+        }
+
+        if (bc->hint_len + sizeof(hint) + klen > bc->hint_cap) {
+                cap = bc->hint_cap ? bc->hint_cap : 4096;
+                while (bc->hint_len + sizeof(hint) + klen > cap)
+                        cap *= 2;
+                if (NULL == (hints = (char *)realloc(bc->hints, cap)))
+                        return -1;
+                bc->hints = hints;
+                bc->hint_cap = cap;
+        }
+
+        hdr.key_len = (uint32_t)klen;
+        hdr.val_len = vlen;
+        hdr.crc = _crc32(0, &hdr.key_len, sizeof(hdr) - sizeof(hdr.crc));
+        hdr.crc = _crc32(hdr.crc, key, klen + 1);
+        iov[0].iov_base = &hdr;
+        iov[0].iov_len = sizeof(hdr);
+        iov[1].iov_base = key;
+        iov[1].iov_len = klen + 1;
+        if (KVSTORE_BC_TOMBSTONE != vlen) {
+                hdr.crc = _crc32(hdr.crc, val, vlen + 1);
+                iov[2].iov_base = val;
+                iov[2].iov_len = vlen + 1;
+                iovcnt++;
+        }
+
+        n = pwritev(seg->fd, iov, iovcnt, (off_t)seg->size);
+        if ((ssize_t)size != n) {
+                /*
+                 * Cut off a short write so that the next record starts
+                 * where the hints say it does.
+                 */
+                if (-1 != n) {
+                        errno = ENOSPC;
+                        if (ftruncate(seg->fd, (off_t)seg->size))
+                                errno = EIO;
+                }
+                return -1;
+        }
+        if (sync && fdatasync(seg->fd))
+                return -1;
+
+        hint.key_len = (uint32_t)klen;
+        hint.val_len = vlen;
+        hint.off = seg->size;
+        memcpy(bc->hints + bc->hint_len, &hint, sizeof(hint));
+        memcpy(bc->hints + bc->hint_len + sizeof(hint), key, klen);
+        bc->hint_len += sizeof(hint) + klen;
+
+        if (NULL != valp)
+                *valp = seg->map + seg->size + sizeof(hdr) + klen + 1;
+        seg->size += size;
+        return 0;
+}
+
+
+int
+_kvstore_bc_set(kvstore kvs, char *key, size_t klen, uint64_t hash,
+    char *val)
+{
+        struct _kvstore_bc      *bc = kvs->bc;
+        struct _kvstore_kv      *kv;
+        struct _kvstore_seg     *old;
+        char                    *mapped;
+        size_t                   vlen;
+
+        vlen = strnlen(val, kvs->max_vallen + 1);
+        if (((kvs->max_vallen + 1) == vlen) || (0 == vlen))
+                return -1;
+        if (vlen >= KVSTORE_BC_TOMBSTONE)
+                return -1;
+
+        kv = _kvstore_find(kvs, key, klen, hash);
+        if ((NULL == kv) && (NULL == (kv = _kvstore_new_kv(key, klen, hash))))
+                return -1;
+        if (_bc_append(kvs, key, klen, val, (uint32_t)vlen, bc->sync,
+            &mapped)) {
+                if (NULL == kv->val)
+                        _kvstore_free_kv(kvs, kv);
+                return -1;
+        }
+
+        if (NULL == kv->val) {
+                _kvstore_link(kvs, kv);
+        } else if (NULL != (old = _seg_find(bc, kv->seg))) {
+                old->dead += _rec_size((uint32_t)klen, (uint32_t)kv->val_len);
+        }
+        kv->val = mapped;
+        kv->val_len = vlen;
+        kv->seg = bc->segs[bc->nsegs - 1]->id;
+        bc->writes++;
+        return 0;
+}
+
+
+int
+_kvstore_bc_del(kvstore kvs, char *key, size_t klen, uint64_t hash)
+{
+        struct _kvstore_bc      *bc = kvs->bc;
+        struct _kvstore_kv      *kv;
+        struct _kvstore_seg     *old;
+
+        if (NULL == _kvstore_find(kvs, key, klen, hash))
+                return -1;
+        if (_bc_append(kvs, key, klen, NULL, KVSTORE_BC_TOMBSTONE, bc->sync,
+            NULL))
+                return -1;
+
+        kv = _kvstore_unlink(kvs, key, klen, hash);
+        if (NULL != (old = _seg_find(bc, kv->seg)))
+                old->dead += _rec_size((uint32_t)klen, (uint32_t)kv->val_len);
+        bc->segs[bc->nsegs - 1]->dead += _rec_size((uint32_t)klen,
+            KVSTORE_BC_TOMBSTONE);
+        _kvstore_free_kv(kvs, kv);
+        bc->writes++;
+        return 0;
+}
+
+
+/*
+ * _bc_apply replays one record found while loading segment seg at off.
+ */
+void
+_bc_apply(kvstore kvs, struct _kvstore_seg *seg, char *key, size_t klen,
+    uint32_t vlen, size_t off)
+{
+        struct _kvstore_kv      *kv;
+        struct _kvstore_seg     *old;
+        uint64_t                 hash;
+
+        hash = _kvstore_hash(kvs, key, klen);
+        kv = _kvstore_find(kvs, key, klen, hash);
+        if (NULL != kv) {
+                if (NULL != (old = _seg_find(kvs->bc, kv->seg)))
+                        old->dead += _rec_size((uint32_t)klen,
+                            (uint32_t)kv->val_len);
+        }
+
+        if (KVSTORE_BC_TOMBSTONE == vlen) {
+                seg->dead += _rec_size((uint32_t)klen, vlen);
+                if (NULL != kv)
+                        _kvstore_free_kv(kvs,
+                            _kvstore_unlink(kvs, key, klen, hash));
+                return;
+        }
+
+        if (NULL == kv) {
+                if (NULL == (kv = _kvstore_new_kv(key, klen, hash)))
+                        return;
+                _kvstore_link(kvs, kv);
+        }
+        kv->val = seg->map + off + sizeof(struct _kvstore_bc_hdr) + klen + 1;
+        kv->val_len = vlen;
+        kv->seg = seg->id;
+}
+
+
+/*
+ * _bc_load_hints rebuilds the index entries for a segment from its hint
+ * file. It returns -1, having changed nothing, if the hint file is
+ * missing or does not describe the whole segment.
+ */
+int
+_bc_load_hints(kvstore kvs, struct _kvstore_seg *seg)
+{
+        struct _kvstore_bc_hint  hint;
+        struct stat              st;
+        char                    *path, *hints = NULL;
+        size_t                   off = 0;
+        ssize_t                  n;
+        int                      fd;
+        int                      retval = -1;
+
+        if (NULL == (path = _seg_path(kvs->bc, seg->id, "hint")))
+                return -1;
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        free(path);
+        if (-1 == fd)
+                return -1;
+        if (fstat(fd, &st) || ((size_t)st.st_size < sizeof(hint)))
+                goto hints_done;
+        if (NULL == (hints = (char *)malloc((size_t)st.st_size)))
+                goto hints_done;
+        while (off < (size_t)st.st_size) {
+                n = read(fd, hints + off, (size_t)st.st_size - off);
+                if (n <= 0)
+                        goto hints_done;
+                off += (size_t)n;
+        }
+
+        memcpy(&hint, hints + off - sizeof(hint), sizeof(hint));
+        if ((0 != hint.key_len) || (hint.off != seg->size))
+                goto hints_done;
+
+        off = 0;
+        while (off + sizeof(hint) < (size_t)st.st_size) {
+                memcpy(&hint, hints + off, sizeof(hint));
+                off += sizeof(hint);
+                if ((off + hint.key_len > (size_t)st.st_size) ||
+                    (hint.off + _rec_size(hint.key_len, hint.val_len) >
+                    seg->size))
+                        break;
+                _bc_apply(kvs, seg, seg->map + hint.off +
+                    sizeof(struct _kvstore_bc_hdr), hint.key_len,
+                    hint.val_len, hint.off);
+                off += hint.key_len;
+        }
+        retval = 0;
+
+hints_done:
+        free(hints);
+        close(fd);
+        return retval;
+}
+
+
+/*
+ * _bc_load_data rebuilds the index entries for a segment by reading the
+ * records themselves, stopping at the first torn or corrupt record and
+ * cutting the file off there.
+ */
+int
+_bc_load_data(kvstore kvs, struct _kvstore_seg *seg)
+{
+        struct _kvstore_bc_hdr   hdr;
+        struct _kvstore_bc_hint  hint;
+        size_t                   off = 0, size;
+        uint32_t                 crc;
+        char                    *key;
+
+        kvs->bc->hint_len = 0;
+        while (off + sizeof(hdr) <= seg->size) {
+                memcpy(&hdr, seg->map + off, sizeof(hdr));
+                size = _rec_size(hdr.key_len, hdr.val_len);
+                if ((0 == hdr.key_len) || (off + size > seg->size))
+                        break;
+                key = seg->map + off + sizeof(hdr);
+                crc = _crc32(0, &hdr.key_len, sizeof(hdr) - sizeof(hdr.crc));
+                crc = _crc32(crc, key, size - sizeof(hdr));
+                if (crc != hdr.crc)
+                        break;
+                _bc_apply(kvs, seg, key, hdr.key_len, hdr.val_len, off);
+
+                hint.key_len = hdr.key_len;
+                hint.val_len = hdr.val_len;
+                hint.off = off;
+                if (kvs->bc->hint_len + sizeof(hint) + hint.key_len >
+                    kvs->bc->hint_cap)
+                        return -1;
+                memcpy(kvs->bc->hints + kvs->bc->hint_len, &hint,
+                    sizeof(hint));
+                memcpy(kvs->bc->hints + kvs->bc->hint_len + sizeof(hint),
+                    key, hint.key_len);
+                kvs->bc->hint_len += sizeof(hint) + hint.key_len;
+                off += size;
+        }
+
+        if (off != seg->size) {
+                if (ftruncate(seg->fd, (off_t)off))
+                        return -1;
+                seg->size = off;
+        }
+        return 0;
+}
+
+
+/*
+ * _bc_load opens every segment in the directory in id order and replays
+ * it into the index, then starts a fresh active segment. Segments that
+ * had to be read in full get their hint file written on the way.
+ */
+int
+_bc_load(kvstore kvs)
+{
+        struct _kvstore_bc      *bc = kvs->bc;
+        struct _kvstore_seg     *seg;
+        struct dirent           *de;
+        DIR                     *dir;
+        uint32_t                *ids = NULL, *tmp;
+        unsigned int             id;
+        size_t                   nids = 0, cap = 0, i, j;
+        char                     ext[8];
+        int                      retval = -1;
+
+        if (NULL == (dir = opendir(bc->path)))
+                return -1;
+        while (NULL != (de = readdir(dir))) {
+                if (2 != sscanf(de->d_name, "%10u.%4s", &id, ext))
+                        continue;
+                if (0 != strcmp(ext, "data"))
+                        continue;
+                if (nids == cap) {
+                        cap = cap ? cap * 2 : 16;
+                        tmp = (uint32_t *)realloc(ids, cap * sizeof(*ids));
+                        if (NULL == tmp)
+                                goto load_done;
+                        ids = tmp;
+                }
+                ids[nids++] = (uint32_t)id;
+        }
+
+        for (i = 1; i < nids; i++) {
+                for (j = i; (j > 0) && (ids[j - 1] > ids[j]); j--) {
+                        id = ids[j];
+                        ids[j] = ids[j - 1];
+                        ids[j - 1] = id;
+                }
+        }
+
+        for (i = 0; i < nids; i++) {
+                if (NULL == (seg = _seg_open(bc, ids[i], 0)))
+                        goto load_done;
+                if (0 == seg->size) {
+                        _bc_unlink_seg(bc, ids[i]);
+                        _seg_free(seg);
+                        continue;
+                }
+                if (_seg_add(bc, seg)) {
+                        _seg_free(seg);
+                        goto load_done;
+                }
+                if (0 == _bc_load_hints(kvs, seg))
+                        continue;
+
+                /*
+                 * A hint entry is at most a few bytes larger than the
+                 * smallest record, so twice the segment size is room
+                 * enough for all of them.
+                 */
+                bc->hint_cap = seg->size * 2;
+                if (NULL == (bc->hints = (char *)malloc(bc->hint_cap)))
+                        goto load_done;
+                if (_bc_load_data(kvs, seg) || _seg_finish(bc, seg))
+                        goto load_done;
+                free(bc->hints);
+                bc->hints = NULL;
+                bc->hint_cap = 0;
+        }
+
+        id = bc->nsegs ? bc->segs[bc->nsegs - 1]->id + 1 : 0;
+        if (NULL == (seg = _seg_open(bc, id, 1)))
+                goto load_done;
+        if (_seg_add(bc, seg)) {
+                _seg_free(seg);
+                goto load_done;
+        }
+        retval = 0;
+
+load_done:
+        closedir(dir);
+        free(ids);
+        return retval;
+}
+
+
+void
+_bc_unlink_seg(struct _kvstore_bc *bc, uint32_t id)
+{
+        char    *path;
+
+        if (NULL != (path = _seg_path(bc, id, "hint"))) {
+                unlink(path);
+                free(path);
+        }
+        if (NULL != (path = _seg_path(bc, id, "data"))) {
+                unlink(path);
+                free(path);
+        }
+}
+
+
+int
+_bc_mergeable(struct _kvstore_seg *seg)
+{
+        return (seg->size > 0) && ((seg->dead * 2) >= seg->size);
+}
+
+
+/*
+ * _bc_merge_seg copies the live records of segment id into the active
+ * segment, a batch at a time under the store lock, and then removes its
+ * files and retires it. A tombstone is carried forward only while there
+ * is an older segment that might still hold the key it deletes.
+ */
+int
+_bc_merge_seg(kvstore kvs, uint32_t id)
+{
+        struct _kvstore_bc      *bc = kvs->bc;
+        struct _kvstore_seg     *seg, *active;
+        struct _kvstore_bc_hdr   hdr;
+        struct _kvstore_kv      *kv;
+        char                    *key, *val, *mapped;
+        size_t                   off = 0, size, n, i;
+        int                      older;
+
+        for (;;) {
+                if (_acquire_kvstore(kvs))
+                        return -1;
+                seg = _seg_find(bc, id);
+                if ((NULL == seg) || (seg == bc->segs[bc->nsegs - 1])) {
+                        _unlock_kvstore(kvs);
+                        return -1;
+                }
+                older = (bc->segs[0] != seg);
+
+                for (n = 0; (n < KVSTORE_BC_MERGE_BATCH) &&
+                    (off < seg->size); n++, off += size) {
+                        memcpy(&hdr, seg->map + off, sizeof(hdr));
+                        size = _rec_size(hdr.key_len, hdr.val_len);
+                        key = seg->map + off + sizeof(hdr);
+                        val = key + hdr.key_len + 1;
+                        kv = _kvstore_find(kvs, key, hdr.key_len,
+                            _kvstore_hash(kvs, key, hdr.key_len));
+
+                        if (KVSTORE_BC_TOMBSTONE == hdr.val_len) {
+                                if ((NULL != kv) || !older)
+                                        continue;
+                                if (_bc_append(kvs, key, hdr.key_len, NULL,
+                                    hdr.val_len, 0, NULL))
+                                        goto merge_fail;
+                                active = bc->segs[bc->nsegs - 1];
+                                active->dead += size;
+                                continue;
+                        }
+
+                        if ((NULL == kv) || (kv->val != val))
+                                continue;
+                        if (_bc_append(kvs, key, hdr.key_len, val,
+                            hdr.val_len, 0, &mapped))
+                                goto merge_fail;
+                        seg = _seg_find(bc, id);
+                        seg->dead += size;
+                        kv->val = mapped;
+                        kv->seg = bc->segs[bc->nsegs - 1]->id;
+                }
+
+                if (off < seg->size) {
+                        _unlock_kvstore(kvs);
+                        continue;
+                }
+
+                /*
+                 * Everything live has been copied; make the copies
+                 * durable before the original goes away.
+                 */
+                active = bc->segs[bc->nsegs - 1];
+                if (fdatasync(active->fd))
+                        goto merge_fail;
+                for (i = 0; bc->segs[i] != seg; i++)
+                        ;
+                memmove(&bc->segs[i], &bc->segs[i + 1],
+                    (bc->nsegs - i - 1) * sizeof(struct _kvstore_seg *));
+                bc->nsegs--;
+                seg->next = bc->retired;
+                bc->retired = seg;
+                bc->retired_at = bc->writes;
+                _unlock_kvstore(kvs);
+
+                _bc_unlink_seg(bc, id);
+                return 0;
+        }
+
+merge_fail:
+        _unlock_kvstore(kvs);
+        return -1;
+}
+
+
+/*
+ * _bc_merge merges every finished segment that is at least half dead,
+ * or every finished segment if all is set, oldest first.
+ */
+int
+_bc_merge(kvstore kvs, int all)
+{
+        struct _kvstore_bc      *bc = kvs->bc;
+        uint32_t                *ids;
+        size_t                   nids = 0, i;
+        int                      retval = 0;
+
+        pthread_mutex_lock(&bc->merge_lock);
+        _bc_release(kvs, 0);
+        if (_acquire_kvstore(kvs)) {
+                pthread_mutex_unlock(&bc->merge_lock);
+                return -1;
+        }
+        ids = (uint32_t *)calloc(bc->nsegs, sizeof(uint32_t));
+        if (NULL != ids) {
+                for (i = 0; i + 1 < bc->nsegs; i++) {
+                        if (all || _bc_mergeable(bc->segs[i]))
+                                ids[nids++] = bc->segs[i]->id;
+                }
+        }
+        _unlock_kvstore(kvs);
+        if (NULL == ids) {
+                pthread_mutex_unlock(&bc->merge_lock);
+                return -1;
+        }
+
+        for (i = 0; i < nids; i++) {
+                if (_bc_merge_seg(kvs, ids[i]))
+                        retval = -1;
+        }
+        free(ids);
+        pthread_mutex_unlock(&bc->merge_lock);
+        return retval;
+}
+
+
+/*
+ * _bc_release unmaps the segments merges have retired, once the store
+ * has been written to since the last of them was, or unconditionally if
+ * all is set.
+ */
+void
+_bc_release(kvstore kvs, int all)
+{
+        struct _kvstore_bc      *bc = kvs->bc;
+        struct _kvstore_seg     *seg, *next;
+
+        if (_acquire_kvstore(kvs))
+                return;
+        seg = NULL;
+        if (all || (bc->writes != bc->retired_at)) {
+                seg = bc->retired;
+                bc->retired = NULL;
+        }
+        _unlock_kvstore(kvs);
+
+        for (; NULL != seg; seg = next) {
+                next = seg->next;
+                _seg_free(seg);
+        }
+}
+
+
+void *
+_bc_merger(void *arg)
+{
+        kvstore                  kvs = (kvstore)arg;
+        struct _kvstore_bc      *bc = kvs->bc;
+
+        for (;;) {
+                while ((-1 == sem_wait(&bc->kick)) && (EINTR == errno))
+                        ;
+                if (__atomic_load_n(&bc->stop, __ATOMIC_ACQUIRE))
+                        break;
+                _bc_merge(kvs, 0);
+        }
+        return NULL;
+}
+
+
+/*
+ * kvstore_open opens, creating it if needed, a persistent store in the
+ * directory path. The directory is locked against other processes while
+ * the store is open.
+ */
+kvstore
+kvstore_open(const char *path)
+{
+        struct _kvstore_bc      *bc;
+        kvstore                  kvs;
+        char                    *lockpath;
+        size_t                   len;
+
+        if (NULL == path)
+                return NULL;
+        if ((-1 == mkdir(path, 0755)) && (EEXIST != errno))
+                return NULL;
+        if (NULL == (kvs = kvstore_new()))
+                return NULL;
+
+        pthread_once(&crc_once, _crc_init);
+        bc = (struct _kvstore_bc *)malloc(sizeof(struct _kvstore_bc));
+        if (NULL == bc) {
+                kvstore_discard(kvs);
+                return NULL;
+        }
+        memset(bc, 0x0, sizeof(struct _kvstore_bc));
+        bc->lockfd = -1;
+        bc->seg_max = KVSTORE_DEFAULT_SEGMENT_SIZE;
+        bc->sync = 1;
+        pthread_mutex_init(&bc->merge_lock, NULL);
+        sem_init(&bc->kick, 0, 0);
+        kvs->bc = bc;
+
+        if (NULL == (bc->path = strdup(path)))
+                goto open_fail;
+        len = strlen(path) + 8;
+        if (NULL == (lockpath = (char *)malloc(len)))
+                goto open_fail;
+        snprintf(lockpath, len, "%s/LOCK", path);
+        bc->lockfd = open(lockpath, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        free(lockpath);
+        if ((-1 == bc->lockfd) || flock(bc->lockfd, LOCK_EX | LOCK_NB))
+                goto open_fail;
+
+        if (_bc_load(kvs))
+                goto open_fail;
+        if (pthread_create(&bc->merger, NULL, _bc_merger, kvs))
+                goto open_fail;
+        bc->started = 1;
+        return kvs;
+
+open_fail:
+        kvstore_discard(kvs);
+        return NULL;
+}
+
+
+/*
+ * kvstore_merge merges every finished segment of a persistent store,
+ * dropping overwritten and deleted records. Merges also run in the
+ * background whenever a finished segment is at least half dead.
+ */
+int
+kvstore_merge(kvstore kvs)
+{
+        if ((NULL == kvs) || (NULL == kvs->bc))
+                return -1;
+        return _bc_merge(kvs, 1);
+}
+
+
+int
+_kvstore_bc_config(kvstore kvs, KVSTORE_CONFIG_OPT opt, void *val)
+{
+        if (NULL == kvs->bc)
+                return -1;
+        switch (opt) {
+        case KVSTORE_SYNC:
+                kvs->bc->sync = *(int *)val;
+                break;
+        case KVSTORE_SEGMENT_SIZE:
+                if (*(size_t *)val < 4096)
+                        return -1;
+                kvs->bc->seg_max = *(size_t *)val;
+                break;
+        default:
+                return -1;
+        }
+        return 0;
+}
+
+
+/*
+ * _kvstore_bc_close stops the merger and finishes the active segment so
+ * the next open can load it from its hint file. kvstore_discard calls it
+ * with the store unlocked, before the index is freed, and frees kvs->bc
+ * itself once the index is gone.
+ */
+void
+_kvstore_bc_close(kvstore kvs)
+{
+        struct _kvstore_bc      *bc = kvs->bc;
+        size_t                   i;
+
+        if (NULL == bc)
+                return;
+        if (bc->started) {
+                __atomic_store_n(&bc->stop, 1, __ATOMIC_RELEASE);
+                sem_post(&bc->kick);
+                pthread_join(bc->merger, NULL);
+        }
+        _bc_release(kvs, 1);
+
+        if (bc->nsegs)
+                _seg_finish(bc, bc->segs[bc->nsegs - 1]);
+        for (i = 0; i < bc->nsegs; i++)
+                _seg_free(bc->segs[i]);
+        if (-1 != bc->lockfd)
+                close(bc->lockfd);
+        sem_destroy(&bc->kick);
+        pthread_mutex_destroy(&bc->merge_lock);
+        free(bc->segs);
+        free(bc->hints);
+        free(bc->path);
+}
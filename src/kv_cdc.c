@@ -0,0 +1,466 @@
+/*
+ * Copyright (c) 2013 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+ * OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ * ---------------------------------------------------------------------
+ */
+
+
+/*
+ * Change data capture. A store with a change ring records every
+ * successful set and del, with a sequence number, in a bounded ring of
+ * copies. kvstore_cdc_send streams the changes after a given sequence
+ * number to a pipe or socket; when the ring no longer holds them all it
+ * sends a snapshot of the whole store instead. A follower store reads
+ * the stream with kvstore_cdc_recv, applying each batch it reads under
+ * one lock, and remembers the last sequence number it applied so that
+ * it can resume from there. A snapshot ends with its own record, and a
+ * follower part-way through one is at sequence number 0, so that it is
+ * sent everything again when it resumes.
+ *
+ * Records are a fixed header in host byte order followed by the key and
+ * value, so the stream is only meant for processes on the same machine.
+ */
+
+
+#include <sys/types.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "kv.h"
+#include "kv_int.h"
+
+
+static const size_t      KVSTORE_CDC_READ = 64 * 1024;
+
+enum {
+        KVSTORE_CDC_SET,
+        KVSTORE_CDC_DEL,
+        KVSTORE_CDC_SNAPSHOT,
+        KVSTORE_CDC_SNAPSHOT_END
+};
+
+struct _kvstore_change {
+        uint64_t         seq;
+        KVSTORE_OP       op;
+        size_t           key_len;
+        size_t           val_len;
+        char            *key;
+};
+
+struct _cdc_record {
+        uint64_t         seq;
+        uint32_t         type;
+        uint32_t         key_len;
+        uint32_t         val_len;
+        uint32_t         pad;
+};
+
+struct _kvstore_cdc {
+        struct _kvstore_change  *ring;
+        size_t                   entries;
+        uint64_t                 seq;
+        int                      snapshot;
+        char                    *buf;
+        size_t                   buf_len;
+        size_t                   buf_cap;
+};
+
+
+static struct _kvstore_cdc
+                *_cdc_alloc(kvstore);
+static int       _cdc_reserve(char **, size_t *, size_t);
+static int       _cdc_put(char **, size_t *, size_t *, uint64_t, uint32_t,
+                    const char *, size_t, const char *, size_t);
+static int       _cdc_write(int, const char *, size_t);
+static void      _cdc_clear(kvstore);
+
+
+struct _kvstore_cdc *
+_cdc_alloc(kvstore kvs)
+{
+        if (NULL == kvs->cdc) {
+                kvs->cdc = (struct _kvstore_cdc *)calloc(1,
+                    sizeof(struct _kvstore_cdc));
+        }
+        return kvs->cdc;
+}
+
+
+int
+_cdc_reserve(char **buf, size_t *cap, size_t len)
+{
+        char    *nbuf;
+        size_t   ncap;
+
+        if (len <= *cap)
+                return 0;
+        ncap = *cap ? *cap : 4096;
+        while (ncap < len)
+                ncap *= 2;
+        if (NULL == (nbuf = (char *)realloc(*buf, ncap)))
+                return -1;
+        *buf = nbuf;
+        *cap = ncap;
+        return 0;
+}
+
+
+int
+_cdc_put(char **buf, size_t *len, size_t *cap, uint64_t seq, uint32_t type,
+    const char *key, size_t klen, const char *val, size_t vlen)
+{
+        struct _cdc_record       rec;
+        size_t                   n;
+
+        n = sizeof(rec) + klen + vlen;
+        if (_cdc_reserve(buf, cap, *len + n))
+                return -1;
+        memset(&rec, 0x0, sizeof(rec));
+        rec.seq = seq;
+        rec.type = type;
+        rec.key_len = (uint32_t)klen;
+        rec.val_len = (uint32_t)vlen;
+        memcpy(*buf + *len, &rec, sizeof(rec));
+        if (klen)
+                memcpy(*buf + *len + sizeof(rec), key, klen);
+        if (vlen)
+                memcpy(*buf + *len + sizeof(rec) + klen, val, vlen);
+        *len += n;
+        return 0;
+}
+
+
+int
+_cdc_write(int fd, const char *buf, size_t len)
+{
+        ssize_t n;
+
+        while (len > 0) {
+                n = write(fd, buf, len);
+                if (-1 == n) {
+                        if (EINTR == errno)
+                                continue;
+                        return -1;
+                }
+                buf += n;
+                len -= (size_t)n;
+        }
+        return 0;
+}
+
+
+void
+_cdc_clear(kvstore kvs)
+{
+        struct _kvstore_kv      *kv;
+
+        while (NULL != (kv = TAILQ_FIRST(kvs->queue))) {
+                _kvstore_unlink(kvs, kv->key, kv->key_len, kv->hash);
+                if (NULL != kvs->watch)
+                        _kvstore_watch_notify(kvs, kv->key, kv->key_len);
+                if (NULL != kvs->hot)
+                        _kvstore_hot_write(kvs, kv->key, kv->key_len);
+                _kvstore_retire_kv(kvs, kv);
+        }
+}
+
+
+/*
+ * kvstore_cdc_init starts recording changes in a ring of the given
+ * number of entries.
+ */
+int
+kvstore_cdc_init(kvstore kvs, size_t entries)
+{
+        struct _kvstore_cdc     *cdc;
+        struct _kvstore_change  *ring;
+
+        if ((NULL == kvs) || (0 == entries) || (NULL != kvs->soa) ||
+            (0 != kvs->chunk_size))
+                return -1;
+        if (NULL == (ring = (struct _kvstore_change *)calloc(entries,
+            sizeof(struct _kvstore_change))))
+                return -1;
+        if (_acquire_kvstore(kvs)) {
+                free(ring);
+                return -1;
+        }
+        if ((NULL == (cdc = _cdc_alloc(kvs))) || (NULL != cdc->ring)) {
+                _unlock_kvstore(kvs);
+                free(ring);
+                return -1;
+        }
+        cdc->ring = ring;
+        cdc->entries = entries;
+        return _unlock_kvstore(kvs);
+}
+
+
+/*
+ * _kvstore_cdc_log is called with the store locked after a set or del
+ * has succeeded. If the copy cannot be made the slot is left empty, and
+ * a follower that needs it will be sent a snapshot.
+ */
+void
+_kvstore_cdc_log(kvstore kvs, KVSTORE_OP op, char *key, char *val)
+{
+        struct _kvstore_cdc     *cdc = kvs->cdc;
+        struct _kvstore_change  *c;
+        size_t                   klen, vlen = 0;
+
+        if (NULL == cdc->ring)
+                return;
+        cdc->seq++;
+        c = &cdc->ring[cdc->seq % cdc->entries];
+        free(c->key);
+        memset(c, 0x0, sizeof(struct _kvstore_change));
+
+        klen = strlen(key);
+        if (KVSTORE_OP_SET == op)
+                vlen = strlen(val);
+        if (NULL == (c->key = (char *)malloc(klen + vlen)))
+                return;
+        memcpy(c->key, key, klen);
+        if (KVSTORE_OP_SET == op)
+                memcpy(c->key + klen, val, vlen);
+        c->seq = cdc->seq;
+        c->op = op;
+        c->key_len = klen;
+        c->val_len = vlen;
+}
+
+
+/*
+ * kvstore_cdc_seq returns the sequence number of the last change
+ * recorded by a store with a change ring, or of the last change applied
+ * by a follower.
+ */
+uint64_t
+kvstore_cdc_seq(kvstore kvs)
+{
+        uint64_t        seq = 0;
+
+        if ((NULL == kvs) || _acquire_kvstore(kvs))
+                return 0;
+        if (NULL != kvs->cdc)
+                seq = kvs->cdc->seq;
+        _unlock_kvstore(kvs);
+        return seq;
+}
+
+
+/*
+ * kvstore_cdc_send writes every change after *seq to fd and advances
+ * *seq. If some of them have already left the ring, it writes a snapshot
+ * of the store as of the latest change instead. The records are built
+ * with the store locked and written after it is released. Returns the
+ * number of records written.
+ */
+ssize_t
+kvstore_cdc_send(kvstore kvs, int fd, uint64_t *seq)
+{
+        struct _kvstore_cdc     *cdc;
+        struct _kvstore_change  *c;
+        struct _kvstore_kv      *kv;
+        char                    *buf = NULL;
+        size_t                   len = 0, cap = 0;
+        ssize_t                  n = 0;
+        uint64_t                 s, last;
+        int                      snapshot = 0;
+
+        if ((NULL == kvs) || (NULL == seq))
+                return -1;
+        if (_acquire_kvstore(kvs))
+                return -1;
+        if ((NULL == (cdc = kvs->cdc)) || (NULL == cdc->ring)) {
+                _unlock_kvstore(kvs);
+                return -1;
+        }
+
+        last = cdc->seq;
+        if ((*seq > last) || (last - *seq > cdc->entries))
+                snapshot = 1;
+        for (s = *seq + 1; !snapshot && s <= last; s++) {
+                c = &cdc->ring[s % cdc->entries];
+                if ((c->seq != s) || (NULL == c->key))
+                        snapshot = 1;
+        }
+
+        if (snapshot) {
+                if (_cdc_put(&buf, &len, &cap, last, KVSTORE_CDC_SNAPSHOT,
+                    NULL, 0, NULL, 0))
+                        goto send_fail;
+                n++;
+                TAILQ_FOREACH(kv, kvs->queue, entries) {
+                        if (NULL == kv->val)
+                                continue;
+                        if (_cdc_put(&buf, &len, &cap, last,
+                            KVSTORE_CDC_SET, kv->key, kv->key_len, kv->val,
+                            kv->val_len))
+                                goto send_fail;
+                        n++;
+                }
+                if (_cdc_put(&buf, &len, &cap, last,
+                    KVSTORE_CDC_SNAPSHOT_END, NULL, 0, NULL, 0))
+                        goto send_fail;
+                n++;
+        } else {
+                for (s = *seq + 1; s <= last; s++) {
+                        c = &cdc->ring[s % cdc->entries];
+                        if (_cdc_put(&buf, &len, &cap, s,
+                            KVSTORE_OP_SET == c->op ? KVSTORE_CDC_SET :
+                            KVSTORE_CDC_DEL, c->key, c->key_len,
+                            c->key + c->key_len, c->val_len))
+                                goto send_fail;
+                        n++;
+                }
+        }
+        _unlock_kvstore(kvs);
+
+        if (_cdc_write(fd, buf, len)) {
+                free(buf);
+                return -1;
+        }
+        free(buf);
+        *seq = last;
+        return n;
+
+send_fail:
+        _unlock_kvstore(kvs);
+        free(buf);
+        return -1;
+}
+
+
+/*
+ * kvstore_cdc_recv reads what is available on fd, blocking only if
+ * nothing is, and applies every complete record. A snapshot record
+ * empties the store first, so the follower must be an in-memory store.
+ * The follower's sequence number only moves once a change, or a whole
+ * snapshot, has been applied. Returns the number of records applied, 0
+ * at end of file and -1 on error; a partial record, or one that could
+ * not be applied, is kept for the next call.
+ */
+ssize_t
+kvstore_cdc_recv(kvstore kvs, int fd)
+{
+        struct _kvstore_cdc     *cdc;
+        struct _cdc_record       rec;
+        char                    *p, *key, *val;
+        size_t                   off = 0;
+        ssize_t                  n, applied = 0;
+        int                      failed = 0;
+
+        if ((NULL == kvs) || (NULL != kvs->bc) || (NULL != kvs->lsm) ||
+            (NULL != kvs->soa))
+                return -1;
+        if (_acquire_kvstore(kvs))
+                return -1;
+        cdc = _cdc_alloc(kvs);
+        if ((NULL == cdc) ||
+            _cdc_reserve(&cdc->buf, &cdc->buf_cap,
+            cdc->buf_len + KVSTORE_CDC_READ)) {
+                _unlock_kvstore(kvs);
+                return -1;
+        }
+        _unlock_kvstore(kvs);
+
+        do {
+                n = read(fd, cdc->buf + cdc->buf_len, KVSTORE_CDC_READ);
+        } while ((-1 == n) && (EINTR == errno));
+        if (n <= 0)
+                return n;
+        cdc->buf_len += (size_t)n;
+
+        if (_acquire_kvstore(kvs))
+                return -1;
+        while (cdc->buf_len - off >= sizeof(rec)) {
+                p = cdc->buf + off;
+                memcpy(&rec, p, sizeof(rec));
+                if (cdc->buf_len - off < sizeof(rec) + rec.key_len +
+                    rec.val_len)
+                        break;
+
+                /*
+                 * Keys and values are not terminated on the wire, and
+                 * the buffer may be reallocated by the next read, so
+                 * they are copied out.
+                 */
+                key = strndup(p + sizeof(rec), rec.key_len);
+                val = NULL;
+                if (KVSTORE_CDC_SET == rec.type)
+                        val = strndup(p + sizeof(rec) + rec.key_len,
+                            rec.val_len);
+                switch (rec.type) {
+                case KVSTORE_CDC_SNAPSHOT:
+                        _cdc_clear(kvs);
+                        cdc->snapshot = 1;
+                        cdc->seq = 0;
+                        break;
+                case KVSTORE_CDC_SNAPSHOT_END:
+                        cdc->snapshot = 0;
+                        cdc->seq = rec.seq;
+                        break;
+                case KVSTORE_CDC_SET:
+                        if ((NULL == key) || (NULL == val) ||
+                            _kvstore_set(kvs, key, val))
+                                failed = 1;
+                        break;
+                case KVSTORE_CDC_DEL:
+                        /* The key may already be gone; that is fine. */
+                        if (NULL == key)
+                                failed = 1;
+                        else
+                                _kvstore_del(kvs, key);
+                        break;
+                default:
+                        failed = 1;
+                        break;
+                }
+                free(key);
+                free(val);
+                if (failed)
+                        break;
+                if (((KVSTORE_CDC_SET == rec.type) ||
+                    (KVSTORE_CDC_DEL == rec.type)) && !cdc->snapshot)
+                        cdc->seq = rec.seq;
+                off += sizeof(rec) + rec.key_len + rec.val_len;
+                applied++;
+        }
+        memmove(cdc->buf, cdc->buf + off, cdc->buf_len - off);
+        cdc->buf_len -= off;
+        _unlock_kvstore(kvs);
+        return failed ? -1 : applied;
+}
+
+
+void
+_kvstore_cdc_free(kvstore kvs)
+{
+        struct _kvstore_cdc     *cdc = kvs->cdc;
+        size_t                   i;
+
+        if (NULL == cdc)
+                return;
+        for (i = 0; i < cdc->entries; i++)
+                free(cdc->ring[i].key);
+        free(cdc->ring);
+        free(cdc->buf);
+        free(cdc);
+        kvs->cdc = NULL;
+}
@@ -0,0 +1,404 @@
+/*
+ * Copyright (c) 2013 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+ * OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ * ---------------------------------------------------------------------
+ */
+
+
+
+/*
+ * Values longer than max_vallen, in in-memory stores that allow them
+ * with KVSTORE_CHUNK_SIZE, are held out of line as a table of pointers
+ * to fixed-size chunks rather than as one allocation. Such an entry has
+ * no val, and its val_len is the length of the whole value. Rewriting a
+ * chunked value only stores into the chunks whose bytes changed, and
+ * appending or overwriting part of one only touches the chunks the new
+ * bytes fall in, so neither ever moves the rest of the value.
+ */
+
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kv.h"
+#include "kv_int.h"
+
+
+const size_t     KVSTORE_DEFAULT_MAX_CHUNKED_VALLEN = 256 * 1024 * 1024;
+static const size_t      KVSTORE_CHUNK_MIN = 64;
+
+
+struct _kvstore_chunks {
+        size_t           size;
+        size_t           n;
+        size_t           cap;
+        char           **chunk;
+};
+
+
+static struct _kvstore_chunks
+                *_chunks_new(size_t);
+static int       _chunks_reserve(struct _kvstore_chunks *, size_t);
+static void      _chunks_trim(struct _kvstore_chunks *, size_t);
+static void      _chunks_write(struct _kvstore_chunks *, size_t,
+                    const char *, size_t, size_t);
+
+
+struct _kvstore_chunks *
+_chunks_new(size_t size)
+{
+        struct _kvstore_chunks  *ch;
+
+        ch = (struct _kvstore_chunks *)calloc(1,
+            sizeof(struct _kvstore_chunks));
+        if (NULL != ch)
+                ch->size = size;
+        return ch;
+}
+
+
+void
+_kvstore_chunks_free(struct _kvstore_chunks *ch)
+{
+        size_t  i;
+
+        if (NULL == ch)
+                return;
+        for (i = 0; i < ch->n; i++)
+                free(ch->chunk[i]);
+        free(ch->chunk);
+        free(ch);
+}
+
+
+/*
+ * _chunks_reserve makes sure there are chunks for len bytes, growing the
+ * table geometrically so that appending one chunk at a time is cheap.
+ */
+int
+_chunks_reserve(struct _kvstore_chunks *ch, size_t len)
+{
+        size_t   need, cap;
+        char   **chunk;
+
+        need = (len + ch->size - 1) / ch->size;
+        if (need > ch->cap) {
+                cap = ch->cap * 2 > need ? ch->cap * 2 : need;
+                chunk = (char **)realloc(ch->chunk, cap * sizeof(char *));
+                if (NULL == chunk)
+                        return -1;
+                ch->chunk = chunk;
+                ch->cap = cap;
+        }
+        for (; ch->n < need; ch->n++) {
+                if (NULL == (ch->chunk[ch->n] = (char *)malloc(ch->size)))
+                        return -1;
+        }
+        return 0;
+}
+
+
+void
+_chunks_trim(struct _kvstore_chunks *ch, size_t len)
+{
+        size_t  need;
+
+        need = (len + ch->size - 1) / ch->size;
+        while (ch->n > need)
+                free(ch->chunk[--ch->n]);
+}
+
+
+/*
+ * _chunks_write copies data into the value at off. Pieces that fall
+ * within the first old_len bytes, which hold the value being replaced,
+ * are only stored if they differ from what is there.
+ */
+void
+_chunks_write(struct _kvstore_chunks *ch, size_t off, const char *data,
+    size_t len, size_t old_len)
+{
+        size_t   i, at, n;
+        char    *dst;
+
+        while (len > 0) {
+                i = off / ch->size;
+                at = off % ch->size;
+                n = ch->size - at < len ? ch->size - at : len;
+                dst = ch->chunk[i] + at;
+                if ((off + n > old_len) || (0 != memcmp(dst, data, n)))
+                        memcpy(dst, data, n);
+                off += n;
+                data += n;
+                len -= n;
+        }
+}
+
+
+/*
+ * _kvstore_chunk_set stores the concatenation of iov, len bytes in all,
+ * as key's value in chunks. A value that is already chunked the same way
+ * is rewritten where it differs; otherwise a new table is built and
+ * replaces whatever the key held.
+ */
+int
+_kvstore_chunk_set(kvstore kvs, char *key, size_t klen, uint64_t hash,
+    const struct iovec *iov, int iovcnt, size_t len)
+{
+        struct _kvstore_chunks  *ch;
+        struct _kvstore_kv      *kv;
+        size_t                   off = 0, old_len = 0;
+        int                      i;
+
+        if ((0 == kvs->chunk_size) || (len > kvs->max_chunked))
+                return -1;
+        kv = _kvstore_find(kvs, key, klen, hash);
+        if ((NULL != kv) && (NULL != kv->chunks) &&
+            (kv->chunks->size == kvs->chunk_size)) {
+                ch = kv->chunks;
+                old_len = kv->val_len;
+        } else if (NULL == (ch = _chunks_new(kvs->chunk_size))) {
+                return -1;
+        }
+        if (_chunks_reserve(ch, len)) {
+                if ((NULL != kv) && (ch == kv->chunks))
+                        _chunks_trim(ch, old_len);
+                else
+                        _kvstore_chunks_free(ch);
+                return -1;
+        }
+        for (i = 0; i < iovcnt; i++) {
+                _chunks_write(ch, off, (const char *)iov[i].iov_base,
+                    iov[i].iov_len, old_len);
+                off += iov[i].iov_len;
+        }
+        _chunks_trim(ch, len);
+        if ((NULL != kv) && (ch == kv->chunks)) {
+                kv->val_len = len;
+                return 0;
+        }
+
+        if (NULL == kv) {
+                if (NULL == (kv = _kvstore_new_kv(key, klen, hash))) {
+                        _kvstore_chunks_free(ch);
+                        return -1;
+                }
+                _kvstore_link(kvs, kv);
+        }
+        _kvstore_free_val(kvs, kv);
+        _kvstore_chunks_free(kv->chunks);
+        kv->chunks = ch;
+        kv->val_len = len;
+        return 0;
+}
+
+
+/*
+ * _kvstore_chunk_write writes dlen bytes of data into kv's value at
+ * off, which is at most its length, first moving an ordinary value into
+ * chunks if need be.
+ */
+int
+_kvstore_chunk_write(kvstore kvs, struct _kvstore_kv *kv, size_t off,
+    const char *data, size_t dlen)
+{
+        struct _kvstore_chunks  *ch = kv->chunks;
+        size_t                   len;
+
+        len = off + dlen > kv->val_len ? off + dlen : kv->val_len;
+        if (len > kvs->max_chunked)
+                return -1;
+        if (NULL == ch) {
+                if (NULL == (ch = _chunks_new(kvs->chunk_size)))
+                        return -1;
+                if (_chunks_reserve(ch, len)) {
+                        _kvstore_chunks_free(ch);
+                        return -1;
+                }
+                _chunks_write(ch, 0, kv->val, kv->val_len, 0);
+                _kvstore_free_val(kvs, kv);
+                kv->chunks = ch;
+        } else if (_chunks_reserve(ch, len)) {
+                _chunks_trim(ch, kv->val_len);
+                return -1;
+        }
+        _chunks_write(ch, off, data, dlen, 0);
+        kv->val_len = len;
+        return 0;
+}
+
+
+/*
+ * _kvstore_chunk_read copies up to len bytes of kv's value from off into
+ * buf and returns how many it copied.
+ */
+size_t
+_kvstore_chunk_read(struct _kvstore_kv *kv, size_t off, size_t len,
+    char *buf)
+{
+        struct _kvstore_chunks  *ch = kv->chunks;
+        size_t                   total, at, n;
+
+        if (off >= kv->val_len)
+                return 0;
+        if (len > kv->val_len - off)
+                len = kv->val_len - off;
+        for (total = 0; total < len; total += n) {
+                at = off % ch->size;
+                n = ch->size - at < len - total ? ch->size - at : len - total;
+                memcpy(buf + total, ch->chunk[off / ch->size] + at, n);
+                off += n;
+        }
+        return len;
+}
+
+
+/*
+ * _kvstore_chunk_dup returns a terminated copy of key's value, in one
+ * piece, if the value is held in chunks, for the calls that hand values
+ * out whole. It returns NULL if it is not, or with errno set to ENOMEM
+ * if the copy could not be made.
+ */
+char *
+_kvstore_chunk_dup(kvstore kvs, char *key)
+{
+        struct _kvstore_kv      *kv;
+        char                    *val;
+
+        if ((0 == kvs->chunk_size) ||
+            (NULL == (kv = _kvstore_lookup(kvs, key))) ||
+            (NULL == kv->chunks))
+                return NULL;
+        if (NULL == (val = (char *)malloc(kv->val_len + 1)))
+                return NULL;
+        _kvstore_chunk_read(kv, 0, kv->val_len, val);
+        val[kv->val_len] = 0;
+        return val;
+}
+
+
+int
+_kvstore_chunk_config(kvstore kvs, KVSTORE_CONFIG_OPT opt, size_t val)
+{
+        if ((NULL != kvs->bc) || (NULL != kvs->lsm) || (NULL != kvs->shm) ||
+            (NULL != kvs->soa) || (NULL != kvs->frozen) || (NULL != kvs->cdc) ||
+            (NULL != kvs->hot))
+                return -1;
+        if (KVSTORE_MAX_CHUNKED_VALLEN == opt) {
+                kvs->max_chunked = val;
+                return 0;
+        }
+        if (val < KVSTORE_CHUNK_MIN)
+                return -1;
+        kvs->chunk_size = val;
+        return 0;
+}
+
+
+/*
+ * kvstore_setv sets key's value to the concatenation of the iovecs. A
+ * value longer than max_vallen is stored in chunks, if the store allows
+ * it; anything shorter is stored as kvstore_set would.
+ */
+int
+kvstore_setv(kvstore kvs, char *key, const struct iovec *iov, int iovcnt)
+{
+        uint64_t         hash;
+        size_t           klen, len = 0, off = 0;
+        char            *val;
+        int              i, retval = -1;
+
+        if ((NULL == kvs) || (NULL == key) || (NULL == iov) || (iovcnt < 0))
+                return -1;
+        for (i = 0; i < iovcnt; i++)
+                len += iov[i].iov_len;
+        if (len <= kvs->max_vallen) {
+                if (NULL == (val = (char *)malloc(len + 1)))
+                        return -1;
+                for (i = 0; i < iovcnt; off += iov[i].iov_len, i++)
+                        memcpy(val + off, iov[i].iov_base, iov[i].iov_len);
+                val[len] = 0;
+                retval = kvstore_set(kvs, key, val);
+                free(val);
+                return retval;
+        }
+
+        klen = strnlen(key, kvs->max_keylen + 1);
+        if (((kvs->max_keylen + 1) == klen) || (0 == klen))
+                return -1;
+        if (NULL != kvs->wc)
+                kvstore_wc_sync(kvs);
+        if (_acquire_kvstore(kvs))
+                return -1;
+        hash = _kvstore_hash(kvs, key, klen);
+        if (NULL != kvs->rcache)
+                _kvstore_rcache_bump(kvs, hash);
+        retval = _kvstore_chunk_set(kvs, key, klen, hash, iov, iovcnt, len);
+        if ((0 == retval) && (NULL != kvs->watch))
+                _kvstore_watch_notify(kvs, key, klen);
+        _unlock_kvstore(kvs);
+        return retval;
+}
+
+
+/*
+ * kvstore_getv points the iovecs at the pieces of key's value, in order,
+ * and returns how many pieces there are; if that is more than iovcnt,
+ * only the first iovcnt are filled in. An ordinary value is one piece
+ * and a chunked one has a piece per chunk. The pieces are valid until
+ * the key is next changed. It fails with errno set to ENOENT if the key
+ * is not present.
+ */
+ssize_t
+kvstore_getv(kvstore kvs, char *key, struct iovec *iov, int iovcnt)
+{
+        struct _kvstore_kv      *kv = NULL;
+        struct _kvstore_chunks  *ch;
+        size_t                   len = 0, i;
+        ssize_t                  retval;
+        char                    *val;
+
+        if ((NULL == kvs) || (NULL == key) || ((NULL == iov) && (0 < iovcnt)))
+                return -1;
+        if (_acquire_kvstore(kvs))
+                return -1;
+        if (NULL != (val = _kvstore_get(kvs, key, &len))) {
+                if (0 < iovcnt) {
+                        iov[0].iov_base = val;
+                        iov[0].iov_len = len;
+                }
+                retval = 1;
+        } else if ((NULL == kvs->bc) && (NULL == kvs->lsm) &&
+            (NULL == kvs->shm) && (NULL == kvs->soa) &&
+            (NULL != (kv = _kvstore_lookup(kvs, key))) &&
+            (NULL != (ch = kv->chunks))) {
+                for (i = 0; (i < ch->n) && (i < (size_t)iovcnt); i++) {
+                        iov[i].iov_base = ch->chunk[i];
+                        iov[i].iov_len = ch->size;
+                        if (i == ch->n - 1)
+                                iov[i].iov_len = kv->val_len - i * ch->size;
+                }
+                retval = (ssize_t)ch->n;
+        } else {
+                errno = ENOENT;
+                retval = -1;
+        }
+        _unlock_kvstore(kvs);
+        return retval;
+}
@@ -0,0 +1,223 @@
+/*
+ * Copyright (c) 2013 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+ * OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ * ---------------------------------------------------------------------
+ */
+
+
+
+/*
+ * Value deduplication. With KVSTORE_DEDUP set, a value at least that
+ * long is interned: it is looked up by content in a pool, and entries
+ * holding the same bytes share one reference-counted copy. A pooled
+ * value is never written through; an append or range write gives the
+ * entry a private copy first. An entry holding a pooled value has
+ * val_cap 0, and the copy is freed when its last entry lets go.
+ *
+ * The pool is hashed with the store's own hash, so it is as hard to
+ * flood as the index. It is only touched with the store locked, and it
+ * lasts until the store is discarded, even if interning is turned off.
+ */
+
+
+#include <sys/types.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kv.h"
+#include "kv_int.h"
+
+
+static const size_t      KVSTORE_DEDUP_INITIAL = 256;
+
+
+struct _dedup_val {
+        struct _dedup_val       *next;
+        uint64_t                 hash;
+        size_t                   len;
+        size_t                   refs;
+        char                     val[];
+};
+
+struct _kvstore_dedup {
+        struct _dedup_val      **buckets;
+        size_t                   size;
+        struct kvstore_dedup_stats
+                                 stats;
+};
+
+
+static int       _dedup_grow(struct _kvstore_dedup *);
+
+
+int
+_dedup_grow(struct _kvstore_dedup *dd)
+{
+        struct _dedup_val       **buckets, *dv, *next;
+        size_t                    i, size = dd->size * 2;
+
+        buckets = (struct _dedup_val **)calloc(size,
+            sizeof(struct _dedup_val *));
+        if (NULL == buckets)
+                return -1;
+        for (i = 0; i < dd->size; i++) {
+                for (dv = dd->buckets[i]; NULL != dv; dv = next) {
+                        next = dv->next;
+                        dv->next = buckets[dv->hash & (size - 1)];
+                        buckets[dv->hash & (size - 1)] = dv;
+                }
+        }
+        free(dd->buckets);
+        dd->buckets = buckets;
+        dd->size = size;
+        return 0;
+}
+
+
+/*
+ * _kvstore_dedup_intern returns the pooled copy of the vlen bytes at
+ * val, adding them to the pool if they are not there yet, and takes a
+ * reference to it for the caller.
+ */
+char *
+_kvstore_dedup_intern(kvstore kvs, const char *val, size_t vlen)
+{
+        struct _kvstore_dedup   *dd = kvs->dedup;
+        struct _dedup_val       *dv, **bucket;
+        uint64_t                 hash;
+
+        hash = _kvstore_hash(kvs, val, vlen);
+        bucket = &dd->buckets[hash & (dd->size - 1)];
+        for (dv = *bucket; NULL != dv; dv = dv->next) {
+                if ((dv->hash == hash) && (dv->len == vlen) &&
+                    (0 == memcmp(dv->val, val, vlen))) {
+                        dv->refs++;
+                        dd->stats.refs++;
+                        dd->stats.saved += vlen + 1;
+                        return dv->val;
+                }
+        }
+
+        if ((dd->stats.values >= dd->size) && (0 == _dedup_grow(dd)))
+                bucket = &dd->buckets[hash & (dd->size - 1)];
+        dv = (struct _dedup_val *)malloc(sizeof(struct _dedup_val) + vlen +
+            1);
+        if (NULL == dv)
+                return NULL;
+        dv->hash = hash;
+        dv->len = vlen;
+        dv->refs = 1;
+        memcpy(dv->val, val, vlen);
+        dv->val[vlen] = 0;
+        dv->next = *bucket;
+        *bucket = dv;
+        dd->stats.values++;
+        dd->stats.refs++;
+        dd->stats.bytes += sizeof(struct _dedup_val) + vlen + 1;
+        return dv->val;
+}
+
+
+/*
+ * _kvstore_dedup_release drops a reference to a pooled value, freeing
+ * it if that was the last.
+ */
+void
+_kvstore_dedup_release(kvstore kvs, char *val)
+{
+        struct _kvstore_dedup   *dd = kvs->dedup;
+        struct _dedup_val       *dv, **dvp;
+
+        dv = (struct _dedup_val *)(val - offsetof(struct _dedup_val, val));
+        dd->stats.refs--;
+        if (0 != --dv->refs) {
+                dd->stats.saved -= dv->len + 1;
+                return;
+        }
+        dvp = &dd->buckets[dv->hash & (dd->size - 1)];
+        while (*dvp != dv)
+                dvp = &(*dvp)->next;
+        *dvp = dv->next;
+        dd->stats.values--;
+        dd->stats.bytes -= sizeof(struct _dedup_val) + dv->len + 1;
+        free(dv);
+}
+
+
+/*
+ * _kvstore_dedup_config sets the shortest value to intern; 0 stops
+ * interning new values.
+ */
+int
+_kvstore_dedup_config(kvstore kvs, size_t min)
+{
+        struct _kvstore_dedup   *dd;
+
+        if ((NULL != kvs->bc) || (NULL != kvs->lsm) || (NULL != kvs->shm) ||
+            (NULL != kvs->soa) || (NULL != kvs->frozen))
+                return -1;
+        if ((0 != min) && (NULL == kvs->dedup)) {
+                dd = (struct _kvstore_dedup *)calloc(1,
+                    sizeof(struct _kvstore_dedup));
+                if (NULL == dd)
+                        return -1;
+                dd->buckets = (struct _dedup_val **)calloc(
+                    KVSTORE_DEDUP_INITIAL, sizeof(struct _dedup_val *));
+                if (NULL == dd->buckets) {
+                        free(dd);
+                        return -1;
+                }
+                dd->size = KVSTORE_DEDUP_INITIAL;
+                kvs->dedup = dd;
+        }
+        kvs->dedup_min = min;
+        return 0;
+}
+
+
+int
+kvstore_dedup_stats(kvstore kvs, struct kvstore_dedup_stats *st)
+{
+        if ((NULL == kvs) || (NULL == st) || (NULL == kvs->dedup))
+                return -1;
+        if (_acquire_kvstore(kvs))
+                return -1;
+        *st = kvs->dedup->stats;
+        return _unlock_kvstore(kvs);
+}
+
+
+void
+_kvstore_dedup_free(kvstore kvs)
+{
+        struct _kvstore_dedup   *dd = kvs->dedup;
+        struct _dedup_val       *dv, *next;
+        size_t                   i;
+
+        if (NULL == dd)
+                return;
+        for (i = 0; i < dd->size; i++) {
+                for (dv = dd->buckets[i]; NULL != dv; dv = next) {
+                        next = dv->next;
+                        free(dv);
+                }
+        }
+        free(dd->buckets);
+        free(dd);
+        kvs->dedup = NULL;
+}
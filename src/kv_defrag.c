@@ -0,0 +1,516 @@
+/*
+ * Copyright (c) 2013 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+ * OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ * ---------------------------------------------------------------------
+ */
+
+
+/*
+ * Online defragmentation. Each pass first walks the index a few buckets
+ * at a time, noting where every entry's value lives, and sorts the
+ * notes by address. It then goes through them from the bottom of the
+ * heap up, moving each entry's node, key and value into fresh
+ * allocations and relinking it in place of the old one. Moving entries
+ * in address order fills the holes low in the heap and leaves whole
+ * pages empty further up; at the end of the pass those are handed back
+ * to the kernel.
+ *
+ * An entry is found again by its hash and the address of its value, so
+ * nothing is left pointing at entries deleted between steps.
+ */
+
+
+#include <sys/types.h>
+#include <errno.h>
+#ifdef HAVE_MALLOC_H
+#include <malloc.h>
+#endif
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "kv.h"
+#include "kv_int.h"
+
+
+static const size_t      KVSTORE_DEFRAG_BATCH = 256;
+static const size_t      KVSTORE_DEFRAG_RATIO = 2;
+static const long        KVSTORE_DEFRAG_PAUSE_MS = 1;
+static const long        KVSTORE_DEFRAG_IDLE_MS = 10000;
+
+
+struct _defrag_ref {
+        uintptr_t        addr;
+        uint64_t         hash;
+};
+
+struct _kvstore_defrag {
+        pthread_mutex_t                 busy;
+        int                             moving;
+        size_t                          cursor;
+        struct _defrag_ref             *refs;
+        size_t                          nrefs;
+        size_t                          cap;
+        size_t                          live;
+        struct kvstore_defrag_stats     stats;
+        int                             started;
+        int                             stop;
+        sem_t                           wake;
+        pthread_t                       worker;
+};
+
+
+static int       _defrag_init(kvstore);
+static uintptr_t _defrag_addr(struct _kvstore_kv *);
+static int       _defrag_cmp(const void *, const void *);
+static size_t    _defrag_collect(kvstore, size_t, int *);
+static struct _kvstore_kv
+                *_defrag_move(kvstore, struct _kvstore_kv **);
+static size_t    _defrag_relocate(kvstore, size_t, int *);
+static size_t    _defrag_rss(void);
+static size_t    _defrag_holes(void);
+static void      _defrag_trim(kvstore);
+static ssize_t   _defrag_step(kvstore, size_t);
+static void     *_defrag_worker(void *);
+
+
+int
+_defrag_init(kvstore kvs)
+{
+        struct _kvstore_defrag  *df;
+
+        df = (struct _kvstore_defrag *)malloc(sizeof(struct _kvstore_defrag));
+        if (NULL == df)
+                return -1;
+        memset(df, 0x0, sizeof(struct _kvstore_defrag));
+        if (sem_init(&df->wake, 0, 0)) {
+                free(df);
+                return -1;
+        }
+        pthread_mutex_init(&df->busy, NULL);
+        kvs->defrag = df;
+        return 0;
+}
+
+
+/*
+ * An entry is placed by its value, the largest of its allocations, or by
+ * its node for an LSM tombstone.
+ */
+uintptr_t
+_defrag_addr(struct _kvstore_kv *kv)
+{
+        return (uintptr_t)(NULL == kv->val ? (void *)kv : (void *)kv->val);
+}
+
+
+int
+_defrag_cmp(const void *a, const void *b)
+{
+        const struct _defrag_ref *ra = (const struct _defrag_ref *)a;
+        const struct _defrag_ref *rb = (const struct _defrag_ref *)b;
+
+        if (ra->addr == rb->addr)
+                return 0;
+        return ra->addr < rb->addr ? -1 : 1;
+}
+
+
+/*
+ * _defrag_collect notes the entries of the next few buckets, stopping
+ * after budget entries or ten times as many empty buckets. A rehash
+ * reshapes the buckets under the cursor, so nothing is done until it
+ * finishes. *done is set once the whole table has been seen.
+ */
+size_t
+_defrag_collect(kvstore kvs, size_t budget, int *done)
+{
+        struct _kvstore_defrag  *df = kvs->defrag;
+        struct _kvstore_table   *t = &kvs->table[0];
+        struct _defrag_ref      *refs;
+        struct _kvstore_kv      *kv;
+        size_t                   seen = 0, visits = budget * 10, cap;
+
+        *done = 0;
+        if (-1 != kvs->rehash)
+                return 0;
+        while ((seen < budget) && (0 != visits--)) {
+                if (df->cursor >= t->size) {
+                        *done = 1;
+                        break;
+                }
+                kv = t->buckets[df->cursor++];
+                for (; NULL != kv; kv = kv->next) {
+                        if (df->nrefs == df->cap) {
+                                cap = 0 == df->cap ? 1024 : df->cap * 2;
+                                refs = (struct _defrag_ref *)realloc(df->refs,
+                                    cap * sizeof(struct _defrag_ref));
+                                if (NULL == refs) {
+                                        *done = 1;
+                                        return seen;
+                                }
+                                df->refs = refs;
+                                df->cap = cap;
+                        }
+                        df->refs[df->nrefs].addr = _defrag_addr(kv);
+                        df->refs[df->nrefs].hash = kv->hash;
+                        df->nrefs++;
+                        df->live += sizeof(struct _kvstore_kv) +
+                            kv->key_len + kv->val_len + 2;
+                        seen++;
+                }
+        }
+        return seen;
+}
+
+
+/*
+ * _defrag_move copies the entry at *kvp into new allocations and swaps
+ * the copy into the bucket chain and the entry list. The original is
+ * returned for the caller to free. A value shared through the dedup
+ * pool is handed to the copy as it is. If memory runs out the entry is
+ * left where it is and NULL is returned.
+ */
+struct _kvstore_kv *
+_defrag_move(kvstore kvs, struct _kvstore_kv **kvp)
+{
+        struct _kvstore_kv      *kv = *kvp, *nkv;
+        char                    *key, *val = NULL;
+        int                      pooled = KVSTORE_VAL_POOLED(kvs, kv);
+
+        nkv = (struct _kvstore_kv *)malloc(sizeof(struct _kvstore_kv));
+        key = (char *)malloc(kv->key_len + 1);
+        if ((NULL != kv->val) && !pooled)
+                val = (char *)malloc(kv->val_len + 1);
+        if ((NULL == nkv) || (NULL == key) ||
+            ((NULL != kv->val) && !pooled && (NULL == val))) {
+                free(nkv);
+                free(key);
+                free(val);
+                return NULL;
+        }
+
+        if (NULL != kvs->rcache)
+                _kvstore_rcache_bump(kvs, kv->hash);
+        *nkv = *kv;
+        nkv->key = key;
+        memcpy(key, kv->key, kv->key_len + 1);
+        if (pooled) {
+                kv->val = NULL;
+        } else {
+                nkv->val = val;
+                nkv->val_cap = NULL == val ? 0 : kv->val_len + 1;
+                if (NULL != val)
+                        memcpy(val, kv->val, kv->val_len + 1);
+        }
+        *kvp = nkv;
+        TAILQ_INSERT_AFTER(kvs->queue, kv, nkv, entries);
+        TAILQ_REMOVE(kvs->queue, kv, entries);
+
+        kvs->defrag->stats.moved++;
+        kvs->defrag->stats.moved_bytes += sizeof(struct _kvstore_kv) +
+            kv->key_len + 1 + (NULL == val ? 0 : kv->val_len + 1);
+        return kv;
+}
+
+
+/*
+ * _defrag_relocate moves the entries behind the next budget notes. The
+ * originals are all freed together once the copies are made: if each
+ * were freed straight away, the next copy would mostly be given the
+ * same memory back. A note whose entry has since been deleted or
+ * rewritten matches nothing and is passed over. *done is set at the end
+ * of the notes.
+ */
+size_t
+_defrag_relocate(kvstore kvs, size_t budget, int *done)
+{
+        struct _kvstore_defrag  *df = kvs->defrag;
+        struct _defrag_ref      *ref;
+        struct _kvstore_kv      *kv, **kvp, *old = NULL, *moved;
+        size_t                   n = 0;
+        int                      i;
+
+        for (; (n < budget) && (df->cursor < df->nrefs); n++) {
+                ref = &df->refs[df->cursor++];
+                for (i = 0; i < 2; i++) {
+                        if (NULL == kvs->table[i].buckets)
+                                break;
+                        kvp = &kvs->table[i].buckets[ref->hash &
+                            kvs->table[i].mask];
+                        for (; NULL != (kv = *kvp); kvp = &kv->next) {
+                                if ((kv->hash == ref->hash) &&
+                                    (_defrag_addr(kv) == ref->addr))
+                                        break;
+                        }
+                        if (NULL != kv) {
+                                if (NULL != (moved = _defrag_move(kvs, kvp))) {
+                                        moved->next = old;
+                                        old = moved;
+                                }
+                                break;
+                        }
+                        if (-1 == kvs->rehash)
+                                break;
+                }
+        }
+        for (; NULL != old; old = kv) {
+                kv = old->next;
+                free(old->key);
+                free(old->val);
+                free(old);
+        }
+        *done = df->cursor == df->nrefs;
+        return n;
+}
+
+
+size_t
+_defrag_rss(void)
+{
+        FILE            *f;
+        unsigned long    size, rss = 0;
+
+        if (NULL == (f = fopen("/proc/self/statm", "r")))
+                return 0;
+        if (2 != fscanf(f, "%lu %lu", &size, &rss))
+                rss = 0;
+        fclose(f);
+        return (size_t)rss * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+
+/*
+ * _defrag_holes returns how much memory the allocator is holding in free
+ * chunks: the space a pass can fill in or give back. Unlike the resident
+ * set, it does not grow with what the rest of the process has in use.
+ * An allocator that reports no heap at all, or a C library without
+ * mallinfo2, cannot say, so every pass is let through.
+ */
+size_t
+_defrag_holes(void)
+{
+#ifdef HAVE_MALLINFO2
+        struct mallinfo2        mi;
+
+        mi = mallinfo2();
+        if ((0 == mi.arena) && (0 == mi.hblkhd))
+                return SIZE_MAX;
+        return mi.fordblks;
+#else
+        return SIZE_MAX;
+#endif
+}
+
+
+/*
+ * _defrag_trim gives the pages freed over the last pass back to the
+ * kernel and counts how much the resident set shrank. Without
+ * malloc_trim, only what the allocator returned by itself is counted.
+ */
+void
+_defrag_trim(kvstore kvs)
+{
+        size_t  before, after;
+
+        before = _defrag_rss();
+#ifdef HAVE_MALLOC_TRIM
+        malloc_trim(0);
+#endif
+        after = _defrag_rss();
+        if ((after < before) && (0 == _acquire_kvstore(kvs))) {
+                kvs->defrag->stats.reclaimed_bytes += before - after;
+                _unlock_kvstore(kvs);
+        }
+}
+
+
+void *
+_defrag_worker(void *arg)
+{
+        kvstore                  kvs = (kvstore)arg;
+        struct _kvstore_defrag  *df = kvs->defrag;
+        struct timespec          ts;
+        long                     ms;
+        ssize_t                  n;
+
+        while (!__atomic_load_n(&df->stop, __ATOMIC_ACQUIRE)) {
+                n = _defrag_step(kvs, KVSTORE_DEFRAG_BATCH);
+                ms = 0 == n ? KVSTORE_DEFRAG_IDLE_MS :
+                    KVSTORE_DEFRAG_PAUSE_MS;
+                clock_gettime(CLOCK_REALTIME, &ts);
+                ts.tv_sec += ms / 1000;
+                ts.tv_nsec += (ms % 1000) * 1000000;
+                if (ts.tv_nsec >= 1000000000) {
+                        ts.tv_sec++;
+                        ts.tv_nsec -= 1000000000;
+                }
+                while ((-1 == sem_timedwait(&df->wake, &ts)) &&
+                    (EINTR == errno))
+                        ;
+        }
+        return NULL;
+}
+
+
+/*
+ * _defrag_step does one bounded piece of the current pass. Steps from
+ * the worker and from kvstore_defrag_step are serialised by busy, which
+ * also lets the notes be sorted without the store locked.
+ */
+ssize_t
+_defrag_step(kvstore kvs, size_t budget)
+{
+        struct _kvstore_defrag  *df = kvs->defrag;
+        size_t                   n;
+        int                      done;
+
+        pthread_mutex_lock(&df->busy);
+        if (_acquire_kvstore(kvs)) {
+                pthread_mutex_unlock(&df->busy);
+                return -1;
+        }
+        if (df->moving)
+                n = _defrag_relocate(kvs, budget, &done);
+        else
+                n = _defrag_collect(kvs, budget, &done);
+        if (done && df->moving)
+                df->stats.cycles++;
+        _unlock_kvstore(kvs);
+
+        /*
+         * A pass only moves anything if the heap holds free space of at
+         * least half the memory the entries need.
+         */
+        if (done && !df->moving) {
+                df->moving = 1;
+                df->cursor = 0;
+                if (_defrag_holes() < df->live / KVSTORE_DEFRAG_RATIO)
+                        df->cursor = df->nrefs;
+                else
+                        qsort(df->refs, df->nrefs,
+                            sizeof(struct _defrag_ref), _defrag_cmp);
+        } else if (done) {
+                free(df->refs);
+                df->refs = NULL;
+                df->nrefs = df->cap = df->live = 0;
+                df->moving = 0;
+                df->cursor = 0;
+                _defrag_trim(kvs);
+        }
+        pthread_mutex_unlock(&df->busy);
+        return done && !df->moving ? 0 : (ssize_t)n;
+}
+
+
+/*
+ * kvstore_defrag_step does up to budget entries' worth of work on the
+ * current pass, for callers that would rather defragment from their own
+ * loop than run the background thread. It returns the number of entries
+ * dealt with, or 0 at the end of a pass or if it had to wait for a
+ * rehash to finish.
+ */
+ssize_t
+kvstore_defrag_step(kvstore kvs, size_t budget)
+{
+        if ((NULL == kvs) || (NULL != kvs->bc) || (NULL != kvs->shm) ||
+            (NULL != kvs->soa) || (NULL != kvs->frozen))
+                return -1;
+        if (_acquire_kvstore(kvs))
+                return -1;
+        if ((NULL == kvs->defrag) && _defrag_init(kvs)) {
+                _unlock_kvstore(kvs);
+                return -1;
+        }
+        _unlock_kvstore(kvs);
+        return _defrag_step(kvs, 0 == budget ? 1 : budget);
+}
+
+
+int
+kvstore_defrag_stats(kvstore kvs, struct kvstore_defrag_stats *stats)
+{
+        if ((NULL == kvs) || (NULL == stats))
+                return -1;
+        if (_acquire_kvstore(kvs))
+                return -1;
+        if (NULL == kvs->defrag)
+                memset(stats, 0x0, sizeof(struct kvstore_defrag_stats));
+        else
+                *stats = kvs->defrag->stats;
+        return _unlock_kvstore(kvs);
+}
+
+
+/*
+ * _kvstore_defrag_config starts or stops the background thread. Like
+ * write combining, it should be set before the store is shared.
+ */
+int
+_kvstore_defrag_config(kvstore kvs, int enable)
+{
+        if ((NULL != kvs->bc) || (NULL != kvs->shm) || (NULL != kvs->soa) ||
+            (NULL != kvs->frozen))
+                return -1;
+        if (!enable) {
+                _kvstore_defrag_stop(kvs);
+                return 0;
+        }
+        if ((NULL == kvs->defrag) && _defrag_init(kvs))
+                return -1;
+        if (kvs->defrag->started)
+                return 0;
+        kvs->defrag->stop = 0;
+        if (pthread_create(&kvs->defrag->worker, NULL, _defrag_worker, kvs))
+                return -1;
+        kvs->defrag->started = 1;
+        return 0;
+}
+
+
+/*
+ * _kvstore_defrag_stop is called with the store unlocked, since the
+ * worker may be waiting for the lock.
+ */
+void
+_kvstore_defrag_stop(kvstore kvs)
+{
+        struct _kvstore_defrag  *df = kvs->defrag;
+
+        if ((NULL == df) || !df->started)
+                return;
+        __atomic_store_n(&df->stop, 1, __ATOMIC_RELEASE);
+        sem_post(&df->wake);
+        pthread_join(df->worker, NULL);
+        df->started = 0;
+}
+
+
+void
+_kvstore_defrag_free(kvstore kvs)
+{
+        if (NULL == kvs->defrag)
+                return;
+        sem_destroy(&kvs->defrag->wake);
+        pthread_mutex_destroy(&kvs->defrag->busy);
+        free(kvs->defrag->refs);
+        free(kvs->defrag);
+        kvs->defrag = NULL;
+}
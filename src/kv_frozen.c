@@ -0,0 +1,668 @@
+/*
+ * Copyright (c) 2013 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+ * OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ * ---------------------------------------------------------------------
+ */
+
+
+
+/*
+ * Frozen stores. kvstore_freeze writes a store's keys and values to a
+ * file laid out to be mapped and read in place, indexed by a minimal
+ * perfect hash built the BBHash way: each level is a bit array with a
+ * bit per key not yet placed, every such key sets the bit its level
+ * hash picks, and the keys that land alone on their bit are placed
+ * there while the rest go on to the next level. A key's index is the
+ * number of placed bits ahead of its own, counted from a table of
+ * sums taken every 512 bits, so the whole index costs about 3 bits a
+ * key. The index names the key's record, and comparing the key there
+ * rejects keys that were never frozen: every lookup reads one record.
+ *
+ * The levels are built in parallel. Workers set bits with atomic ors,
+ * noting collisions in a second array, and once they have all finished
+ * each one splits its keys into those placed and those carried over.
+ *
+ * The file is, in host byte order:
+ *
+ *      header
+ *      bits[words]             the levels, each starting on a word
+ *      ranks[words / 8 + 1]    placed bits ahead of each 512-bit block
+ *      offs[keys]              record offsets, by index
+ *      records                 key and value lengths as two uint32s,
+ *                              then the key and the value, each
+ *                              followed by a NUL
+ */
+
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "kv.h"
+#include "kv_int.h"
+
+
+#define KVSTORE_FROZEN_LEVELS   64
+
+static const uint64_t    KVSTORE_FROZEN_MAGIC = 0x315a4f524653564bULL;
+static const size_t      KVSTORE_FROZEN_PAR_MIN = 65536;
+
+
+struct _frozen_header {
+        uint64_t         magic;
+        uint64_t         keys;
+        uint64_t         words;
+        uint64_t         data_len;
+        uint64_t         max_keylen;
+        uint64_t         seed[2];
+        uint32_t         alg;
+        uint32_t         levels;
+        uint64_t         level_bits[KVSTORE_FROZEN_LEVELS];
+        uint64_t         level_word[KVSTORE_FROZEN_LEVELS];
+};
+
+struct _kvstore_frozen {
+        char                    *map;
+        size_t                   map_len;
+        struct _frozen_header   *hdr;
+        uint64_t                *bits;
+        uint64_t                *ranks;
+        uint64_t                *offs;
+        char                    *data;
+};
+
+/*
+ * One worker's share of a level: in the first phase it marks the bits
+ * its keys pick, in the second it moves the keys that collided to the
+ * front of its slice and counts them.
+ */
+struct _frozen_work {
+        uint64_t        *hashes;
+        size_t           n;
+        size_t           kept;
+        uint64_t        *taken;
+        uint64_t        *collide;
+        uint64_t         nbits;
+        uint32_t         level;
+        int              phase;
+        pthread_t        thread;
+};
+
+
+static uint64_t  _frozen_mix(uint64_t, uint32_t);
+static uint64_t  _frozen_rank(struct _kvstore_frozen *, uint64_t);
+static uint64_t  _frozen_index(struct _kvstore_frozen *, uint64_t);
+static void     *_frozen_worker(void *);
+static void      _frozen_run(struct _frozen_work *, size_t, int);
+static int       _frozen_build(struct _frozen_header *, uint64_t **,
+                    uint64_t *, size_t, size_t);
+static uint64_t *_frozen_ranks(uint64_t *, uint64_t);
+static int       _frozen_write(FILE *, struct _kvstore_frozen *,
+                    struct _kvstore_kv **, char *, size_t);
+static int       _frozen_size(struct _frozen_header *, uint64_t *);
+static int       _frozen_check(struct _kvstore_frozen *);
+
+
+uint64_t
+_frozen_mix(uint64_t h, uint32_t level)
+{
+        uint64_t        z = h + (level + 1) * 0x9e3779b97f4a7c15ULL;
+
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+}
+
+
+uint64_t
+_frozen_rank(struct _kvstore_frozen *fz, uint64_t p)
+{
+        uint64_t        r = fz->ranks[p >> 9];
+        uint64_t        w;
+
+        for (w = (p >> 9) << 3; w < (p >> 6); w++)
+                r += (uint64_t)__builtin_popcountll(fz->bits[w]);
+        return r + (uint64_t)__builtin_popcountll(fz->bits[p >> 6] &
+            ((1ULL << (p & 63)) - 1));
+}
+
+
+/*
+ * _frozen_index returns the index of the key with hash h, or -1 if no
+ * level has a bit for it. A key that was not frozen may still be given
+ * an index, so the caller checks the record.
+ */
+uint64_t
+_frozen_index(struct _kvstore_frozen *fz, uint64_t h)
+{
+        struct _frozen_header   *hdr = fz->hdr;
+        uint64_t                 p;
+        uint32_t                 l;
+
+        for (l = 0; l < hdr->levels; l++) {
+                p = hdr->level_word[l] * 64 +
+                    _frozen_mix(h, l) % hdr->level_bits[l];
+                if (fz->bits[p >> 6] & (1ULL << (p & 63)))
+                        return _frozen_rank(fz, p);
+        }
+        return (uint64_t)-1;
+}
+
+
+void *
+_frozen_worker(void *arg)
+{
+        struct _frozen_work     *w = (struct _frozen_work *)arg;
+        uint64_t                 p, bit, *word;
+        size_t                   i;
+
+        if (0 == w->phase) {
+                for (i = 0; i < w->n; i++) {
+                        p = _frozen_mix(w->hashes[i], w->level) % w->nbits;
+                        bit = 1ULL << (p & 63);
+                        word = &w->taken[p >> 6];
+                        if (__atomic_fetch_or(word, bit, __ATOMIC_RELAXED) &
+                            bit)
+                                __atomic_fetch_or(&w->collide[p >> 6], bit,
+                                    __ATOMIC_RELAXED);
+                }
+                return NULL;
+        }
+
+        w->kept = 0;
+        for (i = 0; i < w->n; i++) {
+                p = _frozen_mix(w->hashes[i], w->level) % w->nbits;
+                if (w->collide[p >> 6] & (1ULL << (p & 63)))
+                        w->hashes[w->kept++] = w->hashes[i];
+        }
+        return NULL;
+}
+
+
+/*
+ * _frozen_run runs one phase over every worker, the first on the
+ * calling thread. A worker whose thread cannot be started runs there
+ * too.
+ */
+void
+_frozen_run(struct _frozen_work *w, size_t nw, int phase)
+{
+        size_t  i;
+
+        for (i = 0; i < nw; i++)
+                w[i].phase = phase;
+        for (i = 1; i < nw; i++) {
+                if (pthread_create(&w[i].thread, NULL, _frozen_worker,
+                    &w[i])) {
+                        _frozen_worker(&w[i]);
+                        w[i].phase = -1;
+                }
+        }
+        _frozen_worker(&w[0]);
+        for (i = 1; i < nw; i++) {
+                if (-1 != w[i].phase)
+                        pthread_join(w[i].thread, NULL);
+        }
+}
+
+
+/*
+ * _frozen_build builds the levels over the n hashes, which it reorders,
+ * and fills in the level fields of hdr. It fails with EAGAIN if keys
+ * are left after the last level, which takes two keys with the same
+ * 64-bit hash.
+ */
+int
+_frozen_build(struct _frozen_header *hdr, uint64_t **bitsp,
+    uint64_t *hashes, size_t n, size_t nthreads)
+{
+        struct _frozen_work     *w;
+        uint64_t                *bits = NULL, *taken, *grown;
+        size_t                   i, m = n, nw, per, off, words, total = 0;
+        uint32_t                 l;
+
+        if (NULL == (w = (struct _frozen_work *)calloc(nthreads,
+            sizeof(struct _frozen_work))))
+                return -1;
+        for (l = 0; (0 != m) && (l < KVSTORE_FROZEN_LEVELS); l++) {
+                words = (m + 63) / 64;
+                taken = (uint64_t *)calloc(words * 2, sizeof(uint64_t));
+                grown = (uint64_t *)realloc(bits,
+                    (total + words) * sizeof(uint64_t));
+                if ((NULL == taken) || (NULL == grown)) {
+                        free(taken);
+                        free(NULL == grown ? bits : grown);
+                        free(w);
+                        return -1;
+                }
+                bits = grown;
+
+                nw = m / KVSTORE_FROZEN_PAR_MIN;
+                if (nw > nthreads)
+                        nw = nthreads;
+                if (0 == nw)
+                        nw = 1;
+                per = (m + nw - 1) / nw;
+                for (i = 0, off = 0; i < nw; i++, off += per) {
+                        w[i].hashes = hashes + off;
+                        w[i].n = m - off < per ? m - off : per;
+                        w[i].taken = taken;
+                        w[i].collide = taken + words;
+                        w[i].nbits = words * 64;
+                        w[i].level = l;
+                }
+                _frozen_run(w, nw, 0);
+                _frozen_run(w, nw, 1);
+
+                for (i = 0; i < words; i++)
+                        bits[total + i] = taken[i] & ~taken[words + i];
+                hdr->level_bits[l] = words * 64;
+                hdr->level_word[l] = total;
+                total += words;
+                for (i = 0, m = 0; i < nw; i++) {
+                        memmove(hashes + m, w[i].hashes,
+                            w[i].kept * sizeof(uint64_t));
+                        m += w[i].kept;
+                }
+                free(taken);
+        }
+        free(w);
+        if (0 != m) {
+                free(bits);
+                errno = EAGAIN;
+                return -1;
+        }
+        hdr->levels = l;
+        hdr->words = total;
+        *bitsp = bits;
+        return 0;
+}
+
+
+uint64_t *
+_frozen_ranks(uint64_t *bits, uint64_t words)
+{
+        uint64_t        *ranks;
+        uint64_t         i, sum = 0;
+
+        ranks = (uint64_t *)malloc((words / 8 + 1) * sizeof(uint64_t));
+        if (NULL == ranks)
+                return NULL;
+        for (i = 0; i < words; i++) {
+                if (0 == (i & 7))
+                        ranks[i >> 3] = sum;
+                sum += (uint64_t)__builtin_popcountll(bits[i]);
+        }
+        if (0 == (words & 7))
+                ranks[words >> 3] = sum;
+        return ranks;
+}
+
+
+/*
+ * _frozen_write writes the file for fz, whose records are the entries
+ * in order, to f. buf holds len bytes for copying out chunked values.
+ */
+int
+_frozen_write(FILE *f, struct _kvstore_frozen *fz,
+    struct _kvstore_kv **order, char *buf, size_t len)
+{
+        struct _frozen_header   *hdr = fz->hdr;
+        struct _kvstore_kv      *kv;
+        uint32_t                 lens[2];
+        size_t                   i, off, n;
+
+        if ((1 != fwrite(hdr, sizeof(*hdr), 1, f)) || ((0 != hdr->words) &&
+            (hdr->words != fwrite(fz->bits, sizeof(uint64_t), hdr->words,
+            f))) ||
+            (hdr->words / 8 + 1 != fwrite(fz->ranks, sizeof(uint64_t),
+            hdr->words / 8 + 1, f)) ||
+            (hdr->keys != fwrite(fz->offs, sizeof(uint64_t), hdr->keys, f)))
+                return -1;
+        for (i = 0; i < hdr->keys; i++) {
+                kv = order[i];
+                lens[0] = (uint32_t)kv->key_len;
+                lens[1] = (uint32_t)kv->val_len;
+                if ((1 != fwrite(lens, sizeof(lens), 1, f)) ||
+                    (1 != fwrite(kv->key, kv->key_len + 1, 1, f)))
+                        return -1;
+                if (NULL != kv->val) {
+                        if (1 != fwrite(kv->val, kv->val_len + 1, 1, f))
+                                return -1;
+                        continue;
+                }
+                for (off = 0; off < kv->val_len; off += n) {
+                        n = _kvstore_chunk_read(kv, off, len, buf);
+                        if (n != fwrite(buf, 1, n, f))
+                                return -1;
+                }
+                if (EOF == fputc(0, f))
+                        return -1;
+        }
+        return 0;
+}
+
+
+/*
+ * kvstore_freeze writes the store's keys and values to path as a frozen
+ * store, replacing whatever file was there only once the new one is
+ * complete. The store stays locked while the file is written. Integer
+ * keys have no place in the file, so a store holding any fails with
+ * EINVAL.
+ */
+int
+kvstore_freeze(kvstore kvs, const char *path)
+{
+        struct _frozen_header    hdr;
+        struct _kvstore_frozen   fz;
+        struct _kvstore_kv      *kv, **entries = NULL, **order = NULL;
+        uint64_t                *hashes = NULL, idx, off;
+        size_t                   i, n = 0, nthreads, len = 65536;
+        char                    *tmp = NULL, *buf = NULL;
+        long                     ncpu;
+        FILE                    *f;
+        int                      retval = -1;
+
+        if ((NULL == kvs) || (NULL == path) || (NULL != kvs->bc) ||
+            (NULL != kvs->lsm) || (NULL != kvs->shm) || (NULL != kvs->soa) ||
+            (NULL != kvs->frozen))
+                return -1;
+        nthreads = kvs->load_threads;
+        if ((0 == nthreads) && (0 < (ncpu = sysconf(_SC_NPROCESSORS_ONLN))))
+                nthreads = (size_t)ncpu;
+        if (0 == nthreads)
+                nthreads = 1;
+        if (NULL != kvs->wc)
+                kvstore_wc_sync(kvs);
+        if (_acquire_kvstore(kvs))
+                return -1;
+        if (0 != _kvstore_u64_len(kvs)) {
+                _unlock_kvstore(kvs);
+                errno = EINVAL;
+                return -1;
+        }
+
+        memset(&fz, 0x0, sizeof(fz));
+        memset(&hdr, 0x0, sizeof(hdr));
+        fz.hdr = &hdr;
+        entries = (struct _kvstore_kv **)malloc((kvs->keys + 1) *
+            sizeof(struct _kvstore_kv *));
+        order = (struct _kvstore_kv **)calloc(kvs->keys + 1,
+            sizeof(struct _kvstore_kv *));
+        hashes = (uint64_t *)malloc((kvs->keys + 1) * sizeof(uint64_t));
+        fz.offs = (uint64_t *)malloc((kvs->keys + 1) * sizeof(uint64_t));
+        buf = (char *)malloc(len);
+        tmp = (char *)malloc(strlen(path) + 5);
+        if ((NULL == entries) || (NULL == order) || (NULL == hashes) ||
+            (NULL == fz.offs) || (NULL == buf) || (NULL == tmp))
+                goto freeze_done;
+        TAILQ_FOREACH(kv, kvs->queue, entries) {
+                if ((NULL == kv->val) && (NULL == kv->chunks))
+                        continue;
+                if ((n == kvs->keys) || (UINT32_MAX < kv->val_len)) {
+                        errno = EFBIG;
+                        goto freeze_done;
+                }
+                entries[n] = kv;
+                hashes[n++] = kv->hash;
+        }
+
+        hdr.magic = KVSTORE_FROZEN_MAGIC;
+        hdr.keys = n;
+        hdr.max_keylen = kvs->max_keylen;
+        hdr.alg = (uint32_t)kvs->hasher.alg;
+        memcpy(hdr.seed, kvs->hasher.seed, sizeof(hdr.seed));
+        if (_frozen_build(&hdr, &fz.bits, hashes, n, nthreads))
+                goto freeze_done;
+        if (NULL == (fz.ranks = _frozen_ranks(fz.bits, hdr.words)))
+                goto freeze_done;
+        for (i = 0; i < n; i++) {
+                idx = _frozen_index(&fz, entries[i]->hash);
+                if ((idx >= n) || (NULL != order[idx])) {
+                        errno = EAGAIN;
+                        goto freeze_done;
+                }
+                order[idx] = entries[i];
+        }
+        for (i = 0, off = 0; i < n; i++) {
+                fz.offs[i] = off;
+                off += 2 * sizeof(uint32_t) + order[i]->key_len +
+                    order[i]->val_len + 2;
+        }
+        hdr.data_len = off;
+
+        snprintf(tmp, strlen(path) + 5, "%s.tmp", path);
+        if (NULL == (f = fopen(tmp, "w")))
+                goto freeze_done;
+        if (_frozen_write(f, &fz, order, buf, len) || fflush(f) ||
+            fsync(fileno(f))) {
+                fclose(f);
+                unlink(tmp);
+                goto freeze_done;
+        }
+        if (fclose(f) || rename(tmp, path)) {
+                unlink(tmp);
+                goto freeze_done;
+        }
+        retval = 0;
+
+freeze_done:
+        _unlock_kvstore(kvs);
+        free(entries);
+        free(order);
+        free(hashes);
+        free(fz.bits);
+        free(fz.ranks);
+        free(fz.offs);
+        free(buf);
+        free(tmp);
+        return retval;
+}
+
+
+/*
+ * _frozen_size works out how long the file described by hdr must be,
+ * failing if that does not fit in 64 bits.
+ */
+int
+_frozen_size(struct _frozen_header *hdr, uint64_t *need)
+{
+        uint64_t        words;
+
+        if (__builtin_add_overflow(hdr->words, hdr->words / 8 + 1, &words) ||
+            __builtin_add_overflow(words, hdr->keys, &words) ||
+            __builtin_mul_overflow(words, sizeof(uint64_t), &words) ||
+            __builtin_add_overflow(words, sizeof(*hdr), &words) ||
+            __builtin_add_overflow(words, hdr->data_len, need))
+                return -1;
+        return 0;
+}
+
+
+/*
+ * _frozen_check makes sure every record lies within the data and has
+ * its key and value terminated, so that lookups and scans can trust the
+ * offsets, whatever the file held.
+ */
+int
+_frozen_check(struct _kvstore_frozen *fz)
+{
+        uint64_t        i, off, len = fz->hdr->data_len;
+        uint32_t        lens[2];
+        char           *rec;
+
+        for (i = 0; i < fz->hdr->keys; i++) {
+                off = fz->offs[i];
+                if ((off > len) || (len - off < sizeof(lens)))
+                        return -1;
+                rec = fz->data + off;
+                memcpy(lens, rec, sizeof(lens));
+                if (len - off - sizeof(lens) < (uint64_t)lens[0] + lens[1] + 2)
+                        return -1;
+                rec += sizeof(lens);
+                if ((0 != rec[lens[0]]) || (0 != rec[lens[0] + 1 + lens[1]]))
+                        return -1;
+        }
+        return 0;
+}
+
+
+/*
+ * kvstore_open_frozen maps a file written by kvstore_freeze as a store
+ * that can only be read. A file that does not hold together fails with
+ * EINVAL.
+ */
+kvstore
+kvstore_open_frozen(const char *path)
+{
+        struct _kvstore_frozen  *fz;
+        struct _frozen_header   *hdr;
+        struct stat              st;
+        kvstore                  kvs;
+        uint64_t                 need;
+        uint32_t                 l;
+        char                    *map;
+        int                      fd;
+
+        if (NULL == path)
+                return NULL;
+        if (-1 == (fd = open(path, O_RDONLY | O_CLOEXEC)))
+                return NULL;
+        if (fstat(fd, &st) ||
+            ((size_t)st.st_size < sizeof(struct _frozen_header))) {
+                close(fd);
+                errno = EINVAL;
+                return NULL;
+        }
+        map = (char *)mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED,
+            fd, 0);
+        close(fd);
+        if (MAP_FAILED == map)
+                return NULL;
+
+        hdr = (struct _frozen_header *)map;
+        if ((KVSTORE_FROZEN_MAGIC != hdr->magic) ||
+            (KVSTORE_FROZEN_LEVELS < hdr->levels) ||
+            ((KVSTORE_HASH_SIPHASH != hdr->alg) &&
+            (KVSTORE_HASH_FAST != hdr->alg)) ||
+            _frozen_size(hdr, &need) || (need != (uint64_t)st.st_size))
+                goto open_fail;
+        for (l = 0; l < hdr->levels; l++) {
+                if ((0 == hdr->level_bits[l]) ||
+                    (0 != hdr->level_bits[l] % 64) ||
+                    (hdr->level_word[l] > hdr->words) ||
+                    (hdr->words - hdr->level_word[l] <
+                    hdr->level_bits[l] / 64))
+                        goto open_fail;
+        }
+
+        if (NULL == (fz = (struct _kvstore_frozen *)calloc(1,
+            sizeof(struct _kvstore_frozen))))
+                goto open_fail;
+        fz->map = map;
+        fz->map_len = (size_t)st.st_size;
+        fz->hdr = hdr;
+        fz->bits = (uint64_t *)(hdr + 1);
+        fz->ranks = fz->bits + hdr->words;
+        fz->offs = fz->ranks + hdr->words / 8 + 1;
+        fz->data = (char *)(fz->offs + hdr->keys);
+        if (_frozen_check(fz) || (NULL == (kvs = kvstore_new()))) {
+                free(fz);
+                goto open_fail;
+        }
+        kvs->frozen = fz;
+        kvs->keys = hdr->keys;
+        kvs->max_keylen = hdr->max_keylen;
+        kvs->hasher.alg = (KVSTORE_HASH_ALG)hdr->alg;
+        memcpy(kvs->hasher.seed, hdr->seed, sizeof(kvs->hasher.seed));
+        return kvs;
+
+open_fail:
+        munmap(map, (size_t)st.st_size);
+        errno = EINVAL;
+        return NULL;
+}
+
+
+char *
+_kvstore_frozen_get(kvstore kvs, char *key, size_t *len)
+{
+        struct _kvstore_frozen  *fz = kvs->frozen;
+        uint32_t                 lens[2];
+        uint64_t                 idx;
+        size_t                   klen;
+        char                    *rec;
+
+        klen = strnlen(key, kvs->max_keylen + 1);
+        if (((kvs->max_keylen + 1) == klen) || (0 == klen))
+                return NULL;
+        idx = _frozen_index(fz, _kvstore_hash(kvs, key, klen));
+        if ((idx >= fz->hdr->keys) ||
+            (fz->offs[idx] + sizeof(lens) > fz->hdr->data_len))
+                return NULL;
+        rec = fz->data + fz->offs[idx];
+        memcpy(lens, rec, sizeof(lens));
+        if ((lens[0] != klen) ||
+            (fz->offs[idx] + sizeof(lens) + klen + lens[1] + 2 >
+            fz->hdr->data_len) ||
+            (0 != memcmp(rec + sizeof(lens), key, klen)))
+                return NULL;
+        if (NULL != len)
+                *len = lens[1];
+        return rec + sizeof(lens) + klen + 1;
+}
+
+
+/*
+ * _kvstore_frozen_scan walks the records in index order; the cursor is
+ * the next index.
+ */
+void
+_kvstore_frozen_scan(kvstore kvs, size_t *cursor, size_t count,
+    kvstore_scan_cb cb, void *arg)
+{
+        struct _kvstore_frozen  *fz = kvs->frozen;
+        uint32_t                 lens[2];
+        size_t                   i;
+        char                    *rec;
+
+        for (i = *cursor; (i < fz->hdr->keys) && (0 != count); i++, count--) {
+                rec = fz->data + fz->offs[i];
+                memcpy(lens, rec, sizeof(lens));
+                cb(rec + sizeof(lens), rec + sizeof(lens) + lens[0] + 1, arg);
+        }
+        *cursor = i < fz->hdr->keys ? i : 0;
+}
+
+
+void
+_kvstore_frozen_free(kvstore kvs)
+{
+        struct _kvstore_frozen  *fz = kvs->frozen;
+
+        if (NULL == fz)
+                return;
+        munmap(fz->map, fz->map_len);
+        free(fz);
+        kvs->frozen = NULL;
+}
@@ -0,0 +1,194 @@
+/*
+ * Copyright (c) 2013 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+ * OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ * ---------------------------------------------------------------------
+ */
+
+
+/*
+ * Key hashing. Every store draws a random 128-bit seed when it is
+ * created, so clients cannot pick keys that collide in its index without
+ * knowing the seed. The default is SipHash-1-3, a keyed PRF built to
+ * resist exactly that; KVSTORE_HASH_FAST selects a seeded multiply-mix
+ * hash that eats 32 bytes per round in two independent lanes, for
+ * stores whose keys are trusted.
+ *
+ * Words are read in host byte order. Hashes are never written anywhere
+ * another host could read them, only into shared memory on this one.
+ */
+
+
+#include <sys/types.h>
+#include <sys/random.h>
+#include <sys/time.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "kv.h"
+#include "kv_int.h"
+
+
+static const uint64_t    KVSTORE_FAST_P0 = 0xa0761d6478bd642fULL;
+static const uint64_t    KVSTORE_FAST_P1 = 0xe7037ed1a0b428dbULL;
+static const uint64_t    KVSTORE_FAST_P2 = 0x8ebc6af09c88c6e3ULL;
+
+
+#define ROTL(x, b)      (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND                                                        \
+        do {                                                            \
+                v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0;                  \
+                v0 = ROTL(v0, 32);                                      \
+                v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2;                  \
+                v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0;                  \
+                v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2;                  \
+                v2 = ROTL(v2, 32);                                      \
+        } while (0)
+
+
+static uint64_t  _hash_read(const unsigned char *);
+static uint64_t  _hash_siphash(const uint64_t *, const char *, size_t);
+static uint64_t  _hash_mix(uint64_t, uint64_t);
+static uint64_t  _hash_fast(const uint64_t *, const char *, size_t);
+
+
+uint64_t
+_hash_read(const unsigned char *p)
+{
+        uint64_t        w;
+
+        memcpy(&w, p, sizeof(w));
+        return w;
+}
+
+
+uint64_t
+_hash_siphash(const uint64_t *seed, const char *key, size_t len)
+{
+        const unsigned char     *p = (const unsigned char *)key;
+        const unsigned char     *end = p + (len & ~(size_t)7);
+        uint64_t                 v0, v1, v2, v3, m;
+        uint64_t                 b = (uint64_t)len << 56;
+        size_t                   left = len & 7;
+
+        v0 = seed[0] ^ 0x736f6d6570736575ULL;
+        v1 = seed[1] ^ 0x646f72616e646f6dULL;
+        v2 = seed[0] ^ 0x6c7967656e657261ULL;
+        v3 = seed[1] ^ 0x7465646279746573ULL;
+
+        for (; p != end; p += 8) {
+                m = _hash_read(p);
+                v3 ^= m;
+                SIPROUND;
+                v0 ^= m;
+        }
+        while (left--)
+                b |= (uint64_t)p[left] << (left * 8);
+
+        v3 ^= b;
+        SIPROUND;
+        v0 ^= b;
+        v2 ^= 0xff;
+        SIPROUND;
+        SIPROUND;
+        SIPROUND;
+        return v0 ^ v1 ^ v2 ^ v3;
+}
+
+
+/*
+ * _hash_mix folds the full 128-bit product of a and b into 64 bits.
+ */
+uint64_t
+_hash_mix(uint64_t a, uint64_t b)
+{
+        __uint128_t     r = (__uint128_t)a * b;
+
+        return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+
+uint64_t
+_hash_fast(const uint64_t *seed, const char *key, size_t len)
+{
+        const unsigned char     *p = (const unsigned char *)key;
+        unsigned char            tail[16];
+        uint64_t                 h0, h1;
+        size_t                   left = len;
+
+        h0 = seed[0] ^ _hash_mix(seed[1] ^ KVSTORE_FAST_P0,
+            (uint64_t)len ^ KVSTORE_FAST_P1);
+        h1 = h0 ^ seed[1];
+        for (; left > 32; left -= 32, p += 32) {
+                h0 = _hash_mix(_hash_read(p) ^ KVSTORE_FAST_P1,
+                    _hash_read(p + 8) ^ h0);
+                h1 = _hash_mix(_hash_read(p + 16) ^ KVSTORE_FAST_P2,
+                    _hash_read(p + 24) ^ h1);
+        }
+        h0 ^= h1;
+        if (left > 16) {
+                h0 = _hash_mix(_hash_read(p) ^ KVSTORE_FAST_P1,
+                    _hash_read(p + 8) ^ h0);
+                left -= 16;
+                p += 16;
+        }
+
+        memset(tail, 0x0, sizeof(tail));
+        memcpy(tail, p, left);
+        return _hash_mix(KVSTORE_FAST_P1 ^ (uint64_t)len,
+            _hash_mix(_hash_read(tail) ^ KVSTORE_FAST_P1,
+            _hash_read(tail + 8) ^ h0));
+}
+
+
+/*
+ * _kvstore_hash hashes a key for kvs. Callers hash a key once and pass
+ * the result down to everything that needs it.
+ */
+uint64_t
+_kvstore_hash(kvstore kvs, const char *key, size_t len)
+{
+        if (KVSTORE_HASH_FAST == kvs->hasher.alg)
+                return _hash_fast(kvs->hasher.seed, key, len);
+        return _hash_siphash(kvs->hasher.seed, key, len);
+}
+
+
+/*
+ * _kvstore_hash_init gives a new store the default hash and a random
+ * seed. If the kernel cannot supply one the seed is made from the clock
+ * and the store's address, which is weaker but still differs per store.
+ */
+void
+_kvstore_hash_init(kvstore kvs)
+{
+        struct timeval  tv;
+
+        kvs->hasher.alg = KVSTORE_HASH_SIPHASH;
+        if (sizeof(kvs->hasher.seed) == getrandom(kvs->hasher.seed,
+            sizeof(kvs->hasher.seed), GRND_NONBLOCK))
+                return;
+
+        gettimeofday(&tv, NULL);
+        kvs->hasher.seed[0] = ((uint64_t)tv.tv_sec << 20) ^
+            (uint64_t)tv.tv_usec ^ (uint64_t)getpid();
+        kvs->hasher.seed[1] = (uint64_t)(uintptr_t)kvs;
+        kvs->hasher.seed[0] = _hash_mix(kvs->hasher.seed[0] ^
+            KVSTORE_FAST_P0, kvs->hasher.seed[1] ^ KVSTORE_FAST_P1);
+        kvs->hasher.seed[1] = _hash_mix(kvs->hasher.seed[1] ^
+            KVSTORE_FAST_P2, kvs->hasher.seed[0]);
+}
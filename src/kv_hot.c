@@ -0,0 +1,637 @@
+/*
+ * Copyright (c) 2013 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+ * OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ * ---------------------------------------------------------------------
+ */
+
+
+/*
+ * Hot-key tracking. Reads are counted in a count-min sketch of
+ * KVSTORE_HOT_DEPTH rows, using conservative update so that only the
+ * smallest counters for a key grow, and the k keys with the highest
+ * estimates are kept in a min-heap. Every so often all the counts are
+ * halved so that the heap follows the traffic.
+ *
+ * With replication on, a key that is at the top of the heap and rarely
+ * written is copied into a small direct-mapped table belonging to the
+ * CPU of the thread reading it. kvstore_get looks there first, without
+ * taking the store lock; each CPU's table has its own count of readers
+ * in it, so reads on different CPUs touch no common cache lines. A set
+ * or delete of the key empties its slot on every CPU and waits for that
+ * CPU's readers to drain before freeing the copy.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "kv.h"
+#include "kv_int.h"
+
+
+#define KVSTORE_HOT_DEPTH       4
+#define KVSTORE_HOT_SLOTS       64
+
+static const size_t      KVSTORE_HOT_WIDTH = 4096;
+static const uint64_t    KVSTORE_HOT_DECAY = 65536;
+static const uint64_t    KVSTORE_HOT_MIN_READS = 128;
+static const uint64_t    KVSTORE_HOT_READ_RATIO = 16;
+
+
+struct _hot_entry {
+        char                    *key;
+        size_t                   key_len;
+        uint64_t                 hash;
+        uint64_t                 reads;
+        uint64_t                 writes;
+        int                      replicated;
+};
+
+struct _hot_replica {
+        uint64_t                 hash;
+        uint64_t                 hits;
+        size_t                   key_len;
+        char                    *val;
+        char                     key[];
+};
+
+struct _hot_core {
+        size_t                   readers;
+        struct _hot_replica     *slots[KVSTORE_HOT_SLOTS];
+};
+
+struct _kvstore_hot {
+        uint32_t                *sketch;
+        uint64_t                 updates;
+        struct _hot_entry       *top;
+        size_t                   k;
+        size_t                   n;
+        int                      replicate;
+        size_t                   replicas;
+        struct _hot_core       **cores;
+        size_t                   ncores;
+};
+
+
+static uint64_t  _hot_count(struct _kvstore_hot *, uint64_t);
+static void      _hot_decay(struct _kvstore_hot *);
+static ssize_t   _hot_find(struct _kvstore_hot *, char *, size_t, uint64_t);
+static size_t    _hot_sift(struct _kvstore_hot *, size_t);
+static void      _hot_heapify(struct _kvstore_hot *);
+static int       _hot_match(struct _hot_replica *, char *, size_t,
+                    uint64_t);
+static uint64_t  _hot_fold(struct _kvstore_hot *, struct _hot_entry *);
+static struct _hot_entry
+                *_hot_offer(struct _kvstore_hot *, struct _kvstore_kv *,
+                    uint64_t);
+static struct _hot_core
+                *_hot_core(struct _kvstore_hot *);
+static void      _hot_drop(struct _kvstore_hot *, struct _hot_core *,
+                    size_t);
+static void      _hot_unreplicate(struct _kvstore_hot *,
+                    struct _hot_entry *);
+static void      _hot_replicate(struct _kvstore_hot *, struct _hot_entry *,
+                    struct _kvstore_kv *);
+static void      _hot_read(struct _kvstore_hot *, struct _kvstore_kv *);
+static struct _kvstore_hot
+                *_hot_new(size_t);
+static void      _hot_free(struct _kvstore_hot *);
+
+
+/*
+ * _hot_count adds a read of the key with the given hash to the sketch
+ * and returns its new estimate. The row indexes are derived from the two
+ * halves of the hash.
+ */
+uint64_t
+_hot_count(struct _kvstore_hot *hot, uint64_t hash)
+{
+        uint32_t        *c[KVSTORE_HOT_DEPTH];
+        uint64_t         h1 = hash, h2 = (hash >> 32) | 1;
+        uint32_t         est = UINT32_MAX;
+        size_t           i;
+
+        for (i = 0; i < KVSTORE_HOT_DEPTH; i++) {
+                c[i] = &hot->sketch[i * KVSTORE_HOT_WIDTH +
+                    ((h1 + i * h2) & (KVSTORE_HOT_WIDTH - 1))];
+                if (*c[i] < est)
+                        est = *c[i];
+        }
+        est++;
+        for (i = 0; i < KVSTORE_HOT_DEPTH; i++) {
+                if (*c[i] < est)
+                        *c[i] = est;
+        }
+
+        if (++hot->updates >= KVSTORE_HOT_DECAY)
+                _hot_decay(hot);
+        return est;
+}
+
+
+/*
+ * _hot_decay halves every count. Halving keeps the heap ordered.
+ */
+void
+_hot_decay(struct _kvstore_hot *hot)
+{
+        size_t  i;
+
+        for (i = 0; i < hot->n; i++)
+                _hot_fold(hot, &hot->top[i]);
+        _hot_heapify(hot);
+        for (i = 0; i < KVSTORE_HOT_DEPTH * KVSTORE_HOT_WIDTH; i++)
+                hot->sketch[i] >>= 1;
+        for (i = 0; i < hot->n; i++) {
+                hot->top[i].reads >>= 1;
+                hot->top[i].writes >>= 1;
+        }
+        hot->updates = 0;
+}
+
+
+ssize_t
+_hot_find(struct _kvstore_hot *hot, char *key, size_t klen, uint64_t hash)
+{
+        size_t  i;
+
+        for (i = 0; i < hot->n; i++) {
+                if ((hot->top[i].hash == hash) &&
+                    (hot->top[i].key_len == klen) &&
+                    (0 == memcmp(hot->top[i].key, key, klen)))
+                        return (ssize_t)i;
+        }
+        return -1;
+}
+
+
+/*
+ * _hot_sift moves the entry at i down the heap after its count grew and
+ * returns where it ended up.
+ */
+size_t
+_hot_sift(struct _kvstore_hot *hot, size_t i)
+{
+        struct _hot_entry        tmp;
+        size_t                   least, child;
+
+        for (;;) {
+                least = i;
+                child = 2 * i + 1;
+                if ((child < hot->n) &&
+                    (hot->top[child].reads < hot->top[least].reads))
+                        least = child;
+                if ((child + 1 < hot->n) &&
+                    (hot->top[child + 1].reads < hot->top[least].reads))
+                        least = child + 1;
+                if (least == i)
+                        return i;
+                tmp = hot->top[i];
+                hot->top[i] = hot->top[least];
+                hot->top[least] = tmp;
+                i = least;
+        }
+}
+
+
+void
+_hot_heapify(struct _kvstore_hot *hot)
+{
+        size_t  i;
+
+        for (i = hot->n / 2; i-- > 0; )
+                _hot_sift(hot, i);
+}
+
+
+int
+_hot_match(struct _hot_replica *r, char *key, size_t klen, uint64_t hash)
+{
+        return (NULL != r) && (r->hash == hash) && (r->key_len == klen) &&
+            (0 == memcmp(r->key, key, klen));
+}
+
+
+/*
+ * _hot_fold adds the reads that e's copies served, which never reach
+ * the sketch, to its count.
+ */
+uint64_t
+_hot_fold(struct _kvstore_hot *hot, struct _hot_entry *e)
+{
+        struct _hot_replica     *r;
+        uint64_t                 hits = 0;
+        size_t                   slot = e->hash & (KVSTORE_HOT_SLOTS - 1);
+        size_t                   i;
+
+        if (!e->replicated)
+                return 0;
+        for (i = 0; i < hot->ncores; i++) {
+                r = hot->cores[i]->slots[slot];
+                if (_hot_match(r, e->key, e->key_len, e->hash))
+                        hits += __atomic_exchange_n(&r->hits, 0,
+                            __ATOMIC_RELAXED);
+        }
+        e->reads += hits;
+        return hits;
+}
+
+
+/*
+ * _hot_offer updates kv's entry in the heap with its new estimate, or
+ * adds one if kv now beats the coldest key there. It returns the entry,
+ * or NULL if kv is not among the hottest keys.
+ */
+struct _hot_entry *
+_hot_offer(struct _kvstore_hot *hot, struct _kvstore_kv *kv, uint64_t est)
+{
+        struct _hot_entry       *e, tmp;
+        ssize_t                  i;
+        char                    *key;
+
+        i = _hot_find(hot, kv->key, kv->key_len, kv->hash);
+        if (-1 != i) {
+                e = &hot->top[i];
+                e->reads = est > e->reads ? est : e->reads + 1;
+                return &hot->top[_hot_sift(hot, (size_t)i)];
+        }
+
+        /* The coldest key may have been busier than its count says. */
+        while ((hot->n == hot->k) && (0 != _hot_fold(hot, &hot->top[0])))
+                _hot_sift(hot, 0);
+        if ((hot->n == hot->k) && (est <= hot->top[0].reads))
+                return NULL;
+
+        if (NULL == (key = strndup(kv->key, kv->key_len)))
+                return NULL;
+        if (hot->n == hot->k) {
+                _hot_unreplicate(hot, &hot->top[0]);
+                free(hot->top[0].key);
+                i = 0;
+        } else {
+                i = (ssize_t)hot->n++;
+        }
+        e = &hot->top[i];
+        e->key = key;
+        e->key_len = kv->key_len;
+        e->hash = kv->hash;
+        e->reads = est;
+        e->writes = 0;
+        e->replicated = 0;
+        if (0 == i)
+                return &hot->top[_hot_sift(hot, 0)];
+
+        /* A new leaf moves up past any parent with more reads. */
+        while ((i > 0) && (hot->top[(i - 1) / 2].reads > hot->top[i].reads)) {
+                tmp = hot->top[i];
+                hot->top[i] = hot->top[(i - 1) / 2];
+                hot->top[(i - 1) / 2] = tmp;
+                i = (i - 1) / 2;
+        }
+        return &hot->top[i];
+}
+
+
+struct _hot_core *
+_hot_core(struct _kvstore_hot *hot)
+{
+        int     cpu;
+
+        if (-1 == (cpu = sched_getcpu()))
+                cpu = 0;
+        return hot->cores[(size_t)cpu % hot->ncores];
+}
+
+
+/*
+ * _hot_drop empties a slot, waiting for readers on that CPU that may
+ * have seen the copy to move on before it is freed.
+ */
+void
+_hot_drop(struct _kvstore_hot *hot, struct _hot_core *core, size_t slot)
+{
+        struct _hot_replica     *r = core->slots[slot];
+
+        if (NULL == r)
+                return;
+        __atomic_store_n(&core->slots[slot], NULL, __ATOMIC_SEQ_CST);
+        while (0 != __atomic_load_n(&core->readers, __ATOMIC_SEQ_CST))
+                sched_yield();
+        free(r);
+        __atomic_sub_fetch(&hot->replicas, 1, __ATOMIC_RELAXED);
+}
+
+
+void
+_hot_unreplicate(struct _kvstore_hot *hot, struct _hot_entry *e)
+{
+        struct _hot_replica     *r;
+        size_t                   slot = e->hash & (KVSTORE_HOT_SLOTS - 1);
+        size_t                   i;
+
+        if (!e->replicated)
+                return;
+        _hot_fold(hot, e);
+        for (i = 0; i < hot->ncores; i++) {
+                r = hot->cores[i]->slots[slot];
+                if (_hot_match(r, e->key, e->key_len, e->hash))
+                        _hot_drop(hot, hot->cores[i], slot);
+        }
+        e->replicated = 0;
+}
+
+
+/*
+ * _hot_replicate gives the calling thread's CPU its own copy of kv. A
+ * copy of another key in the same slot is only replaced if that key is
+ * colder, and the reads it served are counted before it goes.
+ */
+void
+_hot_replicate(struct _kvstore_hot *hot, struct _hot_entry *e,
+    struct _kvstore_kv *kv)
+{
+        struct _hot_core        *core = _hot_core(hot);
+        struct _hot_replica     *r;
+        size_t                   slot = kv->hash & (KVSTORE_HOT_SLOTS - 1);
+        uint64_t                 hits = 0;
+        ssize_t                  other = -1;
+
+        if (NULL != (r = core->slots[slot])) {
+                if (_hot_match(r, kv->key, kv->key_len, kv->hash))
+                        return;
+                other = _hot_find(hot, r->key, r->key_len, r->hash);
+                hits = __atomic_load_n(&r->hits, __ATOMIC_RELAXED);
+                if ((-1 != other) &&
+                    (hot->top[other].reads + hits >= e->reads))
+                        return;
+                hits = __atomic_exchange_n(&r->hits, 0, __ATOMIC_RELAXED);
+                _hot_drop(hot, core, slot);
+        }
+
+        r = (struct _hot_replica *)malloc(sizeof(struct _hot_replica) +
+            kv->key_len + kv->val_len + 2);
+        if (NULL != r) {
+                r->hash = kv->hash;
+                r->hits = 0;
+                r->key_len = kv->key_len;
+                memcpy(r->key, kv->key, kv->key_len + 1);
+                r->val = r->key + kv->key_len + 1;
+                memcpy(r->val, kv->val, kv->val_len + 1);
+                __atomic_add_fetch(&hot->replicas, 1, __ATOMIC_RELAXED);
+                __atomic_store_n(&core->slots[slot], r, __ATOMIC_RELEASE);
+                e->replicated = 1;
+        }
+
+        /* Last, as the sift may move e. */
+        if (-1 != other) {
+                hot->top[other].reads += hits;
+                _hot_sift(hot, (size_t)other);
+        }
+}
+
+
+void
+_hot_read(struct _kvstore_hot *hot, struct _kvstore_kv *kv)
+{
+        struct _hot_entry       *e;
+
+        e = _hot_offer(hot, kv, _hot_count(hot, kv->hash));
+        if ((NULL == e) || !hot->replicate)
+                return;
+        if ((e->reads >= KVSTORE_HOT_MIN_READS) &&
+            (e->writes * KVSTORE_HOT_READ_RATIO <= e->reads))
+                _hot_replicate(hot, e, kv);
+}
+
+
+/*
+ * _kvstore_hot_get is kvstore_get for a store tracking hot keys.
+ */
+char *
+_kvstore_hot_get(kvstore kvs, char *key)
+{
+        struct _kvstore_hot     *hot = kvs->hot;
+        struct _hot_core        *core;
+        struct _hot_replica     *r;
+        struct _kvstore_kv      *kv;
+        uint64_t                 hash;
+        size_t                   klen;
+        char                    *val = NULL;
+
+        if (NULL == key)
+                return NULL;
+        klen = strnlen(key, kvs->max_keylen + 1);
+        if (((kvs->max_keylen + 1) == klen) || (0 == klen))
+                return NULL;
+        hash = _kvstore_hash(kvs, key, klen);
+
+        if (0 != __atomic_load_n(&hot->replicas, __ATOMIC_RELAXED)) {
+                core = _hot_core(hot);
+                __atomic_add_fetch(&core->readers, 1, __ATOMIC_SEQ_CST);
+                r = __atomic_load_n(&core->slots[hash &
+                    (KVSTORE_HOT_SLOTS - 1)], __ATOMIC_SEQ_CST);
+                if (_hot_match(r, key, klen, hash)) {
+                        __atomic_add_fetch(&r->hits, 1, __ATOMIC_RELAXED);
+                        val = r->val;
+                }
+                __atomic_sub_fetch(&core->readers, 1, __ATOMIC_RELEASE);
+                if (NULL != val)
+                        return val;
+        }
+
+        if (_acquire_kvstore(kvs))
+                return NULL;
+        if (NULL != (kv = _kvstore_find(kvs, key, klen, hash))) {
+                val = kv->val;
+                _hot_read(hot, kv);
+        }
+        _unlock_kvstore(kvs);
+        return val;
+}
+
+
+/*
+ * _kvstore_hot_write is called with the store locked after key has been
+ * set or deleted, and throws away any copies of it.
+ */
+void
+_kvstore_hot_write(kvstore kvs, char *key, size_t klen)
+{
+        struct _kvstore_hot     *hot = kvs->hot;
+        ssize_t                  i;
+
+        i = _hot_find(hot, key, klen, _kvstore_hash(kvs, key, klen));
+        if (-1 == i)
+                return;
+        hot->top[i].writes++;
+        _hot_unreplicate(hot, &hot->top[i]);
+}
+
+
+struct _kvstore_hot *
+_hot_new(size_t k)
+{
+        struct _kvstore_hot     *hot;
+        long                     ncpu;
+        size_t                   i;
+
+        if (NULL == (hot = (struct _kvstore_hot *)calloc(1,
+            sizeof(struct _kvstore_hot))))
+                return NULL;
+        if ((ncpu = sysconf(_SC_NPROCESSORS_CONF)) < 1)
+                ncpu = 1;
+        hot->k = k;
+        hot->ncores = (size_t)ncpu;
+        hot->sketch = (uint32_t *)calloc(KVSTORE_HOT_DEPTH *
+            KVSTORE_HOT_WIDTH, sizeof(uint32_t));
+        hot->top = (struct _hot_entry *)calloc(k, sizeof(struct _hot_entry));
+        hot->cores = (struct _hot_core **)calloc(hot->ncores,
+            sizeof(struct _hot_core *));
+        if ((NULL == hot->sketch) || (NULL == hot->top) ||
+            (NULL == hot->cores)) {
+                _hot_free(hot);
+                return NULL;
+        }
+        for (i = 0; i < hot->ncores; i++) {
+                if (posix_memalign((void **)&hot->cores[i], 64,
+                    sizeof(struct _hot_core))) {
+                        hot->cores[i] = NULL;
+                        _hot_free(hot);
+                        return NULL;
+                }
+                memset(hot->cores[i], 0x0, sizeof(struct _hot_core));
+        }
+        return hot;
+}
+
+
+void
+_hot_free(struct _kvstore_hot *hot)
+{
+        size_t  i, j;
+
+        for (i = 0; (NULL != hot->cores) && (i < hot->ncores); i++) {
+                if (NULL == hot->cores[i])
+                        break;
+                for (j = 0; j < KVSTORE_HOT_SLOTS; j++)
+                        free(hot->cores[i]->slots[j]);
+                free(hot->cores[i]);
+        }
+        for (i = 0; i < hot->n; i++)
+                free(hot->top[i].key);
+        free(hot->cores);
+        free(hot->top);
+        free(hot->sketch);
+        free(hot);
+}
+
+
+/*
+ * _kvstore_hot_config handles KVSTORE_HOT_KEYS, which starts tracking
+ * the given number of hottest keys (0 stops), and KVSTORE_HOT_REPLICATE.
+ * Both should be set before the store is shared between threads.
+ */
+int
+_kvstore_hot_config(kvstore kvs, KVSTORE_CONFIG_OPT opt, void *val)
+{
+        struct _kvstore_hot     *hot;
+        size_t                   i;
+
+        if ((NULL != kvs->bc) || (NULL != kvs->lsm) || (NULL != kvs->shm) ||
+            (NULL != kvs->soa) || (NULL != kvs->frozen) ||
+            (NULL != kvs->rcache) || (0 != kvs->chunk_size))
+                return -1;
+        if (_acquire_kvstore(kvs))
+                return -1;
+
+        if (KVSTORE_HOT_KEYS == opt) {
+                hot = NULL;
+                if ((0 != *(size_t *)val) &&
+                    (NULL == (hot = _hot_new(*(size_t *)val)))) {
+                        _unlock_kvstore(kvs);
+                        return -1;
+                }
+                if (NULL != kvs->hot)
+                        _hot_free(kvs->hot);
+                kvs->hot = hot;
+        } else if (NULL != (hot = kvs->hot)) {
+                hot->replicate = *(int *)val;
+                for (i = 0; !hot->replicate && (i < hot->n); i++)
+                        _hot_unreplicate(hot, &hot->top[i]);
+        } else {
+                _unlock_kvstore(kvs);
+                return -1;
+        }
+        return _unlock_kvstore(kvs);
+}
+
+
+void
+_kvstore_hot_free(kvstore kvs)
+{
+        if (NULL != kvs->hot)
+                _hot_free(kvs->hot);
+        kvs->hot = NULL;
+}
+
+
+/*
+ * kvstore_hot_keys fills keys with up to n of the hottest keys, hottest
+ * first, and returns how many it filled in. Each key is a copy for the
+ * caller to free.
+ */
+ssize_t
+kvstore_hot_keys(kvstore kvs, struct kvstore_hot_key *keys, size_t n)
+{
+        struct _kvstore_hot     *hot;
+        struct _hot_entry       *e;
+        struct kvstore_hot_key   tmp;
+        size_t                   i, j, filled = 0;
+
+        if ((NULL == kvs) || (NULL == (hot = kvs->hot)) || (NULL == keys))
+                return -1;
+        if (_acquire_kvstore(kvs))
+                return -1;
+
+        for (i = 0; i < hot->n; i++)
+                _hot_fold(hot, &hot->top[i]);
+        _hot_heapify(hot);
+        for (i = 0; (0 != n) && (i < hot->n); i++) {
+                e = &hot->top[i];
+                if (filled == n) {
+                        if (e->reads <= keys[n - 1].reads)
+                                continue;
+                        free(keys[--filled].key);
+                }
+                if (NULL == (keys[filled].key = strndup(e->key, e->key_len)))
+                        break;
+                keys[filled].reads = e->reads;
+                keys[filled].writes = e->writes;
+                keys[filled].replicated = e->replicated;
+                for (j = filled++; (j > 0) &&
+                    (keys[j - 1].reads < keys[j].reads); j--) {
+                        tmp = keys[j - 1];
+                        keys[j - 1] = keys[j];
+                        keys[j] = tmp;
+                }
+        }
+        _unlock_kvstore(kvs);
+        return (ssize_t)filled;
+}
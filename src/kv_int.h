@@ -0,0 +1,231 @@
+/*
+ * Copyright (c) 2013 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+ * OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ * ---------------------------------------------------------------------
+ */
+
+
+#ifndef __LIBKVSTORE_KV_INT_H
+#define __LIBKVSTORE_KV_INT_H
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <semaphore.h>
+#include <stdint.h>
+
+#include "kv.h"
+
+
+/*
+ * val_cap is the size of the allocation behind val, which may be more
+ * than val_len + 1 once a value has been appended to; it is 0 when the
+ * value is not on the heap or is shared through the dedup pool, which
+ * KVSTORE_VAL_POOLED tells apart. A value too long for max_vallen is
+ * held in chunks instead, and val is NULL.
+ */
+struct _kvstore_kv {
+        char                    *key;
+        size_t                   key_len;
+        char                    *val;
+        size_t                   val_len;
+        size_t                   val_cap;
+        struct _kvstore_chunks  *chunks;
+        uint64_t                 hash;
+        uint32_t                 seg;
+        struct _kvstore_kv      *next;
+        TAILQ_ENTRY(_kvstore_kv) entries;
+};
+TAILQ_HEAD(_tq_kvstore_kv, _kvstore_kv);
+
+#define KVSTORE_VAL_POOLED(kvs, kv)                                     \
+        ((NULL != (kvs)->dedup) && (NULL != (kv)->val) &&              \
+         (0 == (kv)->val_cap))
+
+/*
+ * The index is a chained hash table. While it is being resized, entries
+ * live in both table[0] (the old table) and table[1] (the new one), and
+ * rehash is the next bucket in table[0] still waiting to be moved.
+ */
+struct _kvstore_table {
+        struct _kvstore_kv     **buckets;
+        size_t                   size;
+        size_t                   mask;
+        size_t                   used;
+};
+
+struct _kvstore_hasher {
+        KVSTORE_HASH_ALG         alg;
+        uint64_t                 seed[2];
+};
+
+/*
+ * An operation in flight, for tracing: when it started and when it got
+ * the store lock, in _kvstore_ticks.
+ */
+struct _kvstore_span {
+        KVSTORE_OP               op;
+        char                    *key;
+        uint64_t                 start;
+        uint64_t                 locked;
+};
+
+/*
+ * Static probes for perf and bpftrace, compiled in only where the
+ * systemtap headers are installed.
+ */
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define KVSTORE_PROBE1(name, a)         DTRACE_PROBE1(libkvstore, name, a)
+#define KVSTORE_PROBE2(name, a, b)      DTRACE_PROBE2(libkvstore, name, a, b)
+#define KVSTORE_PROBE3(name, a, b, c)   \
+        DTRACE_PROBE3(libkvstore, name, a, b, c)
+#else
+#define KVSTORE_PROBE1(name, a)
+#define KVSTORE_PROBE2(name, a, b)
+#define KVSTORE_PROBE3(name, a, b, c)
+#endif
+
+struct _kvstore {
+        struct _tq_kvstore_kv   *queue;
+        struct _kvstore_table    table[2];
+        ssize_t                  rehash;
+        sem_t                   *sem;
+        size_t                   refs;
+        size_t                   keys;
+        size_t                   max_keylen;
+        size_t                   max_vallen;
+        size_t                   chunk_size;
+        size_t                   max_chunked;
+        size_t                   dedup_min;
+        size_t                   load_threads;
+        int                      reap;
+        struct _kvstore_hasher   hasher;
+        struct timeval           timeo;
+        struct _kvstore_aio     *aio;
+        struct _kvstore_wc      *wc;
+        struct _kvstore_bc      *bc;
+        struct _kvstore_lsm     *lsm;
+        struct _kvstore_cdc     *cdc;
+        struct _kvstore_shm     *shm;
+        struct _kvstore_soa     *soa;
+        struct _kvstore_frozen  *frozen;
+        struct _kvstore_rcache  *rcache;
+        struct _kvstore_dedup   *dedup;
+        struct _kvstore_u64     *u64;
+        struct _kvstore_defrag  *defrag;
+        struct _kvstore_watch   *watch;
+        struct _kvstore_hot     *hot;
+        struct _kvstore_trace   *trace;
+};
+
+
+int              _acquire_kvstore(kvstore);
+int              _unlock_kvstore(kvstore);
+uint64_t         _kvstore_hash(kvstore, const char *, size_t);
+void             _kvstore_hash_init(kvstore);
+struct _kvstore_kv
+                *_kvstore_find(kvstore, char *, size_t, uint64_t);
+struct _kvstore_kv
+                *_kvstore_lookup(kvstore, char *);
+int              _kvstore_set(kvstore, char *, char *);
+char            *_kvstore_get(kvstore, char *, size_t *);
+int              _kvstore_del(kvstore, char *);
+int              _kvstore_presize(kvstore, size_t);
+void             _kvstore_scan_locked(kvstore, size_t *, size_t,
+                    kvstore_scan_cb, void *);
+struct _kvstore_kv
+                *_kvstore_new_kv(char *, size_t, uint64_t);
+void             _kvstore_link(kvstore, struct _kvstore_kv *);
+struct _kvstore_kv
+                *_kvstore_unlink(kvstore, char *, size_t, uint64_t);
+void             _kvstore_free_kv(kvstore, struct _kvstore_kv *);
+void             _kvstore_free_val(kvstore, struct _kvstore_kv *);
+
+void             _kvstore_aio_shutdown(kvstore);
+int              _kvstore_wc_config(kvstore, int);
+int              _kvstore_wc_enqueue(kvstore, KVSTORE_OP, char *, char *);
+void             _kvstore_wc_shutdown(kvstore);
+int              _kvstore_bc_set(kvstore, char *, size_t, uint64_t, char *);
+int              _kvstore_bc_del(kvstore, char *, size_t, uint64_t);
+int              _kvstore_bc_config(kvstore, KVSTORE_CONFIG_OPT, void *);
+void             _kvstore_bc_close(kvstore);
+int              _kvstore_lsm_wrote(kvstore, size_t, size_t, int);
+void             _kvstore_lsm_throttle(kvstore);
+int              _kvstore_lsm_del(kvstore, char *, size_t, uint64_t);
+char            *_kvstore_lsm_get(kvstore, char *, size_t *);
+size_t           _kvstore_lsm_len(kvstore);
+int              _kvstore_lsm_config(kvstore, KVSTORE_CONFIG_OPT, void *);
+void             _kvstore_lsm_close(kvstore);
+void             _kvstore_cdc_log(kvstore, KVSTORE_OP, char *, char *);
+void             _kvstore_cdc_free(kvstore);
+int              _kvstore_shm_lock(kvstore);
+void             _kvstore_shm_unlock(kvstore);
+int              _kvstore_shm_set(kvstore, char *, size_t, uint64_t, char *);
+int              _kvstore_shm_del(kvstore, char *, size_t, uint64_t);
+char            *_kvstore_shm_get(kvstore, char *, size_t *);
+size_t           _kvstore_shm_len(kvstore);
+void             _kvstore_shm_close(kvstore);
+int              _kvstore_soa_set(kvstore, char *, size_t, uint64_t, char *);
+int              _kvstore_soa_del(kvstore, char *, size_t, uint64_t);
+char            *_kvstore_soa_get(kvstore, char *, size_t *);
+void             _kvstore_soa_scan(kvstore, size_t *, size_t,
+                    kvstore_scan_cb, void *);
+int              _kvstore_soa_rehash(kvstore);
+void             _kvstore_soa_free(kvstore);
+void             _kvstore_retire_kv(kvstore, struct _kvstore_kv *);
+int              _kvstore_reap_index(kvstore);
+int              _kvstore_reap_config(kvstore, int);
+void             _kvstore_chunks_free(struct _kvstore_chunks *);
+int              _kvstore_chunk_set(kvstore, char *, size_t, uint64_t,
+                    const struct iovec *, int, size_t);
+int              _kvstore_chunk_write(kvstore, struct _kvstore_kv *, size_t,
+                    const char *, size_t);
+size_t           _kvstore_chunk_read(struct _kvstore_kv *, size_t, size_t,
+                    char *);
+char            *_kvstore_chunk_dup(kvstore, char *);
+int              _kvstore_chunk_config(kvstore, KVSTORE_CONFIG_OPT, size_t);
+char            *_kvstore_frozen_get(kvstore, char *, size_t *);
+void             _kvstore_frozen_scan(kvstore, size_t *, size_t,
+                    kvstore_scan_cb, void *);
+void             _kvstore_frozen_free(kvstore);
+char            *_kvstore_rcache_get(kvstore, char *);
+void             _kvstore_rcache_bump(kvstore, uint64_t);
+int              _kvstore_rcache_config(kvstore, size_t);
+void             _kvstore_rcache_free(kvstore);
+char            *_kvstore_dedup_intern(kvstore, const char *, size_t);
+void             _kvstore_dedup_release(kvstore, char *);
+int              _kvstore_dedup_config(kvstore, size_t);
+void             _kvstore_dedup_free(kvstore);
+size_t           _kvstore_u64_len(kvstore);
+void             _kvstore_u64_free(kvstore);
+int              _kvstore_defrag_config(kvstore, int);
+void             _kvstore_defrag_stop(kvstore);
+void             _kvstore_defrag_free(kvstore);
+void             _kvstore_watch_notify(kvstore, char *, size_t);
+void             _kvstore_watch_free(kvstore);
+int              _kvstore_hot_config(kvstore, KVSTORE_CONFIG_OPT, void *);
+char            *_kvstore_hot_get(kvstore, char *);
+void             _kvstore_hot_write(kvstore, char *, size_t);
+void             _kvstore_hot_free(kvstore);
+uint64_t         _kvstore_ticks(void);
+void             _kvstore_trace_begin(kvstore, struct _kvstore_span *,
+                    KVSTORE_OP, char *);
+void             _kvstore_trace_locked(kvstore, struct _kvstore_span *);
+void             _kvstore_trace_end(kvstore, struct _kvstore_span *, int);
+int              _kvstore_trace_config(kvstore, size_t);
+void             _kvstore_trace_free(kvstore);
+
+#endif
@@ -0,0 +1,475 @@
+/*
+ * Copyright (c) 2013 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+ * OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ * ---------------------------------------------------------------------
+ */
+
+
+/*
+ * Bulk loading. The input file is mapped and cut into one chunk per
+ * thread at record boundaries. In the first pass each thread parses its
+ * chunk and builds finished entries without touching the store, sorting
+ * them into partitions by the low bits of their hash. The index is then
+ * grown once to fit everything, and in the second pass each thread
+ * links in whole partitions. A bucket's index determines its partition,
+ * so no two threads ever touch the same chain. Partitions are taken
+ * chunk by chunk, in file order, so the last record for a key wins.
+ *
+ * Stores with a persistent or shared engine, or a change ring, have to
+ * see every write go through _kvstore_set, so for them the file is
+ * loaded one record at a time instead.
+ */
+
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "kv.h"
+#include "kv_int.h"
+
+
+static const size_t      KVSTORE_LOAD_MAX_PARTS = 1024;
+static const size_t      KVSTORE_LOAD_BATCH = 1024;
+
+
+struct _load_rec {
+        const char      *key;
+        size_t           key_len;
+        const char      *val;
+        size_t           val_len;
+};
+
+struct _load_worker {
+        kvstore                  kvs;
+        struct _load_worker     *all;
+        size_t                   id;
+        size_t                   nworkers;
+        size_t                   nparts;
+        KVSTORE_LOAD_FORMAT      format;
+        const char              *start;
+        const char              *end;
+        struct _kvstore_kv     **heads;
+        struct _kvstore_kv     **tails;
+        size_t                   parsed;
+        size_t                   added;
+        struct _tq_kvstore_kv    queue;
+        int                      failed;
+        int                      running;
+        pthread_t                thread;
+};
+
+
+static int       _load_next(KVSTORE_LOAD_FORMAT, const char **, const char *,
+                    struct _load_rec *);
+static int       _load_valid(kvstore, struct _load_rec *);
+static void     *_load_parse(void *);
+static void     *_load_link(void *);
+static int       _load_split(KVSTORE_LOAD_FORMAT, const char *, size_t,
+                    struct _load_worker *, size_t);
+static ssize_t   _load_serial(kvstore, KVSTORE_LOAD_FORMAT, const char *,
+                    size_t);
+static ssize_t   _load_parallel(kvstore, KVSTORE_LOAD_FORMAT, const char *,
+                    size_t);
+
+
+/*
+ * _load_next reads the record at *p and advances past it. It returns 1
+ * for a record, 0 at the end of the input and -1 if a binary record is
+ * cut short.
+ */
+int
+_load_next(KVSTORE_LOAD_FORMAT format, const char **p, const char *end,
+    struct _load_rec *rec)
+{
+        const char      *line = *p, *eol, *tab;
+        uint32_t         klen, vlen;
+
+        if (line >= end)
+                return 0;
+        if (KVSTORE_LOAD_BINARY == format) {
+                if ((size_t)(end - line) < 2 * sizeof(uint32_t))
+                        return -1;
+                memcpy(&klen, line, sizeof(klen));
+                memcpy(&vlen, line + sizeof(klen), sizeof(vlen));
+                line += 2 * sizeof(uint32_t);
+                if ((size_t)(end - line) < (size_t)klen + vlen)
+                        return -1;
+                rec->key = line;
+                rec->key_len = klen;
+                rec->val = line + klen;
+                rec->val_len = vlen;
+                *p = line + klen + vlen;
+                return 1;
+        }
+
+        if (NULL == (eol = memchr(line, '\n', (size_t)(end - line))))
+                eol = end;
+        *p = eol < end ? eol + 1 : end;
+        if ((eol > line) && ('\r' == eol[-1]))
+                eol--;
+        if (NULL == (tab = memchr(line, '\t', (size_t)(eol - line)))) {
+                rec->key = NULL;
+                return 1;
+        }
+        rec->key = line;
+        rec->key_len = (size_t)(tab - line);
+        rec->val = tab + 1;
+        rec->val_len = (size_t)(eol - tab - 1);
+        return 1;
+}
+
+
+int
+_load_valid(kvstore kvs, struct _load_rec *rec)
+{
+        if ((NULL == rec->key) || (0 == rec->key_len) ||
+            (rec->key_len > kvs->max_keylen) || (0 == rec->val_len) ||
+            (rec->val_len > kvs->max_vallen))
+                return 0;
+        if ((NULL != memchr(rec->key, 0, rec->key_len)) ||
+            (NULL != memchr(rec->val, 0, rec->val_len)))
+                return 0;
+        return 1;
+}
+
+
+void *
+_load_parse(void *arg)
+{
+        struct _load_worker     *w = (struct _load_worker *)arg;
+        struct _kvstore_kv      *kv;
+        struct _load_rec         rec;
+        const char              *p = w->start;
+        uint64_t                 hash;
+        size_t                   part;
+
+        while (1 == _load_next(w->format, &p, w->end, &rec)) {
+                if (!_load_valid(w->kvs, &rec))
+                        continue;
+                hash = _kvstore_hash(w->kvs, rec.key, rec.key_len);
+                kv = _kvstore_new_kv((char *)rec.key, rec.key_len, hash);
+                if ((NULL == kv) ||
+                    (NULL == (kv->val = (char *)malloc(rec.val_len + 1)))) {
+                        free(NULL == kv ? NULL : kv->key);
+                        free(kv);
+                        w->failed = 1;
+                        break;
+                }
+                memcpy(kv->val, rec.val, rec.val_len);
+                kv->val[rec.val_len] = 0;
+                kv->val_len = rec.val_len;
+                kv->val_cap = rec.val_len + 1;
+
+                part = hash & (w->nparts - 1);
+                if (NULL == w->heads[part])
+                        w->heads[part] = kv;
+                else
+                        w->tails[part]->next = kv;
+                w->tails[part] = kv;
+                w->parsed++;
+        }
+        return NULL;
+}
+
+
+/*
+ * _load_link runs with the store locked by the thread that started it,
+ * and links in the entries of every partition it owns.
+ */
+void *
+_load_link(void *arg)
+{
+        struct _load_worker     *w = (struct _load_worker *)arg;
+        struct _kvstore_table   *t = &w->kvs->table[0];
+        struct _kvstore_kv      *kv, *next, *old;
+        size_t                   part, src, idx;
+
+        TAILQ_INIT(&w->queue);
+        for (part = w->id; part < w->nparts; part += w->nworkers) {
+                for (src = 0; src < w->nworkers; src++) {
+                        kv = w->all[src].heads[part];
+                        w->all[src].heads[part] = NULL;
+                        for (; NULL != kv; kv = next) {
+                                next = kv->next;
+                                old = _kvstore_find(w->kvs, kv->key,
+                                    kv->key_len, kv->hash);
+                                if (NULL != old) {
+                                        if (NULL != w->kvs->rcache)
+                                                _kvstore_rcache_bump(w->kvs,
+                                                    old->hash);
+                                        _kvstore_chunks_free(old->chunks);
+                                        old->chunks = NULL;
+                                        _kvstore_free_val(w->kvs, old);
+                                        old->val = kv->val;
+                                        old->val_len = kv->val_len;
+                                        old->val_cap = kv->val_cap;
+                                        free(kv->key);
+                                        free(kv);
+                                        continue;
+                                }
+                                idx = kv->hash & t->mask;
+                                kv->next = t->buckets[idx];
+                                t->buckets[idx] = kv;
+                                TAILQ_INSERT_TAIL(&w->queue, kv, entries);
+                                w->added++;
+                        }
+                }
+        }
+        return NULL;
+}
+
+
+/*
+ * _load_split cuts the input into roughly equal chunks, one per worker,
+ * without splitting a record.
+ */
+int
+_load_split(KVSTORE_LOAD_FORMAT format, const char *map, size_t size,
+    struct _load_worker *w, size_t n)
+{
+        const char              *p = map, *end = map + size, *cut;
+        struct _load_rec         rec;
+        size_t                   i;
+        int                      rc = 1;
+
+        for (i = 0; i < n; i++) {
+                w[i].start = p;
+                cut = map + size / n * (i + 1);
+                if (i == n - 1)
+                        cut = end;
+                if (KVSTORE_LOAD_TSV == format) {
+                        if (cut < p)
+                                cut = p;
+                        if ((cut < end) &&
+                            (NULL != (cut = memchr(cut, '\n',
+                            (size_t)(end - cut)))))
+                                cut++;
+                        p = NULL == cut ? end : cut;
+                } else {
+                        while ((p < cut) &&
+                            (1 == (rc = _load_next(format, &p, end, &rec))))
+                                ;
+                        if (-1 == rc)
+                                return -1;
+                }
+                w[i].end = p;
+        }
+        return 0;
+}
+
+
+ssize_t
+_load_serial(kvstore kvs, KVSTORE_LOAD_FORMAT format, const char *map,
+    size_t size)
+{
+        struct _load_rec         rec;
+        const char              *p = map, *end = map + size;
+        char                    *key = NULL, *val = NULL;
+        ssize_t                  loaded = 0;
+        size_t                   n = 0;
+        int                      rc;
+        int                      locked = 0;
+
+        key = (char *)malloc(kvs->max_keylen + 1);
+        val = (char *)malloc(kvs->max_vallen + 1);
+        if ((NULL == key) || (NULL == val) || _acquire_kvstore(kvs)) {
+                free(key);
+                free(val);
+                return -1;
+        }
+        locked = 1;
+        while (1 == (rc = _load_next(format, &p, end, &rec))) {
+                if (!_load_valid(kvs, &rec))
+                        continue;
+                memcpy(key, rec.key, rec.key_len);
+                key[rec.key_len] = 0;
+                memcpy(val, rec.val, rec.val_len);
+                val[rec.val_len] = 0;
+                if (0 == _kvstore_set(kvs, key, val))
+                        loaded++;
+
+                /* Let other users of the store in now and then. */
+                if (0 == (++n % KVSTORE_LOAD_BATCH)) {
+                        _unlock_kvstore(kvs);
+                        if (_acquire_kvstore(kvs)) {
+                                locked = 0;
+                                rc = -1;
+                                break;
+                        }
+                }
+        }
+        if (locked)
+                _unlock_kvstore(kvs);
+        free(key);
+        free(val);
+        return -1 == rc ? -1 : loaded;
+}
+
+
+ssize_t
+_load_parallel(kvstore kvs, KVSTORE_LOAD_FORMAT format, const char *map,
+    size_t size)
+{
+        struct _load_worker     *w;
+        struct _kvstore_kv      *kv, *next;
+        size_t                   n, nparts = 1, i, part, total = 0;
+        ssize_t                  loaded = -1;
+        long                     ncpu;
+
+        n = kvs->load_threads;
+        if ((0 == n) && (0 >= (ncpu = sysconf(_SC_NPROCESSORS_ONLN))))
+                n = 1;
+        else if (0 == n)
+                n = (size_t)ncpu;
+        while ((nparts < n * 4) && (nparts < KVSTORE_LOAD_MAX_PARTS))
+                nparts <<= 1;
+
+        if (NULL == (w = (struct _load_worker *)calloc(n,
+            sizeof(struct _load_worker))))
+                return -1;
+        for (i = 0; i < n; i++) {
+                w[i].kvs = kvs;
+                w[i].all = w;
+                w[i].id = i;
+                w[i].nworkers = n;
+                w[i].nparts = nparts;
+                w[i].format = format;
+                w[i].heads = (struct _kvstore_kv **)calloc(nparts,
+                    sizeof(struct _kvstore_kv *));
+                w[i].tails = (struct _kvstore_kv **)calloc(nparts,
+                    sizeof(struct _kvstore_kv *));
+                if ((NULL == w[i].heads) || (NULL == w[i].tails))
+                        goto load_done;
+        }
+        if (_load_split(format, map, size, w, n)) {
+                errno = EINVAL;
+                goto load_done;
+        }
+
+        for (i = 0; i < n; i++) {
+                if (pthread_create(&w[i].thread, NULL, _load_parse, &w[i]))
+                        _load_parse(&w[i]);
+                else
+                        w[i].running = 1;
+        }
+        for (i = 0; i < n; i++) {
+                if (w[i].running)
+                        pthread_join(w[i].thread, NULL);
+                w[i].running = 0;
+        }
+        for (i = 0; i < n; i++) {
+                if (w[i].failed)
+                        goto load_done;
+                total += w[i].parsed;
+        }
+
+        if (_acquire_kvstore(kvs))
+                goto load_done;
+        if (_kvstore_presize(kvs, kvs->keys + total < nparts ? nparts :
+            kvs->keys + total)) {
+                _unlock_kvstore(kvs);
+                goto load_done;
+        }
+        for (i = 0; i < n; i++) {
+                if (pthread_create(&w[i].thread, NULL, _load_link, &w[i]))
+                        _load_link(&w[i]);
+                else
+                        w[i].running = 1;
+        }
+        loaded = 0;
+        for (i = 0; i < n; i++) {
+                if (w[i].running)
+                        pthread_join(w[i].thread, NULL);
+                kvs->table[0].used += w[i].added;
+                kvs->keys += w[i].added;
+                TAILQ_CONCAT(kvs->queue, &w[i].queue, entries);
+                loaded += (ssize_t)w[i].parsed;
+        }
+        _unlock_kvstore(kvs);
+
+load_done:
+        for (i = 0; i < n; i++) {
+                for (part = 0; (NULL != w[i].heads) && (part < nparts);
+                    part++) {
+                        for (kv = w[i].heads[part]; NULL != kv; kv = next) {
+                                next = kv->next;
+                                free(kv->key);
+                                free(kv->val);
+                                free(kv);
+                        }
+                }
+                free(w[i].heads);
+                free(w[i].tails);
+        }
+        free(w);
+        return loaded;
+}
+
+
+/*
+ * kvstore_bulk_load adds every record in the file at path to the store,
+ * using KVSTORE_LOAD_THREADS threads. A TSV record is a line holding a
+ * key, a tab and a value; a binary record is the key and value lengths
+ * as two 32-bit integers in host byte order followed by the key and the
+ * value. Records that could not be set with kvstore_set are skipped.
+ * Returns the number of records loaded.
+ */
+ssize_t
+kvstore_bulk_load(kvstore kvs, const char *path, KVSTORE_LOAD_FORMAT format)
+{
+        struct stat      st;
+        ssize_t          loaded;
+        char            *map;
+        int              fd;
+
+        if ((NULL == kvs) || (NULL == path) || (NULL != kvs->frozen) ||
+            ((KVSTORE_LOAD_TSV != format) && (KVSTORE_LOAD_BINARY != format)))
+                return -1;
+        if (-1 == (fd = open(path, O_RDONLY | O_CLOEXEC)))
+                return -1;
+        if (fstat(fd, &st)) {
+                close(fd);
+                return -1;
+        }
+        if (0 == st.st_size) {
+                close(fd);
+                return 0;
+        }
+        map = (char *)mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE,
+            fd, 0);
+        close(fd);
+        if (MAP_FAILED == map)
+                return -1;
+        posix_madvise(map, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+
+        if (NULL != kvs->wc)
+                kvstore_wc_sync(kvs);
+        if ((NULL != kvs->bc) || (NULL != kvs->lsm) || (NULL != kvs->shm) ||
+            (NULL != kvs->soa) || (NULL != kvs->cdc) || (NULL != kvs->watch) ||
+            (NULL != kvs->hot) || (NULL != kvs->dedup))
+                loaded = _load_serial(kvs, format, map, (size_t)st.st_size);
+        else
+                loaded = _load_parallel(kvs, format, map, (size_t)st.st_size);
+        munmap(map, (size_t)st.st_size);
+        return loaded;
+}
@@ -0,0 +1,1652 @@
+/*
+ * Copyright (c) 2013 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+ * OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ * ---------------------------------------------------------------------
+ */
+
+
+/*
+ * An LSM-tree engine. The store's own hash index is the memtable; once
+ * it holds KVSTORE_MEMTABLE_SIZE bytes it is frozen as the immutable
+ * memtable (imm) and a background worker writes it out as a sorted
+ * table (SSTable) in level 0. The worker also compacts levels: all of
+ * level 0 is merged into level 1 once it has four tables, and a level
+ * that outgrows its budget (ten times the one above it) has one table
+ * at a time merged into the next level. Below level 0 the tables in a
+ * level never overlap.
+ *
+ * A table is a run of data blocks, a block index, a Bloom filter and a
+ * fixed-size footer. Entries are
+ *
+ *      key length | value length | key \0 | value \0
+ *
+ * sorted by key, with a value length of KVSTORE_LSM_TOMBSTONE (and no
+ * value) marking a delete. Lookups go memtable, imm, level 0 from newest
+ * to oldest, then one table per deeper level; tables whose Bloom filter
+ * rules the key out are skipped without touching their blocks. Tables
+ * are mapped read-only, so values are returned from the mapping.
+ *
+ * kvstore_get hands out pointers into the memtables and the mappings,
+ * which the worker would otherwise free and unmap behind the caller's
+ * back. So a flushed memtable and the inputs to a compaction are only
+ * retired, and released once the store has been written to since: a
+ * value read from an LSM store is good until the next set or delete of
+ * any key.
+ *
+ * The MANIFEST file lists the live tables of each level and is replaced
+ * atomically after every flush and compaction. Only flushed data is
+ * durable: the memtable is written out when the store is discarded.
+ */
+
+
+#include <sys/types.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "kv.h"
+#include "kv_int.h"
+
+
+const size_t             KVSTORE_DEFAULT_MEMTABLE_SIZE = 4 * 1024 * 1024;
+static const uint32_t    KVSTORE_LSM_TOMBSTONE = UINT32_MAX;
+static const size_t      KVSTORE_LSM_BLOCK = 4096;
+static const size_t      KVSTORE_LSM_L0_TABLES = 4;
+static const uint64_t    KVSTORE_LSM_MAGIC = 0x6b7673746f726531ULL;
+static const uint32_t    KVSTORE_LSM_BLOOM_K = 7;
+
+
+struct _sst_footer {
+        uint64_t         index_off;
+        uint64_t         index_len;
+        uint64_t         bloom_off;
+        uint64_t         bloom_len;
+        uint64_t         entries;
+        uint32_t         bloom_k;
+        uint32_t         nblocks;
+        uint64_t         magic;
+};
+
+struct _sst_block {
+        uint64_t         off;
+        uint32_t         len;
+        uint32_t         key_len;
+        char            *key;
+};
+
+struct _kvstore_sst {
+        uint32_t                 id;
+        char                    *map;
+        size_t                   size;
+        size_t                   data_end;
+        struct _sst_block       *blocks;
+        uint32_t                 nblocks;
+        unsigned char           *bloom;
+        uint64_t                 bloom_bits;
+        uint32_t                 bloom_k;
+        char                    *last;
+        uint32_t                 last_len;
+};
+
+struct _kvstore_level {
+        struct _kvstore_sst    **t;
+        size_t                   n;
+        size_t                   cap;
+        uint64_t                 bytes;
+        size_t                   next;
+};
+
+struct _sst_writer {
+        int              fd;
+        uint32_t         id;
+        uint64_t         off;
+        char            *block;
+        size_t           block_len;
+        size_t           block_cap;
+        char            *index;
+        size_t           index_len;
+        size_t           index_cap;
+        size_t           index_pos;
+        uint64_t        *hashes;
+        size_t           nhashes;
+        size_t           hashes_cap;
+        uint32_t         nblocks;
+};
+
+/*
+ * What one flush or compaction retired: the flushed memtable, or the
+ * tables that were merged away.
+ */
+struct _lsm_retired {
+        struct _lsm_retired     *next;
+        kvstore                  imm;
+        struct _kvstore_sst    **t;
+        size_t                   n;
+};
+
+struct _kvstore_lsm {
+        char                    *path;
+        int                      lockfd;
+        struct _kvstore_level    levels[KVSTORE_LSM_LEVELS];
+        kvstore                  imm;
+        uint32_t                 next_id;
+        size_t                   mem_bytes;
+        size_t                   mem_max;
+        size_t                   dead;
+        uint64_t                 writes;
+        uint64_t                 retired_at;
+        struct _lsm_retired     *retired;
+        struct kvstore_lsm_stats stats;
+        pthread_mutex_t          work;
+        pthread_mutex_t          stall_lock;
+        pthread_cond_t           stall_cv;
+        int                      stall;
+        sem_t                    kick;
+        pthread_t                worker;
+        int                      started;
+        int                      stop;
+};
+
+struct _lsm_run {
+        struct _kvstore_sst    **t;
+        size_t                   n;
+        size_t                   ti;
+        size_t                   pos;
+        char                    *key;
+        uint32_t                 key_len;
+        uint32_t                 val_len;
+        char                    *val;
+};
+
+
+static uint64_t  _lsm_hash(const char *, size_t);
+static int       _lsm_cmp(const char *, size_t, const char *, size_t);
+static uint32_t  _get32(const char *);
+static uint64_t  _get64(const char *);
+static int       _buf_append(char **, size_t *, size_t *, const void *,
+                    size_t);
+static char     *_lsm_path(struct _kvstore_lsm *, const char *, uint32_t);
+static int       _write_all(int, const char *, size_t);
+static int       _sst_create(struct _kvstore_lsm *, struct _sst_writer *);
+static int       _sst_flush_block(struct _sst_writer *);
+static int       _sst_add(struct _sst_writer *, const char *, uint32_t,
+                    const char *, uint32_t);
+static struct _kvstore_sst
+                *_sst_finish(struct _kvstore_lsm *, struct _sst_writer *);
+static void      _sst_abort(struct _kvstore_lsm *, struct _sst_writer *);
+static struct _kvstore_sst
+                *_sst_open(struct _kvstore_lsm *, uint32_t);
+static void      _sst_close(struct _kvstore_sst *);
+static void      _sst_unlink(struct _kvstore_lsm *, uint32_t);
+static int       _sst_get(struct _kvstore_lsm *, struct _kvstore_sst *,
+                    const char *, size_t, uint64_t, char **, size_t *);
+static int       _level_insert(struct _kvstore_level *, size_t,
+                    struct _kvstore_sst *);
+static void      _level_remove(struct _kvstore_level *,
+                    struct _kvstore_sst *);
+static int       _level_add_sorted(struct _kvstore_level *,
+                    struct _kvstore_sst *);
+static int       _lsm_write_manifest(struct _kvstore_lsm *);
+static int       _lsm_load(struct _kvstore_lsm *);
+static void      _lsm_swap_index(kvstore, kvstore);
+static int       _lsm_freeze(kvstore);
+static int       _lsm_cmp_kv(const void *, const void *);
+static int       _lsm_flush(kvstore);
+static void      _run_load(struct _lsm_run *);
+static void      _run_next(struct _lsm_run *);
+static uint64_t  _level_max(struct _kvstore_lsm *, int);
+static int       _lsm_pick(struct _kvstore_lsm *);
+static int       _lsm_compact(kvstore, int);
+static void      _lsm_retire(struct _kvstore_lsm *, struct _lsm_retired *);
+static void      _lsm_release(kvstore, int);
+static void     *_lsm_worker(void *);
+
+
+/*
+ * Tables outlive the process, so the Bloom filters use a fixed hash
+ * rather than the store's: FNV-1a with a murmur3 finalizer.
+ */
+uint64_t
+_lsm_hash(const char *key, size_t len)
+{
+        uint64_t        h = 0xcbf29ce484222325ULL;
+        size_t          i;
+
+        for (i = 0; i < len; i++) {
+                h ^= (unsigned char)key[i];
+                h *= 0x100000001b3ULL;
+        }
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h;
+}
+
+
+int
+_lsm_cmp(const char *a, size_t alen, const char *b, size_t blen)
+{
+        int     c;
+
+        c = memcmp(a, b, alen < blen ? alen : blen);
+        if (0 != c)
+                return c;
+        if (alen == blen)
+                return 0;
+        return alen < blen ? -1 : 1;
+}
+
+
+uint32_t
+_get32(const char *p)
+{
+        uint32_t        v;
+
+        memcpy(&v, p, sizeof(v));
+        return v;
+}
+
+
+uint64_t
+_get64(const char *p)
+{
+        uint64_t        v;
+
+        memcpy(&v, p, sizeof(v));
+        return v;
+}
+
+
+int
+_buf_append(char **buf, size_t *len, size_t *cap, const void *data,
+    size_t n)
+{
+        char    *nbuf;
+        size_t   ncap;
+
+        if (*len + n > *cap) {
+                ncap = *cap ? *cap : 4096;
+                while (*len + n > ncap)
+                        ncap *= 2;
+                if (NULL == (nbuf = (char *)realloc(*buf, ncap)))
+                        return -1;
+                *buf = nbuf;
+                *cap = ncap;
+        }
+        memcpy(*buf + *len, data, n);
+        *len += n;
+        return 0;
+}
+
+
+char *
+_lsm_path(struct _kvstore_lsm *lsm, const char *name, uint32_t id)
+{
+        char    *path;
+        size_t   len;
+
+        len = strlen(lsm->path) + 32;
+        if (NULL == (path = (char *)malloc(len)))
+                return NULL;
+        if (NULL == name)
+                snprintf(path, len, "%s/%06u.sst", lsm->path,
+                    (unsigned int)id);
+        else
+                snprintf(path, len, "%s/%s", lsm->path, name);
+        return path;
+}
+
+
+int
+_write_all(int fd, const char *buf, size_t len)
+{
+        ssize_t n;
+
+        while (len > 0) {
+                n = write(fd, buf, len);
+                if (-1 == n) {
+                        if (EINTR == errno)
+                                continue;
+                        return -1;
+                }
+                buf += n;
+                len -= (size_t)n;
+        }
+        return 0;
+}
+
+
+int
+_sst_create(struct _kvstore_lsm *lsm, struct _sst_writer *w)
+{
+        char    *path;
+
+        memset(w, 0x0, sizeof(struct _sst_writer));
+        w->id = lsm->next_id++;
+        if (NULL == (path = _lsm_path(lsm, NULL, w->id)))
+                return -1;
+        w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        free(path);
+        return -1 == w->fd ? -1 : 0;
+}
+
+
+int
+_sst_flush_block(struct _sst_writer *w)
+{
+        uint32_t        len = (uint32_t)w->block_len;
+
+        if (0 == w->block_len)
+                return 0;
+        if (_write_all(w->fd, w->block, w->block_len))
+                return -1;
+        memcpy(w->index + w->index_pos + sizeof(uint64_t), &len, sizeof(len));
+        w->off += w->block_len;
+        w->block_len = 0;
+        return 0;
+}
+
+
+/*
+ * _sst_add appends an entry; entries must arrive in key order. A block
+ * is cut once it reaches KVSTORE_LSM_BLOCK bytes.
+ */
+int
+_sst_add(struct _sst_writer *w, const char *key, uint32_t klen,
+    const char *val, uint32_t vlen)
+{
+        uint64_t        *hashes;
+        uint32_t         zero = 0;
+        size_t           cap;
+
+        if (0 == w->block_len) {
+                w->index_pos = w->index_len;
+                if (_buf_append(&w->index, &w->index_len, &w->index_cap,
+                    &w->off, sizeof(w->off)) ||
+                    _buf_append(&w->index, &w->index_len, &w->index_cap,
+                    &zero, sizeof(zero)) ||
+                    _buf_append(&w->index, &w->index_len, &w->index_cap,
+                    &klen, sizeof(klen)) ||
+                    _buf_append(&w->index, &w->index_len, &w->index_cap,
+                    key, klen + 1))
+                        return -1;
+                w->nblocks++;
+        }
+
+        if (_buf_append(&w->block, &w->block_len, &w->block_cap, &klen,
+            sizeof(klen)) ||
+            _buf_append(&w->block, &w->block_len, &w->block_cap, &vlen,
+            sizeof(vlen)) ||
+            _buf_append(&w->block, &w->block_len, &w->block_cap, key,
+            klen + 1))
+                return -1;
+        if ((KVSTORE_LSM_TOMBSTONE != vlen) &&
+            _buf_append(&w->block, &w->block_len, &w->block_cap, val,
+            vlen + 1))
+                return -1;
+
+        if (w->nhashes == w->hashes_cap) {
+                cap = w->hashes_cap ? w->hashes_cap * 2 : 1024;
+                hashes = (uint64_t *)realloc(w->hashes,
+                    cap * sizeof(uint64_t));
+                if (NULL == hashes)
+                        return -1;
+                w->hashes = hashes;
+                w->hashes_cap = cap;
+        }
+        w->hashes[w->nhashes++] = _lsm_hash(key, klen);
+
+        if (w->block_len >= KVSTORE_LSM_BLOCK)
+                return _sst_flush_block(w);
+        return 0;
+}
+
+
+/*
+ * _sst_finish writes the index, a Bloom filter at ten bits per key and
+ * the footer, syncs the file and opens the finished table.
+ */
+struct _kvstore_sst *
+_sst_finish(struct _kvstore_lsm *lsm, struct _sst_writer *w)
+{
+        struct _sst_footer       footer;
+        unsigned char           *bloom = NULL;
+        uint64_t                 bits, h1, h2;
+        size_t                   i;
+        uint32_t                 k;
+        uint32_t                 id = w->id;
+
+        if (_sst_flush_block(w))
+                goto finish_fail;
+
+        bits = (uint64_t)w->nhashes * 10;
+        if (bits < 64)
+                bits = 64;
+        bits = (bits + 7) & ~(uint64_t)7;
+        if (NULL == (bloom = (unsigned char *)calloc(bits / 8, 1)))
+                goto finish_fail;
+        for (i = 0; i < w->nhashes; i++) {
+                h1 = w->hashes[i] & 0xffffffffULL;
+                h2 = (w->hashes[i] >> 32) | 1;
+                for (k = 0; k < KVSTORE_LSM_BLOOM_K; k++) {
+                        bloom[((h1 + k * h2) % bits) / 8] |=
+                            (unsigned char)(1 << (((h1 + k * h2) % bits) % 8));
+                }
+        }
+
+        memset(&footer, 0x0, sizeof(footer));
+        footer.index_off = w->off;
+        footer.index_len = w->index_len;
+        footer.bloom_off = w->off + w->index_len;
+        footer.bloom_len = bits / 8;
+        footer.entries = w->nhashes;
+        footer.bloom_k = KVSTORE_LSM_BLOOM_K;
+        footer.nblocks = w->nblocks;
+        footer.magic = KVSTORE_LSM_MAGIC;
+        if (_write_all(w->fd, w->index, w->index_len) ||
+            _write_all(w->fd, (char *)bloom, bits / 8) ||
+            _write_all(w->fd, (char *)&footer, sizeof(footer)) ||
+            fsync(w->fd))
+                goto finish_fail;
+
+        free(bloom);
+        close(w->fd);
+        free(w->block);
+        free(w->index);
+        free(w->hashes);
+        return _sst_open(lsm, id);
+
+finish_fail:
+        free(bloom);
+        _sst_abort(lsm, w);
+        return NULL;
+}
+
+
+void
+_sst_abort(struct _kvstore_lsm *lsm, struct _sst_writer *w)
+{
+        char    *path;
+
+        close(w->fd);
+        if (NULL != (path = _lsm_path(lsm, NULL, w->id))) {
+                unlink(path);
+                free(path);
+        }
+        free(w->block);
+        free(w->index);
+        free(w->hashes);
+}
+
+
+struct _kvstore_sst *
+_sst_open(struct _kvstore_lsm *lsm, uint32_t id)
+{
+        struct _kvstore_sst     *t;
+        struct _sst_footer       footer;
+        struct stat              st;
+        char                    *path, *p, *end;
+        uint32_t                 i, klen, vlen;
+        int                      fd;
+
+        if (NULL == (path = _lsm_path(lsm, NULL, id)))
+                return NULL;
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        free(path);
+        if (-1 == fd)
+                return NULL;
+        if (NULL == (t = (struct _kvstore_sst *)calloc(1, sizeof(*t)))) {
+                close(fd);
+                return NULL;
+        }
+        t->id = id;
+        t->map = MAP_FAILED;
+        if (fstat(fd, &st) || ((size_t)st.st_size < sizeof(footer)))
+                goto open_fail;
+        t->size = (size_t)st.st_size;
+        t->map = (char *)mmap(NULL, t->size, PROT_READ, MAP_SHARED, fd, 0);
+        if (MAP_FAILED == t->map)
+                goto open_fail;
+        close(fd);
+        fd = -1;
+
+        memcpy(&footer, t->map + t->size - sizeof(footer), sizeof(footer));
+        if ((KVSTORE_LSM_MAGIC != footer.magic) || (0 == footer.nblocks) ||
+            (footer.bloom_off + footer.bloom_len + sizeof(footer) !=
+            t->size))
+                goto open_fail;
+        t->data_end = footer.index_off;
+        t->bloom = (unsigned char *)t->map + footer.bloom_off;
+        t->bloom_bits = footer.bloom_len * 8;
+        t->bloom_k = footer.bloom_k;
+        t->nblocks = footer.nblocks;
+        t->blocks = (struct _sst_block *)calloc(t->nblocks,
+            sizeof(struct _sst_block));
+        if (NULL == t->blocks)
+                goto open_fail;
+
+        p = t->map + footer.index_off;
+        end = p + footer.index_len;
+        for (i = 0; i < t->nblocks; i++) {
+                if (p + 16 > end)
+                        goto open_fail;
+                t->blocks[i].off = _get64(p);
+                t->blocks[i].len = _get32(p + 8);
+                t->blocks[i].key_len = _get32(p + 12);
+                t->blocks[i].key = p + 16;
+                p += 16 + t->blocks[i].key_len + 1;
+        }
+
+        p = t->map + t->blocks[t->nblocks - 1].off;
+        end = p + t->blocks[t->nblocks - 1].len;
+        while (p < end) {
+                klen = _get32(p);
+                vlen = _get32(p + 4);
+                t->last = p + 8;
+                t->last_len = klen;
+                p += 8 + klen + 1;
+                if (KVSTORE_LSM_TOMBSTONE != vlen)
+                        p += vlen + 1;
+        }
+        return t;
+
+open_fail:
+        if (-1 != fd)
+                close(fd);
+        _sst_close(t);
+        return NULL;
+}
+
+
+void
+_sst_close(struct _kvstore_sst *t)
+{
+        if (NULL == t)
+                return;
+        if (MAP_FAILED != t->map)
+                munmap(t->map, t->size);
+        free(t->blocks);
+        free(t);
+}
+
+
+void
+_sst_unlink(struct _kvstore_lsm *lsm, uint32_t id)
+{
+        char    *path;
+
+        if (NULL != (path = _lsm_path(lsm, NULL, id))) {
+                unlink(path);
+                free(path);
+        }
+}
+
+
+/*
+ * _sst_get returns 1 if the table has an entry for key, setting *val to
+ * the value or to NULL for a delete, and 0 if it does not.
+ */
+int
+_sst_get(struct _kvstore_lsm *lsm, struct _kvstore_sst *t, const char *key,
+    size_t klen, uint64_t h, char **val, size_t *vlen)
+{
+        uint64_t         h1, h2, bit;
+        uint32_t         lo, hi, mid, k, eklen, evlen;
+        char            *p, *end;
+        int              c;
+
+        h1 = h & 0xffffffffULL;
+        h2 = (h >> 32) | 1;
+        for (k = 0; k < t->bloom_k; k++) {
+                bit = (h1 + k * h2) % t->bloom_bits;
+                if (0 == (t->bloom[bit / 8] & (1 << (bit % 8)))) {
+                        lsm->stats.bloom_skips++;
+                        return 0;
+                }
+        }
+
+        lo = 0;
+        hi = t->nblocks;
+        while (lo < hi) {
+                mid = lo + (hi - lo) / 2;
+                if (_lsm_cmp(t->blocks[mid].key, t->blocks[mid].key_len,
+                    key, klen) <= 0)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+        if (0 == lo)
+                return 0;
+
+        lsm->stats.block_reads++;
+        p = t->map + t->blocks[lo - 1].off;
+        end = p + t->blocks[lo - 1].len;
+        while (p < end) {
+                eklen = _get32(p);
+                evlen = _get32(p + 4);
+                c = _lsm_cmp(p + 8, eklen, key, klen);
+                if (0 == c) {
+                        if (KVSTORE_LSM_TOMBSTONE == evlen) {
+                                *val = NULL;
+                        } else {
+                                *val = p + 8 + eklen + 1;
+                                *vlen = evlen;
+                        }
+                        return 1;
+                }
+                if (c > 0)
+                        break;
+                p += 8 + eklen + 1;
+                if (KVSTORE_LSM_TOMBSTONE != evlen)
+                        p += evlen + 1;
+        }
+        return 0;
+}
+
+
+int
+_level_insert(struct _kvstore_level *l, size_t idx, struct _kvstore_sst *t)
+{
+        struct _kvstore_sst     **nt;
+        size_t                    cap;
+
+        if (l->n == l->cap) {
+                cap = l->cap ? l->cap * 2 : 8;
+                nt = (struct _kvstore_sst **)realloc(l->t,
+                    cap * sizeof(struct _kvstore_sst *));
+                if (NULL == nt)
+                        return -1;
+                l->t = nt;
+                l->cap = cap;
+        }
+        memmove(&l->t[idx + 1], &l->t[idx],
+            (l->n - idx) * sizeof(struct _kvstore_sst *));
+        l->t[idx] = t;
+        l->n++;
+        l->bytes += t->size;
+        return 0;
+}
+
+
+void
+_level_remove(struct _kvstore_level *l, struct _kvstore_sst *t)
+{
+        size_t  i;
+
+        for (i = 0; i < l->n; i++) {
+                if (l->t[i] != t)
+                        continue;
+                memmove(&l->t[i], &l->t[i + 1],
+                    (l->n - i - 1) * sizeof(struct _kvstore_sst *));
+                l->n--;
+                l->bytes -= t->size;
+                return;
+        }
+}
+
+
+int
+_level_add_sorted(struct _kvstore_level *l, struct _kvstore_sst *t)
+{
+        size_t  i;
+
+        for (i = 0; i < l->n; i++) {
+                if (_lsm_cmp(t->blocks[0].key, t->blocks[0].key_len,
+                    l->t[i]->blocks[0].key, l->t[i]->blocks[0].key_len) < 0)
+                        break;
+        }
+        return _level_insert(l, i, t);
+}
+
+
+int
+_lsm_write_manifest(struct _kvstore_lsm *lsm)
+{
+        char    *tmp, *path;
+        FILE    *f;
+        size_t   i;
+        int      lvl;
+        int      retval = -1;
+
+        tmp = _lsm_path(lsm, "MANIFEST.tmp", 0);
+        path = _lsm_path(lsm, "MANIFEST", 0);
+        if ((NULL == tmp) || (NULL == path))
+                goto manifest_done;
+        if (NULL == (f = fopen(tmp, "w")))
+                goto manifest_done;
+        fprintf(f, "next %u\n", (unsigned int)lsm->next_id);
+        for (lvl = 0; lvl < KVSTORE_LSM_LEVELS; lvl++) {
+                for (i = 0; i < lsm->levels[lvl].n; i++)
+                        fprintf(f, "%d %u\n", lvl,
+                            (unsigned int)lsm->levels[lvl].t[i]->id);
+        }
+        if (fflush(f) || fsync(fileno(f))) {
+                fclose(f);
+                goto manifest_done;
+        }
+        if (fclose(f))
+                goto manifest_done;
+        retval = rename(tmp, path);
+
+manifest_done:
+        free(tmp);
+        free(path);
+        return retval;
+}
+
+
+/*
+ * _lsm_load opens the tables listed in the manifest and removes any
+ * table file it does not mention, which is what an interrupted flush or
+ * compaction leaves behind.
+ */
+int
+_lsm_load(struct _kvstore_lsm *lsm)
+{
+        struct _kvstore_sst     *t;
+        struct dirent           *de;
+        DIR                     *dir;
+        FILE                    *f;
+        char                    *path;
+        unsigned int             id, next = 0;
+        int                      lvl, live;
+        size_t                   i;
+
+        if (NULL == (path = _lsm_path(lsm, "MANIFEST", 0)))
+                return -1;
+        f = fopen(path, "r");
+        free(path);
+        if (NULL != f) {
+                if (1 != fscanf(f, "next %u\n", &next)) {
+                        fclose(f);
+                        return -1;
+                }
+                while (2 == fscanf(f, "%d %u\n", &lvl, &id)) {
+                        if ((lvl < 0) || (lvl >= KVSTORE_LSM_LEVELS) ||
+                            (NULL == (t = _sst_open(lsm, id)))) {
+                                fclose(f);
+                                return -1;
+                        }
+                        if (_level_insert(&lsm->levels[lvl],
+                            lsm->levels[lvl].n, t)) {
+                                _sst_close(t);
+                                fclose(f);
+                                return -1;
+                        }
+                }
+                fclose(f);
+        }
+        lsm->next_id = next;
+
+        if (NULL == (dir = opendir(lsm->path)))
+                return -1;
+        while (NULL != (de = readdir(dir))) {
+                if ((1 != sscanf(de->d_name, "%6u.sst", &id)) ||
+                    (NULL == strstr(de->d_name, ".sst")))
+                        continue;
+                live = 0;
+                for (lvl = 0; !live && lvl < KVSTORE_LSM_LEVELS; lvl++) {
+                        for (i = 0; i < lsm->levels[lvl].n; i++) {
+                                if (lsm->levels[lvl].t[i]->id == id)
+                                        live = 1;
+                        }
+                }
+                if (live)
+                        continue;
+                _sst_unlink(lsm, id);
+                if (id >= lsm->next_id)
+                        lsm->next_id = id + 1;
+        }
+        closedir(dir);
+        return 0;
+}
+
+
+/*
+ * _lsm_swap_index exchanges the hash indexes of two stores; freezing the
+ * memtable is a swap with a fresh, empty store.
+ */
+void
+_lsm_swap_index(kvstore a, kvstore b)
+{
+        struct _tq_kvstore_kv   *queue;
+        struct _kvstore_table    table[2];
+        ssize_t                  rehash;
+        size_t                   keys;
+
+        queue = a->queue;
+        memcpy(table, a->table, sizeof(table));
+        rehash = a->rehash;
+        keys = a->keys;
+
+        a->queue = b->queue;
+        memcpy(a->table, b->table, sizeof(table));
+        a->rehash = b->rehash;
+        a->keys = b->keys;
+
+        b->queue = queue;
+        memcpy(b->table, table, sizeof(table));
+        b->rehash = rehash;
+        b->keys = keys;
+}
+
+
+/*
+ * _lsm_freeze is called with the store locked when the memtable is full.
+ */
+int
+_lsm_freeze(kvstore kvs)
+{
+        struct _kvstore_lsm     *lsm = kvs->lsm;
+        kvstore                  imm;
+
+        if ((NULL != lsm->imm) || (0 == kvs->keys))
+                return 0;
+        if (NULL == (imm = kvstore_new()))
+                return -1;
+        imm->max_keylen = kvs->max_keylen;
+        imm->hasher = kvs->hasher;
+        _lsm_swap_index(kvs, imm);
+        lsm->imm = imm;
+        lsm->mem_bytes = 0;
+        lsm->dead = 0;
+        if (lsm->started)
+                sem_post(&lsm->kick);
+        return 0;
+}
+
+
+int
+_lsm_cmp_kv(const void *a, const void *b)
+{
+        const struct _kvstore_kv *ka = *(struct _kvstore_kv * const *)a;
+        const struct _kvstore_kv *kb = *(struct _kvstore_kv * const *)b;
+
+        return _lsm_cmp(ka->key, ka->key_len, kb->key, kb->key_len);
+}
+
+
+/*
+ * _lsm_flush writes the immutable memtable out as a level 0 table. The
+ * memtable cannot change while it is written, so the store is only
+ * locked to install the table. If the manifest cannot be written, the
+ * table is dropped and the memtable kept for the next try.
+ */
+int
+_lsm_flush(kvstore kvs)
+{
+        struct _kvstore_lsm     *lsm = kvs->lsm;
+        struct _kvstore_kv     **kvs_sorted, *kv;
+        struct _kvstore_sst     *t;
+        struct _lsm_retired     *r;
+        struct _sst_writer       w;
+        kvstore                  imm;
+        size_t                   i, n = 0;
+        int                      rc;
+
+        if (_acquire_kvstore(kvs))
+                return -1;
+        imm = lsm->imm;
+        _unlock_kvstore(kvs);
+        if (NULL == imm)
+                return 0;
+        r = (struct _lsm_retired *)calloc(1, sizeof(struct _lsm_retired));
+        kvs_sorted = (struct _kvstore_kv **)calloc(imm->keys + 1,
+            sizeof(struct _kvstore_kv *));
+        if ((NULL == r) || (NULL == kvs_sorted)) {
+                free(r);
+                free(kvs_sorted);
+                return -1;
+        }
+        TAILQ_FOREACH(kv, imm->queue, entries)
+                kvs_sorted[n++] = kv;
+        qsort(kvs_sorted, n, sizeof(struct _kvstore_kv *), _lsm_cmp_kv);
+
+        if (_acquire_kvstore(kvs)) {
+                free(r);
+                free(kvs_sorted);
+                return -1;
+        }
+        rc = _sst_create(lsm, &w);
+        _unlock_kvstore(kvs);
+        if (rc) {
+                free(r);
+                free(kvs_sorted);
+                return -1;
+        }
+        for (i = 0; i < n; i++) {
+                kv = kvs_sorted[i];
+                if (_sst_add(&w, kv->key, (uint32_t)kv->key_len, kv->val,
+                    NULL == kv->val ? KVSTORE_LSM_TOMBSTONE :
+                    (uint32_t)kv->val_len)) {
+                        _sst_abort(lsm, &w);
+                        free(r);
+                        free(kvs_sorted);
+                        return -1;
+                }
+        }
+        free(kvs_sorted);
+        if (NULL == (t = _sst_finish(lsm, &w))) {
+                free(r);
+                return -1;
+        }
+
+        if (_acquire_kvstore(kvs))
+                goto flush_fail;
+        if (_level_insert(&lsm->levels[0], 0, t)) {
+                _unlock_kvstore(kvs);
+                goto flush_fail;
+        }
+        if (_lsm_write_manifest(lsm)) {
+                _level_remove(&lsm->levels[0], t);
+                _unlock_kvstore(kvs);
+                goto flush_fail;
+        }
+        lsm->stats.disk_writes += t->size;
+        lsm->imm = NULL;
+        r->imm = imm;
+        _lsm_retire(lsm, r);
+        pthread_mutex_lock(&lsm->stall_lock);
+        __atomic_store_n(&lsm->stall, 0, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&lsm->stall_cv);
+        pthread_mutex_unlock(&lsm->stall_lock);
+        _unlock_kvstore(kvs);
+        return 0;
+
+flush_fail:
+        _sst_unlink(lsm, t->id);
+        _sst_close(t);
+        free(r);
+        return -1;
+}
+
+
+void
+_run_load(struct _lsm_run *r)
+{
+        struct _kvstore_sst     *t;
+        char                    *p;
+
+        while (r->ti < r->n) {
+                t = r->t[r->ti];
+                if (r->pos < t->data_end) {
+                        p = t->map + r->pos;
+                        r->key_len = _get32(p);
+                        r->val_len = _get32(p + 4);
+                        r->key = p + 8;
+                        r->val = p + 8 + r->key_len + 1;
+                        return;
+                }
+                r->ti++;
+                r->pos = 0;
+        }
+        r->key = NULL;
+}
+
+
+void
+_run_next(struct _lsm_run *r)
+{
+        r->pos += 8 + r->key_len + 1;
+        if (KVSTORE_LSM_TOMBSTONE != r->val_len)
+                r->pos += r->val_len + 1;
+        _run_load(r);
+}
+
+
+uint64_t
+_level_max(struct _kvstore_lsm *lsm, int lvl)
+{
+        uint64_t        max = lsm->mem_max * 10;
+
+        while (--lvl > 0)
+                max *= 10;
+        return max;
+}
+
+
+/*
+ * _lsm_pick returns the level most in need of compaction, or -1.
+ */
+int
+_lsm_pick(struct _kvstore_lsm *lsm)
+{
+        double  score, best = 1.0;
+        int     lvl, pick = -1;
+
+        for (lvl = 0; lvl < KVSTORE_LSM_LEVELS - 1; lvl++) {
+                if (0 == lvl)
+                        score = (double)lsm->levels[0].n /
+                            KVSTORE_LSM_L0_TABLES;
+                else
+                        score = (double)lsm->levels[lvl].bytes /
+                            _level_max(lsm, lvl);
+                if (score >= best) {
+                        best = score;
+                        pick = lvl;
+                }
+        }
+        return pick;
+}
+
+
+/*
+ * _lsm_compact merges level lvl into level lvl + 1: all of level 0, or
+ * the next table of a deeper level in round-robin order, together with
+ * every table it overlaps in the next level. Inputs are passed to the
+ * merge newest first, so the first run holding a key wins. Deletes are
+ * dropped once nothing deeper could hold an older value. The levels are
+ * put back as they were if the manifest cannot be written, so the
+ * inputs are only removed once the outputs are durably listed.
+ */
+int
+_lsm_compact(kvstore kvs, int lvl)
+{
+        struct _kvstore_lsm     *lsm = kvs->lsm;
+        struct _kvstore_level   *in = &lsm->levels[lvl];
+        struct _kvstore_level   *out = &lsm->levels[lvl + 1];
+        struct _kvstore_sst    **inputs = NULL, **outputs = NULL, *t;
+        struct _lsm_retired     *r;
+        struct _lsm_run         *runs = NULL;
+        struct _sst_writer       w;
+        const char              *lo, *hi;
+        uint32_t                 lo_len, hi_len;
+        size_t                   nin = 0, nout = 0, nruns = 0, i, first;
+        size_t                   target = lsm->mem_max;
+        int                      drop = 1, open = 0, best, rc;
+        int                      retval = -1;
+
+        if (_acquire_kvstore(kvs))
+                return -1;
+        if (0 == in->n) {
+                _unlock_kvstore(kvs);
+                return 0;
+        }
+        inputs = (struct _kvstore_sst **)calloc(in->n + out->n,
+            sizeof(struct _kvstore_sst *));
+        runs = (struct _lsm_run *)calloc(in->n + 1, sizeof(struct _lsm_run));
+        outputs = (struct _kvstore_sst **)calloc(1,
+            sizeof(struct _kvstore_sst *));
+        r = (struct _lsm_retired *)calloc(1, sizeof(struct _lsm_retired));
+        if ((NULL == inputs) || (NULL == runs) || (NULL == outputs) ||
+            (NULL == r)) {
+                _unlock_kvstore(kvs);
+                goto compact_done;
+        }
+
+        if (0 == lvl) {
+                for (i = 0; i < in->n; i++)
+                        inputs[nin++] = in->t[i];
+        } else {
+                inputs[nin++] = in->t[in->next++ % in->n];
+        }
+        lo = inputs[0]->blocks[0].key;
+        lo_len = inputs[0]->blocks[0].key_len;
+        hi = inputs[0]->last;
+        hi_len = inputs[0]->last_len;
+        for (i = 1; i < nin; i++) {
+                t = inputs[i];
+                if (_lsm_cmp(t->blocks[0].key, t->blocks[0].key_len, lo,
+                    lo_len) < 0) {
+                        lo = t->blocks[0].key;
+                        lo_len = t->blocks[0].key_len;
+                }
+                if (_lsm_cmp(t->last, t->last_len, hi, hi_len) > 0) {
+                        hi = t->last;
+                        hi_len = t->last_len;
+                }
+        }
+        for (i = 0; i < nin; i++) {
+                runs[nruns].t = &inputs[i];
+                runs[nruns].n = 1;
+                nruns++;
+        }
+        first = nin;
+        for (i = 0; i < out->n; i++) {
+                t = out->t[i];
+                if ((_lsm_cmp(t->last, t->last_len, lo, lo_len) < 0) ||
+                    (_lsm_cmp(t->blocks[0].key, t->blocks[0].key_len, hi,
+                    hi_len) > 0))
+                        continue;
+                inputs[nin++] = t;
+        }
+        if (nin > first) {
+                runs[nruns].t = &inputs[first];
+                runs[nruns].n = nin - first;
+                nruns++;
+        }
+        for (i = lvl + 2; i < KVSTORE_LSM_LEVELS; i++) {
+                if (lsm->levels[i].n)
+                        drop = 0;
+        }
+        _unlock_kvstore(kvs);
+
+        for (i = 0; i < nruns; i++)
+                _run_load(&runs[i]);
+
+        for (;;) {
+                best = -1;
+                for (i = 0; i < nruns; i++) {
+                        if (NULL == runs[i].key)
+                                continue;
+                        if ((-1 == best) || (_lsm_cmp(runs[i].key,
+                            runs[i].key_len, runs[best].key,
+                            runs[best].key_len) < 0))
+                                best = (int)i;
+                }
+                if (-1 == best)
+                        break;
+
+                if (!(drop && (KVSTORE_LSM_TOMBSTONE ==
+                    runs[best].val_len))) {
+                        if (!open) {
+                                if (_acquire_kvstore(kvs))
+                                        goto compact_done;
+                                rc = _sst_create(lsm, &w);
+                                _unlock_kvstore(kvs);
+                                if (rc)
+                                        goto compact_done;
+                                open = 1;
+                        }
+                        if (_sst_add(&w, runs[best].key, runs[best].key_len,
+                            runs[best].val, runs[best].val_len))
+                                goto compact_done;
+                }
+
+                for (i = best + 1; i < nruns; i++) {
+                        if ((NULL != runs[i].key) && (0 == _lsm_cmp(
+                            runs[i].key, runs[i].key_len, runs[best].key,
+                            runs[best].key_len)))
+                                _run_next(&runs[i]);
+                }
+                _run_next(&runs[best]);
+
+                if (open && (w.off >= target)) {
+                        open = 0;
+                        if (NULL == (t = _sst_finish(lsm, &w)))
+                                goto compact_done;
+                        outputs = (struct _kvstore_sst **)realloc(outputs,
+                            (nout + 1) * sizeof(struct _kvstore_sst *));
+                        if (NULL == outputs) {
+                                _sst_close(t);
+                                goto compact_done;
+                        }
+                        outputs[nout++] = t;
+                }
+        }
+        if (open) {
+                open = 0;
+                if (NULL == (t = _sst_finish(lsm, &w)))
+                        goto compact_done;
+                outputs = (struct _kvstore_sst **)realloc(outputs,
+                    (nout + 1) * sizeof(struct _kvstore_sst *));
+                if (NULL == outputs) {
+                        _sst_close(t);
+                        goto compact_done;
+                }
+                outputs[nout++] = t;
+        }
+
+        if (_acquire_kvstore(kvs))
+                goto compact_done;
+        for (i = 0; i < first; i++)
+                _level_remove(in, inputs[i]);
+        for (i = first; i < nin; i++)
+                _level_remove(out, inputs[i]);
+        for (i = 0; i < nout; i++) {
+                if (_level_add_sorted(out, outputs[i]))
+                        break;
+        }
+        if ((i < nout) || _lsm_write_manifest(lsm)) {
+                /* Removing made the room these need, so they cannot fail. */
+                while (i-- > 0)
+                        _level_remove(out, outputs[i]);
+                for (i = 0; i < first; i++) {
+                        if (0 == lvl)
+                                _level_insert(in, in->n, inputs[i]);
+                        else
+                                _level_add_sorted(in, inputs[i]);
+                }
+                for (i = first; i < nin; i++)
+                        _level_add_sorted(out, inputs[i]);
+                _unlock_kvstore(kvs);
+                goto compact_done;
+        }
+        for (i = 0; i < nout; i++)
+                lsm->stats.disk_writes += outputs[i]->size;
+        r->t = inputs;
+        r->n = nin;
+        _lsm_retire(lsm, r);
+        _unlock_kvstore(kvs);
+        r = NULL;
+        nout = 0;
+
+        for (i = 0; i < nin; i++)
+                _sst_unlink(lsm, inputs[i]->id);
+        inputs = NULL;
+        retval = 0;
+
+compact_done:
+        if (open)
+                _sst_abort(lsm, &w);
+        for (i = 0; (NULL != outputs) && (i < nout); i++) {
+                _sst_unlink(lsm, outputs[i]->id);
+                _sst_close(outputs[i]);
+        }
+        free(outputs);
+        free(inputs);
+        free(runs);
+        free(r);
+        return retval;
+}
+
+
+/*
+ * _lsm_retire queues what a flush or compaction replaced, with the store
+ * locked. Values handed out before the next write may still point into
+ * it.
+ */
+void
+_lsm_retire(struct _kvstore_lsm *lsm, struct _lsm_retired *r)
+{
+        r->next = lsm->retired;
+        lsm->retired = r;
+        lsm->retired_at = lsm->writes;
+}
+
+
+/*
+ * _lsm_release frees what has been retired, once the store has been
+ * written to since it was, or unconditionally if all is set. Only the
+ * thread doing the flushes and compactions calls it.
+ */
+void
+_lsm_release(kvstore kvs, int all)
+{
+        struct _kvstore_lsm     *lsm = kvs->lsm;
+        struct _lsm_retired     *r, *next;
+        size_t                   i;
+
+        if (_acquire_kvstore(kvs))
+                return;
+        r = NULL;
+        if (all || (lsm->writes != lsm->retired_at)) {
+                r = lsm->retired;
+                lsm->retired = NULL;
+        }
+        _unlock_kvstore(kvs);
+
+        for (; NULL != r; r = next) {
+                next = r->next;
+                if (NULL != r->imm)
+                        kvstore_discard(r->imm);
+                for (i = 0; i < r->n; i++)
+                        _sst_close(r->t[i]);
+                free(r->t);
+                free(r);
+        }
+}
+
+
+void *
+_lsm_worker(void *arg)
+{
+        kvstore                  kvs = (kvstore)arg;
+        struct _kvstore_lsm     *lsm = kvs->lsm;
+        int                      lvl;
+
+        for (;;) {
+                while ((-1 == sem_wait(&lsm->kick)) && (EINTR == errno))
+                        ;
+                if (__atomic_load_n(&lsm->stop, __ATOMIC_ACQUIRE))
+                        break;
+                pthread_mutex_lock(&lsm->work);
+                _lsm_release(kvs, 0);
+                _lsm_flush(kvs);
+                while (-1 != (lvl = _lsm_pick(lsm))) {
+                        if (_lsm_compact(kvs, lvl))
+                                break;
+                }
+                pthread_mutex_unlock(&lsm->work);
+        }
+        return NULL;
+}
+
+
+/*
+ * kvstore_open_lsm opens, creating it if needed, an LSM store in the
+ * directory path.
+ */
+kvstore
+kvstore_open_lsm(const char *path)
+{
+        struct _kvstore_lsm     *lsm;
+        kvstore                  kvs;
+        char                    *lockpath;
+
+        if (NULL == path)
+                return NULL;
+        if ((-1 == mkdir(path, 0755)) && (EEXIST != errno))
+                return NULL;
+        if (NULL == (kvs = kvstore_new()))
+                return NULL;
+
+        lsm = (struct _kvstore_lsm *)malloc(sizeof(struct _kvstore_lsm));
+        if (NULL == lsm) {
+                kvstore_discard(kvs);
+                return NULL;
+        }
+        memset(lsm, 0x0, sizeof(struct _kvstore_lsm));
+        lsm->lockfd = -1;
+        lsm->mem_max = KVSTORE_DEFAULT_MEMTABLE_SIZE;
+        pthread_mutex_init(&lsm->work, NULL);
+        pthread_mutex_init(&lsm->stall_lock, NULL);
+        pthread_cond_init(&lsm->stall_cv, NULL);
+        sem_init(&lsm->kick, 0, 0);
+        kvs->lsm = lsm;
+
+        if (NULL == (lsm->path = strdup(path)))
+                goto open_fail;
+        if (NULL == (lockpath = _lsm_path(lsm, "LOCK", 0)))
+                goto open_fail;
+        lsm->lockfd = open(lockpath, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        free(lockpath);
+        if ((-1 == lsm->lockfd) || flock(lsm->lockfd, LOCK_EX | LOCK_NB))
+                goto open_fail;
+        if (_lsm_load(lsm))
+                goto open_fail;
+        if (pthread_create(&lsm->worker, NULL, _lsm_worker, kvs))
+                goto open_fail;
+        lsm->started = 1;
+        return kvs;
+
+open_fail:
+        kvstore_discard(kvs);
+        return NULL;
+}
+
+
+/*
+ * _kvstore_lsm_wrote accounts for a set or delete that has just gone
+ * into the memtable, and freezes the memtable once it is full. dead is
+ * 1 if the write left a new delete in the memtable and -1 if it replaced
+ * one. If the previous memtable is still being flushed when the new one
+ * reaches twice the limit, writers are stalled until the flush is done.
+ */
+int
+_kvstore_lsm_wrote(kvstore kvs, size_t klen, size_t vlen, int dead)
+{
+        struct _kvstore_lsm     *lsm = kvs->lsm;
+
+        lsm->writes++;
+        lsm->dead += dead;
+        lsm->stats.user_bytes += klen + vlen;
+        lsm->mem_bytes += klen + vlen + sizeof(struct _kvstore_kv);
+        if (lsm->mem_bytes < lsm->mem_max)
+                return 0;
+        if (NULL == lsm->imm)
+                return _lsm_freeze(kvs);
+        if (lsm->started && (lsm->mem_bytes >= lsm->mem_max * 2))
+                __atomic_store_n(&lsm->stall, 1, __ATOMIC_RELEASE);
+        return 0;
+}
+
+
+/*
+ * _kvstore_lsm_throttle is called by kvstore_set and kvstore_del with
+ * the store unlocked, and waits out a write stall.
+ */
+void
+_kvstore_lsm_throttle(kvstore kvs)
+{
+        struct _kvstore_lsm     *lsm = kvs->lsm;
+
+        if (!__atomic_load_n(&lsm->stall, __ATOMIC_ACQUIRE))
+                return;
+        pthread_mutex_lock(&lsm->stall_lock);
+        while (__atomic_load_n(&lsm->stall, __ATOMIC_ACQUIRE))
+                pthread_cond_wait(&lsm->stall_cv, &lsm->stall_lock);
+        pthread_mutex_unlock(&lsm->stall_lock);
+}
+
+
+/*
+ * _kvstore_lsm_del records a delete in the memtable. Like kvstore_del on
+ * an in-memory store, it fails if the key is not present.
+ */
+int
+_kvstore_lsm_del(kvstore kvs, char *key, size_t klen, uint64_t hash)
+{
+        struct _kvstore_kv      *kv;
+
+        kv = _kvstore_find(kvs, key, klen, hash);
+        if (NULL != kv) {
+                if (NULL == kv->val)
+                        return -1;
+                _kvstore_free_val(kvs, kv);
+                kv->val_len = 0;
+                return _kvstore_lsm_wrote(kvs, klen, 0, 1);
+        }
+
+        if (NULL == _kvstore_lsm_get(kvs, key, NULL))
+                return -1;
+        if (NULL == (kv = _kvstore_new_kv(key, klen, hash)))
+                return -1;
+        _kvstore_link(kvs, kv);
+        return _kvstore_lsm_wrote(kvs, klen, 0, 1);
+}
+
+
+/*
+ * _kvstore_lsm_len counts the keys in the memtable, leaving out deletes.
+ */
+size_t
+_kvstore_lsm_len(kvstore kvs)
+{
+        return kvs->keys - kvs->lsm->dead;
+}
+
+
+/*
+ * _kvstore_lsm_get searches everything below the memtable, with the
+ * store locked.
+ */
+char *
+_kvstore_lsm_get(kvstore kvs, char *key, size_t *len)
+{
+        struct _kvstore_lsm     *lsm = kvs->lsm;
+        struct _kvstore_level   *l;
+        struct _kvstore_kv      *kv;
+        struct _kvstore_sst     *t;
+        uint64_t                 h;
+        size_t                   klen, vlen = 0, lo, hi, mid, i;
+        char                    *val;
+        int                      lvl;
+
+        klen = strnlen(key, kvs->max_keylen + 1);
+        if (((kvs->max_keylen + 1) == klen) || (0 == klen))
+                return NULL;
+        if (NULL != lsm->imm) {
+                kv = _kvstore_find(lsm->imm, key, klen,
+                    _kvstore_hash(lsm->imm, key, klen));
+                if (NULL != kv) {
+                        if ((NULL != len) && (NULL != kv->val))
+                                *len = kv->val_len;
+                        return kv->val;
+                }
+        }
+
+        lsm->stats.gets++;
+        h = _lsm_hash(key, klen);
+        for (i = 0; i < lsm->levels[0].n; i++) {
+                if (_sst_get(lsm, lsm->levels[0].t[i], key, klen, h, &val,
+                    &vlen))
+                        goto found;
+        }
+        for (lvl = 1; lvl < KVSTORE_LSM_LEVELS; lvl++) {
+                l = &lsm->levels[lvl];
+                lo = 0;
+                hi = l->n;
+                while (lo < hi) {
+                        mid = lo + (hi - lo) / 2;
+                        if (_lsm_cmp(l->t[mid]->last, l->t[mid]->last_len,
+                            key, klen) < 0)
+                                lo = mid + 1;
+                        else
+                                hi = mid;
+                }
+                if (lo == l->n)
+                        continue;
+                t = l->t[lo];
+                if (_lsm_cmp(t->blocks[0].key, t->blocks[0].key_len, key,
+                    klen) > 0)
+                        continue;
+                if (_sst_get(lsm, t, key, klen, h, &val, &vlen))
+                        goto found;
+        }
+        return NULL;
+
+found:
+        if ((NULL != val) && (NULL != len))
+                *len = vlen;
+        return val;
+}
+
+
+/*
+ * kvstore_lsm_compact flushes the memtable and compacts until every
+ * level is within its budget, waiting for the work to finish.
+ */
+int
+kvstore_lsm_compact(kvstore kvs)
+{
+        struct _kvstore_lsm     *lsm;
+        int                      lvl, retval = 0;
+
+        if ((NULL == kvs) || (NULL == (lsm = kvs->lsm)))
+                return -1;
+        pthread_mutex_lock(&lsm->work);
+        _lsm_release(kvs, 0);
+        if (_lsm_flush(kvs) || _acquire_kvstore(kvs)) {
+                pthread_mutex_unlock(&lsm->work);
+                return -1;
+        }
+        _lsm_freeze(kvs);
+        _unlock_kvstore(kvs);
+        if (_lsm_flush(kvs))
+                retval = -1;
+        while ((0 == retval) && (-1 != (lvl = _lsm_pick(lsm))))
+                retval = _lsm_compact(kvs, lvl);
+        pthread_mutex_unlock(&lsm->work);
+        return retval;
+}
+
+
+int
+kvstore_lsm_stats(kvstore kvs, struct kvstore_lsm_stats *stats)
+{
+        struct _kvstore_lsm     *lsm;
+        int                      lvl;
+
+        if ((NULL == kvs) || (NULL == (lsm = kvs->lsm)) || (NULL == stats))
+                return -1;
+        if (_acquire_kvstore(kvs))
+                return -1;
+        *stats = lsm->stats;
+        stats->disk_bytes = 0;
+        for (lvl = 0; lvl < KVSTORE_LSM_LEVELS; lvl++) {
+                stats->tables[lvl] = lsm->levels[lvl].n;
+                stats->disk_bytes += lsm->levels[lvl].bytes;
+        }
+        return _unlock_kvstore(kvs);
+}
+
+
+int
+_kvstore_lsm_config(kvstore kvs, KVSTORE_CONFIG_OPT opt, void *val)
+{
+        if (NULL == kvs->lsm)
+                return -1;
+        switch (opt) {
+        case KVSTORE_MEMTABLE_SIZE:
+                if (*(size_t *)val < 1024)
+                        return -1;
+                kvs->lsm->mem_max = *(size_t *)val;
+                break;
+        default:
+                return -1;
+        }
+        return 0;
+}
+
+
+/*
+ * _kvstore_lsm_close stops the worker and writes out whatever is still
+ * in memory, then releases the tables. kvstore_discard calls it with the
+ * store unlocked; the memtable entries themselves are freed afterwards
+ * with the rest of the index.
+ */
+void
+_kvstore_lsm_close(kvstore kvs)
+{
+        struct _kvstore_lsm     *lsm = kvs->lsm;
+        int                      lvl;
+        size_t                   i;
+
+        if (NULL == lsm)
+                return;
+        if (lsm->started) {
+                __atomic_store_n(&lsm->stop, 1, __ATOMIC_RELEASE);
+                sem_post(&lsm->kick);
+                pthread_join(lsm->worker, NULL);
+                lsm->started = 0;
+
+                _lsm_flush(kvs);
+                _acquire_kvstore(kvs);
+                _lsm_freeze(kvs);
+                _unlock_kvstore(kvs);
+                _lsm_flush(kvs);
+        }
+        _lsm_release(kvs, 1);
+        if (NULL != lsm->imm)
+                kvstore_discard(lsm->imm);
+
+        for (lvl = 0; lvl < KVSTORE_LSM_LEVELS; lvl++) {
+                for (i = 0; i < lsm->levels[lvl].n; i++)
+                        _sst_close(lsm->levels[lvl].t[i]);
+                free(lsm->levels[lvl].t);
+        }
+        if (-1 != lsm->lockfd)
+                close(lsm->lockfd);
+        sem_destroy(&lsm->kick);
+        pthread_mutex_destroy(&lsm->work);
+        pthread_mutex_destroy(&lsm->stall_lock);
+        pthread_cond_destroy(&lsm->stall_cv);
+        free(lsm->path);
+        free(lsm);
+        kvs->lsm = NULL;
+}
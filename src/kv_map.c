@@ -0,0 +1,386 @@
+/*
+ * Copyright (c) 2013 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+ * OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ * ---------------------------------------------------------------------
+ */
+
+
+/*
+ * Parallel map and reduce over every entry. The pass runs in two rounds
+ * over the same split of the index into chunks of buckets. In the first
+ * round, with the store locked, the workers copy the entries of each
+ * chunk into a snapshot buffer for it; in the second, with the lock
+ * released, they run the callback over the snapshot. The callbacks so
+ * see the store as it was at one instant and are free to use the store
+ * themselves.
+ *
+ * Each worker starts with an equal run of chunks and takes them from the
+ * front. A worker that runs out steals the back half of the largest run
+ * left, so a few slow chunks do not hold up the whole pass.
+ */
+
+
+#include <sys/types.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "kv.h"
+#include "kv_int.h"
+
+
+static const size_t      KVSTORE_MAP_CHUNK = 256;
+
+
+struct _map_chunk {
+        char            *buf;
+        size_t           len;
+        size_t           n;
+};
+
+struct _map_run {
+        pthread_mutex_t  lock;
+        size_t           lo;
+        size_t           hi;
+};
+
+struct _map_pass;
+
+struct _map_worker {
+        struct _map_pass        *pass;
+        struct _map_run          run;
+        void                    *acc;
+        int                      failed;
+        int                      running;
+        pthread_t                thread;
+};
+
+struct _map_pass {
+        kvstore                  kvs;
+        struct _map_worker      *w;
+        size_t                   nworkers;
+        struct _map_chunk       *chunks;
+        size_t                   nchunks;
+        int                      copying;
+        kvstore_scan_cb          each;
+        kvstore_reduce_cb        reduce;
+        void                    *ctx;
+};
+
+
+static int       _map_take(struct _map_worker *, size_t *);
+static struct _kvstore_kv
+                *_map_bucket(kvstore, size_t);
+static int       _map_copy(struct _map_pass *, size_t);
+static void      _map_visit(struct _map_worker *, size_t);
+static void     *_map_work(void *);
+static int       _map_round(struct _map_pass *, int);
+static int       _map_start(kvstore, size_t, kvstore_scan_cb,
+                    kvstore_reduce_cb, kvstore_merge_cb, void *, size_t,
+                    void *);
+
+
+/*
+ * _map_take hands the worker its next chunk, stealing from the others
+ * once its own run is empty. It returns 0 when there is nothing left.
+ */
+int
+_map_take(struct _map_worker *w, size_t *chunk)
+{
+        struct _map_pass        *pass = w->pass;
+        struct _map_run         *victim;
+        size_t                   i, best, left, mid;
+
+        for (;;) {
+                pthread_mutex_lock(&w->run.lock);
+                if (w->run.lo < w->run.hi) {
+                        *chunk = w->run.lo++;
+                        pthread_mutex_unlock(&w->run.lock);
+                        return 1;
+                }
+                pthread_mutex_unlock(&w->run.lock);
+
+                victim = NULL;
+                best = 0;
+                for (i = 0; i < pass->nworkers; i++) {
+                        if (&pass->w[i] == w)
+                                continue;
+                        pthread_mutex_lock(&pass->w[i].run.lock);
+                        left = pass->w[i].run.hi - pass->w[i].run.lo;
+                        pthread_mutex_unlock(&pass->w[i].run.lock);
+                        if (left > best) {
+                                best = left;
+                                victim = &pass->w[i].run;
+                        }
+                }
+                if (NULL == victim)
+                        return 0;
+
+                /* The victim may have moved on since it was sized up. */
+                pthread_mutex_lock(&victim->lock);
+                left = victim->hi - victim->lo;
+                mid = victim->hi - (left + 1) / 2;
+                if (0 < left)
+                        victim->hi = mid;
+                pthread_mutex_unlock(&victim->lock);
+                if (0 == left)
+                        continue;
+
+                pthread_mutex_lock(&w->run.lock);
+                w->run.lo = mid;
+                w->run.hi = mid + (left + 1) / 2;
+                pthread_mutex_unlock(&w->run.lock);
+        }
+}
+
+
+/*
+ * _map_bucket returns the head of bucket b, numbering the buckets of
+ * table[0] first and then, during a rehash, those of table[1].
+ */
+struct _kvstore_kv *
+_map_bucket(kvstore kvs, size_t b)
+{
+        if (b < kvs->table[0].size)
+                return kvs->table[0].buckets[b];
+        b -= kvs->table[0].size;
+        if (b < kvs->table[1].size)
+                return kvs->table[1].buckets[b];
+        return NULL;
+}
+
+
+/*
+ * _map_copy snapshots one chunk as a run of key\0val\0 pairs, joining
+ * chunked values into one piece. The store is locked by the thread that
+ * started the round.
+ */
+int
+_map_copy(struct _map_pass *pass, size_t chunk)
+{
+        struct _map_chunk       *c = &pass->chunks[chunk];
+        struct _kvstore_kv      *kv;
+        size_t                   first, last, b;
+        char                    *p;
+
+        first = chunk * KVSTORE_MAP_CHUNK;
+        last = first + KVSTORE_MAP_CHUNK;
+        for (b = first; b < last; b++) {
+                kv = _map_bucket(pass->kvs, b);
+                for (; NULL != kv; kv = kv->next) {
+                        if ((NULL == kv->val) && (NULL == kv->chunks))
+                                continue;
+                        c->len += kv->key_len + kv->val_len + 2;
+                        c->n++;
+                }
+        }
+        if (0 == c->n)
+                return 0;
+        if (NULL == (p = c->buf = (char *)malloc(c->len)))
+                return -1;
+
+        for (b = first; b < last; b++) {
+                kv = _map_bucket(pass->kvs, b);
+                for (; NULL != kv; kv = kv->next) {
+                        if ((NULL == kv->val) && (NULL == kv->chunks))
+                                continue;
+                        memcpy(p, kv->key, kv->key_len + 1);
+                        p += kv->key_len + 1;
+                        if (NULL != kv->chunks)
+                                _kvstore_chunk_read(kv, 0, kv->val_len, p);
+                        else
+                                memcpy(p, kv->val, kv->val_len);
+                        p += kv->val_len;
+                        *p++ = 0;
+                }
+        }
+        return 0;
+}
+
+
+void
+_map_visit(struct _map_worker *w, size_t chunk)
+{
+        struct _map_pass        *pass = w->pass;
+        struct _map_chunk       *c = &pass->chunks[chunk];
+        char                    *key, *val;
+        size_t                   i;
+
+        key = c->buf;
+        for (i = 0; i < c->n; i++) {
+                val = key + strlen(key) + 1;
+                if (NULL != pass->each)
+                        pass->each(key, val, pass->ctx);
+                else
+                        pass->reduce(w->acc, key, val, pass->ctx);
+                key = val + strlen(val) + 1;
+        }
+        free(c->buf);
+        c->buf = NULL;
+}
+
+
+void *
+_map_work(void *arg)
+{
+        struct _map_worker      *w = (struct _map_worker *)arg;
+        size_t                   chunk;
+
+        while (_map_take(w, &chunk)) {
+                if (!w->pass->copying)
+                        _map_visit(w, chunk);
+                else if (_map_copy(w->pass, chunk))
+                        w->failed = 1;
+        }
+        return NULL;
+}
+
+
+/*
+ * _map_round deals the chunks out evenly and runs the workers over them,
+ * with the calling thread acting as the first worker.
+ */
+int
+_map_round(struct _map_pass *pass, int copying)
+{
+        struct _map_worker      *w;
+        size_t                   i, n = pass->nworkers;
+        int                      failed = 0;
+
+        pass->copying = copying;
+        for (i = 0; i < n; i++) {
+                w = &pass->w[i];
+                w->run.lo = pass->nchunks * i / n;
+                w->run.hi = pass->nchunks * (i + 1) / n;
+        }
+        for (i = 1; i < n; i++) {
+                w = &pass->w[i];
+                w->running = !pthread_create(&w->thread, NULL, _map_work,
+                    w);
+        }
+        _map_work(&pass->w[0]);
+        for (i = 0; i < n; i++) {
+                w = &pass->w[i];
+                if (w->running)
+                        pthread_join(w->thread, NULL);
+                w->running = 0;
+                failed |= w->failed;
+        }
+        return failed ? -1 : 0;
+}
+
+
+int
+_map_start(kvstore kvs, size_t nthreads, kvstore_scan_cb each,
+    kvstore_reduce_cb reduce, kvstore_merge_cb merge, void *acc,
+    size_t acc_size, void *ctx)
+{
+        struct _map_pass         pass;
+        size_t                   i, buckets;
+        long                     ncpu;
+        int                      retval = -1;
+
+        if ((NULL == kvs) || (NULL != kvs->shm) || (NULL != kvs->soa) ||
+            (NULL != kvs->frozen))
+                return -1;
+        if ((0 == nthreads) && (0 < (ncpu = sysconf(_SC_NPROCESSORS_ONLN))))
+                nthreads = (size_t)ncpu;
+        if (0 == nthreads)
+                nthreads = 1;
+
+        memset(&pass, 0x0, sizeof(pass));
+        pass.kvs = kvs;
+        pass.nworkers = nthreads;
+        pass.each = each;
+        pass.reduce = reduce;
+        pass.ctx = ctx;
+        pass.w = (struct _map_worker *)calloc(nthreads,
+            sizeof(struct _map_worker));
+        if (NULL == pass.w)
+                return -1;
+        for (i = 0; i < nthreads; i++) {
+                pass.w[i].pass = &pass;
+                pthread_mutex_init(&pass.w[i].run.lock, NULL);
+                if (NULL == reduce)
+                        continue;
+                if (NULL == (pass.w[i].acc = malloc(acc_size)))
+                        goto map_done;
+                memcpy(pass.w[i].acc, acc, acc_size);
+        }
+
+        if (_acquire_kvstore(kvs))
+                goto map_done;
+        buckets = kvs->table[0].size + kvs->table[1].size;
+        pass.nchunks = (buckets + KVSTORE_MAP_CHUNK - 1) / KVSTORE_MAP_CHUNK;
+        pass.chunks = (struct _map_chunk *)calloc(pass.nchunks,
+            sizeof(struct _map_chunk));
+        if ((NULL == pass.chunks) || _map_round(&pass, 1)) {
+                _unlock_kvstore(kvs);
+                goto map_done;
+        }
+        _unlock_kvstore(kvs);
+
+        _map_round(&pass, 0);
+        for (i = 0; (NULL != reduce) && (i < nthreads); i++)
+                merge(acc, pass.w[i].acc, ctx);
+        retval = 0;
+
+map_done:
+        for (i = 0; (NULL != pass.chunks) && (i < pass.nchunks); i++)
+                free(pass.chunks[i].buf);
+        free(pass.chunks);
+        for (i = 0; i < nthreads; i++) {
+                pthread_mutex_destroy(&pass.w[i].run.lock);
+                free(pass.w[i].acc);
+        }
+        free(pass.w);
+        return retval;
+}
+
+
+/*
+ * kvstore_parallel_foreach calls cb on every entry from nthreads threads
+ * at once (by default one per online CPU), so cb must be safe to call
+ * concurrently. The entries are a copy taken at the start of the call;
+ * the store is not locked while cb runs.
+ */
+int
+kvstore_parallel_foreach(kvstore kvs, size_t nthreads, kvstore_scan_cb cb,
+    void *ctx)
+{
+        if (NULL == cb)
+                return -1;
+        return _map_start(kvs, nthreads, cb, NULL, NULL, NULL, 0, ctx);
+}
+
+
+/*
+ * kvstore_parallel_reduce folds every entry into an accumulator of
+ * acc_size bytes. Each thread starts from its own copy of *acc, which
+ * should hold the identity for the fold, and calls fn with it for each
+ * entry; merge then combines each thread's result into *acc in turn.
+ */
+int
+kvstore_parallel_reduce(kvstore kvs, size_t nthreads, kvstore_reduce_cb fn,
+    kvstore_merge_cb merge, void *acc, size_t acc_size, void *ctx)
+{
+        if ((NULL == fn) || (NULL == merge) || (NULL == acc) ||
+            (0 == acc_size))
+                return -1;
+        return _map_start(kvs, nthreads, NULL, fn, merge, acc, acc_size, ctx);
+}
@@ -0,0 +1,204 @@
+/*
+ * Copyright (c) 2013 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+ * OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ * ---------------------------------------------------------------------
+ */
+
+
+/*
+ * Range deletes. The index is walked with the kvstore_scan cursor a
+ * batch at a time: each batch finds its matching keys and unlinks them
+ * with the store locked, then frees them after the lock is dropped, so
+ * other callers only ever wait behind one batch however large the range.
+ */
+
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kv.h"
+#include "kv_int.h"
+
+
+static const size_t      KVSTORE_RANGE_BATCH = 1024;
+
+
+struct _range_match {
+        const char      *lo;
+        const char      *hi;
+        const char      *prefix;
+        size_t           prefix_len;
+        char           **keys;
+        size_t           n;
+        size_t           cap;
+        int              failed;
+};
+
+
+static void      _range_collect(char *, char *, void *);
+static ssize_t   _range_del(kvstore, struct _range_match *);
+
+
+void
+_range_collect(char *key, char *val, void *arg)
+{
+        struct _range_match     *m = (struct _range_match *)arg;
+        char                   **keys;
+        size_t                   cap;
+
+        (void)val;
+        if (NULL != m->prefix) {
+                if (0 != strncmp(key, m->prefix, m->prefix_len))
+                        return;
+        } else if (((NULL != m->lo) && (strcmp(key, m->lo) < 0)) ||
+            ((NULL != m->hi) && (strcmp(key, m->hi) >= 0))) {
+                return;
+        }
+
+        if (m->n == m->cap) {
+                cap = m->cap ? m->cap * 2 : KVSTORE_RANGE_BATCH;
+                keys = (char **)realloc(m->keys, cap * sizeof(char *));
+                if (NULL == keys) {
+                        m->failed = 1;
+                        return;
+                }
+                m->keys = keys;
+                m->cap = cap;
+        }
+        m->keys[m->n++] = key;
+}
+
+
+/*
+ * _range_del removes everything _range_collect matches. Entries of an
+ * in-memory store are chained through their next pointers once they are
+ * unlinked and freed outside the lock; values they share through the
+ * dedup pool are released before it is dropped. Bitcask deletes write
+ * tombstones and free their entries themselves, so their keys are copied
+ * first for the change ring and watchers. A compact store's deletes
+ * leave its keys where they are.
+ */
+ssize_t
+_range_del(kvstore kvs, struct _range_match *m)
+{
+        struct _kvstore_kv      *kv, *dead;
+        uint64_t                 hash;
+        size_t                   cursor = 0, klen, i;
+        ssize_t                  deleted = 0;
+        char                    *buf = NULL, *key;
+
+        if ((NULL != kvs->bc) &&
+            (NULL == (buf = (char *)malloc(kvs->max_keylen + 1))))
+                return -1;
+        if (NULL != kvs->wc)
+                kvstore_wc_sync(kvs);
+
+        do {
+                if (_acquire_kvstore(kvs)) {
+                        deleted = -1;
+                        break;
+                }
+                m->n = 0;
+                _kvstore_scan_locked(kvs, &cursor, KVSTORE_RANGE_BATCH,
+                    _range_collect, m);
+
+                dead = NULL;
+                for (i = 0; i < m->n; i++) {
+                        klen = strlen(m->keys[i]);
+                        hash = _kvstore_hash(kvs, m->keys[i], klen);
+                        if (NULL != kvs->bc) {
+                                key = buf;
+                                memcpy(key, m->keys[i], klen + 1);
+                                if (_kvstore_bc_del(kvs, key, klen, hash))
+                                        continue;
+                        } else if (NULL != kvs->soa) {
+                                key = m->keys[i];
+                                if (_kvstore_soa_del(kvs, key, klen, hash))
+                                        continue;
+                        } else {
+                                kv = _kvstore_unlink(kvs, m->keys[i], klen,
+                                    hash);
+                                if (NULL == kv)
+                                        continue;
+                                if (KVSTORE_VAL_POOLED(kvs, kv))
+                                        _kvstore_free_val(kvs, kv);
+                                kv->next = dead;
+                                dead = kv;
+                                key = kv->key;
+                        }
+                        if (NULL != kvs->cdc)
+                                _kvstore_cdc_log(kvs, KVSTORE_OP_DEL, key,
+                                    NULL);
+                        if (NULL != kvs->watch)
+                                _kvstore_watch_notify(kvs, key, klen);
+                        if (NULL != kvs->hot)
+                                _kvstore_hot_write(kvs, key, klen);
+                        deleted++;
+                }
+                _unlock_kvstore(kvs);
+
+                while (NULL != (kv = dead)) {
+                        dead = kv->next;
+                        _kvstore_retire_kv(kvs, kv);
+                }
+        } while ((0 != cursor) && !m->failed);
+
+        free(buf);
+        free(m->keys);
+        if (m->failed)
+                return -1;
+        return deleted;
+}
+
+
+/*
+ * kvstore_del_prefix deletes every key starting with prefix and returns
+ * how many it removed.
+ */
+ssize_t
+kvstore_del_prefix(kvstore kvs, char *prefix)
+{
+        struct _range_match      m;
+
+        if ((NULL == kvs) || (NULL == prefix) || (NULL != kvs->shm) ||
+            (NULL != kvs->lsm) || (NULL != kvs->frozen))
+                return -1;
+        memset(&m, 0x0, sizeof(m));
+        m.prefix = prefix;
+        m.prefix_len = strlen(prefix);
+        return _range_del(kvs, &m);
+}
+
+
+/*
+ * kvstore_del_range deletes every key k with lo <= k < hi, comparing
+ * bytes as strcmp does, and returns how many it removed. A NULL bound
+ * leaves that end of the range open.
+ */
+ssize_t
+kvstore_del_range(kvstore kvs, char *lo, char *hi)
+{
+        struct _range_match      m;
+
+        if ((NULL == kvs) || (NULL != kvs->shm) || (NULL != kvs->lsm) ||
+            (NULL != kvs->frozen))
+                return -1;
+        memset(&m, 0x0, sizeof(m));
+        m.lo = lo;
+        m.hi = hi;
+        return _range_del(kvs, &m);
+}
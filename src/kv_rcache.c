@@ -0,0 +1,249 @@
+/*
+ * Copyright (c) 2013 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+ * OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ * ---------------------------------------------------------------------
+ */
+
+
+
+/*
+ * Per-thread read caches. With KVSTORE_READ_CACHE set, each thread that
+ * calls kvstore_get gets a small direct-mapped cache of the values it
+ * has read, and a hit is answered without taking the store's lock or
+ * touching its index. Every slot remembers the version of the key's
+ * stripe when the value was read; a set or delete bumps that version
+ * with the store locked, so a slot whose version no longer matches is
+ * never served. Keys are spread over the stripes by hash, so a write
+ * also sends the few other cached keys sharing its stripe back to the
+ * index once.
+ *
+ * Only keys short enough to be copied into the slot are cached. A
+ * thread's cache lives until the store is discarded.
+ */
+
+
+#include <sys/types.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kv.h"
+#include "kv_int.h"
+
+
+#define KVSTORE_RCACHE_STRIPES  4096
+#define KVSTORE_RCACHE_KEYLEN   36
+
+
+struct _rcache_slot {
+        uint64_t         hash;
+        uint64_t         version;
+        char            *val;
+        uint32_t         key_len;
+        char             key[KVSTORE_RCACHE_KEYLEN];
+};
+
+struct _rcache_thread {
+        struct _rcache_thread   *next;
+        uint64_t                 hits;
+        uint64_t                 misses;
+        uint64_t                 stale;
+        struct _rcache_slot      slot[];
+};
+
+struct _kvstore_rcache {
+        pthread_key_t            key;
+        pthread_mutex_t          lock;
+        struct _rcache_thread   *threads;
+        size_t                   mask;
+        uint64_t                 version[KVSTORE_RCACHE_STRIPES];
+};
+
+
+static struct _rcache_thread
+                *_rcache_thread(struct _kvstore_rcache *);
+
+
+/*
+ * _rcache_thread returns the calling thread's cache, making it on the
+ * thread's first read.
+ */
+struct _rcache_thread *
+_rcache_thread(struct _kvstore_rcache *rc)
+{
+        struct _rcache_thread   *t;
+
+        if (NULL != (t = (struct _rcache_thread *)pthread_getspecific(rc->key)))
+                return t;
+        t = (struct _rcache_thread *)calloc(1, sizeof(struct _rcache_thread) +
+            (rc->mask + 1) * sizeof(struct _rcache_slot));
+        if (NULL == t)
+                return NULL;
+        if (pthread_setspecific(rc->key, t)) {
+                free(t);
+                return NULL;
+        }
+        pthread_mutex_lock(&rc->lock);
+        t->next = rc->threads;
+        rc->threads = t;
+        pthread_mutex_unlock(&rc->lock);
+        return t;
+}
+
+
+/*
+ * _kvstore_rcache_get is kvstore_get for a store with read caches.
+ */
+char *
+_kvstore_rcache_get(kvstore kvs, char *key)
+{
+        struct _kvstore_rcache  *rc = kvs->rcache;
+        struct _rcache_thread   *t;
+        struct _rcache_slot     *s = NULL;
+        uint64_t                 hash, *stripe, version;
+        size_t                   klen;
+        char                    *val;
+
+        klen = strnlen(key, kvs->max_keylen + 1);
+        if (((kvs->max_keylen + 1) == klen) || (0 == klen))
+                return NULL;
+        hash = _kvstore_hash(kvs, key, klen);
+        stripe = &rc->version[hash & (KVSTORE_RCACHE_STRIPES - 1)];
+        if (NULL != (t = _rcache_thread(rc))) {
+                s = &t->slot[(hash >> 32) & rc->mask];
+                version = __atomic_load_n(stripe, __ATOMIC_ACQUIRE);
+                if ((NULL != s->val) && (s->hash == hash) &&
+                    (s->key_len == klen) && (0 == memcmp(s->key, key, klen))) {
+                        if (s->version == version) {
+                                __atomic_store_n(&t->hits, t->hits + 1,
+                                    __ATOMIC_RELAXED);
+                                return s->val;
+                        }
+                        __atomic_store_n(&t->stale, t->stale + 1,
+                            __ATOMIC_RELAXED);
+                } else {
+                        __atomic_store_n(&t->misses, t->misses + 1,
+                            __ATOMIC_RELAXED);
+                }
+        }
+
+        if (_acquire_kvstore(kvs))
+                return NULL;
+        version = __atomic_load_n(stripe, __ATOMIC_RELAXED);
+        val = _kvstore_get(kvs, key, NULL);
+        _unlock_kvstore(kvs);
+
+        if (NULL == s)
+                return val;
+        s->val = NULL;
+        if ((NULL != val) && (klen <= KVSTORE_RCACHE_KEYLEN)) {
+                s->hash = hash;
+                s->version = version;
+                s->val = val;
+                s->key_len = (uint32_t)klen;
+                memcpy(s->key, key, klen);
+        }
+        return val;
+}
+
+
+/*
+ * _kvstore_rcache_bump marks every value cached for the stripe of hash
+ * as stale. It is called with the store locked, before the entry is
+ * changed.
+ */
+void
+_kvstore_rcache_bump(kvstore kvs, uint64_t hash)
+{
+        __atomic_add_fetch(&kvs->rcache->version[hash &
+            (KVSTORE_RCACHE_STRIPES - 1)], 1, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * _kvstore_rcache_config turns read caches on with at least the given
+ * number of slots per thread. It should be set before the store is
+ * shared between threads, and cannot be changed afterwards.
+ */
+int
+_kvstore_rcache_config(kvstore kvs, size_t slots)
+{
+        struct _kvstore_rcache  *rc;
+        size_t                   n = 1;
+
+        if ((0 == slots) || (NULL != kvs->rcache) || (NULL != kvs->bc) ||
+            (NULL != kvs->lsm) || (NULL != kvs->shm) || (NULL != kvs->soa) ||
+            (NULL != kvs->hot))
+                return -1;
+        while (n < slots)
+                n <<= 1;
+        if (NULL == (rc = (struct _kvstore_rcache *)calloc(1,
+            sizeof(struct _kvstore_rcache))))
+                return -1;
+        if (pthread_key_create(&rc->key, NULL)) {
+                free(rc);
+                return -1;
+        }
+        pthread_mutex_init(&rc->lock, NULL);
+        rc->mask = n - 1;
+        kvs->rcache = rc;
+        return 0;
+}
+
+
+/*
+ * kvstore_read_cache_stats adds up the counters of every thread's read
+ * cache.
+ */
+int
+kvstore_read_cache_stats(kvstore kvs, struct kvstore_read_cache_stats *st)
+{
+        struct _kvstore_rcache  *rc;
+        struct _rcache_thread   *t;
+
+        if ((NULL == kvs) || (NULL == st) || (NULL == (rc = kvs->rcache)))
+                return -1;
+        memset(st, 0x0, sizeof(*st));
+        pthread_mutex_lock(&rc->lock);
+        for (t = rc->threads; NULL != t; t = t->next) {
+                st->threads++;
+                st->hits += __atomic_load_n(&t->hits, __ATOMIC_RELAXED);
+                st->misses += __atomic_load_n(&t->misses, __ATOMIC_RELAXED);
+                st->stale += __atomic_load_n(&t->stale, __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&rc->lock);
+        return 0;
+}
+
+
+void
+_kvstore_rcache_free(kvstore kvs)
+{
+        struct _kvstore_rcache  *rc = kvs->rcache;
+        struct _rcache_thread   *t;
+
+        if (NULL == rc)
+                return;
+        while (NULL != (t = rc->threads)) {
+                rc->threads = t->next;
+                free(t);
+        }
+        pthread_key_delete(rc->key);
+        pthread_mutex_destroy(&rc->lock);
+        free(rc);
+        kvs->rcache = NULL;
+}
@@ -0,0 +1,301 @@
+/*
+ * Copyright (c) 2013 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+ * OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ * ---------------------------------------------------------------------
+ */
+
+
+
+/*
+ * Deferred reclamation. A store with KVSTORE_REAP set does not free what
+ * it deletes: a deleted entry is unlinked from the index as usual and
+ * pushed onto a stack, and kvstore_discard hands the whole index and
+ * entry list over in one piece. A reaper thread, one per process and
+ * started the first time it is needed, frees them in the background.
+ *
+ * Entries are pushed with a compare-and-swap on the stack head, reusing
+ * their next pointer; only a push onto an empty stack takes the mutex,
+ * to wake the reaper.
+ *
+ * A forked child has no reaper, as only the forking thread is copied.
+ * The child starts over with no reaper and nothing queued, and starts
+ * one of its own the next time it is needed; what the parent had queued
+ * is left for the parent's reaper to free.
+ */
+
+
+#include <sys/types.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kv.h"
+#include "kv_int.h"
+
+
+/*
+ * Everything a discarded store had in its index. free_vals is clear for
+ * a bitcask store, whose values live in its segment files.
+ */
+struct _reap_job {
+        struct _reap_job        *next;
+        struct _tq_kvstore_kv   *queue;
+        struct _kvstore_kv     **buckets[2];
+        int                      free_vals;
+};
+
+
+static pthread_once_t            _reap_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t           _reap_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t            _reap_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t            _reap_done = PTHREAD_COND_INITIALIZER;
+static struct _kvstore_kv       *_reap_kvs;
+static struct _reap_job         *_reap_jobs;
+static uint64_t                  _reap_queued;
+static uint64_t                  _reap_freed;
+static int                       _reap_started;
+static int                       _reap_atfork;
+
+
+static void      _reap_start(void);
+static void      _reap_prepare(void);
+static void      _reap_parent(void);
+static void      _reap_child(void);
+static void      _reap_wake(void);
+static void      _reap_free_job(struct _reap_job *);
+static void     *_reap_thread(void *);
+
+
+void
+_reap_start(void)
+{
+        pthread_attr_t   attr;
+        pthread_t        thread;
+
+        /*
+         * The handlers are inherited by a forked child, so they are only
+         * registered once however many times the reaper is restarted.
+         */
+        if (!_reap_atfork) {
+                if (pthread_atfork(_reap_prepare, _reap_parent, _reap_child))
+                        return;
+                _reap_atfork = 1;
+        }
+        if (pthread_attr_init(&attr))
+                return;
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (0 == pthread_create(&thread, &attr, _reap_thread, NULL))
+                _reap_started = 1;
+        pthread_attr_destroy(&attr);
+}
+
+
+/*
+ * The lock is held across fork so that the child does not inherit it
+ * held by the reaper.
+ */
+void
+_reap_prepare(void)
+{
+        pthread_mutex_lock(&_reap_lock);
+}
+
+
+void
+_reap_parent(void)
+{
+        pthread_mutex_unlock(&_reap_lock);
+}
+
+
+void
+_reap_child(void)
+{
+        pthread_mutex_init(&_reap_lock, NULL);
+        pthread_cond_init(&_reap_cond, NULL);
+        pthread_cond_init(&_reap_done, NULL);
+        _reap_once = (pthread_once_t)PTHREAD_ONCE_INIT;
+        _reap_started = 0;
+        _reap_kvs = NULL;
+        _reap_jobs = NULL;
+        _reap_queued = 0;
+        _reap_freed = 0;
+}
+
+
+void
+_reap_wake(void)
+{
+        pthread_mutex_lock(&_reap_lock);
+        pthread_cond_signal(&_reap_cond);
+        pthread_mutex_unlock(&_reap_lock);
+}
+
+
+void
+_reap_free_job(struct _reap_job *job)
+{
+        struct _kvstore_kv      *kv;
+
+        while (NULL != (kv = TAILQ_FIRST(job->queue))) {
+                TAILQ_REMOVE(job->queue, kv, entries);
+                _kvstore_chunks_free(kv->chunks);
+                free(kv->key);
+                if (job->free_vals)
+                        free(kv->val);
+                free(kv);
+        }
+        free(job->queue);
+        free(job->buckets[0]);
+        free(job->buckets[1]);
+        free(job);
+}
+
+
+void *
+_reap_thread(void *arg)
+{
+        struct _kvstore_kv      *kv, *next;
+        struct _reap_job        *jobs, *job;
+        uint64_t                 freed;
+
+        (void)arg;
+        for (;;) {
+                pthread_mutex_lock(&_reap_lock);
+                while ((NULL == _reap_jobs) &&
+                    (NULL == __atomic_load_n(&_reap_kvs, __ATOMIC_ACQUIRE)))
+                        pthread_cond_wait(&_reap_cond, &_reap_lock);
+                jobs = _reap_jobs;
+                _reap_jobs = NULL;
+                pthread_mutex_unlock(&_reap_lock);
+
+                freed = 0;
+                kv = __atomic_exchange_n(&_reap_kvs, NULL, __ATOMIC_ACQUIRE);
+                for (; NULL != kv; kv = next) {
+                        next = kv->next;
+                        _kvstore_chunks_free(kv->chunks);
+                        free(kv->key);
+                        free(kv->val);
+                        free(kv);
+                        freed++;
+                }
+                while (NULL != (job = jobs)) {
+                        jobs = job->next;
+                        _reap_free_job(job);
+                        freed++;
+                }
+
+                pthread_mutex_lock(&_reap_lock);
+                _reap_freed += freed;
+                pthread_cond_broadcast(&_reap_done);
+                pthread_mutex_unlock(&_reap_lock);
+        }
+        return NULL;
+}
+
+
+/*
+ * _kvstore_retire_kv disposes of an entry that has been unlinked from
+ * the index: later, on the reaper, if the store defers reclamation and
+ * its values are on the heap, or else right away. A value shared
+ * through the dedup pool is let go of here, as the pool is the store's;
+ * a caller retiring entries after unlocking the store must release
+ * such values itself first.
+ */
+void
+_kvstore_retire_kv(kvstore kvs, struct _kvstore_kv *kv)
+{
+        struct _kvstore_kv      *head;
+
+        if (!kvs->reap || (NULL != kvs->bc) ||
+            (0 != pthread_once(&_reap_once, _reap_start)) || !_reap_started) {
+                _kvstore_free_kv(kvs, kv);
+                return;
+        }
+        if (KVSTORE_VAL_POOLED(kvs, kv))
+                _kvstore_free_val(kvs, kv);
+
+        __atomic_add_fetch(&_reap_queued, 1, __ATOMIC_RELAXED);
+        head = __atomic_load_n(&_reap_kvs, __ATOMIC_RELAXED);
+        do {
+                kv->next = head;
+        } while (!__atomic_compare_exchange_n(&_reap_kvs, &head, kv, 1,
+            __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+        if (NULL == head)
+                _reap_wake();
+}
+
+
+/*
+ * _kvstore_reap_index gives the store's index and entries to the reaper
+ * and leaves the store without them. It returns -1, having taken
+ * nothing, if the store does not defer reclamation or shares values
+ * through a dedup pool, which only the store can release into.
+ */
+int
+_kvstore_reap_index(kvstore kvs)
+{
+        struct _reap_job        *job;
+
+        if (!kvs->reap || (NULL == kvs->queue) || (NULL != kvs->dedup) ||
+            (0 != pthread_once(&_reap_once, _reap_start)) || !_reap_started)
+                return -1;
+        if (NULL == (job = (struct _reap_job *)malloc(
+            sizeof(struct _reap_job))))
+                return -1;
+        job->queue = kvs->queue;
+        job->buckets[0] = kvs->table[0].buckets;
+        job->buckets[1] = kvs->table[1].buckets;
+        job->free_vals = NULL == kvs->bc;
+        kvs->queue = NULL;
+        memset(kvs->table, 0x0, sizeof(kvs->table));
+
+        __atomic_add_fetch(&_reap_queued, 1, __ATOMIC_RELAXED);
+        pthread_mutex_lock(&_reap_lock);
+        job->next = _reap_jobs;
+        _reap_jobs = job;
+        pthread_cond_signal(&_reap_cond);
+        pthread_mutex_unlock(&_reap_lock);
+        return 0;
+}
+
+
+int
+_kvstore_reap_config(kvstore kvs, int enable)
+{
+        if (enable && ((0 != pthread_once(&_reap_once, _reap_start)) ||
+            !_reap_started))
+                return -1;
+        kvs->reap = enable ? 1 : 0;
+        return 0;
+}
+
+
+/*
+ * kvstore_reap_wait blocks until everything handed to the reaper before
+ * the call, by any store, has been freed.
+ */
+void
+kvstore_reap_wait(void)
+{
+        uint64_t        target;
+
+        target = __atomic_load_n(&_reap_queued, __ATOMIC_RELAXED);
+        pthread_mutex_lock(&_reap_lock);
+        while (_reap_freed < target)
+                pthread_cond_wait(&_reap_done, &_reap_lock);
+        pthread_mutex_unlock(&_reap_lock);
+}
@@ -0,0 +1,518 @@
+/*
+ * Copyright (c) 2013 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+ * OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ * ---------------------------------------------------------------------
+ */
+
+
+/*
+ * A store that lives entirely in a shared memory segment, so several
+ * processes can attach to one copy of the data. Everything in the
+ * segment refers to everything else by offset from its start, since
+ * each process may map it at a different address.
+ *
+ * The segment holds a header, a fixed array of hash buckets and a heap.
+ * The heap hands out blocks in power-of-two size classes, taking them
+ * from a per-class free list or else from the unused end of the heap.
+ * Each entry is one block holding its key, and its value is another.
+ *
+ * Access is serialized by a process-shared robust mutex, which
+ * _lock_kvstore takes after the store's own semaphore. Every change is
+ * published with a single store of an offset, so a process that dies
+ * holding the lock leaves the index consistent: at worst a block is
+ * leaked or the key count is stale. The next locker gets EOWNERDEAD,
+ * recounts the keys and marks the mutex consistent again.
+ */
+
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "kv.h"
+#include "kv_int.h"
+
+
+#define KVSTORE_SHM_CLASSES     32
+
+const size_t             KVSTORE_DEFAULT_SHM_SIZE = 64 * 1024 * 1024;
+static const uint64_t    KVSTORE_SHM_MAGIC = 0x6b7673686d303032ULL;
+static const uint64_t    KVSTORE_SHM_MIN_CLASS = 32;
+
+
+struct _shm_header {
+        uint64_t         magic;
+        uint64_t         size;
+        pthread_mutex_t  lock;
+        uint64_t         nbuckets;
+        uint64_t         buckets;
+        uint64_t         heap;
+        uint64_t         brk;
+        uint64_t         keys;
+        uint64_t         hash_alg;
+        uint64_t         hash_seed[2];
+        uint64_t         free[KVSTORE_SHM_CLASSES];
+};
+
+struct _shm_kv {
+        uint64_t         next;
+        uint64_t         hash;
+        uint64_t         val;
+        uint32_t         key_len;
+        uint32_t         val_len;
+        char             key[];
+};
+
+struct _kvstore_shm {
+        struct _shm_header      *hdr;
+        char                    *base;
+        size_t                   size;
+        int                      fd;
+};
+
+
+#define SHM_PTR(shm, off)       ((void *)((shm)->base + (off)))
+
+
+static int       _shm_class(size_t);
+static uint64_t  _shm_alloc(struct _kvstore_shm *, size_t);
+static void      _shm_free(struct _kvstore_shm *, uint64_t);
+static uint64_t *_shm_bucket(struct _kvstore_shm *, uint64_t);
+static struct _shm_kv
+                *_shm_find(struct _kvstore_shm *, char *, size_t, uint64_t,
+                    uint64_t **);
+static uint64_t  _shm_copy_val(struct _kvstore_shm *, char *, size_t);
+static void      _shm_recover(struct _kvstore_shm *);
+static int       _shm_init(struct _kvstore_shm *, size_t,
+                    struct _kvstore_hasher *);
+static int       _shm_attach(struct _kvstore_shm *);
+
+
+int
+_shm_class(size_t n)
+{
+        int     c = 0;
+
+        n += sizeof(uint64_t);
+        while ((KVSTORE_SHM_MIN_CLASS << c) < n) {
+                if (++c == KVSTORE_SHM_CLASSES)
+                        return -1;
+        }
+        return c;
+}
+
+
+/*
+ * _shm_alloc returns the offset of n usable bytes, or 0 if the segment
+ * is full. Each block starts with its size class.
+ */
+uint64_t
+_shm_alloc(struct _kvstore_shm *shm, size_t n)
+{
+        struct _shm_header      *hdr = shm->hdr;
+        uint64_t                 off, size;
+        int                      c;
+
+        if (-1 == (c = _shm_class(n)))
+                return 0;
+        off = hdr->free[c];
+        if (0 != off) {
+                __atomic_store_n(&hdr->free[c],
+                    *(uint64_t *)SHM_PTR(shm, off), __ATOMIC_RELEASE);
+                return off;
+        }
+
+        size = KVSTORE_SHM_MIN_CLASS << c;
+        if (hdr->brk + size > hdr->size) {
+                errno = ENOMEM;
+                return 0;
+        }
+        off = hdr->brk + sizeof(uint64_t);
+        *(uint64_t *)SHM_PTR(shm, hdr->brk) = (uint64_t)c;
+        __atomic_store_n(&hdr->brk, hdr->brk + size, __ATOMIC_RELEASE);
+        return off;
+}
+
+
+void
+_shm_free(struct _kvstore_shm *shm, uint64_t off)
+{
+        struct _shm_header      *hdr = shm->hdr;
+        uint64_t                 c;
+
+        c = *(uint64_t *)SHM_PTR(shm, off - sizeof(uint64_t));
+        *(uint64_t *)SHM_PTR(shm, off) = hdr->free[c];
+        __atomic_store_n(&hdr->free[c], off, __ATOMIC_RELEASE);
+}
+
+
+uint64_t *
+_shm_bucket(struct _kvstore_shm *shm, uint64_t hash)
+{
+        uint64_t        *buckets = SHM_PTR(shm, shm->hdr->buckets);
+
+        return &buckets[hash & (shm->hdr->nbuckets - 1)];
+}
+
+
+/*
+ * _shm_find returns the entry for key, and in *prevp the link that
+ * points to it.
+ */
+struct _shm_kv *
+_shm_find(struct _kvstore_shm *shm, char *key, size_t klen, uint64_t hash,
+    uint64_t **prevp)
+{
+        struct _shm_kv  *kv;
+        uint64_t        *link;
+
+        for (link = _shm_bucket(shm, hash); 0 != *link; link = &kv->next) {
+                kv = SHM_PTR(shm, *link);
+                if ((kv->hash == hash) && (kv->key_len == klen) &&
+                    (0 == memcmp(kv->key, key, klen))) {
+                        if (NULL != prevp)
+                                *prevp = link;
+                        return kv;
+                }
+        }
+        return NULL;
+}
+
+
+uint64_t
+_shm_copy_val(struct _kvstore_shm *shm, char *val, size_t vlen)
+{
+        uint64_t        off;
+
+        if (0 == (off = _shm_alloc(shm, vlen + 1)))
+                return 0;
+        memcpy(SHM_PTR(shm, off), val, vlen + 1);
+        return off;
+}
+
+
+/*
+ * _shm_recover runs when the previous holder of the lock died. Links
+ * are only ever changed by single stores of complete entries, so the
+ * chains are intact; only the key count and the length of a value that
+ * was being replaced have to be rebuilt.
+ */
+void
+_shm_recover(struct _kvstore_shm *shm)
+{
+        struct _shm_kv  *kv;
+        uint64_t        *buckets = SHM_PTR(shm, shm->hdr->buckets);
+        uint64_t         i, off, keys = 0;
+
+        for (i = 0; i < shm->hdr->nbuckets; i++) {
+                for (off = buckets[i]; 0 != off; off = kv->next) {
+                        kv = SHM_PTR(shm, off);
+                        kv->val_len = (uint32_t)strlen(SHM_PTR(shm,
+                            kv->val));
+                        keys++;
+                }
+        }
+        shm->hdr->keys = keys;
+}
+
+
+int
+_kvstore_shm_lock(kvstore kvs)
+{
+        struct _kvstore_shm     *shm = kvs->shm;
+        int                      rc;
+
+        rc = pthread_mutex_lock(&shm->hdr->lock);
+        if (EOWNERDEAD == rc) {
+                _shm_recover(shm);
+                rc = pthread_mutex_consistent(&shm->hdr->lock);
+        }
+        if (0 != rc) {
+                errno = rc;
+                return -1;
+        }
+        return 0;
+}
+
+
+void
+_kvstore_shm_unlock(kvstore kvs)
+{
+        pthread_mutex_unlock(&kvs->shm->hdr->lock);
+}
+
+
+int
+_kvstore_shm_set(kvstore kvs, char *key, size_t klen, uint64_t hash,
+    char *val)
+{
+        struct _kvstore_shm     *shm = kvs->shm;
+        struct _shm_kv          *kv;
+        uint64_t                *bucket;
+        uint64_t                 off, voff, old;
+        size_t                   vlen;
+
+        vlen = strnlen(val, kvs->max_vallen + 1);
+        if (((kvs->max_vallen + 1) == vlen) || (0 == vlen))
+                return -1;
+        if (0 == (voff = _shm_copy_val(shm, val, vlen)))
+                return -1;
+
+        if (NULL != (kv = _shm_find(shm, key, klen, hash, NULL))) {
+                old = kv->val;
+                __atomic_store_n(&kv->val, voff, __ATOMIC_RELEASE);
+                kv->val_len = (uint32_t)vlen;
+                _shm_free(shm, old);
+                return 0;
+        }
+
+        if (0 == (off = _shm_alloc(shm, sizeof(struct _shm_kv) + klen + 1))) {
+                _shm_free(shm, voff);
+                return -1;
+        }
+        kv = SHM_PTR(shm, off);
+        bucket = _shm_bucket(shm, hash);
+        kv->next = *bucket;
+        kv->hash = hash;
+        kv->val = voff;
+        kv->key_len = (uint32_t)klen;
+        kv->val_len = (uint32_t)vlen;
+        memcpy(kv->key, key, klen + 1);
+        __atomic_store_n(bucket, off, __ATOMIC_RELEASE);
+        shm->hdr->keys++;
+        return 0;
+}
+
+
+int
+_kvstore_shm_del(kvstore kvs, char *key, size_t klen, uint64_t hash)
+{
+        struct _kvstore_shm     *shm = kvs->shm;
+        struct _shm_kv          *kv;
+        uint64_t                *link;
+        uint64_t                 off;
+
+        if (NULL == (kv = _shm_find(shm, key, klen, hash, &link)))
+                return -1;
+        off = *link;
+        __atomic_store_n(link, kv->next, __ATOMIC_RELEASE);
+        shm->hdr->keys--;
+        _shm_free(shm, kv->val);
+        _shm_free(shm, off);
+        return 0;
+}
+
+
+char *
+_kvstore_shm_get(kvstore kvs, char *key, size_t *len)
+{
+        struct _shm_kv  *kv;
+        size_t           klen;
+
+        klen = strnlen(key, kvs->max_keylen + 1);
+        if (((kvs->max_keylen + 1) == klen) || (0 == klen))
+                return NULL;
+        kv = _shm_find(kvs->shm, key, klen, _kvstore_hash(kvs, key, klen),
+            NULL);
+        if (NULL == kv)
+                return NULL;
+        if (NULL != len)
+                *len = kv->val_len;
+        return SHM_PTR(kvs->shm, kv->val);
+}
+
+
+size_t
+_kvstore_shm_len(kvstore kvs)
+{
+        return __atomic_load_n(&kvs->shm->hdr->keys, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * _shm_init lays out a new segment. The creating store's hash and seed
+ * are recorded in the header for every process that attaches later.
+ */
+int
+_shm_init(struct _kvstore_shm *shm, size_t size, struct _kvstore_hasher *h)
+{
+        struct _shm_header      *hdr = shm->hdr;
+        pthread_mutexattr_t      attr;
+        uint64_t                 n = 1024;
+
+        while (n * 512 < size)
+                n <<= 1;
+        hdr->size = size;
+        hdr->nbuckets = n;
+        hdr->buckets = (sizeof(struct _shm_header) + 63) & ~(uint64_t)63;
+        hdr->heap = hdr->buckets + n * sizeof(uint64_t);
+        hdr->brk = hdr->heap;
+        if (hdr->heap >= size)
+                return -1;
+        hdr->hash_alg = (uint64_t)h->alg;
+        hdr->hash_seed[0] = h->seed[0];
+        hdr->hash_seed[1] = h->seed[1];
+
+        if (pthread_mutexattr_init(&attr))
+                return -1;
+        if (pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED) ||
+            pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST) ||
+            pthread_mutex_init(&hdr->lock, &attr)) {
+                pthread_mutexattr_destroy(&attr);
+                return -1;
+        }
+        pthread_mutexattr_destroy(&attr);
+        __atomic_store_n(&hdr->magic, KVSTORE_SHM_MAGIC, __ATOMIC_RELEASE);
+        return 0;
+}
+
+
+/*
+ * _shm_attach maps a segment some other process created, waiting for a
+ * moment if it has not finished setting it up.
+ */
+int
+_shm_attach(struct _kvstore_shm *shm)
+{
+        struct timespec  ts = { 0, 1000000 };
+        struct stat      st;
+        int              tries;
+
+        for (tries = 0; tries < 1000; tries++) {
+                if (fstat(shm->fd, &st))
+                        return -1;
+                if ((size_t)st.st_size >= sizeof(struct _shm_header))
+                        break;
+                nanosleep(&ts, NULL);
+        }
+        if ((size_t)st.st_size < sizeof(struct _shm_header))
+                return -1;
+        shm->size = (size_t)st.st_size;
+        shm->base = mmap(NULL, shm->size, PROT_READ | PROT_WRITE,
+            MAP_SHARED, shm->fd, 0);
+        if (MAP_FAILED == shm->base)
+                return -1;
+        shm->hdr = (struct _shm_header *)shm->base;
+        for (tries = 0; tries < 1000; tries++) {
+                if (KVSTORE_SHM_MAGIC == __atomic_load_n(&shm->hdr->magic,
+                    __ATOMIC_ACQUIRE))
+                        break;
+                nanosleep(&ts, NULL);
+        }
+        if ((KVSTORE_SHM_MAGIC != shm->hdr->magic) ||
+            (shm->hdr->size != shm->size))
+                return -1;
+        return 0;
+}
+
+
+/*
+ * kvstore_shm_open creates the shared memory segment name with room for
+ * size bytes (KVSTORE_DEFAULT_SHM_SIZE if 0), or attaches to it if it
+ * already exists. With a NULL name the segment is anonymous and shared
+ * only with children forked afterwards.
+ */
+kvstore
+kvstore_shm_open(const char *name, size_t size)
+{
+        struct _kvstore_shm     *shm;
+        kvstore                  kvs;
+        int                      created = 0;
+
+        if (0 == size)
+                size = KVSTORE_DEFAULT_SHM_SIZE;
+        if (NULL == (kvs = kvstore_new()))
+                return NULL;
+        if (NULL == (shm = (struct _kvstore_shm *)calloc(1,
+            sizeof(struct _kvstore_shm)))) {
+                kvstore_discard(kvs);
+                return NULL;
+        }
+        shm->fd = -1;
+        shm->base = MAP_FAILED;
+
+        if (NULL == name) {
+                shm->size = size;
+                shm->base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+                created = 1;
+        } else {
+                shm->fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+                if (-1 != shm->fd) {
+                        created = 1;
+                        if (ftruncate(shm->fd, (off_t)size))
+                                goto shm_fail;
+                        shm->size = size;
+                        shm->base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED, shm->fd, 0);
+                } else if (EEXIST == errno) {
+                        shm->fd = shm_open(name, O_RDWR, 0600);
+                        if ((-1 == shm->fd) || _shm_attach(shm))
+                                goto shm_fail;
+                } else {
+                        goto shm_fail;
+                }
+        }
+        if (MAP_FAILED == shm->base)
+                goto shm_fail;
+        shm->hdr = (struct _shm_header *)shm->base;
+        if (created && _shm_init(shm, size, &kvs->hasher))
+                goto shm_fail;
+        kvs->hasher.alg = (KVSTORE_HASH_ALG)shm->hdr->hash_alg;
+        kvs->hasher.seed[0] = shm->hdr->hash_seed[0];
+        kvs->hasher.seed[1] = shm->hdr->hash_seed[1];
+
+        kvs->shm = shm;
+        return kvs;
+
+shm_fail:
+        if (created && (NULL != name))
+                shm_unlink(name);
+        if (MAP_FAILED != shm->base)
+                munmap(shm->base, shm->size);
+        if (-1 != shm->fd)
+                close(shm->fd);
+        free(shm);
+        kvstore_discard(kvs);
+        return NULL;
+}
+
+
+/*
+ * _kvstore_shm_close detaches from the segment; the data stays until
+ * the last process unmaps it and, for a named segment, shm_unlink has
+ * been called.
+ */
+void
+_kvstore_shm_close(kvstore kvs)
+{
+        struct _kvstore_shm     *shm = kvs->shm;
+
+        if (NULL == shm)
+                return;
+        munmap(shm->base, shm->size);
+        if (-1 != shm->fd)
+                close(shm->fd);
+        free(shm);
+        kvs->shm = NULL;
+}
@@ -0,0 +1,510 @@
+/*
+ * Copyright (c) 2013 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+ * OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ * ---------------------------------------------------------------------
+ */
+
+
+
+/*
+ * The compact layout keeps a store's entries as parallel arrays rather
+ * than as linked nodes: one array of hashes, one each of key and value
+ * lengths and one of offsets into a single buffer that holds every key
+ * and value back to back, each NUL-terminated. A scan walks the arrays
+ * and the buffer front to back, and a lookup probes an open-addressed
+ * index of entry numbers, then compares against the hash array before
+ * it touches any key bytes.
+ *
+ * A deleted entry is left in place with a key length of 0, and a value
+ * that outgrows its room is written again at the end of the buffer.
+ * Once at least half the entries or bytes are dead, the next write
+ * copies the live ones into fresh arrays and a fresh buffer, in order,
+ * and rebuilds the index. Deletes never move anything, so keys handed
+ * out by a scan stay put until the next set.
+ *
+ * kvstore_scan cursors are entry numbers, tagged with a count of
+ * compactions in their top bits; a cursor from before a compaction
+ * starts the scan over.
+ */
+
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kv.h"
+#include "kv_int.h"
+
+
+#define KVSTORE_SOA_GEN_BITS    16
+#define KVSTORE_SOA_POS_BITS    (sizeof(size_t) * 8 - KVSTORE_SOA_GEN_BITS)
+
+static const size_t      KVSTORE_SOA_MIN_ENTRIES = 64;
+static const size_t      KVSTORE_SOA_MIN_BLOB = 4096;
+
+
+struct _kvstore_soa {
+        uint64_t        *hashes;
+        uint32_t        *key_lens;
+        uint32_t        *val_lens;
+        uint64_t        *offs;
+        size_t           n;
+        size_t           cap;
+        size_t           dead;
+
+        uint32_t        *index;
+        size_t           mask;
+
+        char            *blob;
+        size_t           blob_len;
+        size_t           blob_cap;
+        size_t           blob_dead;
+
+        size_t           gen;
+};
+
+
+static ssize_t   _soa_find(struct _kvstore_soa *, char *, size_t, uint64_t,
+                    size_t *);
+static void      _soa_index_add(struct _kvstore_soa *, size_t);
+static void      _soa_index_del(struct _kvstore_soa *, size_t);
+static int       _soa_index_build(struct _kvstore_soa *, size_t);
+static int       _soa_arrays(struct _kvstore_soa *, size_t);
+static int       _soa_compact(struct _kvstore_soa *, size_t);
+static int       _soa_room(struct _kvstore_soa *, size_t, size_t);
+static uint64_t  _soa_append(struct _kvstore_soa *, char *, size_t, char *,
+                    size_t);
+static int       _soa_aliases(struct _kvstore_soa *, const char *);
+
+
+/*
+ * _soa_find returns the live entry holding key, or -1, and stores the
+ * index slot that refers to it in *slot if slot is not NULL.
+ */
+ssize_t
+_soa_find(struct _kvstore_soa *soa, char *key, size_t klen, uint64_t hash,
+    size_t *slot)
+{
+        size_t   i, e;
+
+        for (i = hash & soa->mask; 0 != soa->index[i];
+            i = (i + 1) & soa->mask) {
+                e = soa->index[i] - 1;
+                if ((soa->hashes[e] != hash) || (soa->key_lens[e] != klen))
+                        continue;
+                if (0 != memcmp(soa->blob + soa->offs[e], key, klen))
+                        continue;
+                if (NULL != slot)
+                        *slot = i;
+                return (ssize_t)e;
+        }
+        return -1;
+}
+
+
+void
+_soa_index_add(struct _kvstore_soa *soa, size_t e)
+{
+        size_t   i;
+
+        i = soa->hashes[e] & soa->mask;
+        while (0 != soa->index[i])
+                i = (i + 1) & soa->mask;
+        soa->index[i] = (uint32_t)(e + 1);
+}
+
+
+/*
+ * _soa_index_del empties a slot and shifts later members of its probe
+ * run back to fill the gap, so that the index never needs tombstones.
+ */
+void
+_soa_index_del(struct _kvstore_soa *soa, size_t slot)
+{
+        size_t   i, home;
+
+        i = slot;
+        for (;;) {
+                soa->index[slot] = 0;
+                for (;;) {
+                        i = (i + 1) & soa->mask;
+                        if (0 == soa->index[i])
+                                return;
+                        home = soa->hashes[soa->index[i] - 1] & soa->mask;
+                        if (slot <= i) {
+                                if ((home <= slot) || (home > i))
+                                        break;
+                        } else if ((home <= slot) && (home > i)) {
+                                break;
+                        }
+                }
+                soa->index[slot] = soa->index[i];
+                slot = i;
+        }
+}
+
+
+/*
+ * _soa_index_build replaces the index with one of at least twice as
+ * many slots as there are to be live entries, and adds the live ones.
+ */
+int
+_soa_index_build(struct _kvstore_soa *soa, size_t live)
+{
+        uint32_t        *index;
+        size_t           size, e;
+
+        for (size = KVSTORE_SOA_MIN_ENTRIES; size < live * 2; size <<= 1)
+                ;
+        if (NULL == (index = (uint32_t *)calloc(size, sizeof(uint32_t))))
+                return -1;
+        free(soa->index);
+        soa->index = index;
+        soa->mask = size - 1;
+        for (e = 0; e < soa->n; e++) {
+                if (0 != soa->key_lens[e])
+                        _soa_index_add(soa, e);
+        }
+        return 0;
+}
+
+
+int
+_soa_arrays(struct _kvstore_soa *soa, size_t cap)
+{
+        void    *p;
+
+        if (NULL == (p = realloc(soa->hashes, cap * sizeof(uint64_t))))
+                return -1;
+        soa->hashes = (uint64_t *)p;
+        if (NULL == (p = realloc(soa->key_lens, cap * sizeof(uint32_t))))
+                return -1;
+        soa->key_lens = (uint32_t *)p;
+        if (NULL == (p = realloc(soa->val_lens, cap * sizeof(uint32_t))))
+                return -1;
+        soa->val_lens = (uint32_t *)p;
+        if (NULL == (p = realloc(soa->offs, cap * sizeof(uint64_t))))
+                return -1;
+        soa->offs = (uint64_t *)p;
+        soa->cap = cap;
+        return 0;
+}
+
+
+/*
+ * _soa_compact copies the live entries' keys and values, in entry
+ * order, into a new buffer with room for at least extra more bytes,
+ * closes the gaps the dead entries left in the arrays and rebuilds the
+ * index.
+ */
+int
+_soa_compact(struct _kvstore_soa *soa, size_t extra)
+{
+        char    *blob, *rec;
+        size_t   live_bytes, cap, len, e, w;
+
+        live_bytes = soa->blob_len - soa->blob_dead;
+        for (cap = KVSTORE_SOA_MIN_BLOB; cap < (live_bytes + extra) * 2; )
+                cap <<= 1;
+        if (NULL == (blob = (char *)malloc(cap)))
+                return -1;
+
+        len = 0;
+        for (e = 0, w = 0; e < soa->n; e++) {
+                if (0 == soa->key_lens[e])
+                        continue;
+                rec = soa->blob + soa->offs[e];
+                memcpy(blob + len, rec,
+                    soa->key_lens[e] + soa->val_lens[e] + 2);
+                soa->hashes[w] = soa->hashes[e];
+                soa->key_lens[w] = soa->key_lens[e];
+                soa->val_lens[w] = soa->val_lens[e];
+                soa->offs[w] = len;
+                len += soa->key_lens[e] + soa->val_lens[e] + 2;
+                w++;
+        }
+
+        free(soa->blob);
+        soa->blob = blob;
+        soa->blob_len = len;
+        soa->blob_cap = cap;
+        soa->blob_dead = 0;
+        soa->n = w;
+        soa->dead = 0;
+        soa->gen++;
+        return _soa_index_build(soa, w);
+}
+
+
+/*
+ * _soa_room makes space for entries more entries and bytes more bytes
+ * of keys and values, first compacting if at least half the entries or
+ * half the bytes are dead. Every compaction follows at least as many
+ * deletes or moves as there are live entries left, so its cost is
+ * spread over them.
+ */
+int
+_soa_room(struct _kvstore_soa *soa, size_t entries, size_t bytes)
+{
+        size_t   cap;
+        void    *blob;
+
+        if (((soa->dead >= KVSTORE_SOA_MIN_ENTRIES) &&
+            (soa->dead * 2 >= soa->n)) ||
+            ((soa->blob_dead >= KVSTORE_SOA_MIN_BLOB) &&
+            (soa->blob_dead * 2 >= soa->blob_len))) {
+                if (_soa_compact(soa, bytes))
+                        return -1;
+        }
+
+        if (soa->n + entries > soa->cap) {
+                for (cap = soa->cap; cap < soa->n + entries; cap <<= 1)
+                        ;
+                if (_soa_arrays(soa, cap))
+                        return -1;
+        }
+        if (soa->blob_len + bytes > soa->blob_cap) {
+                for (cap = soa->blob_cap; cap < soa->blob_len + bytes; )
+                        cap <<= 1;
+                if (NULL == (blob = realloc(soa->blob, cap)))
+                        return -1;
+                soa->blob = (char *)blob;
+                soa->blob_cap = cap;
+        }
+        return 0;
+}
+
+
+uint64_t
+_soa_append(struct _kvstore_soa *soa, char *key, size_t klen, char *val,
+    size_t vlen)
+{
+        uint64_t         off = soa->blob_len;
+        char            *rec = soa->blob + off;
+
+        memcpy(rec, key, klen);
+        rec[klen] = 0;
+        memcpy(rec + klen + 1, val, vlen);
+        rec[klen + vlen + 1] = 0;
+        soa->blob_len += klen + vlen + 2;
+        return off;
+}
+
+
+int
+_soa_aliases(struct _kvstore_soa *soa, const char *p)
+{
+        uintptr_t        base = (uintptr_t)soa->blob;
+
+        return ((uintptr_t)p >= base) && ((uintptr_t)p < base + soa->blob_cap);
+}
+
+
+/*
+ * _kvstore_soa_set adds or replaces an entry. A key or value that
+ * points into the store's own buffer is copied out first, since making
+ * room may move the buffer.
+ */
+int
+_kvstore_soa_set(kvstore kvs, char *key, size_t klen, uint64_t hash,
+    char *val)
+{
+        struct _kvstore_soa     *soa = kvs->soa;
+        ssize_t                  e;
+        size_t                   vlen;
+        char                    *copy;
+        int                      retval;
+
+        vlen = strnlen(val, kvs->max_vallen + 1);
+        if (((kvs->max_vallen + 1) == vlen) || (0 == vlen) ||
+            (klen > UINT32_MAX) || (vlen > UINT32_MAX))
+                return -1;
+
+        if (_soa_aliases(soa, key) || _soa_aliases(soa, val)) {
+                if (NULL == (copy = (char *)malloc(klen + vlen + 2)))
+                        return -1;
+                memcpy(copy, key, klen);
+                copy[klen] = 0;
+                memcpy(copy + klen + 1, val, vlen + 1);
+                retval = _kvstore_soa_set(kvs, copy, klen, hash,
+                    copy + klen + 1);
+                free(copy);
+                return retval;
+        }
+
+        if (-1 != (e = _soa_find(soa, key, klen, hash, NULL))) {
+                if (vlen <= soa->val_lens[e]) {
+                        copy = soa->blob + soa->offs[e] + klen + 1;
+                        memcpy(copy, val, vlen);
+                        copy[vlen] = 0;
+                        soa->blob_dead += soa->val_lens[e] - vlen;
+                        soa->val_lens[e] = (uint32_t)vlen;
+                        return 0;
+                }
+                if (_soa_room(soa, 0, klen + vlen + 2))
+                        return -1;
+                e = _soa_find(soa, key, klen, hash, NULL);
+                soa->blob_dead += klen + soa->val_lens[e] + 2;
+                soa->offs[e] = _soa_append(soa, key, klen, val, vlen);
+                soa->val_lens[e] = (uint32_t)vlen;
+                return 0;
+        }
+
+        if (soa->n >= UINT32_MAX - 1)
+                return -1;
+        if (_soa_room(soa, 1, klen + vlen + 2))
+                return -1;
+        if ((kvs->keys + 1) * 2 > soa->mask + 1) {
+                if (_soa_index_build(soa, (kvs->keys + 1) * 2))
+                        return -1;
+        }
+        e = (ssize_t)soa->n++;
+        soa->hashes[e] = hash;
+        soa->key_lens[e] = (uint32_t)klen;
+        soa->val_lens[e] = (uint32_t)vlen;
+        soa->offs[e] = _soa_append(soa, key, klen, val, vlen);
+        _soa_index_add(soa, (size_t)e);
+        kvs->keys++;
+        return 0;
+}
+
+
+int
+_kvstore_soa_del(kvstore kvs, char *key, size_t klen, uint64_t hash)
+{
+        struct _kvstore_soa     *soa = kvs->soa;
+        ssize_t                  e;
+        size_t                   slot;
+
+        if (-1 == (e = _soa_find(soa, key, klen, hash, &slot)))
+                return -1;
+        _soa_index_del(soa, slot);
+        soa->blob_dead += soa->key_lens[e] + soa->val_lens[e] + 2;
+        soa->key_lens[e] = 0;
+        soa->dead++;
+        kvs->keys--;
+        return 0;
+}
+
+
+char *
+_kvstore_soa_get(kvstore kvs, char *key, size_t *len)
+{
+        struct _kvstore_soa     *soa = kvs->soa;
+        ssize_t                  e;
+        size_t                   klen;
+
+        klen = strnlen(key, kvs->max_keylen + 1);
+        if (((kvs->max_keylen + 1) == klen) || (0 == klen))
+                return NULL;
+        e = _soa_find(soa, key, klen, _kvstore_hash(kvs, key, klen), NULL);
+        if (-1 == e)
+                return NULL;
+        if (NULL != len)
+                *len = soa->val_lens[e];
+        return soa->blob + soa->offs[e] + klen + 1;
+}
+
+
+void
+_kvstore_soa_scan(kvstore kvs, size_t *cursor, size_t count,
+    kvstore_scan_cb cb, void *arg)
+{
+        struct _kvstore_soa     *soa = kvs->soa;
+        size_t                   gen, pos, found = 0;
+        char                    *rec;
+
+        gen = soa->gen & (((size_t)1 << KVSTORE_SOA_GEN_BITS) - 1);
+        pos = *cursor & (((size_t)1 << KVSTORE_SOA_POS_BITS) - 1);
+        if ((*cursor >> KVSTORE_SOA_POS_BITS) != gen)
+                pos = 0;
+
+        for (; (pos < soa->n) && (found < count); pos++) {
+                if (0 == soa->key_lens[pos])
+                        continue;
+                rec = soa->blob + soa->offs[pos];
+                cb(rec, rec + soa->key_lens[pos] + 1, arg);
+                found++;
+        }
+        if (pos >= soa->n)
+                *cursor = 0;
+        else
+                *cursor = (gen << KVSTORE_SOA_POS_BITS) | pos;
+}
+
+
+/*
+ * _kvstore_soa_rehash recomputes every hash after the store's hash
+ * function has changed.
+ */
+int
+_kvstore_soa_rehash(kvstore kvs)
+{
+        struct _kvstore_soa     *soa = kvs->soa;
+        size_t                   e;
+
+        for (e = 0; e < soa->n; e++) {
+                if (0 == soa->key_lens[e])
+                        continue;
+                soa->hashes[e] = _kvstore_hash(kvs, soa->blob + soa->offs[e],
+                    soa->key_lens[e]);
+        }
+        return _soa_index_build(soa, kvs->keys);
+}
+
+
+void
+_kvstore_soa_free(kvstore kvs)
+{
+        struct _kvstore_soa     *soa = kvs->soa;
+
+        if (NULL == soa)
+                return;
+        free(soa->hashes);
+        free(soa->key_lens);
+        free(soa->val_lens);
+        free(soa->offs);
+        free(soa->index);
+        free(soa->blob);
+        free(soa);
+        kvs->soa = NULL;
+}
+
+
+kvstore
+kvstore_new_compact(void)
+{
+        struct _kvstore_soa     *soa;
+        kvstore                  kvs;
+
+        if (NULL == (kvs = kvstore_new()))
+                return NULL;
+        if (NULL == (soa = (struct _kvstore_soa *)calloc(1,
+            sizeof(struct _kvstore_soa))))
+                goto soa_fail;
+        kvs->soa = soa;
+        if (_soa_arrays(soa, KVSTORE_SOA_MIN_ENTRIES) ||
+            _soa_index_build(soa, 0))
+                goto soa_fail;
+        if (NULL == (soa->blob = (char *)malloc(KVSTORE_SOA_MIN_BLOB)))
+                goto soa_fail;
+        soa->blob_cap = KVSTORE_SOA_MIN_BLOB;
+        return kvs;
+
+soa_fail:
+        kvstore_discard(kvs);
+        return NULL;
+}
@@ -0,0 +1,362 @@
+/*
+ * Copyright (c) 2013 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+ * OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ * ---------------------------------------------------------------------
+ */
+
+
+/*
+ * Operation tracing. Each thread that touches a traced store gets its
+ * own ring of fixed-size events, found through a thread-specific key, so
+ * recording takes no locks and shares no cache lines. An event holds
+ * the operation, the key's hash, when it started, how long it waited
+ * for the store lock, how long it then held it and its result, all in
+ * ticks of the time-stamp counter (nanoseconds where there is none).
+ *
+ * A dump writes one block per ring: a struct kvstore_trace_header and
+ * then the ring's events, oldest first. Dumps only use write(2), so they
+ * can be taken from a signal handler. A ring being written while it is
+ * dumped may yield a torn event or two.
+ *
+ * Independently of the rings, the lock and operations carry static
+ * probes when sys/sdt.h is available, for perf and bpftrace.
+ */
+
+
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "kv.h"
+#include "kv_int.h"
+
+
+struct _trace_ring {
+        struct _trace_ring              *next;
+        uint64_t                         thread;
+        uint64_t                         head;
+        struct kvstore_trace_event       ev[];
+};
+
+struct _kvstore_trace {
+        pthread_key_t            key;
+        size_t                   size;
+        uint64_t                 hz;
+        uint64_t                 threads;
+        struct _trace_ring      *rings;
+};
+
+
+static kvstore           _trace_sig_kvs;
+static int               _trace_sig_fd = -1;
+
+
+static uint64_t  _trace_ns(void);
+static uint64_t  _trace_hz(void);
+static struct _trace_ring
+                *_trace_ring(struct _kvstore_trace *);
+static int       _trace_write(int, const void *, size_t);
+static void      _trace_signal(int);
+
+
+uint64_t
+_trace_ns(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+
+uint64_t
+_kvstore_ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+        return __builtin_ia32_rdtsc();
+#else
+        return _trace_ns();
+#endif
+}
+
+
+/*
+ * _trace_hz measures the tick rate against the monotonic clock.
+ */
+uint64_t
+_trace_hz(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+        struct timespec  ts = {0, 20000000};
+        uint64_t         t0, c0, t1, c1;
+
+        t0 = _trace_ns();
+        c0 = _kvstore_ticks();
+        nanosleep(&ts, NULL);
+        t1 = _trace_ns();
+        c1 = _kvstore_ticks();
+        if ((t1 <= t0) || (c1 <= c0))
+                return 1000000000ULL;
+        return (uint64_t)((double)(c1 - c0) * 1e9 / (double)(t1 - t0));
+#else
+        return 1000000000ULL;
+#endif
+}
+
+
+struct _trace_ring *
+_trace_ring(struct _kvstore_trace *tr)
+{
+        struct _trace_ring      *ring;
+
+        if (NULL != (ring = pthread_getspecific(tr->key)))
+                return ring;
+        ring = (struct _trace_ring *)calloc(1, sizeof(struct _trace_ring) +
+            tr->size * sizeof(struct kvstore_trace_event));
+        if (NULL == ring)
+                return NULL;
+        ring->thread = __atomic_add_fetch(&tr->threads, 1, __ATOMIC_RELAXED);
+        ring->next = __atomic_load_n(&tr->rings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&tr->rings, &ring->next, ring,
+            0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+                ;
+        pthread_setspecific(tr->key, ring);
+        return ring;
+}
+
+
+/*
+ * _kvstore_trace_begin, _locked and _end bracket an operation: begin
+ * before taking the lock, locked once it is held and end after it has
+ * been released.
+ */
+void
+_kvstore_trace_begin(kvstore kvs, struct _kvstore_span *sp, KVSTORE_OP op,
+    char *key)
+{
+        KVSTORE_PROBE2(op__start, op, key);
+        sp->op = op;
+        sp->key = key;
+        if (NULL != kvs->trace)
+                sp->start = sp->locked = _kvstore_ticks();
+}
+
+
+void
+_kvstore_trace_locked(kvstore kvs, struct _kvstore_span *sp)
+{
+        if (NULL != kvs->trace)
+                sp->locked = _kvstore_ticks();
+}
+
+
+void
+_kvstore_trace_end(kvstore kvs, struct _kvstore_span *sp, int result)
+{
+        struct _trace_ring              *ring;
+        struct kvstore_trace_event      *ev;
+        uint64_t                         end;
+        size_t                           klen;
+
+        KVSTORE_PROBE3(op__done, sp->op, sp->key, result);
+        if (NULL == kvs->trace)
+                return;
+        end = _kvstore_ticks();
+        if (NULL == (ring = _trace_ring(kvs->trace)))
+                return;
+
+        ev = &ring->ev[ring->head & (kvs->trace->size - 1)];
+        ev->tsc = sp->start;
+        ev->hash = 0;
+        if (NULL != sp->key) {
+                klen = strnlen(sp->key, kvs->max_keylen + 1);
+                ev->hash = _kvstore_hash(kvs, sp->key, klen);
+        }
+        ev->lock_wait = sp->locked - sp->start;
+        ev->work = end - sp->locked;
+        ev->thread = (uint32_t)ring->thread;
+        ev->op = (uint16_t)sp->op;
+        ev->result = (int16_t)result;
+        __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * _kvstore_trace_config turns tracing on with rings of at least the
+ * given number of events per thread, or off with 0. It should be set
+ * before the store is shared between threads.
+ */
+int
+_kvstore_trace_config(kvstore kvs, size_t events)
+{
+        struct _kvstore_trace   *tr;
+        size_t                   size;
+
+        _kvstore_trace_free(kvs);
+        if (0 == events)
+                return 0;
+
+        for (size = 64; size < events; size <<= 1)
+                ;
+        if (NULL == (tr = (struct _kvstore_trace *)calloc(1,
+            sizeof(struct _kvstore_trace))))
+                return -1;
+        if (pthread_key_create(&tr->key, NULL)) {
+                free(tr);
+                return -1;
+        }
+        tr->size = size;
+        tr->hz = _trace_hz();
+        kvs->trace = tr;
+        return 0;
+}
+
+
+void
+_kvstore_trace_free(kvstore kvs)
+{
+        struct _kvstore_trace   *tr = kvs->trace;
+        struct _trace_ring      *ring;
+
+        if (NULL == tr)
+                return;
+        if (kvs == _trace_sig_kvs)
+                _trace_sig_kvs = NULL;
+        kvs->trace = NULL;
+        while (NULL != (ring = tr->rings)) {
+                tr->rings = ring->next;
+                free(ring);
+        }
+        pthread_key_delete(tr->key);
+        free(tr);
+}
+
+
+int
+_trace_write(int fd, const void *buf, size_t len)
+{
+        const char      *p = (const char *)buf;
+        ssize_t          n;
+
+        while (len > 0) {
+                n = write(fd, p, len);
+                if (-1 == n) {
+                        if (EINTR == errno)
+                                continue;
+                        return -1;
+                }
+                p += n;
+                len -= (size_t)n;
+        }
+        return 0;
+}
+
+
+/*
+ * kvstore_trace_dump writes every thread's ring to fd and returns the
+ * number of events written.
+ */
+ssize_t
+kvstore_trace_dump(kvstore kvs, int fd)
+{
+        struct kvstore_trace_header      hdr;
+        struct _kvstore_trace           *tr;
+        struct _trace_ring              *ring;
+        uint64_t                         head, first;
+        size_t                           at;
+        ssize_t                          total = 0;
+
+        if ((NULL == kvs) || (NULL == (tr = kvs->trace)))
+                return -1;
+
+        ring = __atomic_load_n(&tr->rings, __ATOMIC_ACQUIRE);
+        for (; NULL != ring; ring = ring->next) {
+                head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+                first = head > tr->size ? head - tr->size : 0;
+                hdr.magic = KVSTORE_TRACE_MAGIC;
+                hdr.ticks_per_sec = tr->hz;
+                hdr.thread = ring->thread;
+                hdr.events = head - first;
+                if (_trace_write(fd, &hdr, sizeof(hdr)))
+                        return -1;
+
+                at = (size_t)(first & (tr->size - 1));
+                if ((0 != hdr.events) && (at + hdr.events > tr->size)) {
+                        if (_trace_write(fd, &ring->ev[at],
+                            (tr->size - at) * sizeof(ring->ev[0])) ||
+                            _trace_write(fd, &ring->ev[0],
+                            (at + hdr.events - tr->size) *
+                            sizeof(ring->ev[0])))
+                                return -1;
+                } else if (_trace_write(fd, &ring->ev[at],
+                    hdr.events * sizeof(ring->ev[0]))) {
+                        return -1;
+                }
+                total += (ssize_t)hdr.events;
+        }
+        return total;
+}
+
+
+void
+_trace_signal(int signo)
+{
+        int     saved = errno;
+
+        (void)signo;
+        if ((NULL != _trace_sig_kvs) && (-1 != _trace_sig_fd))
+                kvstore_trace_dump(_trace_sig_kvs, _trace_sig_fd);
+        errno = saved;
+}
+
+
+/*
+ * kvstore_trace_signal appends a dump of the store's trace to path each
+ * time the process receives signo. Only one store per process can be
+ * dumped this way; a later call replaces an earlier one.
+ */
+int
+kvstore_trace_signal(kvstore kvs, int signo, const char *path)
+{
+        struct sigaction         sa;
+        int                      fd;
+
+        if ((NULL == kvs) || (NULL == kvs->trace) || (NULL == path))
+                return -1;
+        fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+        if (-1 == fd)
+                return -1;
+
+        memset(&sa, 0x0, sizeof(sa));
+        sa.sa_handler = _trace_signal;
+        sa.sa_flags = SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        if (-1 != _trace_sig_fd)
+                close(_trace_sig_fd);
+        _trace_sig_fd = fd;
+        _trace_sig_kvs = kvs;
+        if (sigaction(signo, &sa, NULL)) {
+                _trace_sig_kvs = NULL;
+                return -1;
+        }
+        return 0;
+}
@@ -0,0 +1,414 @@
+/*
+ * Copyright (c) 2013 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+ * OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ * ---------------------------------------------------------------------
+ */
+
+
+/*
+ * Optimistic transactions. Reads take the lock only long enough to copy
+ * the value out, and writes are buffered in the transaction. Commit
+ * locks the store once, checks that every key read still has the value
+ * it was read with (or is still missing), and applies the writes before
+ * unlocking, so other threads see all of them or none. What the written
+ * keys held is copied out first, so a write that fails undoes the ones
+ * before it rather than leaving half a transaction behind. The work a
+ * transaction does between its reads and its commit runs unlocked. A
+ * value held in chunks is read, and checked, whole.
+ *
+ * Checking values rather than versions means a key that was changed and
+ * then changed back does not count as a conflict, which is still safe:
+ * the transaction's reads are exactly what the store holds when it
+ * commits.
+ */
+
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kv.h"
+#include "kv_int.h"
+
+
+static const int         KVSTORE_TXN_RETRIES = 100;
+
+
+enum {
+        _TXN_NONE,
+        _TXN_SET,
+        _TXN_DEL
+};
+
+struct _txn_key {
+        char            *key;
+        size_t           key_len;
+        uint64_t         hash;
+        int              read;
+        char            *seen;
+        int              op;
+        char            *val;
+        char            *old;
+        size_t           old_len;
+};
+
+struct _kvstore_txn {
+        kvstore          kvs;
+        struct _txn_key *keys;
+        size_t           n;
+        size_t           cap;
+};
+
+
+static struct _txn_key
+                *_txn_key(kvstore_txn, char *);
+static void      _txn_free(kvstore_txn);
+static int       _txn_check(kvstore_txn);
+static int       _txn_save(kvstore_txn);
+static void      _txn_undo(kvstore_txn, size_t);
+
+
+/*
+ * _txn_key finds key among those the transaction has touched, adding it
+ * if it is new. Transactions are expected to be small, so the keys are
+ * searched in order.
+ */
+struct _txn_key *
+_txn_key(kvstore_txn txn, char *key)
+{
+        struct _txn_key *tk;
+        uint64_t         hash;
+        size_t           klen, i, cap;
+
+        if (NULL == key)
+                return NULL;
+        klen = strnlen(key, txn->kvs->max_keylen + 1);
+        if ((0 == klen) || (klen > txn->kvs->max_keylen))
+                return NULL;
+        hash = _kvstore_hash(txn->kvs, key, klen);
+        for (i = 0; i < txn->n; i++) {
+                tk = &txn->keys[i];
+                if ((tk->hash == hash) && (tk->key_len == klen) &&
+                    (0 == memcmp(tk->key, key, klen)))
+                        return tk;
+        }
+
+        if (txn->n == txn->cap) {
+                cap = 0 == txn->cap ? 8 : txn->cap * 2;
+                tk = (struct _txn_key *)realloc(txn->keys,
+                    cap * sizeof(struct _txn_key));
+                if (NULL == tk)
+                        return NULL;
+                txn->keys = tk;
+                txn->cap = cap;
+        }
+        tk = &txn->keys[txn->n];
+        memset(tk, 0x0, sizeof(struct _txn_key));
+        if (NULL == (tk->key = strndup(key, klen)))
+                return NULL;
+        tk->key_len = klen;
+        tk->hash = hash;
+        txn->n++;
+        return tk;
+}
+
+
+void
+_txn_free(kvstore_txn txn)
+{
+        size_t  i;
+
+        for (i = 0; i < txn->n; i++) {
+                free(txn->keys[i].key);
+                free(txn->keys[i].seen);
+                free(txn->keys[i].val);
+                free(txn->keys[i].old);
+        }
+        free(txn->keys);
+        free(txn);
+}
+
+
+kvstore_txn
+kvstore_txn_begin(kvstore kvs)
+{
+        kvstore_txn     txn;
+
+        if (NULL == kvs)
+                return NULL;
+        if (NULL == (txn = (kvstore_txn)malloc(sizeof(struct _kvstore_txn))))
+                return NULL;
+        memset(txn, 0x0, sizeof(struct _kvstore_txn));
+        txn->kvs = kvs;
+        return txn;
+}
+
+
+/*
+ * kvstore_txn_get returns the transaction's own write to key if it has
+ * one, and otherwise the value key had when the transaction first read
+ * it. The pointer belongs to the transaction and is good until the key
+ * is next written in it, or the transaction ends.
+ */
+char *
+kvstore_txn_get(kvstore_txn txn, char *key)
+{
+        struct _txn_key *tk;
+        char            *val;
+        int              failed = 0;
+
+        if ((NULL == txn) || (NULL == (tk = _txn_key(txn, key))))
+                return NULL;
+        if (_TXN_NONE != tk->op)
+                return tk->val;
+        if (tk->read)
+                return tk->seen;
+
+        if (_acquire_kvstore(txn->kvs))
+                return NULL;
+        errno = 0;
+        if (NULL != (val = _kvstore_get(txn->kvs, tk->key, NULL)))
+                failed = NULL == (tk->seen = strdup(val));
+        else
+                tk->seen = _kvstore_chunk_dup(txn->kvs, tk->key);
+        if ((NULL == tk->seen) && (ENOMEM == errno))
+                failed = 1;
+        _unlock_kvstore(txn->kvs);
+        if (failed)
+                return NULL;
+        tk->read = 1;
+        return tk->seen;
+}
+
+
+int
+kvstore_txn_set(kvstore_txn txn, char *key, char *val)
+{
+        struct _txn_key *tk;
+        char            *copy;
+        size_t           vlen;
+
+        if ((NULL == txn) || (NULL == val))
+                return -1;
+        vlen = strnlen(val, txn->kvs->max_vallen + 1);
+        if ((0 == vlen) || (vlen > txn->kvs->max_vallen))
+                return -1;
+        if (NULL == (tk = _txn_key(txn, key)))
+                return -1;
+        if (NULL == (copy = strdup(val)))
+                return -1;
+        free(tk->val);
+        tk->val = copy;
+        tk->op = _TXN_SET;
+        return 0;
+}
+
+
+int
+kvstore_txn_del(kvstore_txn txn, char *key)
+{
+        struct _txn_key *tk;
+
+        if ((NULL == txn) || (NULL == (tk = _txn_key(txn, key))))
+                return -1;
+        free(tk->val);
+        tk->val = NULL;
+        tk->op = _TXN_DEL;
+        return 0;
+}
+
+
+void
+kvstore_txn_abort(kvstore_txn txn)
+{
+        if (NULL != txn)
+                _txn_free(txn);
+}
+
+
+/*
+ * _txn_check makes sure every key the transaction read still holds what
+ * it was read with, failing with EAGAIN if one does not.
+ */
+int
+_txn_check(kvstore_txn txn)
+{
+        struct _txn_key *tk;
+        char            *val, *whole;
+        size_t           i;
+        int              conflict;
+
+        for (i = 0; i < txn->n; i++) {
+                tk = &txn->keys[i];
+                if (!tk->read)
+                        continue;
+                errno = 0;
+                whole = NULL;
+                if (NULL == (val = _kvstore_get(txn->kvs, tk->key, NULL)))
+                        val = whole = _kvstore_chunk_dup(txn->kvs, tk->key);
+                if ((NULL == val) && (ENOMEM == errno))
+                        return -1;
+                conflict = ((NULL == val) != (NULL == tk->seen)) ||
+                    ((NULL != val) && (0 != strcmp(val, tk->seen)));
+                free(whole);
+                if (conflict) {
+                        errno = EAGAIN;
+                        return -1;
+                }
+        }
+        return 0;
+}
+
+
+/*
+ * _txn_save copies out what each key the transaction writes holds now,
+ * so that a commit that fails part way through can put it back. Nothing
+ * has been written yet if this fails.
+ */
+int
+_txn_save(kvstore_txn txn)
+{
+        struct _txn_key *tk;
+        char            *val;
+        size_t           i;
+
+        for (i = 0; i < txn->n; i++) {
+                tk = &txn->keys[i];
+                if (_TXN_NONE == tk->op)
+                        continue;
+                errno = 0;
+                if (NULL != (val = _kvstore_get(txn->kvs, tk->key, NULL)))
+                        tk->old = strdup(val);
+                else
+                        tk->old = _kvstore_chunk_dup(txn->kvs, tk->key);
+                if ((NULL == tk->old) && ((NULL != val) || (ENOMEM == errno)))
+                        return -1;
+                if (NULL != tk->old)
+                        tk->old_len = strlen(tk->old);
+        }
+        return 0;
+}
+
+
+/*
+ * _txn_undo puts back the saved values of the first n keys, last first,
+ * after a write failed. A value that was held in chunks goes back into
+ * chunks.
+ */
+void
+_txn_undo(kvstore_txn txn, size_t n)
+{
+        struct _txn_key *tk;
+        struct iovec     iov;
+        kvstore          kvs = txn->kvs;
+
+        while (n-- > 0) {
+                tk = &txn->keys[n];
+                if ((_TXN_NONE == tk->op) ||
+                    ((_TXN_DEL == tk->op) && (NULL == tk->old)))
+                        continue;
+                if (NULL == tk->old) {
+                        _kvstore_del(kvs, tk->key);
+                } else if (tk->old_len <= kvs->max_vallen) {
+                        _kvstore_set(kvs, tk->key, tk->old);
+                } else {
+                        iov.iov_base = tk->old;
+                        iov.iov_len = tk->old_len;
+                        _kvstore_chunk_set(kvs, tk->key, tk->key_len,
+                            tk->hash, &iov, 1, tk->old_len);
+                }
+        }
+}
+
+
+/*
+ * kvstore_txn_commit applies the transaction if nothing it read has
+ * changed since, and frees it either way. On a conflict it returns -1
+ * with errno set to EAGAIN. If it fails for any reason, the store is
+ * left as it was: a write that fails part way through has the ones
+ * before it undone.
+ */
+int
+kvstore_txn_commit(kvstore_txn txn)
+{
+        kvstore          kvs;
+        struct _txn_key *tk;
+        size_t           i;
+        int              retval = 0, wrote = 0, err;
+
+        if (NULL == txn)
+                return -1;
+        kvs = txn->kvs;
+        if (_acquire_kvstore(kvs)) {
+                _txn_free(txn);
+                return -1;
+        }
+        if (_txn_check(txn) || _txn_save(txn))
+                retval = -1;
+        for (i = 0; (0 == retval) && (i < txn->n); i++) {
+                tk = &txn->keys[i];
+                if (_TXN_SET == tk->op)
+                        retval = _kvstore_set(kvs, tk->key, tk->val);
+                else if ((_TXN_DEL == tk->op) && (NULL != tk->old))
+                        retval = _kvstore_del(kvs, tk->key);
+                wrote |= _TXN_NONE != tk->op;
+                if (0 != retval) {
+                        err = errno;
+                        _txn_undo(txn, i + 1);
+                        errno = err;
+                }
+        }
+        _unlock_kvstore(kvs);
+        if ((0 == retval) && wrote && (NULL != kvs->lsm))
+                _kvstore_lsm_throttle(kvs);
+        _txn_free(txn);
+        return retval;
+}
+
+
+/*
+ * kvstore_txn_run runs fn in a fresh transaction and commits it,
+ * starting over when the commit hits a conflict. fn returns 0 to commit
+ * and anything else to abort, which is passed back. Gives up with EAGAIN
+ * after repeated conflicts.
+ */
+int
+kvstore_txn_run(kvstore kvs, kvstore_txn_cb fn, void *ctx)
+{
+        kvstore_txn     txn;
+        int             try, rc;
+
+        if ((NULL == kvs) || (NULL == fn))
+                return -1;
+        for (try = 0; try < KVSTORE_TXN_RETRIES; try++) {
+                if (NULL == (txn = kvstore_txn_begin(kvs)))
+                        return -1;
+                if (0 != (rc = fn(txn, ctx))) {
+                        kvstore_txn_abort(txn);
+                        return rc;
+                }
+                if (0 == kvstore_txn_commit(txn))
+                        return 0;
+                if (EAGAIN != errno)
+                        return -1;
+                sched_yield();
+        }
+        errno = EAGAIN;
+        return -1;
+}
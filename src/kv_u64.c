@@ -0,0 +1,246 @@
+/*
+ * Copyright (c) 2013 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+ * OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ * ---------------------------------------------------------------------
+ */
+
+
+/*
+ * A separate table for 64-bit integer keys. Slots hold the key inline
+ * next to the value pointer, four to a cache line, and collisions are
+ * resolved by linear probing, so a lookup is usually one multiply-shift
+ * mix and one cache line. Deletion shifts the following entries back
+ * rather than leaving tombstones. The table doubles once it is three
+ * quarters full.
+ *
+ * Integer keys are their own namespace: kvstore_u64_get(kvs, 1) does not
+ * see a key set with kvstore_set(kvs, "1", ...).
+ */
+
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kv.h"
+#include "kv_int.h"
+
+
+static const size_t      KVSTORE_U64_INITIAL = 64;
+
+
+struct _u64_slot {
+        uint64_t         key;
+        char            *val;
+};
+
+struct _kvstore_u64 {
+        struct _u64_slot        *slots;
+        size_t                   mask;
+        size_t                   used;
+};
+
+
+static uint64_t  _u64_mix(uint64_t);
+static int       _u64_grow(struct _kvstore_u64 *);
+static struct _u64_slot
+                *_u64_find(struct _kvstore_u64 *, uint64_t);
+static int       _u64_check(kvstore);
+
+
+/*
+ * The splitmix64 finalizer.
+ */
+uint64_t
+_u64_mix(uint64_t x)
+{
+        x ^= x >> 30;
+        x *= 0xbf58476d1ce4e5b9ULL;
+        x ^= x >> 27;
+        x *= 0x94d049bb133111ebULL;
+        x ^= x >> 31;
+        return x;
+}
+
+
+int
+_u64_grow(struct _kvstore_u64 *t)
+{
+        struct _u64_slot        *old = t->slots, *slots;
+        size_t                   size, i, j, omask = t->mask;
+
+        size = NULL == old ? KVSTORE_U64_INITIAL : (t->mask + 1) * 2;
+        slots = (struct _u64_slot *)calloc(size, sizeof(struct _u64_slot));
+        if (NULL == slots)
+                return -1;
+        t->slots = slots;
+        t->mask = size - 1;
+        for (i = 0; (NULL != old) && (i <= omask); i++) {
+                if (NULL == old[i].val)
+                        continue;
+                j = _u64_mix(old[i].key) & t->mask;
+                while (NULL != slots[j].val)
+                        j = (j + 1) & t->mask;
+                slots[j] = old[i];
+        }
+        free(old);
+        return 0;
+}
+
+
+/*
+ * _u64_find returns the slot holding key, or the empty slot where it
+ * would go.
+ */
+struct _u64_slot *
+_u64_find(struct _kvstore_u64 *t, uint64_t key)
+{
+        struct _u64_slot        *s;
+        size_t                   i;
+
+        i = _u64_mix(key) & t->mask;
+        for (;;) {
+                s = &t->slots[i];
+                if ((NULL == s->val) || (s->key == key))
+                        return s;
+                i = (i + 1) & t->mask;
+        }
+}
+
+
+int
+_u64_check(kvstore kvs)
+{
+        if ((NULL == kvs) || (NULL != kvs->bc) || (NULL != kvs->lsm) ||
+            (NULL != kvs->shm) || (NULL != kvs->frozen))
+                return -1;
+        return _acquire_kvstore(kvs);
+}
+
+
+int
+kvstore_u64_set(kvstore kvs, uint64_t key, char *val)
+{
+        struct _kvstore_u64     *t;
+        struct _u64_slot        *s;
+        size_t                   vlen;
+        char                    *copy;
+
+        if (_u64_check(kvs))
+                return -1;
+        vlen = strnlen(val, kvs->max_vallen + 1);
+        if (((kvs->max_vallen + 1) == vlen) || (0 == vlen))
+                goto set_fail;
+        if (NULL == (t = kvs->u64)) {
+                t = (struct _kvstore_u64 *)calloc(1,
+                    sizeof(struct _kvstore_u64));
+                if ((NULL == t) || _u64_grow(t)) {
+                        free(t);
+                        goto set_fail;
+                }
+                kvs->u64 = t;
+        }
+        if ((((t->used + 1) * 4) > ((t->mask + 1) * 3)) && _u64_grow(t))
+                goto set_fail;
+        if (NULL == (copy = (char *)malloc(vlen + 1)))
+                goto set_fail;
+        memcpy(copy, val, vlen + 1);
+
+        s = _u64_find(t, key);
+        if (NULL == s->val)
+                t->used++;
+        free(s->val);
+        s->key = key;
+        s->val = copy;
+        return _unlock_kvstore(kvs);
+
+set_fail:
+        _unlock_kvstore(kvs);
+        return -1;
+}
+
+
+char *
+kvstore_u64_get(kvstore kvs, uint64_t key)
+{
+        char    *val = NULL;
+
+        if (_u64_check(kvs))
+                return NULL;
+        if (NULL != kvs->u64)
+                val = _u64_find(kvs->u64, key)->val;
+        _unlock_kvstore(kvs);
+        return val;
+}
+
+
+int
+kvstore_u64_del(kvstore kvs, uint64_t key)
+{
+        struct _kvstore_u64     *t;
+        struct _u64_slot        *s;
+        size_t                   i, j, home;
+
+        if (_u64_check(kvs))
+                return -1;
+        t = kvs->u64;
+        if ((NULL == t) || (NULL == (s = _u64_find(t, key))->val)) {
+                _unlock_kvstore(kvs);
+                return -1;
+        }
+        free(s->val);
+        s->val = NULL;
+        t->used--;
+
+        /*
+         * Backward-shift deletion: move up any later entry in the run
+         * whose home slot is at or before the hole.
+         */
+        i = (size_t)(s - t->slots);
+        for (j = (i + 1) & t->mask; NULL != t->slots[j].val;
+            j = (j + 1) & t->mask) {
+                home = _u64_mix(t->slots[j].key) & t->mask;
+                if (((j - home) & t->mask) < ((j - i) & t->mask))
+                        continue;
+                t->slots[i] = t->slots[j];
+                t->slots[j].val = NULL;
+                i = j;
+        }
+        return _unlock_kvstore(kvs);
+}
+
+
+size_t
+_kvstore_u64_len(kvstore kvs)
+{
+        return NULL == kvs->u64 ? 0 : kvs->u64->used;
+}
+
+
+void
+_kvstore_u64_free(kvstore kvs)
+{
+        struct _kvstore_u64     *t = kvs->u64;
+        size_t                   i;
+
+        if (NULL == t)
+                return;
+        for (i = 0; i <= t->mask; i++)
+                free(t->slots[i].val);
+        free(t->slots);
+        free(t);
+        kvs->u64 = NULL;
+}
@@ -0,0 +1,382 @@
+/*
+ * Copyright (c) 2013 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+ * OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ * ---------------------------------------------------------------------
+ */
+
+
+/*
+ * Key watches. Watched keys get an entry in a side table of their own,
+ * with its own lock, holding a version number, a condition variable
+ * for threads blocked in kvstore_watch and any eventfds registered with
+ * kvstore_watch_fd. Writes only look at the table when it has entries,
+ * so a store nobody watches pays for nothing but that check.
+ *
+ * Versions come from one counter per store. An entry nobody is waiting
+ * on is dropped as soon as its key changes; the next watch creates a
+ * new entry with the counter's current value, which is already past
+ * any version handed out for the old one, so the change is still seen.
+ */
+
+
+#include <sys/types.h>
+#include <sys/eventfd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "kv.h"
+#include "kv_int.h"
+
+
+static const size_t      KVSTORE_WATCH_INITIAL = 64;
+
+
+struct _watch_entry {
+        char                    *key;
+        size_t                   key_len;
+        uint64_t                 hash;
+        uint64_t                 version;
+        size_t                   waiters;
+        pthread_cond_t           cond;
+        int                     *fds;
+        size_t                   nfds;
+        struct _watch_entry     *next;
+};
+
+struct _kvstore_watch {
+        pthread_mutex_t          lock;
+        struct _watch_entry    **buckets;
+        size_t                   size;
+        size_t                   n;
+        uint64_t                 seq;
+};
+
+
+static struct _kvstore_watch
+                *_watch_table(kvstore);
+static struct _watch_entry
+               **_watch_find(struct _kvstore_watch *, char *, size_t,
+                    uint64_t);
+static struct _watch_entry
+                *_watch_get(kvstore, struct _kvstore_watch *, char *);
+static void      _watch_drop(struct _kvstore_watch *,
+                    struct _watch_entry **);
+
+
+/*
+ * _watch_table returns the store's watch table, creating it on first
+ * use. The pointer is only ever set with the store locked.
+ */
+struct _kvstore_watch *
+_watch_table(kvstore kvs)
+{
+        struct _kvstore_watch   *w;
+
+        if (_acquire_kvstore(kvs))
+                return NULL;
+        if (NULL != (w = kvs->watch))
+                goto table_done;
+        if (NULL == (w = (struct _kvstore_watch *)calloc(1,
+            sizeof(struct _kvstore_watch))))
+                goto table_done;
+        w->buckets = (struct _watch_entry **)calloc(KVSTORE_WATCH_INITIAL,
+            sizeof(struct _watch_entry *));
+        if (NULL == w->buckets) {
+                free(w);
+                w = NULL;
+                goto table_done;
+        }
+        w->size = KVSTORE_WATCH_INITIAL;
+        w->seq = 1;
+        pthread_mutex_init(&w->lock, NULL);
+        kvs->watch = w;
+
+table_done:
+        _unlock_kvstore(kvs);
+        return w;
+}
+
+
+struct _watch_entry **
+_watch_find(struct _kvstore_watch *w, char *key, size_t klen, uint64_t hash)
+{
+        struct _watch_entry     **ep;
+
+        ep = &w->buckets[hash & (w->size - 1)];
+        for (; NULL != *ep; ep = &(*ep)->next) {
+                if (((*ep)->hash == hash) && ((*ep)->key_len == klen) &&
+                    (0 == memcmp((*ep)->key, key, klen)))
+                        return ep;
+        }
+        return NULL;
+}
+
+
+/*
+ * _watch_get finds or adds the entry for key, with the table locked.
+ */
+struct _watch_entry *
+_watch_get(kvstore kvs, struct _kvstore_watch *w, char *key)
+{
+        struct _watch_entry     **ep, *e, **buckets, *next;
+        pthread_condattr_t        attr;
+        uint64_t                  hash;
+        size_t                    klen, i;
+
+        klen = strlen(key);
+        hash = _kvstore_hash(kvs, key, klen);
+        if (NULL != (ep = _watch_find(w, key, klen, hash)))
+                return *ep;
+
+        if (w->n >= w->size) {
+                buckets = (struct _watch_entry **)calloc(w->size * 2,
+                    sizeof(struct _watch_entry *));
+                if (NULL == buckets)
+                        return NULL;
+                for (i = 0; i < w->size; i++) {
+                        for (e = w->buckets[i]; NULL != e; e = next) {
+                                next = e->next;
+                                e->next = buckets[e->hash &
+                                    (w->size * 2 - 1)];
+                                buckets[e->hash & (w->size * 2 - 1)] = e;
+                        }
+                }
+                free(w->buckets);
+                w->buckets = buckets;
+                w->size *= 2;
+        }
+
+        if (NULL == (e = (struct _watch_entry *)calloc(1,
+            sizeof(struct _watch_entry))))
+                return NULL;
+        if (NULL == (e->key = strndup(key, klen))) {
+                free(e);
+                return NULL;
+        }
+        e->key_len = klen;
+        e->hash = hash;
+        e->version = w->seq;
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&e->cond, &attr);
+        pthread_condattr_destroy(&attr);
+        e->next = w->buckets[hash & (w->size - 1)];
+        w->buckets[hash & (w->size - 1)] = e;
+        __atomic_store_n(&w->n, w->n + 1, __ATOMIC_RELAXED);
+        return e;
+}
+
+
+void
+_watch_drop(struct _kvstore_watch *w, struct _watch_entry **ep)
+{
+        struct _watch_entry     *e = *ep;
+
+        *ep = e->next;
+        __atomic_store_n(&w->n, w->n - 1, __ATOMIC_RELAXED);
+        pthread_cond_destroy(&e->cond);
+        free(e->fds);
+        free(e->key);
+        free(e);
+}
+
+
+/*
+ * kvstore_watch returns the version of key once it differs from last,
+ * waiting up to timeout milliseconds for a set or delete of the key if
+ * it does not already (a negative timeout waits for as long as it
+ * takes). It returns last if the time ran out and 0 on error. Passing 0
+ * for last returns the current version straight away. Only writes made
+ * through this process's handle on the store are seen.
+ */
+uint64_t
+kvstore_watch(kvstore kvs, char *key, uint64_t last, int timeout)
+{
+        struct _kvstore_watch   *w;
+        struct _watch_entry     *e;
+        struct timespec          ts;
+        uint64_t                 version = 0;
+        size_t                   klen;
+        int                      rc = 0;
+
+        if ((NULL == kvs) || (NULL == key))
+                return 0;
+        klen = strnlen(key, kvs->max_keylen + 1);
+        if ((0 == klen) || (klen > kvs->max_keylen))
+                return 0;
+        if (NULL == (w = _watch_table(kvs)))
+                return 0;
+
+        if (timeout > 0) {
+                clock_gettime(CLOCK_MONOTONIC, &ts);
+                ts.tv_sec += timeout / 1000;
+                ts.tv_nsec += (long)(timeout % 1000) * 1000000;
+                if (ts.tv_nsec >= 1000000000) {
+                        ts.tv_sec++;
+                        ts.tv_nsec -= 1000000000;
+                }
+        }
+
+        pthread_mutex_lock(&w->lock);
+        if (NULL == (e = _watch_get(kvs, w, key)))
+                goto watch_done;
+        while ((e->version == last) && (0 != timeout) && (0 == rc)) {
+                e->waiters++;
+                if (timeout < 0)
+                        rc = pthread_cond_wait(&e->cond, &w->lock);
+                else
+                        rc = pthread_cond_timedwait(&e->cond, &w->lock,
+                            &ts);
+                e->waiters--;
+        }
+        version = e->version;
+
+watch_done:
+        pthread_mutex_unlock(&w->lock);
+        return version;
+}
+
+
+/*
+ * kvstore_watch_fd returns an eventfd that is signalled every time key
+ * is set or deleted, for event loops. Reading it resets the count of
+ * changes; kvstore_unwatch_fd stops the signals and closes it.
+ */
+int
+kvstore_watch_fd(kvstore kvs, char *key)
+{
+        struct _kvstore_watch   *w;
+        struct _watch_entry     *e;
+        int                     *fds, fd = -1;
+        size_t                   klen;
+
+        if ((NULL == kvs) || (NULL == key))
+                return -1;
+        klen = strnlen(key, kvs->max_keylen + 1);
+        if ((0 == klen) || (klen > kvs->max_keylen))
+                return -1;
+        if (NULL == (w = _watch_table(kvs)))
+                return -1;
+
+        pthread_mutex_lock(&w->lock);
+        if (NULL == (e = _watch_get(kvs, w, key)))
+                goto fd_done;
+        fds = (int *)realloc(e->fds, (e->nfds + 1) * sizeof(int));
+        if (NULL == fds)
+                goto fd_done;
+        e->fds = fds;
+        if (-1 == (fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)))
+                goto fd_done;
+        e->fds[e->nfds++] = fd;
+
+fd_done:
+        pthread_mutex_unlock(&w->lock);
+        return fd;
+}
+
+
+int
+kvstore_unwatch_fd(kvstore kvs, char *key, int fd)
+{
+        struct _kvstore_watch   *w;
+        struct _watch_entry     **ep, *e;
+        size_t                   klen, i;
+        int                      retval = -1;
+
+        if ((NULL == kvs) || (NULL == key) || (NULL == (w = kvs->watch)))
+                return -1;
+        klen = strnlen(key, kvs->max_keylen + 1);
+
+        pthread_mutex_lock(&w->lock);
+        ep = _watch_find(w, key, klen, _kvstore_hash(kvs, key, klen));
+        if (NULL == ep)
+                goto unwatch_done;
+        e = *ep;
+        for (i = 0; i < e->nfds; i++) {
+                if (e->fds[i] != fd)
+                        continue;
+                e->fds[i] = e->fds[--e->nfds];
+                close(fd);
+                retval = 0;
+                break;
+        }
+
+unwatch_done:
+        pthread_mutex_unlock(&w->lock);
+        return retval;
+}
+
+
+/*
+ * _kvstore_watch_notify is called with the store locked after key has
+ * been set or deleted.
+ */
+void
+_kvstore_watch_notify(kvstore kvs, char *key, size_t klen)
+{
+        struct _kvstore_watch   *w = kvs->watch;
+        struct _watch_entry     **ep, *e;
+        uint64_t                  one = 1;
+        size_t                    i;
+
+        if ((NULL == w) || (0 == __atomic_load_n(&w->n, __ATOMIC_RELAXED)))
+                return;
+
+        pthread_mutex_lock(&w->lock);
+        ep = _watch_find(w, key, klen, _kvstore_hash(kvs, key, klen));
+        if (NULL != ep) {
+                e = *ep;
+                w->seq++;
+                if ((0 == e->waiters) && (0 == e->nfds)) {
+                        _watch_drop(w, ep);
+                } else {
+                        e->version = w->seq;
+                        pthread_cond_broadcast(&e->cond);
+                        for (i = 0; i < e->nfds; i++) {
+                                while ((-1 == write(e->fds[i], &one,
+                                    sizeof(one))) && (EINTR == errno))
+                                        ;
+                        }
+                }
+        }
+        pthread_mutex_unlock(&w->lock);
+}
+
+
+void
+_kvstore_watch_free(kvstore kvs)
+{
+        struct _kvstore_watch   *w = kvs->watch;
+        size_t                   i, j;
+
+        if (NULL == w)
+                return;
+        for (i = 0; i < w->size; i++) {
+                while (NULL != w->buckets[i]) {
+                        for (j = 0; j < w->buckets[i]->nfds; j++)
+                                close(w->buckets[i]->fds[j]);
+                        _watch_drop(w, &w->buckets[i]);
+                }
+        }
+        pthread_mutex_destroy(&w->lock);
+        free(w->buckets);
+        free(w);
+        kvs->watch = NULL;
+}
@@ -0,0 +1,400 @@
+/*
+ * Copyright (c) 2013 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+ * OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ * ---------------------------------------------------------------------
+ */
+
+
+#include <sys/types.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kv.h"
+#include "kv_int.h"
+
+
+static const size_t      KVSTORE_WC_BATCH = 1024;
+
+
+/*
+ * A queued mutation. The key and value are copied into the same
+ * allocation, right after the header. A KVSTORE_WC_SYNC entry carries
+ * no key; the applier posts its semaphore once everything queued ahead
+ * of it has been applied.
+ */
+#define KVSTORE_WC_SYNC ((KVSTORE_OP)-1)
+
+struct _kvstore_wc_op {
+        struct _kvstore_wc_op   *next;
+        KVSTORE_OP               op;
+        uint64_t                 hash;
+        size_t                   key_len;
+        char                    *key;
+        char                    *val;
+        sem_t                   *done;
+};
+
+/*
+ * Vyukov's intrusive MPSC queue: producers swing head with one atomic
+ * exchange and then link the previous node to theirs; the single
+ * consumer walks from tail. stub keeps the queue from ever being empty.
+ */
+struct _kvstore_wc {
+        struct _kvstore_wc_op   *head;
+        char                     pad0[64 - sizeof(void *)];
+        struct _kvstore_wc_op   *tail;
+        char                     pad1[64 - sizeof(void *)];
+        int                      sleeping;
+        int                      stop;
+        struct _kvstore_wc_op    stub;
+        struct _kvstore_wc_op  **batch;
+        struct _kvstore_wc_op  **seen;
+        sem_t                    wake;
+        pthread_t                applier;
+};
+
+
+static void      _wc_push(struct _kvstore_wc *, struct _kvstore_wc_op *);
+static struct _kvstore_wc_op
+                *_wc_pop(struct _kvstore_wc *);
+static void      _wc_kick(struct _kvstore_wc *);
+static size_t    _wc_coalesce(struct _kvstore_wc_op **, size_t,
+                    struct _kvstore_wc_op **, size_t);
+static void     *_kvstore_wc_applier(void *);
+static int       _kvstore_wc_start(kvstore);
+static void      _kvstore_wc_free(struct _kvstore_wc *);
+
+
+void
+_wc_push(struct _kvstore_wc *wc, struct _kvstore_wc_op *op)
+{
+        struct _kvstore_wc_op   *prev;
+
+        __atomic_store_n(&op->next, NULL, __ATOMIC_RELAXED);
+        prev = __atomic_exchange_n(&wc->head, op, __ATOMIC_ACQ_REL);
+        __atomic_store_n(&prev->next, op, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * _wc_pop returns NULL both when the queue is empty and when a producer
+ * is half-way through a push; in the latter case the producer is about
+ * to kick the applier anyway.
+ */
+struct _kvstore_wc_op *
+_wc_pop(struct _kvstore_wc *wc)
+{
+        struct _kvstore_wc_op   *tail = wc->tail;
+        struct _kvstore_wc_op   *next;
+
+        next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+        if (tail == &wc->stub) {
+                if (NULL == next)
+                        return NULL;
+                wc->tail = next;
+                tail = next;
+                next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+        }
+        if (NULL != next) {
+                wc->tail = next;
+                return tail;
+        }
+        if (tail != __atomic_load_n(&wc->head, __ATOMIC_ACQUIRE))
+                return NULL;
+        _wc_push(wc, &wc->stub);
+        next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+        if (NULL != next) {
+                wc->tail = next;
+                return tail;
+        }
+        return NULL;
+}
+
+
+void
+_wc_kick(struct _kvstore_wc *wc)
+{
+        if (__atomic_exchange_n(&wc->sleeping, 0, __ATOMIC_SEQ_CST))
+                sem_post(&wc->wake);
+}
+
+
+/*
+ * _wc_coalesce keeps only the last write to each key in a batch, walking
+ * it newest first with a small open-addressed set of the keys already
+ * seen. Superseded writes are freed and their slots cleared; sync
+ * markers are always kept. Returns the number of writes dropped.
+ */
+size_t
+_wc_coalesce(struct _kvstore_wc_op **batch, size_t n,
+    struct _kvstore_wc_op **seen, size_t nseen)
+{
+        struct _kvstore_wc_op   *op, *other;
+        size_t                   dropped = 0;
+        size_t                   i, j;
+
+        memset(seen, 0x0, nseen * sizeof(struct _kvstore_wc_op *));
+        for (i = n; i-- > 0; ) {
+                op = batch[i];
+                if (KVSTORE_WC_SYNC == op->op)
+                        continue;
+                j = op->hash & (nseen - 1);
+                while (NULL != (other = seen[j])) {
+                        if ((other->hash == op->hash) &&
+                            (other->key_len == op->key_len) &&
+                            (0 == memcmp(other->key, op->key, op->key_len)))
+                                break;
+                        j = (j + 1) & (nseen - 1);
+                }
+                if (NULL == other) {
+                        seen[j] = op;
+                        continue;
+                }
+                free(op);
+                batch[i] = NULL;
+                dropped++;
+        }
+        return dropped;
+}
+
+
+void *
+_kvstore_wc_applier(void *arg)
+{
+        kvstore                  kvs = (kvstore)arg;
+        struct _kvstore_wc      *wc = kvs->wc;
+        struct _kvstore_wc_op  **batch = wc->batch, **seen = wc->seen, *op;
+        size_t                   i, n;
+        int                      stop;
+
+        for (;;) {
+                stop = __atomic_load_n(&wc->stop, __ATOMIC_ACQUIRE);
+                for (n = 0; n < KVSTORE_WC_BATCH; n++) {
+                        if (NULL == (batch[n] = _wc_pop(wc)))
+                                break;
+                }
+
+                if (0 == n) {
+                        if (stop)
+                                break;
+                        __atomic_store_n(&wc->sleeping, 1, __ATOMIC_SEQ_CST);
+                        if (__atomic_load_n(&wc->head, __ATOMIC_SEQ_CST) !=
+                            wc->tail || wc->tail != &wc->stub ||
+                            __atomic_load_n(&wc->stop, __ATOMIC_SEQ_CST)) {
+                                _wc_kick(wc);
+                        }
+                        while ((-1 == sem_wait(&wc->wake)) &&
+                            (EINTR == errno))
+                                ;
+                        continue;
+                }
+
+                /*
+                 * The writers were already told their writes succeeded,
+                 * so the batch is never dropped for want of the lock.
+                 */
+                _wc_coalesce(batch, n, seen, KVSTORE_WC_BATCH * 2);
+                while (_acquire_kvstore(kvs))
+                        sched_yield();
+                for (i = 0; i < n; i++) {
+                        if (NULL == (op = batch[i]))
+                                continue;
+                        if (KVSTORE_OP_SET == op->op)
+                                _kvstore_set(kvs, op->key, op->val);
+                        else if (KVSTORE_OP_DEL == op->op)
+                                _kvstore_del(kvs, op->key);
+                }
+                _unlock_kvstore(kvs);
+
+                for (i = 0; i < n; i++) {
+                        if (NULL == (op = batch[i]))
+                                continue;
+                        if (KVSTORE_WC_SYNC == op->op)
+                                sem_post(op->done);
+                        else
+                                free(op);
+                }
+        }
+        return NULL;
+}
+
+
+/*
+ * _kvstore_wc_start sets up the queue and the applier's buffers before
+ * starting it, so that once write combining is on the applier cannot
+ * fail for lack of memory.
+ */
+int
+_kvstore_wc_start(kvstore kvs)
+{
+        struct _kvstore_wc      *wc;
+
+        if (posix_memalign((void **)&wc, 64, sizeof(struct _kvstore_wc)))
+                return -1;
+        memset(wc, 0x0, sizeof(struct _kvstore_wc));
+        wc->head = &wc->stub;
+        wc->tail = &wc->stub;
+        wc->batch = (struct _kvstore_wc_op **)calloc(KVSTORE_WC_BATCH,
+            sizeof(struct _kvstore_wc_op *));
+        wc->seen = (struct _kvstore_wc_op **)calloc(KVSTORE_WC_BATCH * 2,
+            sizeof(struct _kvstore_wc_op *));
+        if ((NULL == wc->batch) || (NULL == wc->seen) ||
+            sem_init(&wc->wake, 0, 0)) {
+                free(wc->batch);
+                free(wc->seen);
+                free(wc);
+                return -1;
+        }
+
+        kvs->wc = wc;
+        if (pthread_create(&wc->applier, NULL, _kvstore_wc_applier, kvs)) {
+                kvs->wc = NULL;
+                _kvstore_wc_free(wc);
+                return -1;
+        }
+        return 0;
+}
+
+
+void
+_kvstore_wc_free(struct _kvstore_wc *wc)
+{
+        sem_destroy(&wc->wake);
+        free(wc->batch);
+        free(wc->seen);
+        free(wc);
+}
+
+
+/*
+ * _kvstore_wc_config turns write combining on or off. Turning it off
+ * applies everything still queued before returning. It should be set
+ * before the store is shared between threads. A frozen store takes no
+ * writes, so there is nothing to combine.
+ */
+int
+_kvstore_wc_config(kvstore kvs, int enable)
+{
+        if (enable && (NULL != kvs->frozen))
+                return -1;
+        if (enable && (NULL == kvs->wc))
+                return _kvstore_wc_start(kvs);
+        if (!enable)
+                _kvstore_wc_shutdown(kvs);
+        return 0;
+}
+
+
+/*
+ * _kvstore_wc_enqueue validates and copies a set or del so that errors
+ * are still reported to the caller, then hands it to the applier.
+ */
+int
+_kvstore_wc_enqueue(kvstore kvs, KVSTORE_OP opc, char *key, char *val)
+{
+        struct _kvstore_wc_op   *op;
+        size_t                   klen, vlen = 0;
+        size_t                   limit;
+
+        if (NULL != kvs->frozen) {
+                errno = EROFS;
+                return -1;
+        }
+        klen = strnlen(key, kvs->max_keylen + 1);
+        if (((kvs->max_keylen + 1) == klen) || (0 == klen))
+                return -1;
+        if (KVSTORE_OP_SET == opc) {
+                limit = kvs->max_vallen;
+                if (0 != kvs->chunk_size)
+                        limit = kvs->max_chunked;
+                vlen = strnlen(val, limit + 1);
+                if (((limit + 1) == vlen) || (0 == vlen))
+                        return -1;
+        }
+
+        op = (struct _kvstore_wc_op *)malloc(sizeof(struct _kvstore_wc_op) +
+            klen + vlen + 2);
+        if (NULL == op)
+                return -1;
+        op->op = opc;
+        op->hash = _kvstore_hash(kvs, key, klen);
+        op->key_len = klen;
+        op->key = (char *)(op + 1);
+        memcpy(op->key, key, klen);
+        op->key[klen] = 0;
+        op->val = NULL;
+        if (KVSTORE_OP_SET == opc) {
+                op->val = op->key + klen + 1;
+                memcpy(op->val, val, vlen);
+                op->val[vlen] = 0;
+        }
+        op->done = NULL;
+
+        _wc_push(kvs->wc, op);
+        _wc_kick(kvs->wc);
+        return 0;
+}
+
+
+/*
+ * kvstore_wc_sync blocks until every write the calling thread queued
+ * before the call has been applied. It returns immediately if write
+ * combining is off.
+ */
+int
+kvstore_wc_sync(kvstore kvs)
+{
+        struct _kvstore_wc_op    op;
+        sem_t                    done;
+
+        if (NULL == kvs)
+                return -1;
+        if (NULL == kvs->wc)
+                return 0;
+        if (sem_init(&done, 0, 0))
+                return -1;
+
+        memset(&op, 0x0, sizeof(op));
+        op.op = KVSTORE_WC_SYNC;
+        op.done = &done;
+        _wc_push(kvs->wc, &op);
+        _wc_kick(kvs->wc);
+        while ((-1 == sem_wait(&done)) && (EINTR == errno))
+                ;
+        sem_destroy(&done);
+        return 0;
+}
+
+
+void
+_kvstore_wc_shutdown(kvstore kvs)
+{
+        struct _kvstore_wc      *wc = kvs->wc;
+
+        if (NULL == wc)
+                return;
+        __atomic_store_n(&wc->stop, 1, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&wc->sleeping, 1, __ATOMIC_SEQ_CST);
+        _wc_kick(wc);
+        pthread_join(wc->applier, NULL);
+
+        _kvstore_wc_free(wc);
+        kvs->wc = NULL;
+}
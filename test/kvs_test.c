@@ -17,11 +17,20 @@
  */
 
 
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <assert.h>
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -31,6 +40,7 @@
 #include <CUnit/Basic.h>
 
 #include "kv.h"
+#include "kv_int.h"
 
 
 static const size_t      MAX_WORD_LEN = 32;
@@ -174,6 +184,2371 @@ test_kvstore_multikey(void)
 }
 
 
+static void
+scan_mark(char *key, char *val, void *arg)
+{
+        unsigned char   *seen = (unsigned char *)arg;
+        unsigned long    i;
+
+        i = strtoul(key + 3, NULL, 10);
+        if (seen[i] < 255)
+                seen[i]++;
+}
+
+
+static void
+test_kvstore_scan(void)
+{
+        kvstore          kvs;
+        unsigned char    seen[1000];
+        char             key[MAX_WORD_LEN];
+        size_t           cursor = 0;
+        size_t           calls = 0;
+        size_t           i;
+
+        CU_ASSERT_FATAL(NULL != (kvs = kvstore_new()));
+        for (i = 0; i < 1000; i++) {
+                snprintf(key, MAX_WORD_LEN, "key%lu", (unsigned long)i);
+                CU_ASSERT_FATAL(0 == kvstore_set(kvs, key, key));
+        }
+
+        memset(seen, 0x0, sizeof(seen));
+        do {
+                CU_ASSERT_FATAL(0 == kvstore_scan(kvs, &cursor, 10,
+                    scan_mark, seen));
+                calls++;
+        } while (0 != cursor);
+
+        CU_ASSERT(calls > 1);
+        for (i = 0; i < 1000; i++)
+                CU_ASSERT(1 == seen[i]);
+        CU_ASSERT(0 == kvstore_discard(kvs));
+}
+
+
+/*
+ * Keys 0-499 are present for the whole scan; in between batches the
+ * table is grown by inserting keys 1000-9999 and then shrunk again by
+ * deleting them, so the scan runs across both directions of resize.
+ */
+static void
+test_kvstore_scan_resize(void)
+{
+        kvstore          kvs;
+        unsigned char   *seen;
+        char             key[MAX_WORD_LEN];
+        size_t           cursor = 0;
+        size_t           next = 1000;
+        size_t           gone = 1000;
+        size_t           i;
+
+        CU_ASSERT_FATAL(NULL != (seen = calloc(10000, 1)));
+        CU_ASSERT_FATAL(NULL != (kvs = kvstore_new()));
+        for (i = 0; i < 500; i++) {
+                snprintf(key, MAX_WORD_LEN, "key%lu", (unsigned long)i);
+                CU_ASSERT_FATAL(0 == kvstore_set(kvs, key, key));
+        }
+
+        do {
+                CU_ASSERT_FATAL(0 == kvstore_scan(kvs, &cursor, 4,
+                    scan_mark, seen));
+                for (i = 0; (i < 500) && (next < 10000); i++, next++) {
+                        snprintf(key, MAX_WORD_LEN, "key%lu",
+                            (unsigned long)next);
+                        CU_ASSERT(0 == kvstore_set(kvs, key, key));
+                }
+                if (10000 == next) {
+                        for (i = 0; (i < 500) && (gone < 10000); i++) {
+                                snprintf(key, MAX_WORD_LEN, "key%lu",
+                                    (unsigned long)gone++);
+                                CU_ASSERT(0 == kvstore_del(kvs, key));
+                        }
+                }
+        } while (0 != cursor);
+
+        for (i = 0; i < 500; i++)
+                CU_ASSERT(0 != seen[i]);
+        CU_ASSERT(0 == kvstore_discard(kvs));
+        free(seen);
+}
+
+
+static size_t
+aio_wait(kvstore kvs, struct kvstore_cqe *cqes, size_t want)
+{
+        struct pollfd    pfd;
+        uint64_t         count;
+        ssize_t          n;
+        size_t           got = 0;
+
+        pfd.fd = kvstore_aio_fd(kvs);
+        pfd.events = POLLIN;
+        while (got < want) {
+                if (1 != poll(&pfd, 1, 5000))
+                        break;
+                if (-1 == read(pfd.fd, &count, sizeof(count)))
+                        continue;
+                n = kvstore_aio_reap(kvs, cqes + got, want - got);
+                if (n > 0)
+                        got += (size_t)n;
+        }
+        return got;
+}
+
+
+static void
+test_kvstore_aio(void)
+{
+        kvstore                  kvs;
+        struct kvstore_sqe       sqes[100];
+        struct kvstore_cqe       cqes[100];
+        char                     keys[100][MAX_WORD_LEN];
+        char                     bufs[100][MAX_WORD_LEN];
+        size_t                   i;
+
+        CU_ASSERT_FATAL(NULL != (kvs = kvstore_new()));
+        CU_ASSERT(-1 == kvstore_aio_fd(kvs));
+        CU_ASSERT_FATAL(0 == kvstore_aio_init(kvs, 128));
+        CU_ASSERT(-1 != kvstore_aio_fd(kvs));
+
+        for (i = 0; i < 100; i++) {
+                snprintf(keys[i], MAX_WORD_LEN, "key%lu", (unsigned long)i);
+                sqes[i].op = KVSTORE_OP_SET;
+                sqes[i].key = keys[i];
+                sqes[i].val = keys[i];
+                sqes[i].len = 0;
+                sqes[i].data = i;
+        }
+        CU_ASSERT_FATAL(100 == kvstore_aio_submit(kvs, sqes, 100));
+        CU_ASSERT_FATAL(100 == aio_wait(kvs, cqes, 100));
+        for (i = 0; i < 100; i++)
+                CU_ASSERT(0 == cqes[i].res);
+        CU_ASSERT(100 == kvstore_len(kvs));
+
+        for (i = 0; i < 100; i++) {
+                sqes[i].op = (i % 2) ? KVSTORE_OP_DEL : KVSTORE_OP_GET;
+                sqes[i].val = bufs[i];
+                sqes[i].len = MAX_WORD_LEN;
+        }
+        CU_ASSERT_FATAL(100 == kvstore_aio_submit(kvs, sqes, 100));
+        CU_ASSERT_FATAL(100 == aio_wait(kvs, cqes, 100));
+        for (i = 0; i < 100; i++) {
+                if (cqes[i].data % 2) {
+                        CU_ASSERT(0 == cqes[i].res);
+                } else {
+                        CU_ASSERT((ssize_t)strlen(keys[cqes[i].data]) ==
+                            cqes[i].res);
+                        CU_ASSERT(0 == strcmp(bufs[cqes[i].data],
+                            keys[cqes[i].data]));
+                }
+        }
+        CU_ASSERT(50 == kvstore_len(kvs));
+
+        /*
+         * A short buffer gets a truncated value and the full length.
+         */
+        sqes[0].op = KVSTORE_OP_GET;
+        sqes[0].len = 3;
+        CU_ASSERT_FATAL(1 == kvstore_aio_submit(kvs, sqes, 1));
+        CU_ASSERT_FATAL(1 == aio_wait(kvs, cqes, 1));
+        CU_ASSERT(4 == cqes[0].res);
+        CU_ASSERT(0 == strcmp(bufs[0], "ke"));
+
+        CU_ASSERT(0 == kvstore_discard(kvs));
+}
+
+
+struct wc_writer_arg {
+        kvstore          kvs;
+        int              id;
+};
+
+
+static void *
+wc_writer(void *arg)
+{
+        struct wc_writer_arg    *wa = (struct wc_writer_arg *)arg;
+        char                     key[MAX_WORD_LEN];
+        char                     val[MAX_WORD_LEN];
+        int                      i;
+
+        snprintf(key, MAX_WORD_LEN, "thread%d", wa->id);
+        for (i = 0; i < 1000; i++) {
+                snprintf(val, MAX_WORD_LEN, "%d", i);
+                CU_ASSERT(0 == kvstore_set(wa->kvs, key, val));
+                CU_ASSERT(0 == kvstore_set(wa->kvs, "shared", val));
+        }
+        CU_ASSERT(0 == kvstore_wc_sync(wa->kvs));
+        return NULL;
+}
+
+
+static void
+test_kvstore_write_combine(void)
+{
+        kvstore                  kvs;
+        struct wc_writer_arg     args[8];
+        pthread_t                threads[8];
+        char                     key[MAX_WORD_LEN];
+        char                    *val;
+        int                      enable = 1;
+        int                      i;
+
+        CU_ASSERT_FATAL(NULL != (kvs = kvstore_new()));
+        CU_ASSERT_FATAL(0 == kvstore_config(kvs, KVSTORE_WRITE_COMBINE,
+            &enable));
+
+        for (i = 0; i < 8; i++) {
+                args[i].kvs = kvs;
+                args[i].id = i;
+                CU_ASSERT_FATAL(0 == pthread_create(&threads[i], NULL,
+                    wc_writer, &args[i]));
+        }
+        for (i = 0; i < 8; i++)
+                pthread_join(threads[i], NULL);
+
+        for (i = 0; i < 8; i++) {
+                snprintf(key, MAX_WORD_LEN, "thread%d", i);
+                val = kvstore_get(kvs, key);
+                CU_ASSERT(NULL != val && 0 == strcmp(val, "999"));
+        }
+        CU_ASSERT(NULL != (val = kvstore_get(kvs, "shared")) &&
+            0 == strcmp(val, "999"));
+        CU_ASSERT(9 == kvstore_len(kvs));
+
+        CU_ASSERT(0 == kvstore_del(kvs, "shared"));
+        CU_ASSERT(-1 == kvstore_set(kvs, "shared", ""));
+        CU_ASSERT(0 == kvstore_wc_sync(kvs));
+        CU_ASSERT(NULL == kvstore_get(kvs, "shared"));
+
+        CU_ASSERT(0 == kvstore_set(kvs, "queued", "value"));
+        enable = 0;
+        CU_ASSERT(0 == kvstore_config(kvs, KVSTORE_WRITE_COMBINE, &enable));
+        CU_ASSERT(NULL != kvstore_get(kvs, "queued"));
+        CU_ASSERT(-1 == kvstore_del(kvs, "missing"));
+        CU_ASSERT(0 == kvstore_discard(kvs));
+}
+
+
+static size_t
+count_files(const char *path, const char *suffix)
+{
+        struct dirent   *de;
+        DIR             *dir;
+        size_t           n = 0;
+
+        if (NULL == (dir = opendir(path)))
+                return 0;
+        while (NULL != (de = readdir(dir))) {
+                if (NULL != strstr(de->d_name, suffix))
+                        n++;
+        }
+        closedir(dir);
+        return n;
+}
+
+
+static void
+remove_dir(const char *path)
+{
+        struct dirent   *de;
+        DIR             *dir;
+        char             file[512];
+
+        if (NULL == (dir = opendir(path)))
+                return;
+        while (NULL != (de = readdir(dir))) {
+                if ('.' == de->d_name[0])
+                        continue;
+                snprintf(file, sizeof(file), "%s/%s", path, de->d_name);
+                unlink(file);
+        }
+        closedir(dir);
+        rmdir(path);
+}
+
+
+static void
+test_kvstore_persistent(void)
+{
+        kvstore          kvs;
+        char             path[] = "/tmp/kvs_test.XXXXXX";
+        char             file[256];
+        char            *val;
+        int              fd;
+
+        CU_ASSERT_FATAL(NULL != mkdtemp(path));
+        CU_ASSERT_FATAL(NULL != (kvs = kvstore_open(path)));
+        CU_ASSERT(NULL == kvstore_open(path));
+        CU_ASSERT(0 == kvstore_set(kvs, "hello", "world"));
+        CU_ASSERT(0 == kvstore_set(kvs, "key1", "value1"));
+        CU_ASSERT(0 == kvstore_set(kvs, "key2", "value2"));
+        CU_ASSERT(0 == kvstore_set(kvs, "key1", "ohgodwhatsthis"));
+        CU_ASSERT(0 == kvstore_del(kvs, "key2"));
+        CU_ASSERT(-1 == kvstore_del(kvs, "key2"));
+        CU_ASSERT(NULL != (val = kvstore_get(kvs, "key1")) &&
+            0 == strcmp(val, "ohgodwhatsthis"));
+        CU_ASSERT(2 == kvstore_len(kvs));
+        CU_ASSERT(0 == kvstore_discard(kvs));
+
+        /*
+         * The first open's segment was finished with a hint file.
+         */
+        CU_ASSERT(1 == count_files(path, ".hint"));
+        CU_ASSERT_FATAL(NULL != (kvs = kvstore_open(path)));
+        CU_ASSERT(2 == kvstore_len(kvs));
+        CU_ASSERT(NULL != (val = kvstore_get(kvs, "hello")) &&
+            0 == strcmp(val, "world"));
+        CU_ASSERT(NULL != (val = kvstore_get(kvs, "key1")) &&
+            0 == strcmp(val, "ohgodwhatsthis"));
+        CU_ASSERT(NULL == kvstore_get(kvs, "key2"));
+        CU_ASSERT(0 == kvstore_set(kvs, "key3", "value3"));
+        CU_ASSERT(0 == kvstore_discard(kvs));
+
+        /*
+         * Without its hint file, a segment is read in full; a torn
+         * record at the end is dropped.
+         */
+        snprintf(file, sizeof(file), "%s/%010u.hint", path, 1);
+        CU_ASSERT(0 == unlink(file));
+        snprintf(file, sizeof(file), "%s/%010u.data", path, 1);
+        CU_ASSERT_FATAL(-1 != (fd = open(file, O_WRONLY | O_APPEND)));
+        CU_ASSERT(7 == write(fd, "garbage", 7));
+        close(fd);
+
+        CU_ASSERT_FATAL(NULL != (kvs = kvstore_open(path)));
+        CU_ASSERT(3 == kvstore_len(kvs));
+        CU_ASSERT(NULL != (val = kvstore_get(kvs, "key3")) &&
+            0 == strcmp(val, "value3"));
+        CU_ASSERT(NULL == kvstore_get(kvs, "key2"));
+        CU_ASSERT(0 == kvstore_discard(kvs));
+        remove_dir(path);
+}
+
+
+static void
+test_kvstore_persistent_merge(void)
+{
+        kvstore          kvs;
+        char             path[] = "/tmp/kvs_test.XXXXXX";
+        char             key[MAX_WORD_LEN];
+        char             val[MAX_WORD_LEN];
+        char            *got;
+        size_t           segsize = 4096;
+        int              sync = 0;
+        int              i, round;
+
+        CU_ASSERT_FATAL(NULL != mkdtemp(path));
+        CU_ASSERT_FATAL(NULL != (kvs = kvstore_open(path)));
+        CU_ASSERT(0 == kvstore_config(kvs, KVSTORE_SYNC, &sync));
+        CU_ASSERT(0 == kvstore_config(kvs, KVSTORE_SEGMENT_SIZE, &segsize));
+
+        for (round = 0; round < 20; round++) {
+                for (i = 0; i < 100; i++) {
+                        snprintf(key, MAX_WORD_LEN, "key%d", i);
+                        snprintf(val, MAX_WORD_LEN, "value%d.%d", i, round);
+                        CU_ASSERT(0 == kvstore_set(kvs, key, val));
+                }
+        }
+        for (i = 0; i < 50; i++) {
+                snprintf(key, MAX_WORD_LEN, "key%d", i);
+                CU_ASSERT(0 == kvstore_del(kvs, key));
+        }
+
+        /*
+         * 20 rounds of ~1.5k each over 4k segments; the background
+         * merger may already have reclaimed some of them, but after an
+         * explicit merge only the live half of the last round is left.
+         */
+        CU_ASSERT(0 == kvstore_merge(kvs));
+        CU_ASSERT(count_files(path, ".data") <= 3);
+
+        for (i = 0; i < 100; i++) {
+                snprintf(key, MAX_WORD_LEN, "key%d", i);
+                snprintf(val, MAX_WORD_LEN, "value%d.%d", i, 19);
+                got = kvstore_get(kvs, key);
+                if (i < 50)
+                        CU_ASSERT(NULL == got);
+                else
+                        CU_ASSERT(NULL != got && 0 == strcmp(got, val));
+        }
+
+        /*
+         * Push key99 into a finished segment; a merge moving it leaves
+         * the value already read in place until the next write.
+         */
+        for (i = 0; i < 200; i++)
+                CU_ASSERT(0 == kvstore_set(kvs, "fill", "filler"));
+        got = kvstore_get(kvs, "key99");
+        CU_ASSERT(0 == kvstore_merge(kvs));
+        CU_ASSERT(NULL != got && 0 == strcmp(got, "value99.19"));
+        CU_ASSERT(0 == kvstore_del(kvs, "fill"));
+        CU_ASSERT(0 == kvstore_discard(kvs));
+
+        CU_ASSERT_FATAL(NULL != (kvs = kvstore_open(path)));
+        CU_ASSERT(50 == kvstore_len(kvs));
+        for (i = 0; i < 100; i++) {
+                snprintf(key, MAX_WORD_LEN, "key%d", i);
+                snprintf(val, MAX_WORD_LEN, "value%d.%d", i, 19);
+                got = kvstore_get(kvs, key);
+                if (i < 50)
+                        CU_ASSERT(NULL == got);
+                else
+                        CU_ASSERT(NULL != got && 0 == strcmp(got, val));
+        }
+        CU_ASSERT(0 == kvstore_discard(kvs));
+        remove_dir(path);
+}
+
+
+/*
+ * Flush a tiny memtable once per round to get several level 0 tables
+ * and a compaction, then delete half the keys and check that the store
+ * reads the same before and after a reopen. Values read before a
+ * compaction stay readable until the next write, and a flush that cannot
+ * update the manifest loses nothing.
+ */
+static void
+test_kvstore_lsm(void)
+{
+        struct kvstore_lsm_stats         stats;
+        kvstore                          kvs;
+        char                             path[] = "/tmp/kvs_test.XXXXXX";
+        char                             file[256];
+        char                             key[MAX_WORD_LEN];
+        char                             val[MAX_WORD_LEN];
+        char                            *got;
+        size_t                           memtable = 4096;
+        int                              i, round, pass;
+
+        CU_ASSERT_FATAL(NULL != mkdtemp(path));
+        CU_ASSERT_FATAL(NULL != (kvs = kvstore_open_lsm(path)));
+        CU_ASSERT(0 == kvstore_config(kvs, KVSTORE_MEMTABLE_SIZE, &memtable));
+
+        for (round = 0; round < 10; round++) {
+                for (i = 0; i < 500; i++) {
+                        snprintf(key, MAX_WORD_LEN, "key%d", i);
+                        snprintf(val, MAX_WORD_LEN, "value%d.%d", i, round);
+                        CU_ASSERT(0 == kvstore_set(kvs, key, val));
+                }
+                CU_ASSERT(0 == kvstore_lsm_compact(kvs));
+        }
+        for (i = 0; i < 500; i += 2) {
+                snprintf(key, MAX_WORD_LEN, "key%d", i);
+                CU_ASSERT(0 == kvstore_del(kvs, key));
+        }
+        CU_ASSERT(-1 == kvstore_del(kvs, "key0"));
+        CU_ASSERT(-1 == kvstore_del(kvs, "nonexistent"));
+        CU_ASSERT(0 == kvstore_len(kvs));
+
+        CU_ASSERT(0 == kvstore_lsm_compact(kvs));
+        CU_ASSERT(0 == kvstore_lsm_stats(kvs, &stats));
+        CU_ASSERT(stats.tables[0] < 4);
+        CU_ASSERT(stats.tables[1] > 0);
+        CU_ASSERT(stats.disk_writes > 0);
+        CU_ASSERT(0 == kvstore_len(kvs));
+
+        for (pass = 0; pass < 2; pass++) {
+                for (i = 0; i < 500; i++) {
+                        snprintf(key, MAX_WORD_LEN, "key%d", i);
+                        snprintf(val, MAX_WORD_LEN, "value%d.%d", i, 9);
+                        got = kvstore_get(kvs, key);
+                        if (0 == i % 2)
+                                CU_ASSERT(NULL == got);
+                        else
+                                CU_ASSERT(NULL != got && 0 == strcmp(got, val));
+                }
+                CU_ASSERT(NULL == kvstore_get(kvs, "nonexistent"));
+                CU_ASSERT(0 == kvstore_discard(kvs));
+                CU_ASSERT_FATAL(NULL != (kvs = kvstore_open_lsm(path)));
+        }
+
+        CU_ASSERT(0 == kvstore_set(kvs, "key0", "back"));
+        CU_ASSERT(0 == kvstore_discard(kvs));
+        CU_ASSERT_FATAL(NULL != (kvs = kvstore_open_lsm(path)));
+        got = kvstore_get(kvs, "key0");
+        CU_ASSERT(NULL != got && 0 == strcmp(got, "back"));
+
+        /* A compaction keeps what it merged away until the next write. */
+        for (round = 0; round < 8; round++) {
+                CU_ASSERT(0 == kvstore_set(kvs, "pin", "pinned"));
+                CU_ASSERT(0 == kvstore_lsm_compact(kvs));
+                CU_ASSERT(0 == kvstore_lsm_stats(kvs, &stats));
+                if (3 == stats.tables[0])
+                        break;
+        }
+        CU_ASSERT(3 == stats.tables[0]);
+        CU_ASSERT(0 == kvstore_set(kvs, "other", "value"));
+        got = kvstore_get(kvs, "pin");
+        CU_ASSERT(0 == kvstore_lsm_compact(kvs));
+        CU_ASSERT(0 == kvstore_lsm_stats(kvs, &stats));
+        CU_ASSERT(0 == stats.tables[0]);
+        CU_ASSERT(NULL != got && 0 == strcmp(got, "pinned"));
+
+        /* A flush whose manifest cannot be written keeps the memtable. */
+        snprintf(file, sizeof(file), "%s/MANIFEST.tmp", path);
+        CU_ASSERT_FATAL(0 == mkdir(file, 0755));
+        CU_ASSERT(0 == kvstore_set(kvs, "pin", "unflushed"));
+        CU_ASSERT(-1 == kvstore_lsm_compact(kvs));
+        CU_ASSERT(0 == kvstore_lsm_stats(kvs, &stats));
+        CU_ASSERT(0 == stats.tables[0]);
+        got = kvstore_get(kvs, "pin");
+        CU_ASSERT(NULL != got && 0 == strcmp(got, "unflushed"));
+        CU_ASSERT(0 == rmdir(file));
+        CU_ASSERT(0 == kvstore_lsm_compact(kvs));
+        CU_ASSERT(0 == kvstore_discard(kvs));
+        CU_ASSERT_FATAL(NULL != (kvs = kvstore_open_lsm(path)));
+        got = kvstore_get(kvs, "pin");
+        CU_ASSERT(NULL != got && 0 == strcmp(got, "unflushed"));
+        CU_ASSERT(0 == kvstore_discard(kvs));
+        remove_dir(path);
+}
+
+
+/*
+ * The follower side of test_kvstore_cdc, run in a child process: apply
+ * the stream until the leader shuts down its end, check the result and
+ * report the last sequence number applied.
+ */
+static int
+cdc_follower(int fd)
+{
+        kvstore          kvs;
+        char             key[MAX_WORD_LEN];
+        char             val[MAX_WORD_LEN];
+        char            *got;
+        uint64_t         seq;
+        ssize_t          n;
+        int              i, bad = 0;
+
+        if (NULL == (kvs = kvstore_new()))
+                return 1;
+        while (0 < (n = kvstore_cdc_recv(kvs, fd)))
+                ;
+        if (-1 == n)
+                bad++;
+
+        for (i = 0; i < 500; i++) {
+                snprintf(key, MAX_WORD_LEN, "key%d", i);
+                snprintf(val, MAX_WORD_LEN, "value%d.1", i);
+                got = kvstore_get(kvs, key);
+                if ((i < 30) && (0 == i % 3))
+                        bad += (NULL != got);
+                else
+                        bad += (NULL == got) || (0 != strcmp(got, val));
+        }
+        bad += (490 != kvstore_len(kvs));
+
+        seq = kvstore_cdc_seq(kvs);
+        if (sizeof(seq) != write(fd, &seq, sizeof(seq)))
+                bad++;
+        kvstore_discard(kvs);
+        return bad ? 1 : 0;
+}
+
+
+/*
+ * A follower in another process tails a leader through a small ring:
+ * the first batch fits in the ring, the second overflows it and has to
+ * be sent as a snapshot, the third is incremental again. A second,
+ * in-process follower then catches up over a pipe and resumes from its
+ * own sequence number, as does one that only got part of a snapshot.
+ */
+static void
+test_kvstore_cdc(void)
+{
+        kvstore          leader, follower;
+        char             key[MAX_WORD_LEN];
+        char             val[MAX_WORD_LEN];
+        char            *got;
+        char             buf[64 * 1024];
+        uint64_t         seq = 0, fseq = 0;
+        uint32_t         klen, vlen;
+        size_t           off, max;
+        ssize_t          n;
+        pid_t            pid;
+        int              sv[2], pfd[2];
+        int              i, status;
+
+        CU_ASSERT_FATAL(NULL != (leader = kvstore_new()));
+        CU_ASSERT_FATAL(0 == kvstore_cdc_init(leader, 64));
+        CU_ASSERT_FATAL(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+        CU_ASSERT_FATAL(-1 != (pid = fork()));
+        if (0 == pid) {
+                close(sv[0]);
+                _exit(cdc_follower(sv[1]));
+        }
+        close(sv[1]);
+
+        for (i = 0; i < 50; i++) {
+                snprintf(key, MAX_WORD_LEN, "key%d", i);
+                snprintf(val, MAX_WORD_LEN, "value%d.0", i);
+                CU_ASSERT(0 == kvstore_set(leader, key, val));
+        }
+        CU_ASSERT(50 == kvstore_cdc_send(leader, sv[0], &seq));
+        CU_ASSERT(50 == seq);
+
+        for (i = 0; i < 500; i++) {
+                snprintf(key, MAX_WORD_LEN, "key%d", i);
+                snprintf(val, MAX_WORD_LEN, "value%d.1", i);
+                CU_ASSERT(0 == kvstore_set(leader, key, val));
+        }
+        CU_ASSERT(502 == kvstore_cdc_send(leader, sv[0], &seq));
+        CU_ASSERT(550 == seq);
+
+        for (i = 0; i < 30; i += 3) {
+                snprintf(key, MAX_WORD_LEN, "key%d", i);
+                CU_ASSERT(0 == kvstore_del(leader, key));
+        }
+        CU_ASSERT(-1 == kvstore_del(leader, "key0"));
+        CU_ASSERT(10 == kvstore_cdc_send(leader, sv[0], &seq));
+        CU_ASSERT(0 == kvstore_cdc_send(leader, sv[0], &seq));
+        CU_ASSERT(560 == seq);
+
+        shutdown(sv[0], SHUT_WR);
+        CU_ASSERT(sizeof(fseq) == read(sv[0], &fseq, sizeof(fseq)));
+        CU_ASSERT(560 == fseq);
+        CU_ASSERT(pid == waitpid(pid, &status, 0));
+        CU_ASSERT(WIFEXITED(status) && 0 == WEXITSTATUS(status));
+        close(sv[0]);
+
+        CU_ASSERT_FATAL(NULL != (follower = kvstore_new()));
+        CU_ASSERT_FATAL(0 == pipe(pfd));
+        fseq = 0;
+        CU_ASSERT(492 == kvstore_cdc_send(leader, pfd[1], &fseq));
+        while (0 < kvstore_cdc_recv(follower, pfd[0]) &&
+            kvstore_cdc_seq(follower) < 560)
+                ;
+        CU_ASSERT(560 == kvstore_cdc_seq(follower));
+        CU_ASSERT(490 == kvstore_len(follower));
+
+        CU_ASSERT(0 == kvstore_set(leader, "key0", "back"));
+        fseq = kvstore_cdc_seq(follower);
+        CU_ASSERT(1 == kvstore_cdc_send(leader, pfd[1], &fseq));
+        CU_ASSERT(1 == kvstore_cdc_recv(follower, pfd[0]));
+        got = kvstore_get(follower, "key0");
+        CU_ASSERT(NULL != got && 0 == strcmp(got, "back"));
+        CU_ASSERT(561 == kvstore_cdc_seq(follower));
+        close(pfd[0]);
+        close(pfd[1]);
+        CU_ASSERT(0 == kvstore_discard(follower));
+
+        /*
+         * A snapshot cut off part-way leaves a fresh follower at 0, so
+         * that it asks for everything again.
+         */
+        CU_ASSERT_FATAL(NULL != (follower = kvstore_new()));
+        CU_ASSERT_FATAL(0 == pipe(pfd));
+        fseq = 0;
+        CU_ASSERT(493 == kvstore_cdc_send(leader, pfd[1], &fseq));
+        CU_ASSERT_FATAL(0 < (n = read(pfd[0], buf, sizeof(buf))));
+        for (i = 0, off = 0; i < 101; i++) {
+                memcpy(&klen, buf + off + 12, sizeof(klen));
+                memcpy(&vlen, buf + off + 16, sizeof(vlen));
+                off += 24 + klen + vlen;
+        }
+        CU_ASSERT_FATAL(off < (size_t)n);
+        CU_ASSERT((ssize_t)off == write(pfd[1], buf, off));
+        CU_ASSERT(101 == kvstore_cdc_recv(follower, pfd[0]));
+        CU_ASSERT(0 == kvstore_cdc_seq(follower));
+        CU_ASSERT(100 == kvstore_len(follower));
+        fseq = kvstore_cdc_seq(follower);
+        CU_ASSERT(493 == kvstore_cdc_send(leader, pfd[1], &fseq));
+        while (0 < kvstore_cdc_recv(follower, pfd[0]) &&
+            kvstore_cdc_seq(follower) < 561)
+                ;
+        CU_ASSERT(561 == kvstore_cdc_seq(follower));
+        CU_ASSERT(491 == kvstore_len(follower));
+
+        /* A change the follower cannot apply leaves it where it was. */
+        max = 8;
+        CU_ASSERT(0 == kvstore_config(follower, KVSTORE_MAX_VALLEN, &max));
+        CU_ASSERT(0 == kvstore_set(leader, "key1", "much too long"));
+        CU_ASSERT(1 == kvstore_cdc_send(leader, pfd[1], &fseq));
+        CU_ASSERT(-1 == kvstore_cdc_recv(follower, pfd[0]));
+        CU_ASSERT(561 == kvstore_cdc_seq(follower));
+
+        close(pfd[0]);
+        close(pfd[1]);
+        CU_ASSERT(0 == kvstore_discard(follower));
+        CU_ASSERT(0 == kvstore_discard(leader));
+}
+
+
+static void
+mget_collect(char *key, char *val, void *arg)
+{
+        char    *out = (char *)arg;
+
+        strcat(out, key);
+        strcat(out, "=");
+        strcat(out, NULL == val ? "-" : val);
+        strcat(out, " ");
+}
+
+
+static void
+test_kvstore_mget_incr(void)
+{
+        kvstore          kvs;
+        char            *keys[] = { "a", "missing", "b" };
+        char             out[64] = "";
+        uint64_t         n = 0;
+
+        CU_ASSERT_FATAL(NULL != (kvs = kvstore_new()));
+        CU_ASSERT(0 == kvstore_set(kvs, "a", "1"));
+        CU_ASSERT(0 == kvstore_set(kvs, "b", "two"));
+        CU_ASSERT(0 == kvstore_mget(kvs, keys, 3, mget_collect, out));
+        CU_ASSERT(0 == strcmp(out, "a=1 missing=- b=two "));
+
+        CU_ASSERT(0 == kvstore_incr(kvs, "a", 41, &n));
+        CU_ASSERT(42 == n);
+        CU_ASSERT(0 == strcmp(kvstore_get(kvs, "a"), "42"));
+        CU_ASSERT(0 == kvstore_set(kvs, "a", "18446744073709551615"));
+        CU_ASSERT(0 == kvstore_incr(kvs, "a", 2, &n));
+        CU_ASSERT(1 == n);
+        CU_ASSERT(-1 == kvstore_incr(kvs, "b", 1, &n));
+        CU_ASSERT(EINVAL == errno);
+        CU_ASSERT(-1 == kvstore_incr(kvs, "missing", 1, &n));
+        CU_ASSERT(ENOENT == errno);
+        CU_ASSERT(0 == kvstore_discard(kvs));
+}
+
+
+static void
+shm_die(char *key, char *val, void *arg)
+{
+        (void)key;
+        (void)val;
+        (void)arg;
+        kill(getpid(), SIGKILL);
+}
+
+
+/*
+ * Four processes attach to one named segment and write to it at once,
+ * bumping a shared counter as they go. Then a process is killed while
+ * it holds the lock, and the store has to remain usable.
+ */
+static void
+test_kvstore_shm(void)
+{
+        kvstore          kvs, child;
+        char             name[64];
+        char             key[MAX_WORD_LEN];
+        char             val[MAX_WORD_LEN];
+        char            *keys[] = { "counter" };
+        char            *got;
+        pid_t            pids[4];
+        int              i, j, status, bad;
+        uint64_t         n;
+
+        snprintf(name, sizeof(name), "/kvs_test.%ld", (long)getpid());
+        shm_unlink(name);
+        CU_ASSERT_FATAL(NULL != (kvs = kvstore_shm_open(name, 1 << 20)));
+        CU_ASSERT(0 == kvstore_set(kvs, "counter", "0"));
+
+        for (i = 0; i < 4; i++) {
+                CU_ASSERT_FATAL(-1 != (pids[i] = fork()));
+                if (0 != pids[i])
+                        continue;
+                bad = NULL == (child = kvstore_shm_open(name, 0));
+                for (j = 0; !bad && j < 200; j++) {
+                        snprintf(key, MAX_WORD_LEN, "p%d.%d", i, j);
+                        snprintf(val, MAX_WORD_LEN, "value%d", j);
+                        bad += kvstore_set(child, key, val);
+                        bad += kvstore_incr(child, "counter", 1, &n);
+                }
+                kvstore_discard(child);
+                _exit(bad ? 1 : 0);
+        }
+        for (i = 0; i < 4; i++) {
+                CU_ASSERT(pids[i] == waitpid(pids[i], &status, 0));
+                CU_ASSERT(WIFEXITED(status) && 0 == WEXITSTATUS(status));
+        }
+
+        CU_ASSERT(801 == kvstore_len(kvs));
+        got = kvstore_get(kvs, "counter");
+        CU_ASSERT(NULL != got && 0 == strcmp(got, "800"));
+        for (i = 0; i < 4; i++) {
+                for (j = 0; j < 200; j += 50) {
+                        snprintf(key, MAX_WORD_LEN, "p%d.%d", i, j);
+                        snprintf(val, MAX_WORD_LEN, "value%d", j);
+                        got = kvstore_get(kvs, key);
+                        CU_ASSERT(NULL != got && 0 == strcmp(got, val));
+                }
+        }
+        CU_ASSERT(0 == kvstore_del(kvs, "p0.0"));
+        CU_ASSERT(NULL == kvstore_get(kvs, "p0.0"));
+        CU_ASSERT(800 == kvstore_len(kvs));
+
+        CU_ASSERT_FATAL(-1 != (pids[0] = fork()));
+        if (0 == pids[0]) {
+                child = kvstore_shm_open(name, 0);
+                kvstore_mget(child, keys, 1, shm_die, NULL);
+                _exit(1);
+        }
+        CU_ASSERT(pids[0] == waitpid(pids[0], &status, 0));
+        CU_ASSERT(WIFSIGNALED(status));
+        CU_ASSERT(0 == kvstore_set(kvs, "after", "crash"));
+        got = kvstore_get(kvs, "after");
+        CU_ASSERT(NULL != got && 0 == strcmp(got, "crash"));
+        CU_ASSERT(801 == kvstore_len(kvs));
+
+        CU_ASSERT(0 == kvstore_discard(kvs));
+        shm_unlink(name);
+}
+
+
+/*
+ * Enough integer keys to grow the table several times, with deletes
+ * mixed in to exercise the backward shift.
+ */
+static void
+test_kvstore_u64(void)
+{
+        kvstore          kvs;
+        char             val[MAX_WORD_LEN];
+        char            *got;
+        uint64_t         i, key;
+        size_t           n = 5000;
+
+        CU_ASSERT_FATAL(NULL != (kvs = kvstore_new()));
+        CU_ASSERT(NULL == kvstore_u64_get(kvs, 0));
+        CU_ASSERT(-1 == kvstore_u64_del(kvs, 0));
+        for (i = 0; i < n; i++) {
+                key = i * 0x9e3779b97f4a7c15ULL;
+                snprintf(val, MAX_WORD_LEN, "%llu", (unsigned long long)i);
+                CU_ASSERT(0 == kvstore_u64_set(kvs, key, val));
+        }
+        CU_ASSERT(0 == kvstore_u64_set(kvs, 0, "zero"));
+        CU_ASSERT(-1 == kvstore_u64_set(kvs, 1, ""));
+        CU_ASSERT(0 == kvstore_set(kvs, "0", "string"));
+        CU_ASSERT(n + 1 == kvstore_len(kvs));
+
+        for (i = 0; i < n; i += 3)
+                CU_ASSERT(0 == kvstore_u64_del(kvs, i * 0x9e3779b97f4a7c15ULL));
+        for (i = 0; i < n; i++) {
+                key = i * 0x9e3779b97f4a7c15ULL;
+                snprintf(val, MAX_WORD_LEN, "%llu", (unsigned long long)i);
+                got = kvstore_u64_get(kvs, key);
+                if (0 == i % 3)
+                        CU_ASSERT(NULL == got);
+                else
+                        CU_ASSERT(NULL != got && 0 == strcmp(got, val));
+        }
+        CU_ASSERT(0 == strcmp(kvstore_get(kvs, "0"), "string"));
+        CU_ASSERT(n - (n + 2) / 3 + 1 == kvstore_len(kvs));
+        CU_ASSERT(0 == kvstore_discard(kvs));
+}
+
+
+/*
+ * Bulk load words from the system dictionary, or made-up ones if there
+ * is none, first as TSV and then as binary records that rewrite every
+ * other value.
+ */
+static void
+test_kvstore_bulk_load(void)
+{
+        kvstore          kvs;
+        FILE            *dict, *tsv, *bin;
+        char             path[] = "/tmp/kvs_test_load.XXXXXX";
+        char             tsvpath[64], binpath[64];
+        char             word[MAX_WORD_LEN], val[MAX_WORD_LEN + 2];
+        char           **words;
+        char            *got;
+        size_t           threads = 4, n = 0, max = 20000, i;
+        uint32_t         len[2];
+
+        CU_ASSERT_FATAL(NULL != mkdtemp(path));
+        snprintf(tsvpath, sizeof(tsvpath), "%s/words.tsv", path);
+        snprintf(binpath, sizeof(binpath), "%s/words.bin", path);
+        words = (char **)calloc(max, sizeof(char *));
+        CU_ASSERT_FATAL(NULL != words);
+
+        dict = fopen(KVS_TEST_DICT, "r");
+        while (n < max) {
+                if (NULL == dict)
+                        snprintf(word, MAX_WORD_LEN, "word%zx", n * 7919);
+                else if (NULL == fgets(word, MAX_WORD_LEN, dict))
+                        break;
+                word[strcspn(word, "\r\n\t")] = 0;
+                if (0 == strlen(word))
+                        continue;
+                words[n++] = strdup(word);
+        }
+        if (NULL != dict)
+                fclose(dict);
+
+        CU_ASSERT_FATAL(NULL != (tsv = fopen(tsvpath, "w")));
+        CU_ASSERT_FATAL(NULL != (bin = fopen(binpath, "w")));
+        fprintf(tsv, "no tab on this line\n\tno key\r\n");
+        for (i = 0; i < n; i++) {
+                fprintf(tsv, "%s\t%s!\r\n", words[i], words[i]);
+                if (i % 2)
+                        continue;
+                len[0] = (uint32_t)strlen(words[i]);
+                len[1] = len[0];
+                fwrite(len, sizeof(len), 1, bin);
+                fwrite(words[i], len[0], 1, bin);
+                fwrite(words[i], len[0], 1, bin);
+        }
+        fclose(tsv);
+        fclose(bin);
+
+        CU_ASSERT_FATAL(NULL != (kvs = kvstore_new()));
+        CU_ASSERT(0 == kvstore_config(kvs, KVSTORE_LOAD_THREADS, &threads));
+        CU_ASSERT(0 == kvstore_set(kvs, words[0], "replaced"));
+        CU_ASSERT((ssize_t)n == kvstore_bulk_load(kvs, tsvpath,
+            KVSTORE_LOAD_TSV));
+        CU_ASSERT((ssize_t)(n + 1) / 2 == kvstore_bulk_load(kvs, binpath,
+            KVSTORE_LOAD_BINARY));
+        CU_ASSERT(-1 == kvstore_bulk_load(kvs, "/nonexistent/kvs_test_load",
+            KVSTORE_LOAD_TSV));
+        for (i = 0; i < n; i++) {
+                snprintf(val, sizeof(val), "%s%s", words[i],
+                    i % 2 ? "!" : "");
+                got = kvstore_get(kvs, words[i]);
+                CU_ASSERT(NULL != got && 0 == strcmp(got, val));
+        }
+        CU_ASSERT(n == kvstore_len(kvs));
+        CU_ASSERT(0 == kvstore_discard(kvs));
+
+        for (i = 0; i < n; i++)
+                free(words[i]);
+        free(words);
+        remove_dir(path);
+}
+
+
+struct map_sum {
+        size_t           n;
+        size_t           bytes;
+};
+
+
+static void
+map_copy(char *key, char *val, void *ctx)
+{
+        kvstore          kvs = (kvstore)ctx;
+        char             copy[MAX_WORD_LEN + 8];
+
+        /* The store is not locked, so it can be written from here. */
+        snprintf(copy, sizeof(copy), "copy:%s", key);
+        CU_ASSERT(0 == kvstore_set(kvs, copy, val));
+}
+
+
+static void
+map_fold(void *acc, char *key, char *val, void *ctx)
+{
+        struct map_sum  *sum = (struct map_sum *)acc;
+
+        sum->n++;
+        sum->bytes += strlen(val);
+}
+
+
+static void
+map_merge(void *acc, void *part, void *ctx)
+{
+        struct map_sum  *sum = (struct map_sum *)acc;
+        struct map_sum  *other = (struct map_sum *)part;
+
+        sum->n += other->n;
+        sum->bytes += other->bytes;
+}
+
+
+/*
+ * A pass that writes to the store only sees the entries from before it
+ * started, and a reduce over the result agrees with a serial count.
+ */
+static void
+test_kvstore_parallel(void)
+{
+        kvstore          kvs;
+        struct map_sum   sum;
+        char             key[MAX_WORD_LEN], val[MAX_WORD_LEN];
+        size_t           i, n = 5000, bytes = 0;
+
+        CU_ASSERT_FATAL(NULL != (kvs = kvstore_new()));
+        memset(&sum, 0x0, sizeof(sum));
+        CU_ASSERT(0 == kvstore_parallel_reduce(kvs, 4, map_fold, map_merge,
+            &sum, sizeof(sum), NULL));
+        CU_ASSERT(0 == sum.n);
+
+        for (i = 0; i < n; i++) {
+                snprintf(key, MAX_WORD_LEN, "key%zu", i);
+                snprintf(val, MAX_WORD_LEN, "%zu", i * i);
+                CU_ASSERT(0 == kvstore_set(kvs, key, val));
+                bytes += strlen(val);
+        }
+        CU_ASSERT(0 == kvstore_parallel_foreach(kvs, 4, map_copy, kvs));
+        CU_ASSERT(2 * n == kvstore_len(kvs));
+
+        CU_ASSERT(0 == kvstore_parallel_reduce(kvs, 3, map_fold, map_merge,
+            &sum, sizeof(sum), NULL));
+        CU_ASSERT(2 * n == sum.n);
+        CU_ASSERT(2 * bytes == sum.bytes);
+        CU_ASSERT(-1 == kvstore_parallel_foreach(kvs, 4, NULL, NULL));
+        CU_ASSERT(0 == kvstore_discard(kvs));
+}
+
+
+/*
+ * One full pass of the defragmenter moves every entry exactly once and
+ * leaves the store as it was.
+ */
+static void
+test_kvstore_defrag(void)
+{
+        kvstore                          kvs;
+        struct kvstore_defrag_stats      stats;
+        struct map_sum                   sum;
+        char                             key[MAX_WORD_LEN];
+        char                             val[MAX_WORD_LEN];
+        char                            *got;
+        size_t                           i, n = 3000;
+        int                              on = 1;
+
+        CU_ASSERT_FATAL(NULL != (kvs = kvstore_new()));
+        for (i = 0; i < n; i++) {
+                snprintf(key, MAX_WORD_LEN, "key%zu", i);
+                snprintf(val, MAX_WORD_LEN, "%*zu", (int)(i % 24) + 1, i);
+                CU_ASSERT(0 == kvstore_set(kvs, key, val));
+        }
+        for (i = 0; i < n; i += 2) {
+                snprintf(key, MAX_WORD_LEN, "key%zu", i);
+                CU_ASSERT(0 == kvstore_del(kvs, key));
+        }
+
+        CU_ASSERT(0 == kvstore_defrag_stats(kvs, &stats));
+        CU_ASSERT(0 == stats.cycles && 0 == stats.moved);
+        do {
+                CU_ASSERT(0 <= kvstore_defrag_step(kvs, 100));
+                CU_ASSERT(0 == kvstore_defrag_stats(kvs, &stats));
+        } while (0 == stats.cycles);
+        CU_ASSERT(n / 2 == stats.moved);
+        CU_ASSERT(0 < stats.moved_bytes);
+
+        for (i = 0; i < n; i++) {
+                snprintf(key, MAX_WORD_LEN, "key%zu", i);
+                snprintf(val, MAX_WORD_LEN, "%*zu", (int)(i % 24) + 1, i);
+                got = kvstore_get(kvs, key);
+                if (0 == i % 2)
+                        CU_ASSERT(NULL == got);
+                else
+                        CU_ASSERT(NULL != got && 0 == strcmp(got, val));
+        }
+        memset(&sum, 0x0, sizeof(sum));
+        CU_ASSERT(0 == kvstore_parallel_reduce(kvs, 2, map_fold, map_merge,
+            &sum, sizeof(sum), NULL));
+        CU_ASSERT(n / 2 == sum.n);
+        CU_ASSERT(n / 2 == kvstore_len(kvs));
+
+        /*
+         * Let the background thread finish a pass of its own alongside
+         * writes; it has to stop cleanly on discard.
+         */
+        CU_ASSERT(0 == kvstore_config(kvs, KVSTORE_DEFRAG, &on));
+        for (i = 0; (i < 5000) && (stats.cycles < 2); i++) {
+                snprintf(key, MAX_WORD_LEN, "key%zu", i % n);
+                CU_ASSERT(0 == kvstore_set(kvs, key, "defrag"));
+                usleep(1000);
+                CU_ASSERT(0 == kvstore_defrag_stats(kvs, &stats));
+        }
+        CU_ASSERT(2 <= stats.cycles);
+        CU_ASSERT(0 == kvstore_discard(kvs));
+}
+
+
+struct txn_transfer {
+        kvstore          kvs;
+        size_t           accounts;
+        unsigned int     seed;
+        size_t           from;
+        size_t           to;
+        size_t           failed;
+};
+
+
+static int
+txn_transfer(kvstore_txn txn, void *arg)
+{
+        struct txn_transfer     *tt = (struct txn_transfer *)arg;
+        char                     key[MAX_WORD_LEN], val[MAX_WORD_LEN];
+        char                    *from, *to;
+        long                     a, b;
+
+        snprintf(key, MAX_WORD_LEN, "acct%zu", tt->from);
+        from = kvstore_txn_get(txn, key);
+        snprintf(key, MAX_WORD_LEN, "acct%zu", tt->to);
+        to = kvstore_txn_get(txn, key);
+        if ((NULL == from) || (NULL == to))
+                return 1;
+        a = atol(from) - 1;
+        b = atol(to) + 1;
+        snprintf(val, MAX_WORD_LEN, "%ld", a);
+        snprintf(key, MAX_WORD_LEN, "acct%zu", tt->from);
+        kvstore_txn_set(txn, key, val);
+        snprintf(val, MAX_WORD_LEN, "%ld", b);
+        snprintf(key, MAX_WORD_LEN, "acct%zu", tt->to);
+        kvstore_txn_set(txn, key, val);
+        return 0;
+}
+
+
+static void *
+txn_worker(void *arg)
+{
+        struct txn_transfer     *tt = (struct txn_transfer *)arg;
+        size_t                   i;
+
+        for (i = 0; i < 2000; i++) {
+                tt->from = rand_r(&tt->seed) % tt->accounts;
+                tt->to = (tt->from + 1 + rand_r(&tt->seed) %
+                    (tt->accounts - 1)) % tt->accounts;
+                if (0 != kvstore_txn_run(tt->kvs, txn_transfer, tt))
+                        tt->failed++;
+        }
+        return NULL;
+}
+
+
+/*
+ * Conflicting or failing commits are refused without touching the
+ * store, and concurrent transfers between a few accounts never create or
+ * lose money.
+ */
+static void
+test_kvstore_txn(void)
+{
+        kvstore                  kvs;
+        kvstore_txn              txn;
+        struct txn_transfer      tt[4];
+        pthread_t                threads[4];
+        char                     key[MAX_WORD_LEN];
+        size_t                   i, size;
+        long                     total = 0;
+
+        CU_ASSERT_FATAL(NULL != (kvs = kvstore_new()));
+        CU_ASSERT(0 == kvstore_set(kvs, "a", "1"));
+
+        CU_ASSERT_FATAL(NULL != (txn = kvstore_txn_begin(kvs)));
+        CU_ASSERT(0 == strcmp(kvstore_txn_get(txn, "a"), "1"));
+        CU_ASSERT(NULL == kvstore_txn_get(txn, "b"));
+        CU_ASSERT(0 == kvstore_txn_set(txn, "b", "2"));
+        CU_ASSERT(0 == strcmp(kvstore_txn_get(txn, "b"), "2"));
+        CU_ASSERT(0 == kvstore_txn_del(txn, "a"));
+        CU_ASSERT(NULL == kvstore_txn_get(txn, "a"));
+        CU_ASSERT(-1 == kvstore_txn_set(txn, "c", ""));
+        CU_ASSERT(0 == strcmp(kvstore_get(kvs, "a"), "1"));
+        CU_ASSERT(NULL == kvstore_get(kvs, "b"));
+        CU_ASSERT(0 == kvstore_txn_commit(txn));
+        CU_ASSERT(NULL == kvstore_get(kvs, "a"));
+        CU_ASSERT(0 == strcmp(kvstore_get(kvs, "b"), "2"));
+
+        /* A key read as missing that appears before commit conflicts. */
+        CU_ASSERT_FATAL(NULL != (txn = kvstore_txn_begin(kvs)));
+        CU_ASSERT(NULL == kvstore_txn_get(txn, "a"));
+        CU_ASSERT(0 == strcmp(kvstore_txn_get(txn, "b"), "2"));
+        CU_ASSERT(0 == kvstore_txn_set(txn, "b", "3"));
+        CU_ASSERT(0 == kvstore_set(kvs, "a", "new"));
+        errno = 0;
+        CU_ASSERT(-1 == kvstore_txn_commit(txn));
+        CU_ASSERT(EAGAIN == errno);
+        CU_ASSERT(0 == strcmp(kvstore_get(kvs, "b"), "2"));
+
+        CU_ASSERT_FATAL(NULL != (txn = kvstore_txn_begin(kvs)));
+        CU_ASSERT(0 == kvstore_txn_set(txn, "b", "4"));
+        kvstore_txn_abort(txn);
+        CU_ASSERT(0 == strcmp(kvstore_get(kvs, "b"), "2"));
+
+        /* A write that fails part way through undoes the ones before it. */
+        CU_ASSERT_FATAL(NULL != (txn = kvstore_txn_begin(kvs)));
+        CU_ASSERT(0 == kvstore_txn_set(txn, "a", "5"));
+        CU_ASSERT(0 == kvstore_txn_del(txn, "b"));
+        CU_ASSERT(0 == kvstore_txn_set(txn, "c", "too long"));
+        size = 4;
+        CU_ASSERT(0 == kvstore_config(kvs, KVSTORE_MAX_VALLEN, &size));
+        CU_ASSERT(-1 == kvstore_txn_commit(txn));
+        size = KVSTORE_DEFAULT_MAX_VALLEN;
+        CU_ASSERT(0 == kvstore_config(kvs, KVSTORE_MAX_VALLEN, &size));
+        CU_ASSERT(0 == strcmp(kvstore_get(kvs, "a"), "new"));
+        CU_ASSERT(0 == strcmp(kvstore_get(kvs, "b"), "2"));
+        CU_ASSERT(NULL == kvstore_get(kvs, "c"));
+
+        for (i = 0; i < 8; i++) {
+                snprintf(key, MAX_WORD_LEN, "acct%zu", i);
+                CU_ASSERT(0 == kvstore_set(kvs, key, "100"));
+        }
+        for (i = 0; i < 4; i++) {
+                tt[i].kvs = kvs;
+                tt[i].accounts = 8;
+                tt[i].seed = (unsigned int)i + 1;
+                tt[i].failed = 0;
+                CU_ASSERT_FATAL(0 == pthread_create(&threads[i], NULL,
+                    txn_worker, &tt[i]));
+        }
+        for (i = 0; i < 4; i++) {
+                pthread_join(threads[i], NULL);
+                CU_ASSERT(0 == tt[i].failed);
+        }
+        for (i = 0; i < 8; i++) {
+                snprintf(key, MAX_WORD_LEN, "acct%zu", i);
+                total += atol(kvstore_get(kvs, key));
+        }
+        CU_ASSERT(800 == total);
+        CU_ASSERT(0 == kvstore_discard(kvs));
+}
+
+
+struct watch_wait {
+        kvstore          kvs;
+        uint64_t         last;
+        uint64_t         seen;
+};
+
+
+static void *
+watch_waiter(void *arg)
+{
+        struct watch_wait       *ww = (struct watch_wait *)arg;
+
+        ww->seen = kvstore_watch(ww->kvs, "watched", ww->last, 10000);
+        return NULL;
+}
+
+
+/*
+ * A thread blocked in kvstore_watch wakes when the key is set, a watch
+ * with nothing happening times out, and a watch eventfd becomes
+ * readable on both sets and deletes.
+ */
+static void
+test_kvstore_watch(void)
+{
+        kvstore                  kvs;
+        struct watch_wait        ww;
+        struct pollfd            pfd;
+        pthread_t                waiter;
+        uint64_t                 version, count;
+        int                      fd;
+
+        CU_ASSERT_FATAL(NULL != (kvs = kvstore_new()));
+        CU_ASSERT(0 == kvstore_watch(kvs, "", 0, 0));
+
+        version = kvstore_watch(kvs, "watched", 0, 0);
+        CU_ASSERT(0 != version);
+        CU_ASSERT(version == kvstore_watch(kvs, "watched", version, 50));
+        CU_ASSERT(0 == kvstore_set(kvs, "other", "1"));
+        CU_ASSERT(version == kvstore_watch(kvs, "watched", version, 0));
+
+        ww.kvs = kvs;
+        ww.last = version;
+        ww.seen = 0;
+        CU_ASSERT_FATAL(0 == pthread_create(&waiter, NULL, watch_waiter,
+            &ww));
+        usleep(50000);
+        CU_ASSERT(0 == kvstore_set(kvs, "watched", "1"));
+        pthread_join(waiter, NULL);
+        CU_ASSERT(ww.seen > version);
+        CU_ASSERT(ww.seen == kvstore_watch(kvs, "watched", ww.seen, 0));
+
+        CU_ASSERT_FATAL(-1 != (fd = kvstore_watch_fd(kvs, "watched")));
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        CU_ASSERT(0 == poll(&pfd, 1, 0));
+        CU_ASSERT(0 == kvstore_set(kvs, "watched", "2"));
+        CU_ASSERT(1 == poll(&pfd, 1, 0));
+        CU_ASSERT(sizeof(count) == read(fd, &count, sizeof(count)));
+        CU_ASSERT(1 == count);
+        CU_ASSERT(0 == kvstore_del(kvs, "watched"));
+        CU_ASSERT(1 == poll(&pfd, 1, 0));
+        CU_ASSERT(0 == kvstore_unwatch_fd(kvs, "watched", fd));
+        CU_ASSERT(-1 == kvstore_unwatch_fd(kvs, "watched", fd));
+        CU_ASSERT(0 == kvstore_discard(kvs));
+}
+
+
+/*
+ * Prefix and range deletes remove exactly the keys they match, across
+ * several batches and the index shrinking underneath them.
+ */
+static void
+test_kvstore_del_range(void)
+{
+        kvstore                  kvs;
+        char                     key[MAX_WORD_LEN];
+        size_t                   i;
+
+        CU_ASSERT_FATAL(NULL != (kvs = kvstore_new()));
+        for (i = 0; i < 5000; i++) {
+                snprintf(key, MAX_WORD_LEN, "tenant/a/%zu", i);
+                CU_ASSERT(0 == kvstore_set(kvs, key, "a"));
+                snprintf(key, MAX_WORD_LEN, "tenant/b/%zu", i);
+                CU_ASSERT(0 == kvstore_set(kvs, key, "b"));
+        }
+        CU_ASSERT(0 == kvstore_set(kvs, "tenant/a", "parent"));
+        CU_ASSERT(0 == kvstore_set(kvs, "tenant/ab", "sibling"));
+
+        CU_ASSERT(5000 == kvstore_del_prefix(kvs, "tenant/a/"));
+        CU_ASSERT(0 == kvstore_del_prefix(kvs, "tenant/a/"));
+        CU_ASSERT(5002 == kvstore_len(kvs));
+        CU_ASSERT(NULL == kvstore_get(kvs, "tenant/a/17"));
+        CU_ASSERT(0 == strcmp(kvstore_get(kvs, "tenant/b/17"), "b"));
+        CU_ASSERT(0 == strcmp(kvstore_get(kvs, "tenant/a"), "parent"));
+
+        /* tenant/b/1000 up to but not including tenant/b/2000. */
+        CU_ASSERT(1111 == kvstore_del_range(kvs, "tenant/b/1000",
+            "tenant/b/2000"));
+        CU_ASSERT(NULL == kvstore_get(kvs, "tenant/b/1999"));
+        CU_ASSERT(NULL == kvstore_get(kvs, "tenant/b/1000"));
+        CU_ASSERT(0 == strcmp(kvstore_get(kvs, "tenant/b/2000"), "b"));
+        CU_ASSERT(0 == strcmp(kvstore_get(kvs, "tenant/b/100"), "b"));
+
+        CU_ASSERT(1 == kvstore_del_range(kvs, NULL, "tenant/ab"));
+        CU_ASSERT(3889 == kvstore_del_range(kvs, "tenant/b", NULL));
+        CU_ASSERT(1 == kvstore_len(kvs));
+        CU_ASSERT(1 == kvstore_del_prefix(kvs, ""));
+        CU_ASSERT(0 == kvstore_len(kvs));
+        CU_ASSERT(0 == kvstore_set(kvs, "tenant/a/1", "again"));
+        CU_ASSERT(0 == strcmp(kvstore_get(kvs, "tenant/a/1"), "again"));
+        CU_ASSERT(0 == kvstore_discard(kvs));
+}
+
+
+#define HASH_FLOOD_KEYS 4000
+#define HASH_FLOOD_KEYLEN 16
+
+
+/*
+ * hash_flood_keys fills keys with n keys whose 64-bit FNV-1a hashes, the
+ * store's old unseeded hash, agree in their low 12 bits, so that they
+ * all used to land in one bucket of a table sized for them. The low
+ * bits of FNV-1a only depend on the low bits of its state, so it is
+ * enough to search two-byte suffixes of a fixed prefix.
+ */
+static void
+hash_flood_keys(char keys[][HASH_FLOOD_KEYLEN], size_t n)
+{
+        uint64_t        h, h1, h2;
+        size_t          found = 0, prefix, i, len;
+        unsigned int    c1, c2;
+
+        for (prefix = 0; found < n; prefix++) {
+                len = (size_t)snprintf(keys[found], HASH_FLOOD_KEYLEN,
+                    "adv%zu-", prefix);
+                h = 0xcbf29ce484222325ULL;
+                for (i = 0; i < len; i++)
+                        h = (h ^ (unsigned char)keys[found][i]) *
+                            0x100000001b3ULL;
+                for (c1 = 1; (c1 < 256) && (found < n); c1++) {
+                        h1 = (h ^ c1) * 0x100000001b3ULL;
+                        for (c2 = 1; (c2 < 256) && (found < n); c2++) {
+                                h2 = (h1 ^ c2) * 0x100000001b3ULL;
+                                if (0 != (h2 & 0xfff))
+                                        continue;
+                                snprintf(keys[found], HASH_FLOOD_KEYLEN,
+                                    "adv%zu-%c%c", prefix, c1, c2);
+                                found++;
+                        }
+                }
+        }
+}
+
+
+/*
+ * hash_flood_chain sets keys in a store using alg and returns the length
+ * of the longest bucket chain in its index, looking in both tables in
+ * case a rehash is under way.
+ */
+static size_t
+hash_flood_chain(char keys[][HASH_FLOOD_KEYLEN], size_t n,
+    KVSTORE_HASH_ALG alg)
+{
+        kvstore                  kvs;
+        struct _kvstore_kv      *kv;
+        size_t                   i, t, len, longest = 0, misses = 0;
+
+        kvs = kvstore_new();
+        CU_ASSERT(0 == kvstore_config(kvs, KVSTORE_HASH, &alg));
+        for (i = 0; i < n; i++)
+                kvstore_set(kvs, keys[i], "v");
+        for (i = 0; i < n; i++) {
+                if (NULL == kvstore_get(kvs, keys[i]))
+                        misses++;
+        }
+        CU_ASSERT(0 == misses);
+        CU_ASSERT(n == kvstore_len(kvs));
+        for (t = 0; t < 2; t++) {
+                for (i = 0; i < kvs->table[t].size; i++) {
+                        len = 0;
+                        for (kv = kvs->table[t].buckets[i]; NULL != kv;
+                            kv = kv->next)
+                                len++;
+                        if (len > longest)
+                                longest = len;
+                }
+        }
+        kvstore_discard(kvs);
+        return longest;
+}
+
+
+/*
+ * Keys crafted to collide under a fixed hash spread over the index like
+ * ordinary keys, with either hash, and switching the hash or its seed
+ * keeps every key reachable.
+ */
+static void
+test_kvstore_hash(void)
+{
+        static char              adv[HASH_FLOOD_KEYS][HASH_FLOOD_KEYLEN];
+        static char              benign[HASH_FLOOD_KEYS][HASH_FLOOD_KEYLEN];
+        kvstore                  kvs;
+        KVSTORE_HASH_ALG         alg;
+        uint64_t                 seed[2] = {1, 2};
+        size_t                   i, misses = 0;
+
+        /*
+         * Under a random hash the longest of ~4096 chains holding 4000
+         * keys is almost never over 10; under the old hash it was 4000.
+         */
+        hash_flood_keys(adv, HASH_FLOOD_KEYS);
+        for (i = 0; i < HASH_FLOOD_KEYS; i++)
+                snprintf(benign[i], HASH_FLOOD_KEYLEN, "benign%zu", i);
+        CU_ASSERT(16 > hash_flood_chain(benign, HASH_FLOOD_KEYS,
+            KVSTORE_HASH_SIPHASH));
+        CU_ASSERT(16 > hash_flood_chain(adv, HASH_FLOOD_KEYS,
+            KVSTORE_HASH_SIPHASH));
+        CU_ASSERT(16 > hash_flood_chain(adv, HASH_FLOOD_KEYS,
+            KVSTORE_HASH_FAST));
+
+        CU_ASSERT_FATAL(NULL != (kvs = kvstore_new()));
+        for (i = 0; i < HASH_FLOOD_KEYS; i++)
+                CU_ASSERT(0 == kvstore_set(kvs, adv[i], benign[i]));
+        alg = KVSTORE_HASH_FAST;
+        CU_ASSERT(0 == kvstore_config(kvs, KVSTORE_HASH, &alg));
+        CU_ASSERT(0 == kvstore_config(kvs, KVSTORE_HASH_SEED, seed));
+        for (i = 0; i < HASH_FLOOD_KEYS; i++) {
+                if ((NULL == kvstore_get(kvs, adv[i])) ||
+                    (0 != strcmp(kvstore_get(kvs, adv[i]), benign[i])))
+                        misses++;
+        }
+        CU_ASSERT(0 == misses);
+        alg = (KVSTORE_HASH_ALG)7;
+        CU_ASSERT(-1 == kvstore_config(kvs, KVSTORE_HASH, &alg));
+        alg = KVSTORE_HASH_SIPHASH;
+        CU_ASSERT(0 == kvstore_config(kvs, KVSTORE_HASH, &alg));
+        CU_ASSERT(0 == kvstore_del(kvs, adv[0]));
+        CU_ASSERT(NULL == kvstore_get(kvs, adv[0]));
+        CU_ASSERT(0 == strcmp(kvstore_get(kvs, adv[1]), benign[1]));
+        CU_ASSERT(0 == kvstore_discard(kvs));
+}
+
+
+/*
+ * The most read keys come out of kvstore_hot_keys in order, a hot key
+ * that is only read gets served from a per-CPU copy, and a write drops
+ * the copy so the next read sees the new value.
+ */
+static void
+test_kvstore_hot(void)
+{
+        kvstore                  kvs;
+        struct kvstore_hot_key   hot[4];
+        char                     key[MAX_WORD_LEN];
+        size_t                   k = 4, i, j;
+        ssize_t                  n;
+        int                      on = 1;
+
+        CU_ASSERT_FATAL(NULL != (kvs = kvstore_new()));
+        CU_ASSERT(-1 == kvstore_config(kvs, KVSTORE_HOT_REPLICATE, &on));
+        CU_ASSERT(0 == kvstore_config(kvs, KVSTORE_HOT_KEYS, &k));
+        for (i = 0; i < 50; i++) {
+                snprintf(key, MAX_WORD_LEN, "cold%zu", i);
+                CU_ASSERT(0 == kvstore_set(kvs, key, "c"));
+        }
+        CU_ASSERT(0 == kvstore_set(kvs, "hot", "h"));
+        CU_ASSERT(0 == kvstore_set(kvs, "warm", "w"));
+        CU_ASSERT(0 == kvstore_set(kvs, "busy", "b"));
+
+        for (i = 0; i < 400; i++) {
+                CU_ASSERT(0 == strcmp(kvstore_get(kvs, "hot"), "h"));
+                if (0 == (i % 2))
+                        CU_ASSERT(0 == strcmp(kvstore_get(kvs, "warm"), "w"));
+                if (0 == (i % 4))
+                        CU_ASSERT(NULL != kvstore_get(kvs, "busy"));
+                if (0 == (i % 8)) {
+                        CU_ASSERT(0 == kvstore_set(kvs, "busy", "b"));
+                        for (j = 0; j < 50; j++) {
+                                snprintf(key, MAX_WORD_LEN, "cold%zu", j);
+                                kvstore_get(kvs, key);
+                        }
+                }
+        }
+        n = kvstore_hot_keys(kvs, hot, 2);
+        CU_ASSERT_FATAL(2 == n);
+        CU_ASSERT(0 == strcmp(hot[0].key, "hot"));
+        CU_ASSERT(0 == strcmp(hot[1].key, "warm"));
+        CU_ASSERT(hot[0].reads >= 400);
+        CU_ASSERT(0 == hot[0].replicated);
+        free(hot[0].key);
+        free(hot[1].key);
+
+        CU_ASSERT(0 == kvstore_config(kvs, KVSTORE_HOT_REPLICATE, &on));
+        for (i = 0; i < 200; i++) {
+                kvstore_get(kvs, "hot");
+                kvstore_get(kvs, "busy");
+                if (0 == (i % 4))
+                        CU_ASSERT(0 == kvstore_set(kvs, "busy", "b"));
+        }
+        CU_ASSERT(0 == strcmp(kvstore_get(kvs, "hot"), "h"));
+        n = kvstore_hot_keys(kvs, hot, 4);
+        CU_ASSERT_FATAL(4 == n);
+        for (i = 0; i < (size_t)n; i++) {
+                if (0 == strcmp(hot[i].key, "hot"))
+                        CU_ASSERT(1 == hot[i].replicated);
+                if (0 == strcmp(hot[i].key, "busy"))
+                        CU_ASSERT(0 == hot[i].replicated);
+                free(hot[i].key);
+        }
+
+        CU_ASSERT(0 == kvstore_set(kvs, "hot", "h2"));
+        CU_ASSERT(0 == strcmp(kvstore_get(kvs, "hot"), "h2"));
+        CU_ASSERT(0 == kvstore_del(kvs, "hot"));
+        CU_ASSERT(NULL == kvstore_get(kvs, "hot"));
+        CU_ASSERT(0 == kvstore_discard(kvs));
+}
+
+
+/*
+ * A second thread's share of the traced operations: ten hits, five
+ * misses and five deletes.
+ */
+static void *
+trace_worker(void *arg)
+{
+        kvstore  kvs = (kvstore)arg;
+        char     key[MAX_WORD_LEN];
+        int      i;
+
+        for (i = 0; i < 10; i++) {
+                snprintf(key, MAX_WORD_LEN, "trace%d", i);
+                kvstore_get(kvs, key);
+        }
+        for (i = 0; i < 5; i++)
+                kvstore_get(kvs, "no such key");
+        for (i = 0; i < 5; i++) {
+                snprintf(key, MAX_WORD_LEN, "trace%d", i);
+                kvstore_del(kvs, key);
+        }
+        return NULL;
+}
+
+
+/*
+ * Each thread's ring keeps its most recent events, oldest first, and a
+ * dump has one block per thread that touched the store.
+ */
+static void
+test_kvstore_trace(void)
+{
+        kvstore                          kvs;
+        struct kvstore_trace_header      hdr;
+        struct kvstore_trace_event       ev, prev;
+        char                             path[] = "/tmp/kvs_test.XXXXXX";
+        char                             key[MAX_WORD_LEN];
+        size_t                           events = 1000, ops[3], errors;
+        pthread_t                        worker;
+        uint64_t                         i;
+        int                              fd, blocks;
+
+        CU_ASSERT_FATAL(NULL != (kvs = kvstore_new()));
+        CU_ASSERT(-1 == kvstore_trace_dump(kvs, 1));
+        CU_ASSERT(0 == kvstore_config(kvs, KVSTORE_TRACE, &events));
+        for (i = 0; i < 3000; i++) {
+                snprintf(key, MAX_WORD_LEN, "trace%d", (int)(i % 100));
+                CU_ASSERT(0 == kvstore_set(kvs, key, "v"));
+        }
+        CU_ASSERT_FATAL(0 == pthread_create(&worker, NULL, trace_worker,
+            kvs));
+        pthread_join(worker, NULL);
+
+        CU_ASSERT_FATAL(-1 != (fd = mkstemp(path)));
+        unlink(path);
+        CU_ASSERT(1044 == kvstore_trace_dump(kvs, fd));
+        CU_ASSERT_FATAL(0 == lseek(fd, 0, SEEK_SET));
+        blocks = 0;
+        while (sizeof(hdr) == read(fd, &hdr, sizeof(hdr))) {
+                blocks++;
+                CU_ASSERT(KVSTORE_TRACE_MAGIC == hdr.magic);
+                CU_ASSERT(0 != hdr.ticks_per_sec);
+                memset(ops, 0x0, sizeof(ops));
+                memset(&prev, 0x0, sizeof(prev));
+                errors = 0;
+                for (i = 0; i < hdr.events; i++) {
+                        CU_ASSERT_FATAL(sizeof(ev) ==
+                            read(fd, &ev, sizeof(ev)));
+                        CU_ASSERT(ev.thread == hdr.thread);
+                        CU_ASSERT(ev.tsc >= prev.tsc);
+                        CU_ASSERT_FATAL(ev.op <= KVSTORE_OP_DEL);
+                        ops[ev.op]++;
+                        if (0 != ev.result)
+                                errors++;
+                        prev = ev;
+                }
+                if (1024 == hdr.events) {
+                        CU_ASSERT(1024 == ops[KVSTORE_OP_SET]);
+                        CU_ASSERT(0 == errors);
+                } else {
+                        CU_ASSERT(20 == hdr.events);
+                        CU_ASSERT(15 == ops[KVSTORE_OP_GET]);
+                        CU_ASSERT(5 == ops[KVSTORE_OP_DEL]);
+                        CU_ASSERT(5 == errors);
+                }
+        }
+        CU_ASSERT(2 == blocks);
+        close(fd);
+
+        events = 0;
+        CU_ASSERT(0 == kvstore_config(kvs, KVSTORE_TRACE, &events));
+        CU_ASSERT(-1 == kvstore_trace_dump(kvs, 1));
+        CU_ASSERT(0 == kvstore_discard(kvs));
+}
+
+
+static void
+compact_count(char *key, char *val, void *arg)
+{
+        size_t  *n = (size_t *)arg;
+
+        (void)key;
+        if ('v' == val[0])
+                (*n)++;
+}
+
+
+/*
+ * A compact store behaves like a node store through growth, values
+ * that move when they outgrow their room, deletes and the compaction
+ * they lead to, a scan that runs across a compaction, a hash change and
+ * a range delete.
+ */
+static void
+test_kvstore_compact(void)
+{
+        kvstore                  kvs;
+        KVSTORE_HASH_ALG         alg = KVSTORE_HASH_FAST;
+        char                     key[MAX_WORD_LEN], val[MAX_WORD_LEN];
+        char                    *got;
+        size_t                   cursor, n, i, k = 4;
+        int                      on = 1;
+
+        CU_ASSERT_FATAL(NULL != (kvs = kvstore_new_compact()));
+        for (i = 0; i < 5000; i++) {
+                snprintf(key, MAX_WORD_LEN, "key%zu", i);
+                snprintf(val, MAX_WORD_LEN, "v%zu", i);
+                CU_ASSERT(0 == kvstore_set(kvs, key, val));
+        }
+        CU_ASSERT(5000 == kvstore_len(kvs));
+        for (i = 0; i < 5000; i += 2) {
+                snprintf(key, MAX_WORD_LEN, "key%zu", i);
+                snprintf(val, MAX_WORD_LEN, "value number %zu", i);
+                CU_ASSERT(0 == kvstore_set(kvs, key, val));
+        }
+        CU_ASSERT(5000 == kvstore_len(kvs));
+        for (n = 0, i = 0; i < 5000; i++) {
+                snprintf(key, MAX_WORD_LEN, "key%zu", i);
+                if (0 == (i % 2))
+                        snprintf(val, MAX_WORD_LEN, "value number %zu", i);
+                else
+                        snprintf(val, MAX_WORD_LEN, "v%zu", i);
+                got = kvstore_get(kvs, key);
+                if ((NULL == got) || (0 != strcmp(got, val)))
+                        n++;
+        }
+        CU_ASSERT(0 == n);
+
+        cursor = 0;
+        n = 0;
+        CU_ASSERT(0 == kvstore_scan(kvs, &cursor, 100, compact_count, &n));
+        CU_ASSERT(0 != cursor);
+        for (i = 0; i < 5000; i++) {
+                if (0 == (i % 3))
+                        continue;
+                snprintf(key, MAX_WORD_LEN, "key%zu", i);
+                CU_ASSERT(0 == kvstore_del(kvs, key));
+        }
+        CU_ASSERT(-1 == kvstore_del(kvs, "key1"));
+        CU_ASSERT(NULL == kvstore_get(kvs, "key1"));
+        CU_ASSERT(1667 == kvstore_len(kvs));
+        CU_ASSERT(0 == kvstore_set(kvs, "key1", "value one, again"));
+        do {
+                CU_ASSERT(0 == kvstore_scan(kvs, &cursor, 100,
+                    compact_count, &n));
+        } while (0 != cursor);
+        CU_ASSERT(n >= 1668);
+
+        CU_ASSERT(0 == kvstore_config(kvs, KVSTORE_HASH, &alg));
+        CU_ASSERT(0 == strcmp(kvstore_get(kvs, "key1"), "value one, again"));
+        CU_ASSERT(0 == strcmp(kvstore_get(kvs, "key3"), "v3"));
+        CU_ASSERT(0 == strcmp(kvstore_get(kvs, "key4998"),
+            "value number 4998"));
+        CU_ASSERT(NULL == kvstore_get(kvs, "key4999"));
+
+        CU_ASSERT(369 == kvstore_del_prefix(kvs, "key4"));
+        CU_ASSERT(NULL == kvstore_get(kvs, "key42"));
+        CU_ASSERT(1299 == kvstore_len(kvs));
+        got = kvstore_get(kvs, "key3");
+        CU_ASSERT(0 == kvstore_set(kvs, "copy", got));
+        CU_ASSERT(0 == strcmp(kvstore_get(kvs, "copy"), "v3"));
+
+        CU_ASSERT(-1 == kvstore_cdc_init(kvs, 16));
+        CU_ASSERT(-1 == kvstore_config(kvs, KVSTORE_HOT_KEYS, &k));
+        CU_ASSERT(-1 == kvstore_config(kvs, KVSTORE_DEFRAG, &on));
+        CU_ASSERT(0 == kvstore_discard(kvs));
+}
+
+
+/*
+ * With reclamation deferred, deletes still take effect at once, a
+ * range delete and a discard of a populated store go to the reaper, and
+ * kvstore_reap_wait returns once all of it has been freed, in a forked
+ * child as well.
+ */
+static void
+test_kvstore_reap(void)
+{
+        kvstore  kvs;
+        char     key[MAX_WORD_LEN];
+        size_t   i;
+        pid_t    pid;
+        int      on = 1, status;
+
+        CU_ASSERT_FATAL(NULL != (kvs = kvstore_new()));
+        CU_ASSERT(0 == kvstore_config(kvs, KVSTORE_REAP, &on));
+        for (i = 0; i < 20000; i++) {
+                snprintf(key, MAX_WORD_LEN, "reap%zu", i);
+                CU_ASSERT(0 == kvstore_set(kvs, key, "value"));
+        }
+        for (i = 0; i < 20000; i += 2) {
+                snprintf(key, MAX_WORD_LEN, "reap%zu", i);
+                CU_ASSERT(0 == kvstore_del(kvs, key));
+        }
+        CU_ASSERT(-1 == kvstore_del(kvs, "reap0"));
+        CU_ASSERT(NULL == kvstore_get(kvs, "reap0"));
+        CU_ASSERT(0 == strcmp(kvstore_get(kvs, "reap1"), "value"));
+        CU_ASSERT(10000 == kvstore_len(kvs));
+        CU_ASSERT(0 == kvstore_set(kvs, "reap0", "again"));
+        CU_ASSERT(0 == strcmp(kvstore_get(kvs, "reap0"), "again"));
+        kvstore_reap_wait();
+
+        CU_ASSERT(5556 == kvstore_del_prefix(kvs, "reap1"));
+        CU_ASSERT(NULL == kvstore_get(kvs, "reap11"));
+
+        /* A forked child starts a reaper of its own. */
+        CU_ASSERT_FATAL(-1 != (pid = fork()));
+        if (0 == pid) {
+                alarm(10);
+                if (1 != kvstore_del_prefix(kvs, "reap0"))
+                        _exit(1);
+                kvstore_reap_wait();
+                _exit(0);
+        }
+        CU_ASSERT(pid == waitpid(pid, &status, 0));
+        CU_ASSERT(WIFEXITED(status) && (0 == WEXITSTATUS(status)));
+        CU_ASSERT(0 == kvstore_discard(kvs));
+        kvstore_reap_wait();
+
+        on = 0;
+        CU_ASSERT_FATAL(NULL != (kvs = kvstore_new()));
+        CU_ASSERT(0 == kvstore_config(kvs, KVSTORE_REAP, &on));
+        CU_ASSERT(0 == kvstore_set(kvs, "key", "value"));
+        CU_ASSERT(0 == kvstore_del(kvs, "key"));
+        CU_ASSERT(0 == kvstore_discard(kvs));
+}
+
+
+/*
+ * Appends and range writes change values in place and range reads see
+ * exactly the requested slice, on an in-memory store and on a compact
+ * store, which falls back to rewriting the value.
+ */
+static void
+test_kvstore_append(void)
+{
+        kvstore  stores[2];
+        char     buf[64];
+        size_t   i, len;
+        int      s;
+
+        stores[0] = kvstore_new();
+        stores[1] = kvstore_new_compact();
+        CU_ASSERT_FATAL((NULL != stores[0]) && (NULL != stores[1]));
+        for (s = 0; s < 2; s++) {
+                len = 16384;
+                CU_ASSERT(0 == kvstore_config(stores[s], KVSTORE_MAX_VALLEN,
+                    &len));
+                CU_ASSERT(3 == kvstore_append(stores[s], "log", "abc"));
+                CU_ASSERT(6 == kvstore_append(stores[s], "log", "def"));
+                CU_ASSERT(6 == kvstore_append(stores[s], "log", ""));
+                CU_ASSERT(0 == strcmp(kvstore_get(stores[s], "log"),
+                    "abcdef"));
+                CU_ASSERT(-1 == kvstore_append(stores[s], "empty", ""));
+                CU_ASSERT(NULL == kvstore_get(stores[s], "empty"));
+
+                CU_ASSERT(6 == kvstore_setrange(stores[s], "log", 1, "XY"));
+                CU_ASSERT(8 == kvstore_setrange(stores[s], "log", 5, "123"));
+                CU_ASSERT(0 == strcmp(kvstore_get(stores[s], "log"),
+                    "aXYde123"));
+                CU_ASSERT(-1 == kvstore_setrange(stores[s], "log", 9, "z"));
+                CU_ASSERT(EINVAL == errno);
+                CU_ASSERT(-1 == kvstore_setrange(stores[s], "new", 1, "z"));
+                CU_ASSERT(1 == kvstore_setrange(stores[s], "new", 0, "z"));
+
+                CU_ASSERT(3 == kvstore_getrange(stores[s], "log", 2, 3, buf));
+                CU_ASSERT(0 == memcmp(buf, "Yde", 3));
+                CU_ASSERT(2 == kvstore_getrange(stores[s], "log", 6, 10,
+                    buf));
+                CU_ASSERT(0 == memcmp(buf, "23", 2));
+                CU_ASSERT(0 == kvstore_getrange(stores[s], "log", 8, 1, buf));
+                CU_ASSERT(-1 == kvstore_getrange(stores[s], "none", 0, 1,
+                    buf));
+                CU_ASSERT(ENOENT == errno);
+
+                for (i = 0; i < 1000; i++)
+                        kvstore_append(stores[s], "grow", "0123456789");
+                CU_ASSERT(10000 == strlen(kvstore_get(stores[s], "grow")));
+                CU_ASSERT(10 == kvstore_getrange(stores[s], "grow", 9990,
+                    10, buf));
+                CU_ASSERT(0 == memcmp(buf, "0123456789", 10));
+                CU_ASSERT(0 == kvstore_set(stores[s], "grow", "short"));
+                CU_ASSERT(0 == strcmp(kvstore_get(stores[s], "grow"),
+                    "short"));
+                len = 16;
+                CU_ASSERT(0 == kvstore_config(stores[s], KVSTORE_MAX_VALLEN,
+                    &len));
+                CU_ASSERT(-1 == kvstore_append(stores[s], "log",
+                    "0123456789"));
+                CU_ASSERT(0 == strcmp(kvstore_get(stores[s], "log"),
+                    "aXYde123"));
+                CU_ASSERT(0 == kvstore_discard(stores[s]));
+        }
+}
+
+
+static void
+test_kvstore_chunk_scan(char *key, char *val, void *arg)
+{
+        if (0 == strcmp(key, "big"))
+                *(int *)arg = '\0' == val[0];
+}
+
+
+static void
+test_kvstore_chunk_whole(char *key, char *val, void *arg)
+{
+        if ((0 == strcmp(key, "grow")) && (4100 == strlen(val)))
+                __atomic_add_fetch((int *)arg, 1, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Values longer than max_vallen are held in chunks once a chunk size is
+ * set: they round-trip through the iovec calls and range reads, grow by
+ * appending, and are replaced, deleted and reclaimed like any other
+ * value, while kvstore_get and kvstore_incr refuse them. The calls that
+ * hand values out whole (parallel passes, mget, transactions) join them.
+ */
+static void
+test_kvstore_chunked(void)
+{
+        kvstore          kvs;
+        struct iovec     in[3], out[8];
+        kvstore_txn      txn;
+        char            *big, *buf, *val, *keys[2] = { "grow", "none" };
+        size_t           i, off, size, max = 100000, cursor = 0;
+        uint64_t         n;
+        int              on = 1, seen = 0, whole = 0;
+
+        CU_ASSERT_FATAL(NULL != (big = (char *)malloc(4 * 4096 + 1)));
+        CU_ASSERT_FATAL(NULL != (buf = (char *)malloc(4 * 4096 + 1)));
+        for (i = 0; i < 4 * 4096; i++)
+                big[i] = 'a' + (char)(i % 26);
+        big[4 * 4096] = 0;
+
+        CU_ASSERT_FATAL(NULL != (kvs = kvstore_new()));
+        in[0].iov_base = big;
+        in[0].iov_len = 5000;
+        CU_ASSERT(-1 == kvstore_setv(kvs, "big", in, 1));
+        size = 16;
+        CU_ASSERT(-1 == kvstore_config(kvs, KVSTORE_CHUNK_SIZE, &size));
+        size = 256;
+        CU_ASSERT(0 == kvstore_config(kvs, KVSTORE_CHUNK_SIZE, &size));
+        size = 1024;
+        CU_ASSERT(0 == kvstore_config(kvs, KVSTORE_CHUNK_SIZE, &size));
+        CU_ASSERT(0 == kvstore_config(kvs, KVSTORE_MAX_CHUNKED_VALLEN,
+            &max));
+
+        in[0].iov_len = 1000;
+        in[1].iov_base = big + 1000;
+        in[1].iov_len = 3000;
+        in[2].iov_base = big + 4000;
+        in[2].iov_len = 1000;
+        CU_ASSERT(0 == kvstore_setv(kvs, "big", in, 3));
+        CU_ASSERT(NULL == kvstore_get(kvs, "big"));
+        CU_ASSERT(EFBIG == errno);
+        CU_ASSERT(5 == kvstore_getv(kvs, "big", out, 8));
+        for (i = 0, off = 0; i < 5; off += out[i].iov_len, i++)
+                memcpy(buf + off, out[i].iov_base, out[i].iov_len);
+        CU_ASSERT(5000 == off);
+        CU_ASSERT(0 == memcmp(buf, big, 5000));
+        CU_ASSERT(904 == out[4].iov_len);
+        CU_ASSERT(5 == kvstore_getv(kvs, "big", out, 2));
+        CU_ASSERT(1024 == out[1].iov_len);
+        CU_ASSERT(-1 == kvstore_getv(kvs, "none", out, 8));
+        CU_ASSERT(ENOENT == errno);
+
+        CU_ASSERT(5000 == kvstore_setrange(kvs, "big", 1020, "XXXXXXXX"));
+        CU_ASSERT(10 == kvstore_getrange(kvs, "big", 1019, 10, buf));
+        CU_ASSERT(0 == memcmp(buf, "fXXXXXXXXo", 10));
+        CU_ASSERT(5008 == kvstore_append(kvs, "big", "01234567"));
+        CU_ASSERT(8 == kvstore_getrange(kvs, "big", 5000, 100, buf));
+        CU_ASSERT(0 == memcmp(buf, "01234567", 8));
+        do {
+                CU_ASSERT_FATAL(0 == kvstore_scan(kvs, &cursor, 16,
+                    test_kvstore_chunk_scan, &seen));
+        } while (0 != cursor);
+        CU_ASSERT(1 == seen);
+
+        big[2 * 4096] = 0;
+        CU_ASSERT(0 == kvstore_set(kvs, "str", big));
+        CU_ASSERT(NULL == kvstore_get(kvs, "str"));
+        CU_ASSERT(2 * 4096 == kvstore_getrange(kvs, "str", 0, 4 * 4096,
+            buf));
+        CU_ASSERT(0 == memcmp(buf, big, 2 * 4096));
+        big[2 * 4096] = 'a';
+        CU_ASSERT(0 == kvstore_set(kvs, "str", "small"));
+        CU_ASSERT(0 == strcmp(kvstore_get(kvs, "str"), "small"));
+        CU_ASSERT(1 == kvstore_getv(kvs, "str", out, 8));
+        CU_ASSERT(5 == out[0].iov_len);
+
+        big[4000] = 0;
+        CU_ASSERT(0 == kvstore_set(kvs, "grow", big));
+        big[4000] = 'm';
+        CU_ASSERT(4100 == kvstore_append(kvs, "grow", big + 4 * 4096 -
+            100));
+        CU_ASSERT(NULL == kvstore_get(kvs, "grow"));
+        CU_ASSERT(5 == kvstore_getv(kvs, "grow", out, 8));
+        CU_ASSERT(0 == kvstore_parallel_foreach(kvs, 2,
+            test_kvstore_chunk_whole, &whole));
+        CU_ASSERT(0 == kvstore_mget(kvs, keys, 2, test_kvstore_chunk_whole,
+            &whole));
+        CU_ASSERT(2 == whole);
+        CU_ASSERT(-1 == kvstore_incr(kvs, "grow", 1, &n));
+        CU_ASSERT(EFBIG == errno);
+        CU_ASSERT_FATAL(NULL != (txn = kvstore_txn_begin(kvs)));
+        CU_ASSERT_FATAL(NULL != (val = kvstore_txn_get(txn, "grow")));
+        CU_ASSERT(0 == memcmp(val, big, 4000));
+        CU_ASSERT(4100 == strlen(val));
+        CU_ASSERT(0 == kvstore_txn_set(txn, "str", "txn"));
+        CU_ASSERT(4101 == kvstore_append(kvs, "grow", "z"));
+        CU_ASSERT(-1 == kvstore_txn_commit(txn));
+        CU_ASSERT(EAGAIN == errno);
+        CU_ASSERT(0 == strcmp(kvstore_get(kvs, "str"), "small"));
+
+        in[0].iov_base = big;
+        in[0].iov_len = max + 1;
+        CU_ASSERT(-1 == kvstore_setv(kvs, "huge", in, 1));
+        CU_ASSERT(0 == kvstore_del(kvs, "big"));
+        CU_ASSERT(-1 == kvstore_getv(kvs, "big", out, 8));
+        CU_ASSERT(-1 == kvstore_config(kvs, KVSTORE_HOT_KEYS, &size));
+        CU_ASSERT(-1 == kvstore_cdc_init(kvs, 16));
+        CU_ASSERT(0 == kvstore_config(kvs, KVSTORE_REAP, &on));
+        CU_ASSERT(0 == kvstore_del(kvs, "grow"));
+        CU_ASSERT(0 == kvstore_discard(kvs));
+        kvstore_reap_wait();
+        free(big);
+        free(buf);
+}
+
+
+static void
+test_kvstore_frozen_scan(char *key, char *val, void *arg)
+{
+        size_t  *seen = (size_t *)arg;
+
+        if (0 == strncmp(key, "frozen", 6) && (0 == strncmp(val, "value", 5)))
+                seen[0]++;
+        else
+                seen[1]++;
+}
+
+
+/*
+ * A frozen store answers for exactly the keys it was frozen with,
+ * whichever hash the source used and however long its values, scans
+ * each of them once and refuses writes.
+ */
+static void
+test_kvstore_frozen(void)
+{
+        kvstore          kvs, fz;
+        KVSTORE_HASH_ALG alg = KVSTORE_HASH_FAST;
+        char             path[] = "/tmp/kvs_test.XXXXXX";
+        char             file[256], key[MAX_WORD_LEN], val[MAX_WORD_LEN];
+        char            *big, *v;
+        size_t           i, cursor = 0, threads = 4, chunk = 1024;
+        size_t           seen[2] = {0, 0};
+        uint64_t         words, saved, bad;
+        off_t            off;
+        int              fd, on = 1;
+
+        CU_ASSERT_FATAL(NULL != mkdtemp(path));
+        snprintf(file, sizeof(file), "%s/frozen", path);
+        CU_ASSERT_FATAL(NULL != (big = (char *)malloc(3 * 4096 + 1)));
+        memset(big, 'b', 3 * 4096);
+        big[3 * 4096] = 0;
+
+        CU_ASSERT_FATAL(NULL != (kvs = kvstore_new()));
+        CU_ASSERT(0 == kvstore_config(kvs, KVSTORE_LOAD_THREADS, &threads));
+        CU_ASSERT(0 == kvstore_config(kvs, KVSTORE_CHUNK_SIZE, &chunk));
+        for (i = 0; i < 200000; i++) {
+                snprintf(key, MAX_WORD_LEN, "frozen%zu", i);
+                snprintf(val, MAX_WORD_LEN, "value%zu", i);
+                CU_ASSERT(0 == kvstore_set(kvs, key, val));
+        }
+        CU_ASSERT(0 == kvstore_del(kvs, "frozen7"));
+        CU_ASSERT(0 == kvstore_set(kvs, "big", big));
+        CU_ASSERT(0 == kvstore_freeze(kvs, file));
+        CU_ASSERT(0 == kvstore_discard(kvs));
+
+        CU_ASSERT_FATAL(NULL != (fz = kvstore_open_frozen(file)));
+        CU_ASSERT(200000 == kvstore_len(fz));
+        for (i = 0; i < 200000; i++) {
+                snprintf(key, MAX_WORD_LEN, "frozen%zu", i);
+                snprintf(val, MAX_WORD_LEN, "value%zu", i);
+                v = kvstore_get(fz, key);
+                if (7 == i)
+                        CU_ASSERT(NULL == v);
+                else
+                        CU_ASSERT((NULL != v) && (0 == strcmp(v, val)));
+        }
+        for (i = 0; i < 10000; i++) {
+                snprintf(key, MAX_WORD_LEN, "thawed%zu", i);
+                CU_ASSERT(NULL == kvstore_get(fz, key));
+        }
+        CU_ASSERT((NULL != (v = kvstore_get(fz, "big"))) &&
+            (0 == strcmp(v, big)));
+        do {
+                CU_ASSERT_FATAL(0 == kvstore_scan(fz, &cursor, 1000,
+                    test_kvstore_frozen_scan, seen));
+        } while (0 != cursor);
+        CU_ASSERT(199999 == seen[0]);
+        CU_ASSERT(1 == seen[1]);
+        CU_ASSERT(-1 == kvstore_set(fz, "frozen1", "new"));
+        CU_ASSERT(EROFS == errno);
+        CU_ASSERT(-1 == kvstore_del(fz, "frozen1"));
+        CU_ASSERT(EROFS == errno);
+        CU_ASSERT(0 == strcmp(kvstore_get(fz, "frozen1"), "value1"));
+        CU_ASSERT(-1 == kvstore_freeze(fz, file));
+        CU_ASSERT(-1 == kvstore_defrag_step(fz, 16));
+        CU_ASSERT(-1 == kvstore_config(fz, KVSTORE_DEFRAG, &on));
+        CU_ASSERT(-1 == kvstore_config(fz, KVSTORE_WRITE_COMBINE, &on));
+        CU_ASSERT(0 == kvstore_discard(fz));
+
+        CU_ASSERT_FATAL(NULL != (kvs = kvstore_new()));
+        CU_ASSERT(0 == kvstore_config(kvs, KVSTORE_HASH, &alg));
+        CU_ASSERT(0 == kvstore_freeze(kvs, file));
+        CU_ASSERT_FATAL(NULL != (fz = kvstore_open_frozen(file)));
+        CU_ASSERT(0 == kvstore_len(fz));
+        CU_ASSERT(NULL == kvstore_get(fz, "key"));
+        CU_ASSERT(0 == kvstore_discard(fz));
+        CU_ASSERT(0 == kvstore_set(kvs, "key", "value"));
+        CU_ASSERT(0 == kvstore_u64_set(kvs, 42, "answer"));
+        CU_ASSERT(-1 == kvstore_freeze(kvs, file));
+        CU_ASSERT(EINVAL == errno);
+        CU_ASSERT(0 == kvstore_u64_del(kvs, 42));
+        CU_ASSERT(0 == kvstore_freeze(kvs, file));
+        CU_ASSERT(0 == kvstore_discard(kvs));
+        CU_ASSERT_FATAL(NULL != (fz = kvstore_open_frozen(file)));
+        CU_ASSERT(0 == strcmp(kvstore_get(fz, "key"), "value"));
+        CU_ASSERT(0 == kvstore_discard(fz));
+
+        /*
+         * A record offset pointing outside the data, or lengths that
+         * overflow, are caught when the file is opened. The header is
+         * 5 + 2 + 1 + 2 * 64 words long.
+         */
+        CU_ASSERT_FATAL(-1 != (fd = open(file, O_RDWR)));
+        CU_ASSERT(sizeof(words) == pread(fd, &words, sizeof(words), 16));
+        off = 136 * 8 + (words + words / 8 + 1) * 8;
+        CU_ASSERT(sizeof(saved) == pread(fd, &saved, sizeof(saved), off));
+        bad = 1ULL << 40;
+        CU_ASSERT(sizeof(bad) == pwrite(fd, &bad, sizeof(bad), off));
+        CU_ASSERT(NULL == kvstore_open_frozen(file));
+        CU_ASSERT(sizeof(saved) == pwrite(fd, &saved, sizeof(saved), off));
+        bad = (uint64_t)-1 / 8;
+        CU_ASSERT(sizeof(bad) == pwrite(fd, &bad, sizeof(bad), 8));
+        CU_ASSERT(NULL == kvstore_open_frozen(file));
+        CU_ASSERT(EINVAL == errno);
+        bad = 1;
+        CU_ASSERT(sizeof(bad) == pwrite(fd, &bad, sizeof(bad), 8));
+        close(fd);
+        CU_ASSERT_FATAL(NULL != (fz = kvstore_open_frozen(file)));
+        CU_ASSERT(0 == kvstore_discard(fz));
+
+        CU_ASSERT_FATAL(-1 != (fd = open(file, O_WRONLY | O_APPEND)));
+        CU_ASSERT(7 == write(fd, "garbage", 7));
+        close(fd);
+        CU_ASSERT(NULL == kvstore_open_frozen(file));
+        CU_ASSERT_FATAL(NULL != (kvs = kvstore_new_compact()));
+        CU_ASSERT(-1 == kvstore_freeze(kvs, file));
+        CU_ASSERT(0 == kvstore_discard(kvs));
+        free(big);
+        remove_dir(path);
+}
+
+
+struct rcache_reader {
+        kvstore          kvs;
+        int             *ready;
+        int             *phase;
+        int              fresh;
+};
+
+
+/*
+ * rcache_reader caches every w key while it holds "old", waits for the
+ * main thread to rewrite them all, and counts how many it then reads
+ * as "new".
+ */
+static void *
+rcache_reader(void *arg)
+{
+        struct rcache_reader    *r = (struct rcache_reader *)arg;
+        char                     key[MAX_WORD_LEN];
+        char                    *val;
+        int                      i, pass;
+
+        for (pass = 0; pass < 2; pass++) {
+                for (i = 0; i < 100; i++) {
+                        snprintf(key, MAX_WORD_LEN, "w%d", i);
+                        val = kvstore_get(r->kvs, key);
+                        if (0 == pass)
+                                continue;
+                        if ((NULL != val) && (0 == strcmp(val, "new")))
+                                r->fresh++;
+                }
+                if (0 != pass)
+                        break;
+                __atomic_add_fetch(r->ready, 1, __ATOMIC_RELEASE);
+                while (0 == __atomic_load_n(r->phase, __ATOMIC_ACQUIRE))
+                        sched_yield();
+        }
+        return NULL;
+}
+
+
+/*
+ * A read cache serves repeated gets without going back to the store,
+ * but never once the key has been set, appended to or deleted, by this
+ * thread or another.
+ */
+static void
+test_kvstore_read_cache(void)
+{
+        struct kvstore_read_cache_stats  st;
+        struct rcache_reader             r[4];
+        pthread_t                        threads[4];
+        kvstore                          kvs;
+        char                             key[MAX_WORD_LEN];
+        char                            *val;
+        size_t                           slots = 200;
+        int                              i, ready = 0, phase = 0;
+
+        CU_ASSERT_FATAL(NULL != (kvs = kvstore_new()));
+        CU_ASSERT(-1 == kvstore_read_cache_stats(kvs, &st));
+        CU_ASSERT(0 == kvstore_config(kvs, KVSTORE_READ_CACHE, &slots));
+        CU_ASSERT(-1 == kvstore_config(kvs, KVSTORE_READ_CACHE, &slots));
+        CU_ASSERT(-1 == kvstore_config(kvs, KVSTORE_HOT_KEYS, &slots));
+
+        CU_ASSERT(0 == kvstore_set(kvs, "key", "value"));
+        CU_ASSERT(NULL == kvstore_get(kvs, "none"));
+        for (i = 0; i < 10; i++)
+                CU_ASSERT((NULL != (val = kvstore_get(kvs, "key"))) &&
+                    (0 == strcmp(val, "value")));
+        CU_ASSERT(0 == kvstore_read_cache_stats(kvs, &st));
+        CU_ASSERT(9 == st.hits);
+        CU_ASSERT(2 == st.misses);
+        CU_ASSERT(0 == st.stale);
+        CU_ASSERT(1 == st.threads);
+
+        CU_ASSERT(0 == kvstore_set(kvs, "key", "other"));
+        CU_ASSERT(0 == strcmp(kvstore_get(kvs, "key"), "other"));
+        CU_ASSERT(9 == kvstore_append(kvs, "key", "wise"));
+        CU_ASSERT(0 == strcmp(kvstore_get(kvs, "key"), "otherwise"));
+        CU_ASSERT(0 == kvstore_del(kvs, "key"));
+        CU_ASSERT(NULL == kvstore_get(kvs, "key"));
+        CU_ASSERT(0 == kvstore_read_cache_stats(kvs, &st));
+        CU_ASSERT(3 == st.stale);
+
+        for (i = 0; i < 100; i++) {
+                snprintf(key, MAX_WORD_LEN, "w%d", i);
+                CU_ASSERT(0 == kvstore_set(kvs, key, "old"));
+        }
+        for (i = 0; i < 4; i++) {
+                r[i].kvs = kvs;
+                r[i].ready = &ready;
+                r[i].phase = &phase;
+                r[i].fresh = 0;
+                CU_ASSERT_FATAL(0 == pthread_create(&threads[i], NULL,
+                    rcache_reader, &r[i]));
+        }
+        while (4 != __atomic_load_n(&ready, __ATOMIC_ACQUIRE))
+                sched_yield();
+        for (i = 0; i < 100; i++) {
+                snprintf(key, MAX_WORD_LEN, "w%d", i);
+                CU_ASSERT(0 == kvstore_set(kvs, key, "new"));
+        }
+        __atomic_store_n(&phase, 1, __ATOMIC_RELEASE);
+        for (i = 0; i < 4; i++) {
+                pthread_join(threads[i], NULL);
+                CU_ASSERT(100 == r[i].fresh);
+        }
+        CU_ASSERT(0 == kvstore_read_cache_stats(kvs, &st));
+        CU_ASSERT(5 == st.threads);
+        CU_ASSERT(0 < st.stale);
+        CU_ASSERT(0 == kvstore_discard(kvs));
+}
+
+
+/*
+ * dedup_writer keeps setting its own keys to the shared value while the
+ * main thread range-deletes another set, so that both touch the pool.
+ */
+static void *
+dedup_writer(void *arg)
+{
+        kvstore  kvs = (kvstore)arg;
+        char     key[MAX_WORD_LEN];
+        int      i;
+
+        for (i = 0; i < 20000; i++) {
+                snprintf(key, MAX_WORD_LEN, "b/%d", i % 500);
+                kvstore_set(kvs, key, "a value shared by many");
+        }
+        return NULL;
+}
+
+
+/*
+ * With dedup on, keys set to the same long value share one copy that
+ * lives until the last of them lets go, and writing through one key
+ * never shows through another.
+ */
+static void
+test_kvstore_dedup(void)
+{
+        kvstore                          kvs;
+        struct kvstore_dedup_stats       st;
+        struct kvstore_defrag_stats      ds;
+        char                             key[MAX_WORD_LEN];
+        const char                      *shared = "a value shared by many";
+        size_t                           i, n = 100, min = 8;
+        size_t                           slen = strlen(shared);
+        char                            *first;
+        uint64_t                         seed[2] = { 1, 2 };
+        pthread_t                        writer;
+        int                              on = 1;
+
+        CU_ASSERT_FATAL(NULL != (kvs = kvstore_new()));
+        CU_ASSERT(-1 == kvstore_dedup_stats(kvs, &st));
+        CU_ASSERT(0 == kvstore_config(kvs, KVSTORE_DEDUP, &min));
+        CU_ASSERT(-1 == kvstore_config(kvs, KVSTORE_HASH_SEED, seed));
+        for (i = 0; i < n; i++) {
+                snprintf(key, MAX_WORD_LEN, "key%zu", i);
+                CU_ASSERT(0 == kvstore_set(kvs, key, (char *)shared));
+        }
+        CU_ASSERT(0 == kvstore_set(kvs, "short", "tiny"));
+        CU_ASSERT_FATAL(NULL != (first = kvstore_get(kvs, "key0")));
+        CU_ASSERT(first == kvstore_get(kvs, "key99"));
+        CU_ASSERT(0 == kvstore_dedup_stats(kvs, &st));
+        CU_ASSERT(1 == st.values);
+        CU_ASSERT(n == st.refs);
+        CU_ASSERT((n - 1) * (slen + 1) == st.saved);
+
+        CU_ASSERT(0 == kvstore_set(kvs, "key0", (char *)shared));
+        CU_ASSERT(first == kvstore_get(kvs, "key0"));
+        CU_ASSERT(0 == kvstore_set(kvs, "key1", "another long value"));
+        CU_ASSERT(0 == strcmp(kvstore_get(kvs, "key1"),
+            "another long value"));
+        CU_ASSERT((ssize_t)slen + 1 == kvstore_append(kvs, "key2", "!"));
+        CU_ASSERT(first != kvstore_get(kvs, "key2"));
+        CU_ASSERT((ssize_t)slen == kvstore_setrange(kvs, "key3", 0, "A"));
+        CU_ASSERT(0 == strcmp(kvstore_get(kvs, "key3") + 1, shared + 1));
+        CU_ASSERT(0 == strcmp(kvstore_get(kvs, "key4"), shared));
+        CU_ASSERT(0 == kvstore_dedup_stats(kvs, &st));
+        CU_ASSERT(2 == st.values);
+        CU_ASSERT(n - 2 == st.refs);
+
+        for (i = 10; i < n; i += 2) {
+                snprintf(key, MAX_WORD_LEN, "key%zu", i);
+                CU_ASSERT(0 == kvstore_del(kvs, key));
+        }
+        do {
+                CU_ASSERT(0 <= kvstore_defrag_step(kvs, 16));
+                CU_ASSERT(0 == kvstore_defrag_stats(kvs, &ds));
+        } while (0 == ds.cycles);
+        CU_ASSERT_FATAL(NULL != (first = kvstore_get(kvs, "key0")));
+        CU_ASSERT(0 == strcmp(first, shared));
+        CU_ASSERT(first == kvstore_get(kvs, "key99"));
+
+        CU_ASSERT(0 == kvstore_config(kvs, KVSTORE_REAP, &on));
+        CU_ASSERT(0 == kvstore_del(kvs, "key1"));
+        CU_ASSERT(0 == kvstore_dedup_stats(kvs, &st));
+        CU_ASSERT(1 == st.values);
+        CU_ASSERT(n - 2 - 45 - 1 == st.refs);
+        CU_ASSERT((st.refs - 1) * (slen + 1) == st.saved);
+
+        min = 0;
+        CU_ASSERT(0 == kvstore_config(kvs, KVSTORE_DEDUP, &min));
+        CU_ASSERT(0 == kvstore_set(kvs, "own", (char *)shared));
+        CU_ASSERT(first != kvstore_get(kvs, "own"));
+        CU_ASSERT(0 == kvstore_set(kvs, "key5", "replaced"));
+        CU_ASSERT(0 == kvstore_dedup_stats(kvs, &st));
+        CU_ASSERT(n - 2 - 45 - 2 == st.refs);
+        CU_ASSERT(0 == kvstore_discard(kvs));
+        kvstore_reap_wait();
+
+        /*
+         * Range deletes drop the lock before freeing what they removed;
+         * the pool has to be left consistent all the same.
+         */
+        CU_ASSERT_FATAL(NULL != (kvs = kvstore_new()));
+        min = 8;
+        CU_ASSERT(0 == kvstore_config(kvs, KVSTORE_DEDUP, &min));
+        CU_ASSERT_FATAL(0 == pthread_create(&writer, NULL, dedup_writer,
+            kvs));
+        for (i = 0; i < 20000; i++) {
+                snprintf(key, MAX_WORD_LEN, "a/%zu", i % 500);
+                CU_ASSERT(0 == kvstore_set(kvs, key, (char *)shared));
+                if (0 == i % 10)
+                        CU_ASSERT(0 <= kvstore_del_prefix(kvs, "a/"));
+        }
+        pthread_join(writer, NULL);
+        CU_ASSERT(0 <= kvstore_del_prefix(kvs, "a/"));
+        CU_ASSERT(0 == kvstore_dedup_stats(kvs, &st));
+        CU_ASSERT(1 == st.values);
+        CU_ASSERT(500 == st.refs);
+        CU_ASSERT(0 == kvstore_discard(kvs));
+}
+
+
 int
 initialise_kvstore_test()
 {
@@ -244,6 +2619,114 @@ main(int argc, char *argv[])
                     test_kvstore_multikey))
                 destroy_test_registry();
 
+        if (NULL == CU_add_test(kvstore_suite, "scan",
+                    test_kvstore_scan))
+                destroy_test_registry();
+
+        if (NULL == CU_add_test(kvstore_suite, "scan across resizes",
+                    test_kvstore_scan_resize))
+                destroy_test_registry();
+
+        if (NULL == CU_add_test(kvstore_suite, "async rings",
+                    test_kvstore_aio))
+                destroy_test_registry();
+
+        if (NULL == CU_add_test(kvstore_suite, "write combining",
+                    test_kvstore_write_combine))
+                destroy_test_registry();
+
+        if (NULL == CU_add_test(kvstore_suite, "persistent store",
+                    test_kvstore_persistent))
+                destroy_test_registry();
+
+        if (NULL == CU_add_test(kvstore_suite, "persistent store merge",
+                    test_kvstore_persistent_merge))
+                destroy_test_registry();
+
+        if (NULL == CU_add_test(kvstore_suite, "lsm store",
+                    test_kvstore_lsm))
+                destroy_test_registry();
+
+        if (NULL == CU_add_test(kvstore_suite, "change data capture",
+                    test_kvstore_cdc))
+                destroy_test_registry();
+
+        if (NULL == CU_add_test(kvstore_suite, "mget and incr",
+                    test_kvstore_mget_incr))
+                destroy_test_registry();
+
+        if (NULL == CU_add_test(kvstore_suite, "shared memory store",
+                    test_kvstore_shm))
+                destroy_test_registry();
+
+        if (NULL == CU_add_test(kvstore_suite, "integer keys",
+                    test_kvstore_u64))
+                destroy_test_registry();
+
+        if (NULL == CU_add_test(kvstore_suite, "bulk load",
+                    test_kvstore_bulk_load))
+                destroy_test_registry();
+
+        if (NULL == CU_add_test(kvstore_suite, "parallel map and reduce",
+                    test_kvstore_parallel))
+                destroy_test_registry();
+
+        if (NULL == CU_add_test(kvstore_suite, "defragmentation",
+                    test_kvstore_defrag))
+                destroy_test_registry();
+
+        if (NULL == CU_add_test(kvstore_suite, "transactions",
+                    test_kvstore_txn))
+                destroy_test_registry();
+
+        if (NULL == CU_add_test(kvstore_suite, "key watches",
+                    test_kvstore_watch))
+                destroy_test_registry();
+
+        if (NULL == CU_add_test(kvstore_suite, "range deletes",
+                    test_kvstore_del_range))
+                destroy_test_registry();
+
+        if (NULL == CU_add_test(kvstore_suite, "seeded hashing",
+                    test_kvstore_hash))
+                destroy_test_registry();
+
+        if (NULL == CU_add_test(kvstore_suite, "hot keys",
+                    test_kvstore_hot))
+                destroy_test_registry();
+
+        if (NULL == CU_add_test(kvstore_suite, "tracing",
+                    test_kvstore_trace))
+                destroy_test_registry();
+
+        if (NULL == CU_add_test(kvstore_suite, "compact layout",
+                    test_kvstore_compact))
+                destroy_test_registry();
+
+        if (NULL == CU_add_test(kvstore_suite, "deferred reclamation",
+                    test_kvstore_reap))
+                destroy_test_registry();
+
+        if (NULL == CU_add_test(kvstore_suite, "appends and ranges",
+                    test_kvstore_append))
+                destroy_test_registry();
+
+        if (NULL == CU_add_test(kvstore_suite, "chunked values",
+                    test_kvstore_chunked))
+                destroy_test_registry();
+
+        if (NULL == CU_add_test(kvstore_suite, "frozen store",
+                    test_kvstore_frozen))
+                destroy_test_registry();
+
+        if (NULL == CU_add_test(kvstore_suite, "read cache",
+                    test_kvstore_read_cache))
+                destroy_test_registry();
+
+        if (NULL == CU_add_test(kvstore_suite, "value dedup",
+                    test_kvstore_dedup))
+                destroy_test_registry();
+
         CU_basic_set_mode(CU_BRM_VERBOSE);
         CU_basic_run_tests();
         fails = CU_get_number_of_tests_failed();
@@ -0,0 +1,324 @@
+/*
+ * Copyright (c) 2013 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+ * OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ * ---------------------------------------------------------------------
+ */
+
+
+
+/*
+ * kvs_trace decodes the dumps written by kvstore_trace_dump and
+ * kvstore_trace_signal. By default it prints, for each operation, how
+ * many there were, how many failed and the median, 99th percentile and
+ * worst time spent waiting for the store lock and then working under
+ * it. With -t it prints every event instead, in the order they started.
+ * Events repeated by successive dumps into the same file are dropped.
+ *
+ * usage: kvs_trace [-t] [file ...]
+ */
+
+
+#include <sys/types.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "kv.h"
+
+
+struct record {
+        uint64_t         tsc;
+        uint64_t         hash;
+        uint64_t         hz;
+        uint64_t         lock_wait;
+        uint64_t         work;
+        uint32_t         thread;
+        uint16_t         op;
+        int16_t          result;
+};
+
+struct records {
+        struct record   *rec;
+        size_t           n;
+        size_t           cap;
+};
+
+
+static const char       *op_names[] = { "set", "get", "del" };
+
+
+static const char *
+op_name(uint16_t op)
+{
+        if (op < sizeof(op_names) / sizeof(op_names[0]))
+                return op_names[op];
+        return "?";
+}
+
+
+static double
+to_us(uint64_t ticks, uint64_t hz)
+{
+        if (0 == hz)
+                return 0.0;
+        return (double)ticks * 1000000.0 / (double)hz;
+}
+
+
+static int
+read_full(FILE *f, void *buf, size_t len)
+{
+        return len == fread(buf, 1, len, f) ? 0 : -1;
+}
+
+
+/*
+ * read_dump appends every event in f to recs. Returns -1 if the stream
+ * is not a trace dump or ends in the middle of a block.
+ */
+static int
+read_dump(FILE *f, const char *name, struct records *recs)
+{
+        struct kvstore_trace_header      hdr;
+        struct kvstore_trace_event       ev;
+        struct record                   *rec;
+        uint64_t                         i;
+        size_t                           n;
+
+        while (1 == (n = fread(&hdr, sizeof(hdr), 1, f))) {
+                if (KVSTORE_TRACE_MAGIC != hdr.magic) {
+                        fprintf(stderr, "kvs_trace: %s: not a trace dump\n",
+                            name);
+                        return -1;
+                }
+                for (i = 0; i < hdr.events; i++) {
+                        if (read_full(f, &ev, sizeof(ev))) {
+                                fprintf(stderr, "kvs_trace: %s: truncated\n",
+                                    name);
+                                return -1;
+                        }
+                        if (recs->n == recs->cap) {
+                                recs->cap = recs->cap ? recs->cap * 2 : 4096;
+                                rec = realloc(recs->rec,
+                                    recs->cap * sizeof(struct record));
+                                if (NULL == rec)
+                                        return -1;
+                                recs->rec = rec;
+                        }
+                        rec = &recs->rec[recs->n++];
+                        rec->tsc = ev.tsc;
+                        rec->hash = ev.hash;
+                        rec->hz = hdr.ticks_per_sec;
+                        rec->lock_wait = ev.lock_wait;
+                        rec->work = ev.work;
+                        rec->thread = ev.thread;
+                        rec->op = ev.op;
+                        rec->result = ev.result;
+                }
+        }
+        if (ferror(f)) {
+                fprintf(stderr, "kvs_trace: %s: %s\n", name, strerror(errno));
+                return -1;
+        }
+        return 0;
+}
+
+
+static int
+record_cmp(const void *a, const void *b)
+{
+        const struct record     *ra = a, *rb = b;
+
+        if (ra->tsc != rb->tsc)
+                return ra->tsc < rb->tsc ? -1 : 1;
+        if (ra->thread != rb->thread)
+                return ra->thread < rb->thread ? -1 : 1;
+        return 0;
+}
+
+
+static int
+double_cmp(const void *a, const void *b)
+{
+        double   da = *(const double *)a, db = *(const double *)b;
+
+        return (da > db) - (da < db);
+}
+
+
+/*
+ * uniq drops the events that a later dump of the same rings wrote
+ * again; recs must be sorted.
+ */
+static void
+uniq(struct records *recs)
+{
+        struct record   *prev, *cur;
+        size_t           i, n = 0;
+
+        for (i = 0; i < recs->n; i++) {
+                cur = &recs->rec[i];
+                if (0 != n) {
+                        prev = &recs->rec[n - 1];
+                        if ((prev->tsc == cur->tsc) &&
+                            (prev->thread == cur->thread) &&
+                            (prev->op == cur->op) &&
+                            (prev->hash == cur->hash))
+                                continue;
+                }
+                recs->rec[n++] = *cur;
+        }
+        recs->n = n;
+}
+
+
+static void
+timeline(struct records *recs)
+{
+        struct record   *rec;
+        size_t           i;
+
+        printf("%12s %6s %4s %16s %10s %10s %6s\n", "start us", "thread",
+            "op", "hash", "wait us", "work us", "result");
+        for (i = 0; i < recs->n; i++) {
+                rec = &recs->rec[i];
+                printf("%12.3f %6u %4s %016llx %10.3f %10.3f %6d\n",
+                    to_us(rec->tsc - recs->rec[0].tsc, rec->hz),
+                    (unsigned)rec->thread, op_name(rec->op),
+                    (unsigned long long)rec->hash,
+                    to_us(rec->lock_wait, rec->hz),
+                    to_us(rec->work, rec->hz), (int)rec->result);
+        }
+}
+
+
+static double
+percentile(double *v, size_t n, double p)
+{
+        size_t   i;
+
+        i = (size_t)(p * (double)(n - 1) + 0.5);
+        return v[i];
+}
+
+
+static int
+summary(struct records *recs)
+{
+        struct record   *rec;
+        double          *wait, *work;
+        size_t           count, errors, i;
+        uint16_t         op;
+
+        wait = calloc(recs->n + 1, sizeof(double));
+        work = calloc(recs->n + 1, sizeof(double));
+        if ((NULL == wait) || (NULL == work)) {
+                free(wait);
+                free(work);
+                return -1;
+        }
+
+        printf("%4s %10s %8s %9s %9s %9s %9s %9s %9s\n", "op", "count",
+            "errors", "wait p50", "wait p99", "wait max", "work p50",
+            "work p99", "work max");
+        for (op = 0; op < sizeof(op_names) / sizeof(op_names[0]); op++) {
+                count = errors = 0;
+                for (i = 0; i < recs->n; i++) {
+                        rec = &recs->rec[i];
+                        if (rec->op != op)
+                                continue;
+                        if (0 != rec->result)
+                                errors++;
+                        wait[count] = to_us(rec->lock_wait, rec->hz);
+                        work[count] = to_us(rec->work, rec->hz);
+                        count++;
+                }
+                if (0 == count)
+                        continue;
+                qsort(wait, count, sizeof(double), double_cmp);
+                qsort(work, count, sizeof(double), double_cmp);
+                printf("%4s %10zu %8zu %9.2f %9.2f %9.2f %9.2f %9.2f "
+                    "%9.2f\n", op_names[op], count, errors,
+                    percentile(wait, count, 0.50),
+                    percentile(wait, count, 0.99), wait[count - 1],
+                    percentile(work, count, 0.50),
+                    percentile(work, count, 0.99), work[count - 1]);
+        }
+        printf("(times in microseconds)\n");
+
+        free(wait);
+        free(work);
+        return 0;
+}
+
+
+static void
+usage(void)
+{
+        fprintf(stderr, "usage: kvs_trace [-t] [file ...]\n");
+        exit(1);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+        struct records   recs;
+        FILE            *f;
+        int              ch, i, show_timeline = 0, failed = 0;
+
+        while (-1 != (ch = getopt(argc, argv, "t"))) {
+                switch (ch) {
+                case 't':
+                        show_timeline = 1;
+                        break;
+                default:
+                        usage();
+                }
+        }
+        argc -= optind;
+        argv += optind;
+
+        memset(&recs, 0x0, sizeof(recs));
+        if (0 == argc) {
+                failed = read_dump(stdin, "stdin", &recs);
+        } else {
+                for (i = 0; (i < argc) && !failed; i++) {
+                        if (NULL == (f = fopen(argv[i], "r"))) {
+                                fprintf(stderr, "kvs_trace: %s: %s\n",
+                                    argv[i], strerror(errno));
+                                failed = -1;
+                                break;
+                        }
+                        failed = read_dump(f, argv[i], &recs);
+                        fclose(f);
+                }
+        }
+        if (failed) {
+                free(recs.rec);
+                return 1;
+        }
+
+        qsort(recs.rec, recs.n, sizeof(struct record), record_cmp);
+        uniq(&recs);
+        if (show_timeline)
+                timeline(&recs);
+        else
+                failed = summary(&recs);
+        free(recs.rec);
+        return failed ? 1 : 0;
+}